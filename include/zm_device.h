@@ -44,6 +44,12 @@ extern "C" {
 ZM_DEVICE_EXPORT void
     zm_device_actor (zsock_t *pipe, void *args);
 
+//  Pop "N/M" frame, _seq and _cnt, following device sent by GET-ALL or
+//  PUBLISH-ALL. Returns -1 if message doesn't end with one, leaving it
+//  as it is.
+ZM_DEVICE_EXPORT int
+    zm_device_pop_seq (zmsg_t *msg, size_t *seq_p, size_t *cnt_p);
+
 //  Self test of this actor
 ZM_DEVICE_EXPORT void
     zm_device_test (bool verbose);
@@ -0,0 +1,323 @@
+/*  =========================================================================
+    zm_arena - Slab and byte arena for device records
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+/*
+@header
+    zm_arena - Slab and byte arena for device records
+@discuss
+    Records of fixed size are allocated from slabs and recycled through
+    a free list. Variable sized blocks of bytes are bump allocated from
+    chunks and never freed one by one. Freed bytes are only counted as
+    garbage and reclaimed when owner compacts the arena by copying live
+    blocks into fresh chunks. This packs many small objects densely, with
+    no per-object malloc overhead, and destroys them all at once.
+@end
+*/
+
+#include "zm_device_classes.h"
+
+//  Blocks are aligned to this, so they can hold any data
+
+#define ZM_ARENA_ALIGN(size) (((size) + 7) & ~((size_t) 7))
+
+//  Structure of our class
+
+struct _zm_arena_t {
+    size_t record_size;         //  Size of one record
+    size_t slab_records;        //  Records per slab
+    zlistx_t *slabs;            //  All record slabs
+    size_t slab_used;           //  Records taken from the last slab
+    void *free_records;         //  Free list threaded through records
+    size_t records;             //  Records in use
+    size_t chunk_size;          //  Size of regular chunk
+    zlistx_t *chunks;           //  All byte chunks
+    zlistx_t *old_chunks;       //  Chunks being compacted away
+    byte *chunk;                //  Chunk to allocate from
+    size_t chunk_used;          //  Bytes used in current chunk
+    size_t bytes;               //  Live bytes
+    size_t garbage;             //  Freed bytes not reclaimed yet
+    size_t slab_allocated;      //  Memory taken by slabs
+    size_t chunk_allocated;     //  Memory taken by chunks
+    size_t old_allocated;       //  Memory taken by chunks being compacted
+};
+
+static void
+s_free (void **item_p)
+{
+    free (*item_p);
+    *item_p = NULL;
+}
+
+//  --------------------------------------------------------------------------
+//  Create a new zm_arena
+
+zm_arena_t *
+zm_arena_new (size_t record_size, size_t slab_records, size_t chunk_size)
+{
+    assert (slab_records > 0);
+    assert (chunk_size > 0);
+    zm_arena_t *self = (zm_arena_t *) zmalloc (sizeof (zm_arena_t));
+    assert (self);
+    //  Initialize class properties here
+    //  Free records hold the free list pointer
+    if (record_size < sizeof (void *))
+        record_size = sizeof (void *);
+    self->record_size = ZM_ARENA_ALIGN (record_size);
+    self->slab_records = slab_records;
+    self->chunk_size = ZM_ARENA_ALIGN (chunk_size);
+    self->slabs = zlistx_new ();
+    assert (self->slabs);
+    zlistx_set_destructor (self->slabs, s_free);
+    self->chunks = zlistx_new ();
+    assert (self->chunks);
+    zlistx_set_destructor (self->chunks, s_free);
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the zm_arena
+
+void
+zm_arena_destroy (zm_arena_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zm_arena_t *self = *self_p;
+        //  Free class properties here
+        zlistx_destroy (&self->slabs);
+        zlistx_destroy (&self->chunks);
+        zlistx_destroy (&self->old_chunks);
+        //  Free object itself
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Return new zeroed record
+
+void *
+zm_arena_record_new (zm_arena_t *self)
+{
+    assert (self);
+    void *record;
+    if (self->free_records) {
+        record = self->free_records;
+        self->free_records = *(void **) record;
+    }
+    else {
+        byte *slab = (byte *) zlistx_last (self->slabs);
+        if (!slab || self->slab_used == self->slab_records) {
+            slab = (byte *) malloc (self->record_size * self->slab_records);
+            assert (slab);
+            zlistx_add_end (self->slabs, slab);
+            self->slab_allocated += self->record_size * self->slab_records;
+            self->slab_used = 0;
+        }
+        record = slab + self->record_size * self->slab_used++;
+    }
+    memset (record, 0, self->record_size);
+    self->records++;
+    return record;
+}
+
+//  --------------------------------------------------------------------------
+//  Return record to the arena
+
+void
+zm_arena_record_free (zm_arena_t *self, void *record)
+{
+    assert (self);
+    if (!record)
+        return;
+    assert (self->records > 0);
+    *(void **) record = self->free_records;
+    self->free_records = record;
+    self->records--;
+}
+
+//  --------------------------------------------------------------------------
+//  Return block of size bytes
+
+byte *
+zm_arena_bytes_new (zm_arena_t *self, size_t size)
+{
+    assert (self);
+    size_t aligned = ZM_ARENA_ALIGN (size);
+    if (aligned > self->chunk_size / 4) {
+        //  Big blocks get chunk of their own, not to waste the current one
+        byte *block = (byte *) malloc (aligned ? aligned : 1);
+        assert (block);
+        zlistx_add_end (self->chunks, block);
+        self->chunk_allocated += aligned;
+        self->bytes += size;
+        return block;
+    }
+    if (!self->chunk || self->chunk_used + aligned > self->chunk_size) {
+        self->chunk = (byte *) malloc (self->chunk_size);
+        assert (self->chunk);
+        zlistx_add_end (self->chunks, self->chunk);
+        self->chunk_allocated += self->chunk_size;
+        self->chunk_used = 0;
+    }
+    byte *block = self->chunk + self->chunk_used;
+    self->chunk_used += aligned;
+    self->bytes += size;
+    return block;
+}
+
+//  --------------------------------------------------------------------------
+//  Mark block as garbage
+
+void
+zm_arena_bytes_free (zm_arena_t *self, byte *data, size_t size)
+{
+    assert (self);
+    if (!data)
+        return;
+    assert (self->bytes >= size);
+    self->bytes -= size;
+    self->garbage += size;
+}
+
+//  --------------------------------------------------------------------------
+//  Start compaction
+
+void
+zm_arena_compact_begin (zm_arena_t *self)
+{
+    assert (self);
+    assert (!self->old_chunks);
+    self->old_chunks = self->chunks;
+    self->old_allocated = self->chunk_allocated;
+    self->chunk_allocated = 0;
+    self->chunks = zlistx_new ();
+    assert (self->chunks);
+    zlistx_set_destructor (self->chunks, s_free);
+    self->chunk = NULL;
+    self->chunk_used = 0;
+    self->bytes = 0;
+    self->garbage = 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Finish compaction
+
+void
+zm_arena_compact_end (zm_arena_t *self)
+{
+    assert (self);
+    assert (self->old_chunks);
+    zlistx_destroy (&self->old_chunks);
+    self->old_allocated = 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Return number of records in use
+
+size_t
+zm_arena_records (zm_arena_t *self)
+{
+    assert (self);
+    return self->records;
+}
+
+//  --------------------------------------------------------------------------
+//  Return number of live bytes
+
+size_t
+zm_arena_bytes (zm_arena_t *self)
+{
+    assert (self);
+    return self->bytes;
+}
+
+//  --------------------------------------------------------------------------
+//  Return number of freed bytes waiting for compaction
+
+size_t
+zm_arena_garbage (zm_arena_t *self)
+{
+    assert (self);
+    return self->garbage;
+}
+
+//  --------------------------------------------------------------------------
+//  Return total memory allocated from the system
+
+size_t
+zm_arena_allocated (zm_arena_t *self)
+{
+    assert (self);
+    return self->slab_allocated + self->chunk_allocated + self->old_allocated;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+zm_arena_test (bool verbose)
+{
+    printf (" * zm_arena: ");
+
+    //  @selftest
+    zm_arena_t *self = zm_arena_new (24, 4, 256);
+    assert (self);
+    assert (zm_arena_records (self) == 0);
+    assert (zm_arena_allocated (self) == 0);
+
+    //  Records are recycled through free list
+    void *records [10];
+    int i;
+    for (i = 0; i < 10; i++) {
+        records [i] = zm_arena_record_new (self);
+        assert (records [i]);
+        memset (records [i], i, 24);
+    }
+    assert (zm_arena_records (self) == 10);
+    assert (zm_arena_allocated (self) == 3 * 4 * 24);
+    zm_arena_record_free (self, records [3]);
+    void *record = zm_arena_record_new (self);
+    assert (record == records [3]);
+    assert (((byte *) record) [0] == 0);
+    assert (zm_arena_allocated (self) == 3 * 4 * 24);
+
+    //  Small blocks share chunk, big ones get their own
+    byte *small = zm_arena_bytes_new (self, 10);
+    memcpy (small, "0123456789", 10);
+    byte *other = zm_arena_bytes_new (self, 10);
+    assert (other == small + 16);
+    byte *big = zm_arena_bytes_new (self, 100);
+    memset (big, 'x', 100);
+    assert (zm_arena_bytes (self) == 120);
+    assert (zm_arena_allocated (self) == 3 * 4 * 24 + 256 + 104);
+
+    zm_arena_bytes_free (self, other, 10);
+    zm_arena_bytes_free (self, big, 100);
+    assert (zm_arena_bytes (self) == 10);
+    assert (zm_arena_garbage (self) == 110);
+
+    //  Compaction keeps old blocks valid until it ends
+    zm_arena_compact_begin (self);
+    byte *moved = zm_arena_bytes_new (self, 10);
+    memcpy (moved, small, 10);
+    zm_arena_compact_end (self);
+    assert (memcmp (moved, "0123456789", 10) == 0);
+    assert (zm_arena_bytes (self) == 10);
+    assert (zm_arena_garbage (self) == 0);
+    assert (zm_arena_allocated (self) == 3 * 4 * 24 + 256);
+
+    zm_arena_destroy (&self);
+    //  @end
+    printf ("OK\n");
+}
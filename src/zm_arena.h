@@ -0,0 +1,81 @@
+/*  =========================================================================
+    zm_arena - Slab and byte arena for device records
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+#ifndef ZM_ARENA_H_INCLUDED
+#define ZM_ARENA_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @interface
+//  Create a new arena of records of record_size bytes, allocated by slabs
+//  of slab_records, and of byte blocks taken from chunks of chunk_size.
+ZM_DEVICE_PRIVATE zm_arena_t *
+    zm_arena_new (size_t record_size, size_t slab_records, size_t chunk_size);
+
+//  Destroy the zm_arena, freeing all records and bytes at once
+ZM_DEVICE_PRIVATE void
+    zm_arena_destroy (zm_arena_t **self_p);
+
+//  Return new zeroed record
+ZM_DEVICE_PRIVATE void *
+    zm_arena_record_new (zm_arena_t *self);
+
+//  Return record to the arena
+ZM_DEVICE_PRIVATE void
+    zm_arena_record_free (zm_arena_t *self, void *record);
+
+//  Return block of size bytes, valid until freed or until compaction ends
+ZM_DEVICE_PRIVATE byte *
+    zm_arena_bytes_new (zm_arena_t *self, size_t size);
+
+//  Mark block of size bytes as garbage, space is reclaimed by compaction
+ZM_DEVICE_PRIVATE void
+    zm_arena_bytes_free (zm_arena_t *self, byte *data, size_t size);
+
+//  Start compaction. Caller must copy all live blocks into new ones with
+//  zm_arena_bytes_new, old blocks stay valid until zm_arena_compact_end.
+ZM_DEVICE_PRIVATE void
+    zm_arena_compact_begin (zm_arena_t *self);
+
+//  Finish compaction, freeing chunks of old blocks
+ZM_DEVICE_PRIVATE void
+    zm_arena_compact_end (zm_arena_t *self);
+
+//  Return number of records in use
+ZM_DEVICE_PRIVATE size_t
+    zm_arena_records (zm_arena_t *self);
+
+//  Return number of live bytes in blocks
+ZM_DEVICE_PRIVATE size_t
+    zm_arena_bytes (zm_arena_t *self);
+
+//  Return number of freed bytes waiting for compaction
+ZM_DEVICE_PRIVATE size_t
+    zm_arena_garbage (zm_arena_t *self);
+
+//  Return total memory allocated by arena from the system
+ZM_DEVICE_PRIVATE size_t
+    zm_arena_allocated (zm_arena_t *self);
+
+//  Self test of this class
+ZM_DEVICE_PRIVATE void
+    zm_arena_test (bool verbose);
+
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,261 @@
+/*  =========================================================================
+    zm_cache - Devices of other producers applied in cache mode
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+/*
+@header
+    zm_cache - Devices of other producers applied in cache mode
+@discuss
+    Applies INSERT, DELETE, both batches, CHANGE-BATCH and PUBLISH-ALL
+    consumed from other producers to devices, as CONSUME of zm_device
+    describes. With conflict time, change older than the stored device is
+    dropped, DELETE with time 0 is always applied. With conflict arrival
+    every change is applied. Stamp of the producer is not stored. Actor
+    decides which streams and senders are consumed.
+@end
+*/
+
+#include "zm_device_classes.h"
+
+//  Structure of our class
+
+struct _zm_cache_t {
+    bool arrival;               //  Last change received wins
+    zm_proto_t *msg;            //  Device being applied
+};
+
+
+//  --------------------------------------------------------------------------
+//  Create a new zm_cache
+
+zm_cache_t *
+zm_cache_new (void)
+{
+    zm_cache_t *self = (zm_cache_t *) zmalloc (sizeof (zm_cache_t));
+    assert (self);
+    //  Initialize class properties here
+    self->msg = zm_proto_new ();
+    assert (self->msg);
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the zm_cache
+
+void
+zm_cache_destroy (zm_cache_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zm_cache_t *self = *self_p;
+        //  Free class properties here
+        zm_proto_destroy (&self->msg);
+        //  Free object itself
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Set how conflicts are resolved
+
+int
+zm_cache_set_conflict (zm_cache_t *self, const char *conflict)
+{
+    assert (self);
+    assert (conflict);
+    self->arrival = streq (conflict, "arrival");
+    return self->arrival || streq (conflict, "time") ? 0 : -1;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return true if the last change received wins
+
+bool
+zm_cache_arrival (zm_cache_t *self)
+{
+    assert (self);
+    return self->arrival;
+}
+
+//  Apply change in self->msg unless stored device is newer, returns true
+//  if it was dropped
+
+static bool
+s_cache_apply_one (zm_cache_t *self, bool insert, zm_devices_t *devices)
+{
+    const char *name = zm_proto_device (self->msg);
+    zm_proto_t *stored = zm_devices_lookup (devices, name);
+    if (stored
+    &&  !self->arrival
+    &&  (insert || zm_proto_time (self->msg))
+    &&  zm_proto_time (self->msg) < zm_proto_time (stored))
+        return true;
+    if (insert) {
+        zm_replica_unstamp (self->msg);
+        zm_devices_insert (devices, self->msg);
+    }
+    else
+    if (stored)
+        zm_devices_delete (devices, name);
+    return false;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Apply stream message with subject to devices
+
+int
+zm_cache_apply (zm_cache_t *self, const char *subject, zmsg_t *msg,
+    zm_devices_t *devices)
+{
+    assert (self);
+    assert (subject);
+    assert (msg);
+    assert (devices);
+
+    bool changes = streq (subject, "CHANGE-BATCH");
+    bool batch = streq (subject, "INSERT-BATCH") || streq (subject, "DELETE-BATCH");
+    bool insert = streq (subject, "INSERT")
+               || streq (subject, "INSERT-BATCH")
+               || streq (subject, "PUBLISH-ALL");
+    if (!changes && !insert && !streq (subject, "DELETE") && !streq (subject, "DELETE-BATCH"))
+        return -1;
+    if (changes) {
+        //  Versions of another actor mean nothing here
+        char *from = zmsg_popstr (msg);
+        char *to = zmsg_popstr (msg);
+        zstr_free (&from);
+        zstr_free (&to);
+    }
+    else
+    if (streq (subject, "PUBLISH-ALL"))
+        zm_device_pop_seq (msg, NULL, NULL);
+
+    int stale = 0;
+    char *op = changes ? zmsg_popstr (msg) : NULL;
+    zmsg_t *item = changes || batch ? zmsg_popmsg (msg) : zmsg_dup (msg);
+    while (item) {
+        if (zm_proto_recv (self->msg, item) == 0
+        &&  zm_proto_id (self->msg) == ZM_PROTO_DEVICE
+        &&  s_cache_apply_one (self, changes ? op && streq (op, "INSERT") : insert, devices))
+            stale++;
+        zmsg_destroy (&item);
+        zstr_free (&op);
+        if (changes)
+            op = zmsg_popstr (msg);
+        item = changes || batch ? zmsg_popmsg (msg) : NULL;
+    }
+    zstr_free (&op);
+    return stale;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+static zmsg_t *
+s_test_device (const char *name, uint64_t time, const char *type)
+{
+    zhash_t *ext = zhash_new ();
+    if (type)
+        zhash_insert (ext, "type", (void *) type);
+    zhash_insert (ext, "_epoch", "7");
+    zhash_insert (ext, "_version", "42");
+    zmsg_t *msg = zm_proto_encode_device_v1 (name, time, 0, ext);
+    zhash_destroy (&ext);
+    return msg;
+}
+
+void
+zm_cache_test (bool verbose)
+{
+    printf (" * zm_cache: ");
+
+    //  @selftest
+    zm_cache_t *self = zm_cache_new ();
+    assert (self);
+    zm_devices_t *devices = zm_devices_new (NULL);
+    assert (devices);
+    assert (!zm_cache_arrival (self));
+    assert (zm_cache_set_conflict (self, "newest") == -1);
+    assert (!zm_cache_arrival (self));
+    assert (zm_cache_set_conflict (self, "time") == 0);
+
+    //  Older change is dropped, stamp of the producer is not kept
+    zmsg_t *msg = s_test_device ("cached", 200, "ups");
+    assert (zm_cache_apply (self, "INSERT", msg, devices) == 0);
+    zmsg_destroy (&msg);
+    msg = s_test_device ("cached", 100, "epdu");
+    assert (zm_cache_apply (self, "INSERT", msg, devices) == 1);
+    zmsg_destroy (&msg);
+    zm_proto_t *stored = zm_devices_lookup (devices, "cached");
+    assert (stored);
+    assert (streq (zm_proto_ext_string (stored, "type", ""), "ups"));
+    assert (!zm_proto_ext_string (stored, "_epoch", NULL));
+    assert (!zm_proto_ext_string (stored, "_version", NULL));
+    msg = s_test_device ("cached", 100, NULL);
+    assert (zm_cache_apply (self, "DELETE", msg, devices) == 1);
+    zmsg_destroy (&msg);
+    assert (zm_devices_lookup (devices, "cached"));
+
+    //  Published device comes with its seq frame
+    msg = s_test_device ("cached", 300, "sensor");
+    zmsg_addstr (msg, "1/1");
+    assert (zm_cache_apply (self, "PUBLISH-ALL", msg, devices) == 0);
+    zmsg_destroy (&msg);
+    stored = zm_devices_lookup (devices, "cached");
+    assert (streq (zm_proto_ext_string (stored, "type", ""), "sensor"));
+
+    //  DELETE with time 0 is always applied
+    msg = s_test_device ("cached", 0, NULL);
+    assert (zm_cache_apply (self, "DELETE", msg, devices) == 0);
+    zmsg_destroy (&msg);
+    assert (!zm_devices_lookup (devices, "cached"));
+
+    //  CHANGE-BATCH carries op of each device
+    msg = zmsg_new ();
+    zmsg_addstr (msg, "4");
+    zmsg_addstr (msg, "6");
+    zmsg_addstr (msg, "INSERT");
+    zmsg_t *item = s_test_device ("batched", 100, "ups");
+    zmsg_addmsg (msg, &item);
+    zmsg_addstr (msg, "INSERT");
+    item = s_test_device ("gone", 100, "ups");
+    zmsg_addmsg (msg, &item);
+    zmsg_addstr (msg, "DELETE");
+    item = s_test_device ("gone", 0, NULL);
+    zmsg_addmsg (msg, &item);
+    assert (zm_cache_apply (self, "CHANGE-BATCH", msg, devices) == 0);
+    zmsg_destroy (&msg);
+    assert (zm_devices_lookup (devices, "batched"));
+    assert (!zm_devices_lookup (devices, "gone"));
+
+    //  With arrival the last change wins
+    assert (zm_cache_set_conflict (self, "arrival") == 0);
+    assert (zm_cache_arrival (self));
+    msg = s_test_device ("batched", 50, "epdu");
+    assert (zm_cache_apply (self, "INSERT", msg, devices) == 0);
+    zmsg_destroy (&msg);
+    stored = zm_devices_lookup (devices, "batched");
+    assert (streq (zm_proto_ext_string (stored, "type", ""), "epdu"));
+
+    msg = zmsg_new ();
+    assert (zm_cache_apply (self, "LOOKUP", msg, devices) == -1);
+    zmsg_destroy (&msg);
+    zm_devices_destroy (&devices);
+    zm_cache_destroy (&self);
+    //  @end
+    printf ("OK\n");
+}
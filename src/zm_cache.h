@@ -0,0 +1,55 @@
+/*  =========================================================================
+    zm_cache - Devices of other producers applied in cache mode
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+#ifndef ZM_CACHE_H_INCLUDED
+#define ZM_CACHE_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @interface
+//  Create a new zm_cache, newer time wins conflicts
+ZM_DEVICE_PRIVATE zm_cache_t *
+    zm_cache_new (void);
+
+//  Destroy the zm_cache
+ZM_DEVICE_PRIVATE void
+    zm_cache_destroy (zm_cache_t **self_p);
+
+//  Set how conflicts are resolved, "time" or "arrival". Returns -1 and
+//  uses time if conflict is unknown, otherwise 0.
+ZM_DEVICE_PRIVATE int
+    zm_cache_set_conflict (zm_cache_t *self, const char *conflict);
+
+//  Return true if the last change received wins
+ZM_DEVICE_PRIVATE bool
+    zm_cache_arrival (zm_cache_t *self);
+
+//  Apply stream message with subject to devices. Returns number of
+//  changes dropped as older than stored devices, or -1 if subject is not
+//  a change.
+ZM_DEVICE_PRIVATE int
+    zm_cache_apply (zm_cache_t *self, const char *subject, zmsg_t *msg,
+        zm_devices_t *devices);
+
+//  Self test of this class
+ZM_DEVICE_PRIVATE void
+    zm_cache_test (bool verbose);
+
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,221 @@
+/*  =========================================================================
+    zm_coalesce - Changes of devices waiting for CHANGE-BATCH
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+/*
+@header
+    zm_coalesce - Changes of devices waiting for CHANGE-BATCH
+@discuss
+    Keeps the last change of each device name, as op and encoded device,
+    along with versions of the devices table surrounding them. Actor owns
+    the window timer and publishes what zm_coalesce_flush returns once the
+    window ends or zm_coalesce_add says the batch is full.
+@end
+*/
+
+#include "zm_device_classes.h"
+
+#define ZM_COALESCE_BATCH   1000    //  Default devices per CHANGE-BATCH
+
+//  Structure of our class
+
+struct _zm_coalesce_t {
+    zhashx_t *changes;          //  Name to [op][device]
+    uint64_t from;              //  Version before the oldest of them
+    uint64_t to;                //  Version of the newest
+    size_t batch;               //  Full once this many devices wait
+};
+
+
+//  --------------------------------------------------------------------------
+//  Create a new zm_coalesce
+
+zm_coalesce_t *
+zm_coalesce_new (size_t batch)
+{
+    zm_coalesce_t *self = (zm_coalesce_t *) zmalloc (sizeof (zm_coalesce_t));
+    assert (self);
+    //  Initialize class properties here
+    self->changes = zhashx_new ();
+    assert (self->changes);
+    zhashx_set_destructor (self->changes, (zhashx_destructor_fn *) zmsg_destroy);
+    zm_coalesce_set_batch (self, batch);
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the zm_coalesce
+
+void
+zm_coalesce_destroy (zm_coalesce_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zm_coalesce_t *self = *self_p;
+        //  Free class properties here
+        zhashx_destroy (&self->changes);
+        //  Free object itself
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Set number of devices which make batch full
+
+void
+zm_coalesce_set_batch (zm_coalesce_t *self, size_t batch)
+{
+    assert (self);
+    self->batch = batch ? batch : ZM_COALESCE_BATCH;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Keep change of device as the last one of its name
+
+bool
+zm_coalesce_add (zm_coalesce_t *self, const char *op, zm_proto_t *device, uint64_t version)
+{
+    assert (self);
+    assert (op);
+    assert (device);
+    if (zhashx_size (self->changes) == 0)
+        self->from = version ? version - 1 : 0;
+    self->to = version;
+
+    zmsg_t *change = zmsg_new ();
+    zmsg_addstr (change, op);
+    zmsg_t *item = zmsg_new ();
+    zm_proto_send (device, item);
+    zmsg_addmsg (change, &item);
+    zhashx_update (self->changes, zm_proto_device (device), change);
+    return zhashx_size (self->changes) >= self->batch;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return number of devices waiting
+
+size_t
+zm_coalesce_size (zm_coalesce_t *self)
+{
+    assert (self);
+    return zhashx_size (self->changes);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return waiting changes as CHANGE-BATCH message and forget them
+
+zmsg_t *
+zm_coalesce_flush (zm_coalesce_t *self)
+{
+    assert (self);
+    if (zhashx_size (self->changes) == 0)
+        return NULL;
+
+    zmsg_t *batch = zmsg_new ();
+    zmsg_addstrf (batch, "%" PRIu64, self->from);
+    zmsg_addstrf (batch, "%" PRIu64, self->to);
+    zmsg_t *change = (zmsg_t *) zhashx_first (self->changes);
+    while (change) {
+        zframe_t *frame = zmsg_pop (change);
+        while (frame) {
+            zmsg_append (batch, &frame);
+            frame = zmsg_pop (change);
+        }
+        change = (zmsg_t *) zhashx_next (self->changes);
+    }
+    zhashx_purge (self->changes);
+    return batch;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+zm_coalesce_test (bool verbose)
+{
+    printf (" * zm_coalesce: ");
+
+    //  @selftest
+    zm_coalesce_t *self = zm_coalesce_new (3);
+    assert (self);
+    assert (zm_coalesce_size (self) == 0);
+    assert (!zm_coalesce_flush (self));
+
+    //  Last change of a name replaces the one waiting
+    zm_proto_t *device = zm_proto_new ();
+    zm_proto_encode_device (device, "device1", 1, 0, NULL);
+    assert (!zm_coalesce_add (self, "INSERT", device, 5));
+    zm_proto_encode_device (device, "device1", 2, 0, NULL);
+    assert (!zm_coalesce_add (self, "INSERT", device, 6));
+    zm_proto_encode_device (device, "device2", 3, 0, NULL);
+    assert (!zm_coalesce_add (self, "DELETE", device, 7));
+    assert (zm_coalesce_size (self) == 2);
+
+    zmsg_t *batch = zm_coalesce_flush (self);
+    assert (batch);
+    assert (zm_coalesce_size (self) == 0);
+    assert (zmsg_size (batch) == 2 + 2 * 2);
+    char *str = zmsg_popstr (batch);
+    assert (streq (str, "4"));
+    zstr_free (&str);
+    str = zmsg_popstr (batch);
+    assert (streq (str, "7"));
+    zstr_free (&str);
+    int seen = 0;
+    str = zmsg_popstr (batch);
+    while (str) {
+        zmsg_t *item = zmsg_popmsg (batch);
+        assert (item);
+        int r = zm_proto_recv (device, item);
+        assert (r == 0);
+        zmsg_destroy (&item);
+        if (streq (zm_proto_device (device), "device1")) {
+            assert (streq (str, "INSERT"));
+            assert (zm_proto_time (device) == 2);
+        }
+        else {
+            assert (streq (zm_proto_device (device), "device2"));
+            assert (streq (str, "DELETE"));
+        }
+        seen++;
+        zstr_free (&str);
+        str = zmsg_popstr (batch);
+    }
+    assert (seen == 2);
+    zmsg_destroy (&batch);
+
+    //  Batch is full at its size, versions start over after flush
+    zm_proto_encode_device (device, "device3", 1, 0, NULL);
+    assert (!zm_coalesce_add (self, "INSERT", device, 0));
+    zm_proto_encode_device (device, "device4", 1, 0, NULL);
+    assert (!zm_coalesce_add (self, "INSERT", device, 1));
+    zm_proto_encode_device (device, "device5", 1, 0, NULL);
+    assert (zm_coalesce_add (self, "INSERT", device, 2));
+    batch = zm_coalesce_flush (self);
+    str = zmsg_popstr (batch);
+    assert (streq (str, "0"));
+    zstr_free (&str);
+    zmsg_destroy (&batch);
+
+    zm_coalesce_set_batch (self, 0);
+    assert (!zm_coalesce_add (self, "INSERT", device, 3));
+    zm_proto_destroy (&device);
+    zm_coalesce_destroy (&self);
+    //  @end
+    printf ("OK\n");
+}
@@ -0,0 +1,58 @@
+/*  =========================================================================
+    zm_coalesce - Changes of devices waiting for CHANGE-BATCH
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+#ifndef ZM_COALESCE_H_INCLUDED
+#define ZM_COALESCE_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @interface
+//  Create a new zm_coalesce, full once batch devices wait, 0 is the default
+ZM_DEVICE_PRIVATE zm_coalesce_t *
+    zm_coalesce_new (size_t batch);
+
+//  Destroy the zm_coalesce, waiting changes are dropped
+ZM_DEVICE_PRIVATE void
+    zm_coalesce_destroy (zm_coalesce_t **self_p);
+
+//  Set number of devices which make batch full, 0 is the default
+ZM_DEVICE_PRIVATE void
+    zm_coalesce_set_batch (zm_coalesce_t *self, size_t batch);
+
+//  Keep change of device made in version as the last one of its name,
+//  replacing the change waiting for it, if any. Op is INSERT or DELETE.
+//  Returns true once batch is full.
+ZM_DEVICE_PRIVATE bool
+    zm_coalesce_add (zm_coalesce_t *self, const char *op, zm_proto_t *device, uint64_t version);
+
+//  Return number of devices waiting
+ZM_DEVICE_PRIVATE size_t
+    zm_coalesce_size (zm_coalesce_t *self);
+
+//  Return waiting changes as CHANGE-BATCH message [from][to][op][device]...
+//  and forget them, NULL if there are none. Caller destroys the message.
+ZM_DEVICE_PRIVATE zmsg_t *
+    zm_coalesce_flush (zm_coalesce_t *self);
+
+//  Self test of this class
+ZM_DEVICE_PRIVATE void
+    zm_coalesce_test (bool verbose);
+
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -15,47 +15,434 @@
     zm_device - zm device actor
 @discuss
 
-zm-device have three main mode of operation
+zm-device keeps devices and serves them on its malamute mailbox, publishing
+their changes on a stream. The sections below describe each part.
 
-# PUBLISH on ZM_PROTO_DEVICE_STREAM (not yet implemented)
+# PUBLISH
 
-In this mode actor simple publish information about devices with subjects
-INSERT and DELETE. INSERT means that new device has been added. DELETE means
-device is gone.
+With malamute/producer set, actor publishes changes of devices on that
+stream, normally ZM_PROTO_DEVICE_STREAM, with subjects INSERT and DELETE.
+INSERT means that new device has been added. DELETE means device is gone. Changes made by INSERT-BATCH and DELETE-BATCH are published
+with the same subject as a multi-frame message of up to 1000 encoded
+ZM_PROTO_DEVICE messages (zmsg_popmsg).
 
-# CONSUME (not implemented - what will be the use-case? inventory stream can be done via special MAILBOX command)
+Under bursts of changes this is many small broker messages. With
+server/coalesce_window set, changes wait up to that many msecs and only
+the last state of each device is kept. They are published with subject
+CHANGE-BATCH once the window ends or server/coalesce_batch devices wait,
+as one multi-frame message
+
+    [from][to][op][device]...
+
+where devices changed in versions after from up to to are listed once,
+each with op INSERT or DELETE of its last change. Larger window saves
+messages when the same devices keep changing, at the cost of latency of
+every change.
+
+    server
+        coalesce_window = 0     #   Msecs changes may wait, 0 publishes at once
+        coalesce_batch = 1000   #   Publish once this many devices wait
+
+# CONSUME
+
+With server/cache set, devices published by other producers on streams
+of malamute/consumer are applied to devices of this actor, so it answers
+LOOKUP and the rest locally as a read-through cache of them. INSERT,
+DELETE, both batches, CHANGE-BATCH and PUBLISH-ALL are applied, messages
+of its own address are skipped. Consumed changes are journaled and stored
+as any other, they are not published again, so caches may follow each
+other without loops. Mailbox INSERT and DELETE still work and publish.
+
+    server
+        cache = 1               #   Apply consumed device streams
+        conflict = time         #   time or arrival
+    malamute
+        consumer
+            zmon.devices = .*   #   Stream = subject pattern
+
+With conflict = time, change older than the stored device, by their time,
+is dropped and counted as stale in STATS. DELETE with time 0 is always
+applied and nothing remembers deleted devices, so an older INSERT coming
+after DELETE adds the device again. With conflict = arrival, the last
+change received wins. Cache mode is not available with server/shards
+and server/replicate takes precedence over it.
+
+# PERSISTENCE
+
+Devices are stored to server/file on STOP, CONFIG and when actor is
+destroyed. STOP writes changed devices by the background store, unless
+server/store is sync, and waits for it. Background store which can't
+start is done right away instead, and a failed store is logged as STOP
+error. server/store applies with journal disabled too. Signals don't end the actor,
+its owner sends STOP and then $TERM. Changes made in between are
+written to <file>.journal and replayed on start, so they survive a crash.
+
+    server
+        file = devices.zpl
+        format = zpl            #   zpl or binary, default by extension (.bin)
+        journal = 1             #   Write-ahead journal, 0 disables it
+        sync_batch = 1000       #   fsync journal after N records
+        sync_interval = 1000    #   fsync journal every N msecs
+        compact_after = 100000  #   store snapshot after N journal records
+        store = background      #   Compaction store, background or sync
+        checkpoint_interval = 0 #   Store every N secs, if anything changed
+        checkpoint_changes = 0  #   Store after N changes of content
+
+Checkpoints store devices to server/file even without the journal, by
+the same background store, on whichever of the two comes first. 0
+disables a policy. Devices count changes since they were stored (see
+zm_devices_dirty), so checkpoint is skipped while nothing changes.
+checkpoint_changes counts only changes of content, heartbeats refreshing
+time of the same device do not bring checkpoint closer, they are stored
+by the next one or by checkpoint_interval.
+
+With server/load = lazy, binary snapshot is only indexed on CONFIG and
+the actor answers right away. Devices are decoded when requests touch
+them and hydrated in the background, server/hydrate_batch of them every
+msec. Requests over all devices (GET-ALL, LOOKUP-PREFIX, QUERY, ...) and
+synchronous store wait for the whole hydration. Checkpoints and
+compaction are postponed until it's done. LOAD-STATUS pipe command
+replies with three frames, "loading" or "ready", number of devices
+still pending and number of all devices.
+
+    server
+        load = lazy             #   lazy or full, default full
+        hydrate_batch = 1000    #   Devices hydrated per msec
+
+Compaction does not stall the mailbox. Devices are copied and written to
+a temp file, renamed over server/file, by a background actor, while the
+journal goes on in a fresh file (see zm_devices_store_start). Only STOP,
+CONFIG and destroy store synchronously, waiting for the background store
+first. STORE-MODE pipe command replies with two frames, the configured
+mode and "writing" or "idle".
+
+With server/memory_budget set, only that many bytes of encoded devices
+stay in memory. Least recently used devices beyond it are moved to cold
+file and read back when a request needs them (see zm_devices_set_budget).
+Cold file is scratch space, unlinked once opened, so it's never left
+behind and does not replace server/file.
+
+    server
+        memory_budget = 0       #   Bytes of devices in memory, 0 is all
+        cold_file = devices.cold    #   Default <file>.cold
+
+# EXPIRY
+
+Device with non-zero ttl (msecs) is removed when it was neither inserted
+nor touched for that long, and DELETE is published for it. Expired devices
+are collected from a timer in slices, so large expiry waves do not stall
+the actor.
+
+    server
+        expire_interval = 100   #   Collect expired devices every N msecs
+        expire_batch = 100      #   Max devices collected per run
+
+# BACKPRESSURE
+
+Mailbox requests are drained from the client into two queues. Writes
+(INSERT, TOUCH, DELETE and batches) are applied in slices of 100 per
+msec, reads are answered first, so LOOKUP is not stuck behind a burst of
+bulk writes. Requests of one sender keep their order, its read waits in
+the write queue while any of its writes do.
+
+Once server/queue_high writes wait, further ones are refused with
+ZM_PROTO_ERROR 503. With server/sender_rate, each sender may send that
+many requests per second, with one second burst, the rest is refused
+with ZM_PROTO_ERROR 429. Description of both is "BUSY retry_after=N",
+where N is msecs the sender should wait before trying again. STATS
+counts refused requests as BUSY and time requests waited as wait.
+
+    server
+        queue_high = 10000      #   Writes waiting before BUSY, 0 is no limit
+        sender_rate = 0         #   Requests/sec of one sender, 0 is no limit
+
+# TRACING
+
+Tracing is off by default and then costs a flag test per request. With
+server/trace_slow set, mailbox requests taking longer than that many
+msecs are logged with the time split to
+
+    broker      from _sent of the request to being drained from the client
+    queue       waiting in admission queue, see BACKPRESSURE
+    handle      handler itself, without store and send
+    store       devices and journal
+    send        sending replies
+
+Request may carry ext _trace, an opaque id put into the log line, and
+_sent, zclock_usecs of the sender, without it broker is 0 and total
+starts when request was drained. With server/trace set, every request
+carrying _trace produces a span, ZPL published with subject TRACE on
+malamute/stats stream, or logged when there's none
+
+    id = 42ab
+    subject = LOOKUP
+    sender = client
+    received = 1700000000000000
+    total = 830                 #   usecs, total = broker + queue + handle
+    broker = 420                #   + store + send
+    queue = 310
+    handle = 60
+    store = 0
+    send = 40
+
+    server
+        trace_slow = 0          #   Log requests slower than N msecs, 0 never
+        trace = 0               #   Emit span of requests with _trace
+
+# REPLICA
+
+Changes published on the stream carry ext _epoch and _version of the
+change, see SYNC-SINCE. With
+server/replicate set to address of another zm-device actor, this one is
+its read-only replica. It subscribes to ZM_PROTO_DEVICE_STREAM, applies
+INSERT, DELETE and batches published by that address to its own devices
+and answers LOOKUP, LOOKUP-PREFIX, GET-ALL, GET-PAGE and QUERY. INSERT,
+TOUCH, DELETE and batches are refused with ZM_PROTO_ERROR 403.
+
+    server
+        replicate = it.zmon.device  #   Leader to follow
+
+On START, the replica asks the leader with SNAPSHOT. Whenever a gap in
+versions shows that changes were lost, it asks with SYNC-SINCE, falling
+back to SNAPSHOT on 410 or a new epoch. Stream messages are kept aside
+until the reply comes, the request is repeated when no reply came within
+5 seconds. SNAPSHOT reply is a series of multi-frame messages
+
+    [status][epoch][version][chunk][more][device]...
+
+with up to 1000 devices of the leader as of version each, encoded
+ZM_PROTO_DEVICE messages (zmsg_popmsg). Chunk counts from 1, more is "1"
+for all chunks but the last one. Devices of the replica not in any chunk
+are deleted after the last one. Stream messages up to version are then
+skipped, later ones applied. CHANGE-BATCH is applied when its from is not
+ahead of the replica, skipping devices it already has. Replica of
+sharded actor follows one of its workers.
+
+# STATS
+
+Actor counts mailbox requests by subject, and their handling time, along
+with time taken by store, load and sync of devices and by expiry runs.
+Latencies are in usecs, with histograms precise to 1/16. STATS subject
+and STATS pipe command return them as ZPL
+
+    devices = 1000              #   Gauges: devices, allocated, journal,
+    allocated = 1048576         #   version, storing, dirty, loading,
+                                #   hot_bytes, cold, cursors, shards,
+                                #   coalesced, queued, pending
+    INSERT
+        count = 10
+        total = 120
+        p50 = 11
+        p90 = 15
+        p99 = 23
+        p999 = 23
+        max = 23
+
+If malamute/stats names a stream, ZPL is published on it with subject
+STATS every server/stats_interval msecs, by a client at <address>.stats
+as a client can produce on one stream only.
+
+    malamute
+        stats = METRICS
+    server
+        stats_interval = 10000
+
+# SHARDING
+
+With server/shards above 1 the actor keeps no devices itself. It runs that
+many worker actors, each with its own devices, <file>.<k> with journal and
+malamute client <address>.<k>, and routes mailbox requests to them, so
+different devices are served in parallel. Device name is hashed with
+FNV-1a and mapped to a worker by jump consistent hash.
+
+    server
+        shards = 4              #   Worker actors, 1 keeps devices here
+
+INSERT, TOUCH, DELETE and LOOKUP are passed to the owning worker, which
+replies and publishes from its own address. Batches are split among the
+workers and replied by this actor. GET-ALL, LOOKUP-PREFIX and PUBLISH-*
+are merged from all workers, with _seq and _cnt counted across them and
+name order kept by GET-ALL and LOOKUP-PREFIX. Worker which does not reply
+to them in 5 seconds is left out, its reply dropped when it comes.
+
+GET-PAGE, QUERY, SNAPSHOT and SYNC-SINCE return ZM_PROTO_ERROR 501, so
+cursor pagination, QUERY and replication from a sharded leader are not
+available. Page through LOOKUP-PREFIX with empty prefix instead and
+replicate from the workers (<address>.<k>) rather than this actor.
+PUBLISH-ALL budget is split evenly. Changing the number of shards does
+not move devices already stored in worker files.
 
 # MAILBOX
 
-In this mode actor provide three commands (subjects)
+Actor answers these commands (subjects) sent to its malamute address
 
     * INSERT - adds or update device in internal cache, PUBLISH it on STREAM
-        returns ZM_PROTO_OK
+        if the content changed (time and ext keys starting with '_' do not
+        count), returns ZM_PROTO_OK
+    * TOUCH - refresh time of known device to the one in request, nothing
+        is published
+        returns ZM_PROTO_OK or ZM_PROTO_ERROR 404 for unknown device
     * DELETE - delete device from cache and PUBLISH it on stream
         returns ZM_PROTO_OK
+    * INSERT-BATCH, DELETE-BATCH - as INSERT and DELETE for many devices
+        request is multi-frame message of encoded ZM_PROTO_DEVICE messages
+        (zmsg_addmsg), reply is one multi-frame message
+            [status][applied][code]...
+        where status is encoded ZM_PROTO_OK, applied is number of changed
+        devices and there is one code per request item, 200 for applied one,
+        304 for INSERT of unchanged device, 400 for malformed and 404 for
+        DELETE of unknown device. Only applied items are published.
     * LOOKUP - search by device name
         returns ZM_PROTO_DEVICE if found
         returns ZM_PROTO_ERROR if not found
-    * GET-ALL - return all devices
+    * LOOKUP-PREFIX - return devices whose name starts with device name of
+        the request, in name order, request ext may have
+        _limit : "N"    max devices per page, default 100
+        _after : "NAME" last device of previous page
+        reply is one multi-frame message
+            [status][next][count][device]...
+        where status is encoded ZM_PROTO_OK, next is the name to pass as
+        _after for the next page (empty for the last one), count is number
+        of devices with the prefix and each device is encoded ZM_PROTO_DEVICE
+        (zmsg_popmsg). Nothing is kept in between pages, empty prefix pages
+        through all devices.
+    * GET-ALL - return all devices, in name order
         return ZM_PROTO_ERROR if there are no devices
-        return M ZM_PROTO_DEVICE messages, where ext have
-        _seq : "N"
-        _cnt : "M"
+        return M ZM_PROTO_DEVICE messages, each followed by frame "N/M",
+        that is _seq and _cnt of the device (see zm_device_pop_seq). Stored
+        device is sent as it is, without decoding or encoding it again.
+    * GET-PAGE - return devices in pages, request ext may have
+        _limit : "N"    max devices per page, default 100
+        _cursor : "C"   token from previous page, absent for the first one
+        reply is one multi-frame message
+            [status][cursor][count][device]...
+        where status is encoded ZM_PROTO_OK or ZM_PROTO_ERROR (410 for
+        unknown or expired cursor), cursor is token for the next page
+        ("0" for the last one), count is number of devices when paging
+        started and each device is encoded ZM_PROTO_DEVICE (zmsg_popmsg).
+        Pages are served from list of names taken on the first page, so
+        devices deleted in between are skipped, new ones are not included.
+    * QUERY - return devices matching conditions in request ext, in name
+        order, paged and replied as GET-PAGE. Ext keys not starting with '_' must be equal,
+        name must start with _prefix and match shell _glob, if given.
+        Conditions are evaluated on the first page, next pages are asked
+        by QUERY with _cursor only. Equality on keys listed as server/index
+        is answered from index, without visiting other devices.
+
+            server
+                index
+                    key = type
+    * SNAPSHOT - return all devices with their version, see REPLICA
+    * STATS - return stats, see STATS
+        reply is [status][zpl] where status is encoded ZM_PROTO_OK
+    * SYNC-SINCE - return devices changed since version, request ext has
+        _epoch : "E"    epoch of the version
+        _version : "N"  last version client knows
+        reply is one multi-frame message
+            [status][epoch][version][inserted][device]...[name]...
+        where status is encoded ZM_PROTO_OK or ZM_PROTO_ERROR 410 when
+        epoch differs or the change log no longer reaches version N, then
+        client has to start over with SNAPSHOT. Epoch and version are the
+        current ones, to pass in the next request. There are inserted
+        encoded ZM_PROTO_DEVICE messages (zmsg_popmsg) with current state
+        of devices changed since N, followed by names of deleted devices.
+        Each device is listed once, no matter how many times it changed.
+        Version grows by one with each change of device content (see
+        INSERT) and each removal, epoch is time when devices were loaded.
+        Last server/changes (default 100000) changes are kept.
     * PUBLISH-ALL - publish all the devices
-        publish M ZM_PROTO_DEVICE messages, where ext have
-        _seq : "N"
-        _cnt : "M"
+        publish M ZM_PROTO_DEVICE messages followed by "N/M" frame, as
+        GET-ALL does
+        Devices are published in background from the actor loop, limited
+        by server/publish_rate (messages/sec) and server/publish_bytes
+        (bytes/sec), 0 means no limit. Request while previous one is still
+        running is ignored.
+    * PUBLISH-STATUS - progress of PUBLISH-ALL
+        reply is [status][seq][cnt] where status is encoded ZM_PROTO_OK if
+        PUBLISH-ALL runs or ZM_PROTO_ERROR 404 if not
+    * PUBLISH-CANCEL - stop running PUBLISH-ALL
+        returns ZM_PROTO_OK or ZM_PROTO_ERROR 404 if there was nothing to stop
 
 @end
 */
 
 #include "zm_device_classes.h"
 
+//  Admission queues of mailbox requests, see BACKPRESSURE
+
+#define ZM_DEVICE_DRAIN         1000    //  Max requests drained at once
+#define ZM_DEVICE_WRITE_SLICE   100     //  Writes applied per msec
+#define ZM_DEVICE_QUEUE_HIGH    10000   //  Default writes waiting before BUSY
+
+//  GET-PAGE cursor, names of devices left to send
+
+#define ZM_DEVICE_PAGE_LIMIT    100     //  Default devices per page
+#define ZM_DEVICE_CURSOR_MAX    16      //  Max open cursors
+#define ZM_DEVICE_CURSOR_TTL    60000   //  Drop cursor unused for msecs
+
+typedef struct {
+    zlistx_t *names;            //  Device names still to send
+    size_t count;               //  Number of devices at the first page
+    int64_t used;               //  Last time cursor was used
+} zm_device_cursor_t;
+
+static void
+s_cursor_destroy (zm_device_cursor_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zm_device_cursor_t *self = *self_p;
+        zlistx_destroy (&self->names);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Background PUBLISH-ALL
+
+#define ZM_DEVICE_PUBLISH_TICK  10      //  Publisher runs every msecs
+#define ZM_DEVICE_PUBLISH_CHUNK 1000    //  Max messages per tick
+
+typedef struct {
+    zlistx_t *names;            //  Device names still to publish
+    size_t cnt;                 //  Number of devices at start
+    size_t offset;              //  First _seq, shards publish in ranges
+    size_t seq;                 //  Number of devices published so far
+    int timer;                  //  Publisher tick
+    size_t rate;                //  Messages per second, 0 is unlimited
+    size_t bytes;               //  Bytes per second, 0 is unlimited
+    double rate_budget;         //  Messages allowed to send now
+    double bytes_budget;        //  Bytes allowed to send now
+    int64_t refilled;           //  Last time budgets were refilled
+} zm_device_publisher_t;
+
+//  Sharded mode
+
+
+//  Replica mode
+
+#define ZM_DEVICE_REPLICA_TIMEOUT   5000    //  Ask SNAPSHOT again after msecs
+#define ZM_DEVICE_SNAPSHOT_CHUNK    1000    //  Max devices per SNAPSHOT message
+
+//  Expiry of stale devices
+
+#define ZM_DEVICE_EXPIRE_INTERVAL   100     //  Default msecs between runs
+#define ZM_DEVICE_EXPIRE_BATCH      100     //  Default devices per run
+
+//  Checkpoints
+
+#define ZM_DEVICE_CHECKPOINT_TICK   100     //  Msecs between policy checks
+
+//  Lazy load
+
+#define ZM_DEVICE_HYDRATE_INTERVAL  1       //  Msecs between hydration slices
+#define ZM_DEVICE_HYDRATE_BATCH     1000    //  Default devices per slice
+
 //  Structure of our actor
 
 struct _zm_device_t {
     zsock_t *pipe;              //  Actor command pipe
-    zpoller_t *poller;          //  Socket poller
+    zloop_t *loop;              //  Reactor driving pipe, client and timers
     bool terminated;            //  Did caller ask us to quit?
     bool verbose;               //  Verbose logging enabled?
     //  TODO: Declare properties
@@ -64,9 +451,71 @@ struct _zm_device_t {
     zhash_t *consumers;         //  List of streams to subscribe
     zm_proto_t *msg;            //  Last received message
     zm_devices_t *devices;      //  List of devices to maintain
+    zhashx_t *cursors;          //  Open GET-PAGE cursors
+    uint64_t cursor_id;         //  Last assigned cursor token
+    zm_device_publisher_t *publisher;   //  Running PUBLISH-ALL, if any
+    int sync_timer;             //  Journal sync and compaction timer
+    size_t compact_after;       //  Store snapshot after this many journal records
+    bool store_background;      //  Compact in background, see PERSISTENCE
+    int64_t store_started;      //  When background store started
+    int checkpoint_timer;       //  Checks checkpoint policies
+    size_t checkpoint_interval; //  Store every N msecs if dirty, 0 never
+    size_t checkpoint_changes;  //  Store after N changes, 0 never
+    int64_t checkpoint_at;      //  When the last checkpoint started
+    int hydrate_timer;          //  Hydrates lazily loaded devices
+    size_t hydrate_batch;       //  Devices hydrated per timer run
+    int64_t load_started;       //  When lazy load started
+    zm_coalesce_t *coalesce;    //  Changes waiting for CHANGE-BATCH
+    int coalesce_timer;         //  Ends the window
+    size_t coalesce_window;     //  Msecs changes may wait, 0 is no waiting
+    int expire_timer;           //  Expiry timer
+    size_t expire_batch;        //  Max devices expired per timer run
+    const char *sender;         //  Sender of request being handled
+    const char *subject;        //  Subject of request being handled
+    bool gather;                //  Reply goes to the pipe, see SHARDING
+    zm_shards_t *shards;        //  Worker actors in sharded mode
+    zm_replica_t *replica;      //  Following server/replicate, see REPLICA
+    zm_cache_t *cache;          //  Applies consumed streams, see CONSUME
+    int replica_timer;          //  Asks again when no reply came
+    zm_stats_t *stats;          //  Counters and latencies, see STATS
+    mlm_client_t *stats_client; //  Producer on malamute/stats stream
+    int stats_timer;            //  Publisher of stats
+    zm_queue_t *queue;          //  Admitted requests, see BACKPRESSURE
+    int queue_timer;            //  Applies next slice of writes
+    zm_trace_t *trace;          //  Timing of requests, see TRACING
 };
 
 
+static int
+zm_device_publish_all_cancel (zm_device_t *self);
+
+static void
+zm_device_coalesce_flush (zm_device_t *self);
+
+static void
+zm_device_coalesce_setup (zm_device_t *self);
+
+static void
+zm_device_queue_setup (zm_device_t *self);
+
+static void
+zm_device_trace_setup (zm_device_t *self);
+
+static void
+zm_device_cache_setup (zm_device_t *self);
+
+static size_t
+zm_device_queue_run (zm_device_t *self, size_t writes);
+
+static int
+zm_device_handle_expire (zloop_t *loop, int timer_id, void *arg);
+
+static int
+zm_device_handle_stats (zloop_t *loop, int timer_id, void *arg);
+
+static void
+zm_device_recv_request (zm_device_t *self, zmsg_t *request);
+
 //  --------------------------------------------------------------------------
 //  Create a new zm_device instance
 
@@ -78,15 +527,42 @@ zm_device_new (zsock_t *pipe, void *args)
 
     self->pipe = pipe;
     self->terminated = false;
-    self->poller = zpoller_new (self->pipe, NULL);
+    self->loop = zloop_new ();
+    assert (self->loop);
+    //  Owner ends us by $TERM, after STOP has stored devices, signals don't
+    zloop_set_nonstop (self->loop, true);
     self->devices = zm_devices_new (NULL);
 
     self->config = NULL;
     self->consumers = NULL;
     self->msg = zm_proto_new ();
-    self->client = mlm_client_new ();
-    assert (self->client);
-    zpoller_add (self->poller, mlm_client_msgpipe (self->client));
+    self->client = NULL;
+    self->sync_timer = -1;
+    self->checkpoint_timer = -1;
+    self->hydrate_timer = -1;
+    self->coalesce_timer = -1;
+    self->coalesce = zm_coalesce_new (0);
+    self->store_background = true;
+    self->stats = zm_stats_new ();
+    //  Names of our own operations are there whatever subjects arrive
+    const char *operations [] = {
+        "store", "sync", "load", "expire", "stale", "STREAM", "BUSY", "wait", NULL
+    };
+    size_t operation;
+    for (operation = 0; operations [operation]; operation++)
+        zm_stats_reserve (self->stats, operations [operation]);
+    self->stats_timer = -1;
+    self->replica = zm_replica_new ();
+    self->cache = zm_cache_new ();
+    self->replica_timer = -1;
+    self->expire_batch = ZM_DEVICE_EXPIRE_BATCH;
+    self->expire_timer = zloop_timer (self->loop, ZM_DEVICE_EXPIRE_INTERVAL, 0, zm_device_handle_expire, self);
+    self->cursors = zhashx_new ();
+    assert (self->cursors);
+    zhashx_set_destructor (self->cursors, (zhashx_destructor_fn *) s_cursor_destroy);
+    self->queue = zm_queue_new (ZM_DEVICE_WRITE_SLICE);
+    self->queue_timer = -1;
+    self->trace = zm_trace_new ();
 
     return self;
 }
@@ -102,14 +578,28 @@ zm_device_destroy (zm_device_t **self_p)
     if (*self_p) {
         zm_device_t *self = *self_p;
 
+        //  Answer what is queued while configuration and cursors exist
+        if (self->client)
+            zm_device_queue_run (self, SIZE_MAX);
         zconfig_destroy (&self->config);
         zhash_destroy (&self->consumers);
+        zhashx_destroy (&self->cursors);
+        zm_device_publish_all_cancel (self);
+        zm_device_coalesce_flush (self);
+        zm_coalesce_destroy (&self->coalesce);
         zm_proto_destroy (&self->msg);
         mlm_client_destroy (&self->client);
-        zpoller_destroy (&self->poller);
+        mlm_client_destroy (&self->stats_client);
+        zm_shards_destroy (&self->shards);
+        zm_replica_destroy (&self->replica);
+        zm_cache_destroy (&self->cache);
+        zm_queue_destroy (&self->queue);
+        zm_trace_destroy (&self->trace);
+        zloop_destroy (&self->loop);
 
         zm_devices_store (self->devices);
         zm_devices_destroy (&self->devices);
+        zm_stats_destroy (&self->stats);
 
         //  Free object itself
         free (self);
@@ -146,6 +636,15 @@ zm_device_cfg_producer (zm_device_t *self) {
     return NULL;
 }
 
+static const char *
+zm_device_cfg_replicate (zm_device_t *self) {
+    assert (self);
+    if (self->config) {
+        return zconfig_resolve (self->config, "server/replicate", NULL);
+    }
+    return NULL;
+}
+
 static const char *
 zm_device_cfg_file (zm_device_t *self) {
     assert (self);
@@ -155,6 +654,50 @@ zm_device_cfg_file (zm_device_t *self) {
     return NULL;
 }
 
+static const char *
+zm_device_cfg_format (zm_device_t *self) {
+    assert (self);
+    if (self->config) {
+        return zconfig_resolve (self->config, "server/format", NULL);
+    }
+    return NULL;
+}
+
+static const char*
+zm_device_cfg_load (zm_device_t *self) {
+    assert (self);
+    if (self->config) {
+        return zconfig_resolve (self->config, "server/load", "full");
+    }
+    return "full";
+}
+
+static const char*
+zm_device_cfg_store (zm_device_t *self) {
+    assert (self);
+    if (self->config) {
+        return zconfig_resolve (self->config, "server/store", "background");
+    }
+    return "background";
+}
+
+static size_t
+zm_device_cfg_number (zm_device_t *self, const char *path, size_t dflt) {
+    assert (self);
+    if (self->config) {
+        const char *value = zconfig_resolve (self->config, path, NULL);
+        if (value)
+            return (size_t) strtoull (value, NULL, 10);
+    }
+    return dflt;
+}
+
+static bool
+zm_device_cfg_cache (zm_device_t *self) {
+    assert (self);
+    return zm_device_cfg_number (self, "server/cache", 0) != 0;
+}
+
 static const char*
 zm_device_cfg_consumer_first (zm_device_t *self) {
     assert (self);
@@ -187,6 +730,12 @@ zm_device_cfg_consumer_stream (zm_device_t *self) {
      return zhash_cursor (self->consumers);
 }
 
+static int
+zm_device_handle_mlm (zloop_t *loop, zsock_t *reader, void *arg);
+
+static void
+zm_device_replica_sync (zm_device_t *self);
+
 static int
 zm_device_connect_to_malamute (zm_device_t *self)
 {
@@ -210,7 +759,8 @@ zm_device_connect_to_malamute (zm_device_t *self)
 
     if (!self->client) {
         self->client = mlm_client_new ();
-        zpoller_add (self->poller, mlm_client_msgpipe (self->client));
+        assert (self->client);
+        zloop_reader (self->loop, mlm_client_msgpipe (self->client), zm_device_handle_mlm, self);
     }
 
     int r = mlm_client_connect (self->client, endpoint, 5000, address);
@@ -227,7 +777,10 @@ zm_device_connect_to_malamute (zm_device_t *self)
         }
     }
 
-    const char *pattern = zm_device_cfg_consumer_first (self);
+    //  Streams are consumed by the front actor, not by its workers
+    const char *pattern = zconfig_resolve (self->config, "server/shard", NULL)
+        ? NULL
+        : zm_device_cfg_consumer_first (self);
     while (pattern) {
         const char *stream = zm_device_cfg_consumer_stream (self);
         r = mlm_client_set_consumer (self->client, stream, pattern);
@@ -237,6 +790,29 @@ zm_device_connect_to_malamute (zm_device_t *self)
         }
         pattern = zm_device_cfg_consumer_next (self);
     }
+
+    //  Client can produce on one stream only, so stats have their own
+    const char *stats = zconfig_resolve (self->config, "malamute/stats", NULL);
+    if (stats && !self->stats_client) {
+        char *stats_address = zsys_sprintf ("%s.stats", address);
+        self->stats_client = mlm_client_new ();
+        assert (self->stats_client);
+        r = mlm_client_connect (self->stats_client, endpoint, 5000, stats_address);
+        zstr_free (&stats_address);
+        if (r == -1 || mlm_client_set_producer (self->stats_client, stats) == -1) {
+            zsys_warning ("Can't setup publisher on stream %s", stats);
+            mlm_client_destroy (&self->stats_client);
+        }
+    }
+
+    if (zm_device_cfg_replicate (self)
+    && (!self->consumers || !zhash_lookup (self->consumers, ZM_PROTO_DEVICE_STREAM))) {
+        r = mlm_client_set_consumer (self->client, ZM_PROTO_DEVICE_STREAM, ".*");
+        if (r == -1) {
+            zsys_warning ("Can't setup consumer %s/.*", ZM_PROTO_DEVICE_STREAM);
+            return -1;
+        }
+    }
     return 0;
 }
 
@@ -248,221 +824,2283 @@ zm_device_start (zm_device_t *self)
 {
     assert (self);
 
+    if (self->shards)
+        zm_shards_send (self->shards, "START");
+
     int r = zm_device_connect_to_malamute (self);
     if (r == -1)
         return r;
 
+    if (zm_device_cfg_replicate (self))
+        zm_device_replica_sync (self);
+    else
+    if (zm_device_cfg_cache (self) && self->shards)
+        zsys_warning ("zm_device: server/cache is not available with server/shards");
     return 0;
 }
 
 
-//  Stop this actor. Return a value greater or equal to zero if stopping 
-//  was successful. Otherwise -1.
+//  Add "N/M" frame with _seq and _cnt to device sent by GET-ALL or
+//  PUBLISH-ALL, so stored device does not change, see zm_device_pop_seq
+
+static void
+zm_device_add_seq (zmsg_t *msg, size_t seq, size_t cnt)
+{
+    zmsg_addstrf (msg, "%zu/%zu", seq, cnt);
+}
+
+//  Publish next batch of devices within budget, called from the loop
 
 static int
-zm_device_stop (zm_device_t *self)
+zm_device_handle_publish (zloop_t *loop, int timer_id, void *arg)
 {
-    assert (self);
+    zm_device_t *self = (zm_device_t *) arg;
+    zm_device_publisher_t *publisher = self->publisher;
+    assert (publisher);
+
+    //  Refill token buckets, allowing at most one second burst
+    int64_t now = zclock_mono ();
+    double elapsed = (now - publisher->refilled) / 1000.0;
+    publisher->refilled = now;
+    if (publisher->rate) {
+        publisher->rate_budget += publisher->rate * elapsed;
+        if (publisher->rate_budget > publisher->rate)
+            publisher->rate_budget = publisher->rate;
+    }
+    if (publisher->bytes) {
+        publisher->bytes_budget += publisher->bytes * elapsed;
+        if (publisher->bytes_budget > publisher->bytes)
+            publisher->bytes_budget = publisher->bytes;
+    }
 
-    zpoller_remove (self->poller, mlm_client_msgpipe (self->client));
-    mlm_client_destroy (&self->client);
-    zm_devices_store (self->devices);
+    size_t sent = 0;
+    char *name = (char *) zlistx_first (publisher->names);
+    while (name
+    &&     sent < ZM_DEVICE_PUBLISH_CHUNK
+    &&     (!publisher->rate || publisher->rate_budget >= 1)
+    &&     (!publisher->bytes || publisher->bytes_budget > 0)) {
+        zmsg_t *msg = zm_devices_lookup_msg (self->devices, name);
+        if (msg) {
+            zm_device_add_seq (msg, publisher->offset + publisher->seq++, publisher->cnt);
+            publisher->rate_budget -= 1;
+            publisher->bytes_budget -= zmsg_content_size (msg);
+            mlm_client_send (self->client, "PUBLISH-ALL", &msg);
+            sent++;
+        }
+        zlistx_delete (publisher->names, NULL);
+        name = (char *) zlistx_first (publisher->names);
+    }
 
+    if (!name) {
+        if (self->verbose)
+            zsys_debug ("zm_device: PUBLISH-ALL done, %zu devices", publisher->seq);
+        zm_device_publish_all_cancel (self);
+    }
     return 0;
 }
 
-//  Config message, second argument is string representation of config file
+//  Start publishing all devices in background. Sharded workers number
+//  devices from offset, out of total devices of all shards, otherwise
+//  both are 0.
+
 static int
-zm_device_config (zm_device_t *self, zmsg_t *request)
+zm_device_publish_all (zm_device_t *self, size_t offset, size_t total)
 {
     assert (self);
-    assert (request);
-
-    char *str_config = zmsg_popstr (request);
-    if (str_config) {
-        zconfig_t *foo = zconfig_str_load (str_config);
-        zstr_free (&str_config);
-        if (foo) {
-            zconfig_destroy (&self->config);
-            self->config = foo;
-            if (zm_device_cfg_file (self)) {
-                if (!zm_devices_file (self->devices))
-                    zm_devices_set_file (self->devices, zm_device_cfg_file (self));
-                zm_devices_store (self->devices);
-                zm_devices_destroy (&self->devices);
-                self->devices = zm_devices_new (zm_device_cfg_file (self));
-            }
-        }
-        else {
-            zsys_warning ("zm_device: can't load config file from string");
-            return -1;
-        }
-    }
-    else
+    if (self->publisher) {
+        if (self->verbose)
+            zsys_debug ("zm_device: PUBLISH-ALL already running, %zu/%zu",
+                self->publisher->seq, self->publisher->cnt);
         return -1;
+    }
+
+    zm_device_publisher_t *publisher =
+        (zm_device_publisher_t *) zmalloc (sizeof (zm_device_publisher_t));
+    assert (publisher);
+    publisher->names = zm_devices_names (self->devices);
+    publisher->cnt = total ? total : zlistx_size (publisher->names);
+    publisher->offset = offset;
+    publisher->rate = zm_device_cfg_number (self, "server/publish_rate", 0);
+    publisher->bytes = zm_device_cfg_number (self, "server/publish_bytes", 0);
+    //  Allow the first tick to send something
+    publisher->rate_budget = publisher->rate ? 1 : 0;
+    publisher->bytes_budget = publisher->bytes ? 1 : 0;
+    publisher->refilled = zclock_mono ();
+    publisher->timer = zloop_timer (
+        self->loop, ZM_DEVICE_PUBLISH_TICK, 0, zm_device_handle_publish, self);
+    self->publisher = publisher;
     return 0;
 }
 
+//  Stop running PUBLISH-ALL, returns -1 if there was none
 
-//  Here we handle incoming message from the node
-
-static void
-zm_device_recv_api (zm_device_t *self)
+static int
+zm_device_publish_all_cancel (zm_device_t *self)
 {
-    //  Get the whole message of the pipe in one go
-    zmsg_t *request = zmsg_recv (self->pipe);
-    if (!request)
-       return;        //  Interrupted
+    assert (self);
+    zm_device_publisher_t *publisher = self->publisher;
+    if (!publisher)
+        return -1;
 
-    char *command = zmsg_popstr (request);
-    if (streq (command, "START"))
-        zm_device_start (self);
-    else
-    if (streq (command, "STOP"))
-        zm_device_stop (self);
-    else
-    if (streq (command, "VERBOSE"))
-        self->verbose = true;
-    else
-    if (streq (command, "$TERM"))
-        //  The $TERM command is send by zactor_destroy() method
-        self->terminated = true;
-    else
-    if (streq (command, "CONFIG"))
-        zm_device_config (self, request);
-    else {
-        zsys_error ("invalid command '%s'", command);
-        assert (false);
-    }
-    zstr_free (&command);
-    zmsg_destroy (&request);
+    zloop_timer_end (self->loop, publisher->timer);
+    zlistx_destroy (&publisher->names);
+    free (publisher);
+    self->publisher = NULL;
+    return 0;
 }
 
+//  Collect result of background store, if there's one running. Return -1
+//  if it failed, otherwise 0.
+
 static int
-zm_device_publish (zm_device_t *self, zm_proto_t *device, const char *subject)
+zm_device_store_end (zm_device_t *self)
 {
     assert (self);
-    assert (device);
-    assert (subject);
+    zactor_t *store = self->devices ? zm_devices_store_actor (self->devices) : NULL;
+    if (!store)
+        return 0;
+    zloop_reader_end (self->loop, zactor_sock (store));
+    int rv = zm_devices_store_finish (self->devices);
+    if (rv == -1)
+        zsys_warning ("zm_device: background store of %s failed", zm_devices_file (self->devices));
+    zm_stats_record (self->stats, "store", zclock_usecs () - self->store_started);
+    return rv;
+}
 
-    zmsg_t *msg = zmsg_new ();
-    zm_proto_send (device, msg);
-    return mlm_client_send (self->client, subject, &msg);
+static int
+zm_device_handle_store (zloop_t *loop, zsock_t *reader, void *arg)
+{
+    zm_device_t *self = (zm_device_t *) arg;
+    zm_device_store_end (self);
+    return 0;
 }
 
-static void
-zm_device_recv_mlm_mailbox (zm_device_t *self)
+//  Store devices, measuring how long it takes. Return -1 if it failed,
+//  otherwise 0.
+
+static int
+zm_device_store (zm_device_t *self)
 {
     assert (self);
+    zm_device_store_end (self);
+    if (!self->devices)
+        return 0;
+    int64_t start = zclock_usecs ();
+    int rv = zm_devices_store (self->devices);
+    zm_stats_record (self->stats, "store", zclock_usecs () - start);
+    return rv;
+}
 
-    const char *subject = mlm_client_subject (self->client);
-    zm_proto_t *msg = self->msg;    // message to send
-    zm_proto_t *reply = NULL;
+//  Store devices without blocking the actor, unless server/store is sync.
+//  Does nothing while previous background store is running. When the
+//  background store can't start, devices are stored right away. Return
+//  -1 if that failed, otherwise 0.
 
-    if (streq (subject, "INSERT")) {
-        zm_devices_insert (self->devices, self->msg);
-        zm_device_publish (self, self->msg, subject);
-        zm_proto_encode_ok (self->msg);
-    }
-    else
-    if (streq (subject, "DELETE")) {
-        const char *device = zm_proto_device (self->msg);
-        zm_devices_delete (self->devices, device);
-        zm_device_publish (self, self->msg, subject);
-        zm_proto_encode_ok (self->msg);
-    }
-    else
-    if (streq (subject, "LOOKUP")) {
-        const char *device = zm_proto_device (self->msg);
-        reply = zm_devices_lookup (self->devices, device);
+static int
+zm_device_store_background (zm_device_t *self)
+{
+    assert (self);
+    if (!self->store_background)
+        return zm_device_store (self);
+    if (zm_devices_store_actor (self->devices))
+        return 0;
 
-        if (reply)
-            msg = reply;
-        else
-            zm_proto_encode_error (self->msg, 404, "Requested device does not exists");
+    self->store_started = zclock_usecs ();
+    if (zm_devices_store_start (self->devices) == -1) {
+        zsys_warning ("zm_device: can't start background store of %s, storing now",
+            zm_devices_file (self->devices));
+        return zm_device_store (self);
     }
+    zactor_t *store = zm_devices_store_actor (self->devices);
+    if (store)
+        zloop_reader (self->loop, zactor_sock (store), zm_device_handle_store, self);
     else
-    if (streq (subject, "GET-ALL")) {
-        if (zm_devices_size (self->devices) == 0) {
-            zm_proto_encode_error (self->msg, 404, "No devices");
-            goto send;
-        }
+        zm_stats_record (self->stats, "store", zclock_usecs () - self->store_started);
+    return 0;
+}
 
-        msg = zm_devices_first (self->devices);
-        zm_proto_ext_set_int (msg, "_cnt", zm_devices_size (self->devices));
-        size_t i = 0;
-        while (msg) {
-            zm_proto_ext_set_int (msg, "_seq", i++);
-            zm_proto_sendto (
-                msg,
-                self->client,
-                mlm_client_sender (self->client),
-                subject);
-            msg = zm_devices_next (self->devices);
-        }
+//  Stop this actor. Return a value greater or equal to zero if stopping 
+//  was successful. Otherwise -1, when devices could not be stored.
+
+static int
+zm_device_stop (zm_device_t *self)
+{
+    assert (self);
+
+    zm_device_publish_all_cancel (self);
+    if (self->client) {
+        //  Answer whatever was admitted before going away
+        zm_device_queue_run (self, SIZE_MAX);
+        if (self->queue_timer != -1) {
+            zloop_timer_end (self->loop, self->queue_timer);
+            self->queue_timer = -1;
+        }
+    }
+    zm_device_coalesce_flush (self);
+    if (self->client) {
+        zloop_reader_end (self->loop, mlm_client_msgpipe (self->client));
+        mlm_client_destroy (&self->client);
+    }
+    if (self->shards)
+        zm_shards_send (self->shards, "STOP");
+    mlm_client_destroy (&self->stats_client);
+    //  Frozen view is written as is, lazily loaded devices are not hydrated
+    int rv = 0;
+    if (self->store_background
+    &&  self->devices
+    &&  zm_devices_file (self->devices)
+    &&  zm_devices_dirty (self->devices)) {
+        zm_device_store_end (self);
+        rv = zm_device_store_background (self);
+        if (zm_device_store_end (self) == -1)
+            rv = -1;
+    }
+    else
+        rv = zm_device_store (self);
+
+    return rv;
+}
+
+//  Sync journal to disk and fold it into snapshot once it grows too big
+
+static int
+zm_device_handle_sync (zloop_t *loop, int timer_id, void *arg)
+{
+    zm_device_t *self = (zm_device_t *) arg;
+    if (!self->devices)
+        return 0;
+    int64_t start = zclock_usecs ();
+    zm_devices_sync (self->devices);
+    zm_stats_record (self->stats, "sync", zclock_usecs () - start);
+    if (self->compact_after
+    &&  !zm_devices_pending (self->devices)
+    &&  zm_devices_journal_size (self->devices) >= self->compact_after)
+        zm_device_store_background (self);
+    return 0;
+}
+
+//  Start checkpoint once any of server/checkpoint_* policies is due
+
+static int
+zm_device_handle_checkpoint (zloop_t *loop, int timer_id, void *arg)
+{
+    zm_device_t *self = (zm_device_t *) arg;
+    if (!self->devices
+    ||  !zm_devices_file (self->devices)
+    ||  zm_devices_pending (self->devices))
+        return 0;
+    size_t dirty = zm_devices_dirty (self->devices);
+    if (!dirty)
+        return 0;
+
+    int64_t now = zclock_mono ();
+    size_t changes = zm_devices_dirty_content (self->devices);
+    if ((self->checkpoint_changes && changes >= self->checkpoint_changes)
+    ||  (self->checkpoint_interval
+         && now - self->checkpoint_at >= (int64_t) self->checkpoint_interval)) {
+        if (zm_devices_store_actor (self->devices))
+            return 0;   //  Still writing the previous one
+        if (self->verbose)
+            zsys_debug ("zm_device: checkpoint of %zu changes", dirty);
+        self->checkpoint_at = now;
+        zm_device_store_background (self);
+    }
+    return 0;
+}
+
+//  Hydrate next slice of lazily loaded devices
+
+static int
+zm_device_handle_hydrate (zloop_t *loop, int timer_id, void *arg)
+{
+    zm_device_t *self = (zm_device_t *) arg;
+    if (self->devices && zm_devices_hydrate (self->devices, self->hydrate_batch))
+        return 0;
+    zloop_timer_end (self->loop, self->hydrate_timer);
+    self->hydrate_timer = -1;
+    zm_stats_record (self->stats, "load", zclock_usecs () - self->load_started);
+    if (self->verbose)
+        zsys_debug ("zm_device: %zu devices loaded", self->devices ? zm_devices_size (self->devices) : 0);
+    return 0;
+}
+
+//  Load devices from server/file, lazily if server/load says so
+
+static void
+zm_device_load (zm_device_t *self)
+{
+    assert (self);
+    if (self->hydrate_timer != -1) {
+        zloop_timer_end (self->loop, self->hydrate_timer);
+        self->hydrate_timer = -1;
+    }
+    self->load_started = zclock_usecs ();
+    const char *load = zm_device_cfg_load (self);
+    if (streq (load, "lazy")) {
+        self->devices = zm_devices_new_lazy (zm_device_cfg_file (self));
+        self->hydrate_batch = zm_device_cfg_number (self, "server/hydrate_batch", ZM_DEVICE_HYDRATE_BATCH);
+        if (!self->hydrate_batch)
+            self->hydrate_batch = ZM_DEVICE_HYDRATE_BATCH;
+        if (self->devices && zm_devices_pending (self->devices)) {
+            self->hydrate_timer = zloop_timer (self->loop,
+                ZM_DEVICE_HYDRATE_INTERVAL, 0, zm_device_handle_hydrate, self);
+            return;
+        }
+    }
+    else {
+        if (!streq (load, "full"))
+            zsys_warning ("zm_device: unknown server/load '%s'", load);
+        self->devices = zm_devices_new (zm_device_cfg_file (self));
+    }
+    zm_stats_record (self->stats, "load", zclock_usecs () - self->load_started);
+}
+
+//  Apply server/checkpoint_* configuration
+
+static void
+zm_device_checkpoint_setup (zm_device_t *self)
+{
+    assert (self);
+    if (self->checkpoint_timer != -1) {
+        zloop_timer_end (self->loop, self->checkpoint_timer);
+        self->checkpoint_timer = -1;
+    }
+    self->checkpoint_interval = zm_device_cfg_number (self, "server/checkpoint_interval", 0) * 1000;
+    self->checkpoint_changes = zm_device_cfg_number (self, "server/checkpoint_changes", 0);
+    self->checkpoint_at = zclock_mono ();
+    if (self->checkpoint_interval || self->checkpoint_changes)
+        self->checkpoint_timer = zloop_timer (self->loop,
+            ZM_DEVICE_CHECKPOINT_TICK, 0, zm_device_handle_checkpoint, self);
+}
+
+//  Apply server/memory_budget and server/cold_file configuration
+
+static void
+zm_device_budget_setup (zm_device_t *self)
+{
+    assert (self);
+    if (!self->devices)
+        return;
+    size_t budget = zm_device_cfg_number (self, "server/memory_budget", 0);
+    const char *cold_file = zconfig_resolve (self->config, "server/cold_file", NULL);
+    if (zm_devices_set_budget (self->devices, budget, cold_file) == -1)
+        zsys_warning ("zm_device: can't open cold file, devices stay in memory");
+}
+
+//  Enable the journal according to server/journal* configuration
+
+static void
+zm_device_journal_setup (zm_device_t *self)
+{
+    assert (self);
+    if (self->sync_timer != -1) {
+        zloop_timer_end (self->loop, self->sync_timer);
+        self->sync_timer = -1;
+    }
+
+    if (!self->devices
+    ||  !zm_devices_file (self->devices)
+    ||  !zm_device_cfg_number (self, "server/journal", 1))
+        return;
+
+    size_t batch = zm_device_cfg_number (self, "server/sync_batch", 1000);
+    if (zm_devices_journal_open (self->devices, batch) == -1) {
+        zsys_warning ("zm_device: can't open journal, changes will be stored on STOP only");
+        return;
+    }
+    self->compact_after = zm_device_cfg_number (self, "server/compact_after", 100000);
+    size_t interval = zm_device_cfg_number (self, "server/sync_interval", 1000);
+    if (interval)
+        self->sync_timer = zloop_timer (self->loop, interval, 0, zm_device_handle_sync, self);
+}
+
+//  Apply server/store configuration, it holds with journal disabled too
+
+static void
+zm_device_store_setup (zm_device_t *self)
+{
+    assert (self);
+    const char *store = zm_device_cfg_store (self);
+    self->store_background = !streq (store, "sync");
+    if (self->store_background && !streq (store, "background"))
+        zsys_warning ("zm_device: unknown server/store '%s'", store);
+}
+
+//  Apply server/expire_* configuration
+
+static void
+zm_device_expire_setup (zm_device_t *self)
+{
+    assert (self);
+    if (self->expire_timer != -1) {
+        zloop_timer_end (self->loop, self->expire_timer);
+        self->expire_timer = -1;
+    }
+    self->expire_batch = zm_device_cfg_number (self, "server/expire_batch", ZM_DEVICE_EXPIRE_BATCH);
+    size_t interval = zm_device_cfg_number (self, "server/expire_interval", ZM_DEVICE_EXPIRE_INTERVAL);
+    if (interval && self->expire_batch)
+        self->expire_timer = zloop_timer (self->loop, interval, 0, zm_device_handle_expire, self);
+}
+
+//  Index ext keys listed in server/index
+
+static void
+zm_device_index_setup (zm_device_t *self)
+{
+    assert (self);
+    zconfig_t *index = self->devices ? zconfig_locate (self->config, "server/index") : NULL;
+    zconfig_t *child = index ? zconfig_child (index) : NULL;
+    while (child) {
+        const char *key = zconfig_value (child);
+        if (key && *key)
+            zm_devices_index (self->devices, key);
+        child = zconfig_next (child);
+    }
+}
+
+//  Return stats of the actor as ZPL string, caller frees it
+
+static char *
+zm_device_stats_str (zm_device_t *self)
+{
+    assert (self);
+    if (self->devices) {
+        zm_stats_set (self->stats, "devices", zm_devices_size (self->devices));
+        zm_stats_set (self->stats, "allocated", zm_devices_allocated (self->devices));
+        zm_stats_set (self->stats, "journal", zm_devices_journal_size (self->devices));
+        zm_stats_set (self->stats, "version", zm_devices_version (self->devices));
+        zm_stats_set (self->stats, "storing", zm_devices_store_actor (self->devices) != NULL);
+        zm_stats_set (self->stats, "dirty", zm_devices_dirty (self->devices));
+        zm_stats_set (self->stats, "loading", zm_devices_pending (self->devices));
+        zm_stats_set (self->stats, "hot_bytes", zm_devices_hot_bytes (self->devices));
+        zm_stats_set (self->stats, "cold", zm_devices_cold (self->devices));
+    }
+    zm_stats_set (self->stats, "cursors", zhashx_size (self->cursors));
+    zm_stats_set (self->stats, "shards", self->shards ? zm_shards_size (self->shards) : 0);
+    zm_stats_set (self->stats, "coalesced", zm_coalesce_size (self->coalesce));
+    zm_stats_set (self->stats, "queued", zm_queue_reads (self->queue) + zm_queue_writes (self->queue));
+    zm_stats_set (self->stats, "pending", zm_replica_pending (self->replica));
+    zconfig_t *zpl = zm_stats_zpl (self->stats);
+    char *str = zconfig_str_save (zpl);
+    zconfig_destroy (&zpl);
+    return str;
+}
+
+//  Publish stats on malamute/stats stream
+
+static int
+zm_device_handle_stats (zloop_t *loop, int timer_id, void *arg)
+{
+    zm_device_t *self = (zm_device_t *) arg;
+    if (!self->stats_client)
+        return 0;
+    zmsg_t *msg = zmsg_new ();
+    char *str = zm_device_stats_str (self);
+    zmsg_addstr (msg, str);
+    zstr_free (&str);
+    mlm_client_send (self->stats_client, "STATS", &msg);
+    return 0;
+}
+
+//  Publish stats every server/stats_interval msecs
+
+static void
+zm_device_stats_setup (zm_device_t *self)
+{
+    assert (self);
+    if (self->stats_timer != -1) {
+        zloop_timer_end (self->loop, self->stats_timer);
+        self->stats_timer = -1;
+    }
+    size_t interval = zm_device_cfg_number (self, "server/stats_interval", 0);
+    if (interval)
+        self->stats_timer = zloop_timer (self->loop, interval, 0, zm_device_handle_stats, self);
+}
+
+//  Start server/shards worker actors, each with own malamute address, file
+//  and share of PUBLISH-ALL budget, see SHARDING. Running workers of the
+//  same count just take the new configuration, keeping their devices.
+
+static void
+zm_device_shards_setup (zm_device_t *self)
+{
+    assert (self);
+    size_t count = zm_device_cfg_number (self, "server/shards", 1);
+    if (count < 2 || zconfig_resolve (self->config, "server/shard", NULL)) {
+        zm_shards_destroy (&self->shards);
+        return;
+    }
+    if (zm_device_cfg_replicate (self)) {
+        zm_shards_destroy (&self->shards);
+        zsys_warning ("zm_device: server/shards is ignored by replica");
+        return;
+    }
+    bool running = self->shards && zm_shards_size (self->shards) == count;
+    if (!running)
+        zm_shards_destroy (&self->shards);
+
+    const char *address = zm_device_cfg_address (self);
+    const char *file = zm_device_cfg_file (self);
+    const char *cold_file = zconfig_resolve (self->config, "server/cold_file", NULL);
+    size_t rate = zm_device_cfg_number (self, "server/publish_rate", 0);
+    size_t bytes = zm_device_cfg_number (self, "server/publish_bytes", 0);
+    char *str_config = zconfig_str_save (self->config);
+
+    if (!running) {
+        self->shards = zm_shards_new (count);
+        if (self->verbose)
+            zm_shards_send (self->shards, "VERBOSE");
+    }
+    size_t i;
+    for (i = 0; i < count; i++) {
+        zconfig_t *config = zconfig_str_load (str_config);
+        assert (config);
+        zconfig_put (config, "server/shards", "1");
+        zconfig_putf (config, "server/shard", "%zu", i);
+        zconfig_putf (config, "malamute/address", "%s.%zu", address ? address : "zm-device", i);
+        if (file) {
+            zconfig_putf (config, "server/file", "%s.%zu", file, i);
+            //  Suffix hides .bin extension
+            size_t len = strlen (file);
+            if (!zm_device_cfg_format (self))
+                zconfig_put (config, "server/format",
+                    len >= 4 && streq (file + len - 4, ".bin") ? "binary" : "zpl");
+        }
+        if (cold_file)
+            zconfig_putf (config, "server/cold_file", "%s.%zu", cold_file, i);
+        if (rate)
+            zconfig_putf (config, "server/publish_rate", "%zu", rate > count ? rate / count : 1);
+        if (bytes)
+            zconfig_putf (config, "server/publish_bytes", "%zu", bytes > count ? bytes / count : 1);
+        char *str_worker = zconfig_str_save (config);
+        zconfig_destroy (&config);
+
+        zactor_t *worker = zm_shards_worker (self->shards, i);
+        zstr_sendx (worker, "CONFIG", str_worker, NULL);
+        if (!running && self->client)
+            zstr_send (worker, "START");
+        zstr_free (&str_worker);
+    }
+    zstr_free (&str_config);
+}
+
+//  Load devices of server/file. Devices loaded from it already are kept,
+//  so CONFIG reloading the same configuration costs no load. Devices of
+//  other file are stored there first. Returns true if devices were loaded.
+
+static bool
+zm_device_file_setup (zm_device_t *self)
+{
+    assert (self);
+    const char *file = zm_device_cfg_file (self);
+    const char *current = self->devices ? zm_devices_file (self->devices) : NULL;
+    if (current && streq (current, file))
+        return false;
+    //  Devices made before there was any file are moved to it
+    if (self->devices && (current || zm_devices_size (self->devices))) {
+        if (!current)
+            zm_devices_set_file (self->devices, file);
+        zm_device_store (self);
+    }
+    zm_devices_destroy (&self->devices);
+    zm_device_load (self);
+    return true;
+}
+
+//  Return true if there's no old configuration or any of paths, NULL
+//  terminated, has other value or subtree in config than in old one
+
+static bool
+zm_device_cfg_changed (zconfig_t *old, zconfig_t *config, const char *paths [])
+{
+    assert (config);
+    if (!old)
+        return true;
+    size_t i;
+    for (i = 0; paths [i]; i++) {
+        zconfig_t *before = zconfig_locate (old, paths [i]);
+        zconfig_t *after = zconfig_locate (config, paths [i]);
+        if (!before || !after) {
+            if (before != after)
+                return true;
+            continue;
+        }
+        const char *value = zconfig_value (before);
+        const char *other = zconfig_value (after);
+        if (!streq (value ? value : "", other ? other : ""))
+            return true;
+        char *subtree = zconfig_str_save (before);
+        char *other_subtree = zconfig_str_save (after);
+        bool changed = !streq (subtree ? subtree : "", other_subtree ? other_subtree : "");
+        zstr_free (&subtree);
+        zstr_free (&other_subtree);
+        if (changed)
+            return true;
+    }
+    return false;
+}
+
+//  Config message, second argument is string representation of config file
+static int
+zm_device_config (zm_device_t *self, zmsg_t *request)
+{
+    assert (self);
+    assert (request);
+
+    char *str_config = zmsg_popstr (request);
+    if (str_config) {
+        zconfig_t *foo = zconfig_str_load (str_config);
+        zstr_free (&str_config);
+        if (foo) {
+            //  Reload redoes only setups of what changed, see zmdevice
+            static const char *stats_paths [] = {"server/stats_interval", NULL};
+            static const char *coalesce_paths [] = {
+                "server/coalesce_window", "server/coalesce_batch", NULL};
+            static const char *queue_paths [] = {
+                "server/queue_high", "server/sender_rate", NULL};
+            static const char *trace_paths [] = {
+                "server/trace", "server/trace_slow", NULL};
+            static const char *cache_paths [] = {"server/conflict", NULL};
+            static const char *shards_paths [] = {
+                "server/shards", "server/shard", NULL};
+            static const char *format_paths [] = {"server/format", NULL};
+            static const char *journal_paths [] = {
+                "server/journal", "server/sync_batch", "server/sync_interval",
+                "server/compact_after", NULL};
+            static const char *store_paths [] = {"server/store", NULL};
+            static const char *checkpoint_paths [] = {
+                "server/checkpoint_interval", "server/checkpoint_changes", NULL};
+            static const char *budget_paths [] = {
+                "server/memory_budget", "server/cold_file", NULL};
+            static const char *expire_paths [] = {
+                "server/expire_interval", "server/expire_batch", NULL};
+            static const char *index_paths [] = {"server/index", NULL};
+            static const char *changes_paths [] = {"server/changes", NULL};
+
+            zconfig_t *old = self->config;
+            self->config = foo;
+            if (zm_device_cfg_changed (old, foo, stats_paths))
+                zm_device_stats_setup (self);
+            if (zm_device_cfg_changed (old, foo, coalesce_paths))
+                zm_device_coalesce_setup (self);
+            if (zm_device_cfg_changed (old, foo, queue_paths))
+                zm_device_queue_setup (self);
+            if (zm_device_cfg_changed (old, foo, trace_paths))
+                zm_device_trace_setup (self);
+            if (zm_device_cfg_changed (old, foo, cache_paths))
+                zm_device_cache_setup (self);
+            //  Workers take the whole configuration and do the same
+            bool fresh = zm_device_cfg_changed (old, foo, shards_paths);
+            zm_device_shards_setup (self);
+            if (self->shards) {
+                zconfig_destroy (&old);
+                return 0;       //  Devices are kept by workers
+            }
+            if (zm_device_cfg_file (self) && zm_device_file_setup (self))
+                fresh = true;
+            //  Loaded devices take all of the configuration
+            zconfig_t *before = fresh ? NULL : old;
+            const char *format = zm_device_cfg_format (self);
+            if (self->devices && format
+            &&  zm_device_cfg_changed (before, foo, format_paths)) {
+                if (streq (format, "binary"))
+                    zm_devices_set_format (self->devices, ZM_DEVICES_BINARY);
+                else
+                if (streq (format, "zpl"))
+                    zm_devices_set_format (self->devices, ZM_DEVICES_ZPL);
+                else
+                    zsys_warning ("zm_device: unknown server/format '%s'", format);
+            }
+            if (zm_device_cfg_changed (old, foo, store_paths))
+                zm_device_store_setup (self);
+            if (zm_device_cfg_changed (before, foo, journal_paths))
+                zm_device_journal_setup (self);
+            if (zm_device_cfg_changed (old, foo, checkpoint_paths))
+                zm_device_checkpoint_setup (self);
+            if (zm_device_cfg_changed (before, foo, budget_paths))
+                zm_device_budget_setup (self);
+            if (zm_device_cfg_changed (old, foo, expire_paths))
+                zm_device_expire_setup (self);
+            if (zm_device_cfg_changed (before, foo, index_paths))
+                zm_device_index_setup (self);
+            if (self->devices && zm_device_cfg_changed (before, foo, changes_paths))
+                zm_devices_set_changes_max (self->devices,
+                    zm_device_cfg_number (self, "server/changes", 100000));
+            zconfig_destroy (&old);
+        }
+        else {
+            zsys_warning ("zm_device: can't load config file from string");
+            return -1;
+        }
+    }
+    else
+        return -1;
+    return 0;
+}
+
+
+//  Here we handle incoming message from the node
+
+static void
+zm_device_recv_api (zm_device_t *self)
+{
+    //  Get the whole message of the pipe in one go
+    zmsg_t *request = zmsg_recv (self->pipe);
+    if (!request)
+       return;        //  Interrupted
+
+    char *command = zmsg_popstr (request);
+    if (streq (command, "START"))
+        zm_device_start (self);
+    else
+    if (streq (command, "STOP")) {
+        if (zm_device_stop (self) == -1)
+            zsys_error ("zm_device: STOP did not store devices");
+    }
+    else
+    if (streq (command, "VERBOSE"))
+        self->verbose = true;
+    else
+    if (streq (command, "$TERM"))
+        //  The $TERM command is send by zactor_destroy() method
+        self->terminated = true;
+    else
+    if (streq (command, "CONFIG"))
+        zm_device_config (self, request);
+    else
+    if (streq (command, "MAILBOX") || streq (command, "GATHER")) {
+        //  Request routed by the front actor, GATHER is replied to the pipe
+        self->gather = streq (command, "GATHER");
+        char *sender = self->gather ? NULL : zmsg_popstr (request);
+        char *subject = zmsg_popstr (request);
+        self->sender = sender;
+        self->subject = subject;
+        if (subject) {
+            int64_t start = zclock_usecs ();
+            zm_device_recv_request (self, request);
+            zm_stats_record (self->stats, subject, zclock_usecs () - start);
+        }
+        self->sender = NULL;
+        self->subject = NULL;
+        self->gather = false;
+        zstr_free (&sender);
+        zstr_free (&subject);
+    }
+    else
+    if (streq (command, "SIZE"))
+        zstr_sendf (self->pipe, "%zu", zm_devices_size (self->devices));
+    else
+    if (streq (command, "LOAD-STATUS")) {
+        size_t pending = self->devices ? zm_devices_pending (self->devices) : 0;
+        zstr_sendm (self->pipe, pending ? "loading" : "ready");
+        zstr_sendfm (self->pipe, "%zu", pending);
+        zstr_sendf (self->pipe, "%zu", self->devices ? zm_devices_size (self->devices) : 0);
+    }
+    else
+    if (streq (command, "STORE-MODE"))
+        zstr_sendx (self->pipe,
+            self->store_background ? "background" : "sync",
+            self->devices && zm_devices_store_actor (self->devices) ? "writing" : "idle",
+            NULL);
+    else
+    if (streq (command, "STATS")) {
+        char *str = zm_device_stats_str (self);
+        zstr_send (self->pipe, str);
+        zstr_free (&str);
+    }
+    else
+    if (streq (command, "PUBLISH-ALL")) {
+        char *offset = zmsg_popstr (request);
+        char *total = zmsg_popstr (request);
+        zm_device_publish_all (self,
+            offset ? (size_t) strtoull (offset, NULL, 10) : 0,
+            total ? (size_t) strtoull (total, NULL, 10) : 0);
+        zstr_free (&offset);
+        zstr_free (&total);
+    }
+    else {
+        zsys_error ("invalid command '%s'", command);
+        assert (false);
+    }
+    zstr_free (&command);
+    zmsg_destroy (&request);
+}
+
+//  Stamp change with epoch and version of devices, replicas use them to
+//  find lost stream messages
+
+static void
+zm_device_stamp (zm_device_t *self, zm_proto_t *device)
+{
+    assert (self);
+    assert (device);
+    zm_proto_ext_set_int (device, "_epoch", (uint64_t) zm_devices_epoch (self->devices));
+    zm_proto_ext_set_int (device, "_version", zm_devices_version (self->devices));
+}
+
+//  Publish coalesced changes as one CHANGE-BATCH, see PUBLISH
+
+static void
+zm_device_coalesce_flush (zm_device_t *self)
+{
+    assert (self);
+    if (self->coalesce_timer != -1) {
+        zloop_timer_end (self->loop, self->coalesce_timer);
+        self->coalesce_timer = -1;
+    }
+    zmsg_t *batch = self->coalesce ? zm_coalesce_flush (self->coalesce) : NULL;
+    if (batch && self->client)
+        mlm_client_send (self->client, "CHANGE-BATCH", &batch);
+    zmsg_destroy (&batch);
+}
+
+static int
+zm_device_handle_coalesce (zloop_t *loop, int timer_id, void *arg)
+{
+    zm_device_t *self = (zm_device_t *) arg;
+    //  One-shot timer is gone once it fired
+    self->coalesce_timer = -1;
+    zm_device_coalesce_flush (self);
+    return 0;
+}
+
+//  Keep stamped device as the last change of its name until the window
+//  ends, replacing the change waiting for it, if any
+
+static void
+zm_device_coalesce (zm_device_t *self, zm_proto_t *device, const char *subject)
+{
+    assert (self);
+    if (zm_coalesce_size (self->coalesce) == 0)
+        self->coalesce_timer = zloop_timer (self->loop, self->coalesce_window, 1,
+            zm_device_handle_coalesce, self);
+    if (zm_coalesce_add (self->coalesce, strstr (subject, "DELETE") ? "DELETE" : "INSERT",
+            device, zm_devices_version (self->devices)))
+        zm_device_coalesce_flush (self);
+}
+
+//  Apply server/coalesce_* configuration, changes waiting so far are
+//  published first
+
+static void
+zm_device_coalesce_setup (zm_device_t *self)
+{
+    assert (self);
+    zm_device_coalesce_flush (self);
+    self->coalesce_window = zm_device_cfg_number (self, "server/coalesce_window", 0);
+    zm_coalesce_set_batch (self->coalesce, zm_device_cfg_number (self, "server/coalesce_batch", 0));
+}
+
+//  Apply server/queue_high and server/sender_rate, see BACKPRESSURE
+
+static void
+zm_device_queue_setup (zm_device_t *self)
+{
+    assert (self);
+    zm_queue_set (self->queue,
+        zm_device_cfg_number (self, "server/queue_high", ZM_DEVICE_QUEUE_HIGH),
+        zm_device_cfg_number (self, "server/sender_rate", 0));
+}
+
+static int
+zm_device_publish (zm_device_t *self, zm_proto_t *device, const char *subject)
+{
+    assert (self);
+    assert (device);
+    assert (subject);
+
+    if (!self->client)
+        return -1;
+    zm_device_stamp (self, device);
+    if (self->coalesce_window) {
+        zm_device_coalesce (self, device, subject);
+        return 0;
+    }
+    zmsg_t *msg = zmsg_new ();
+    zm_proto_send (device, msg);
+    return mlm_client_send (self->client, subject, &msg);
+}
+
+//  --------------------------------------------------------------------------
+//  Tracing of mailbox requests, see TRACING
+
+static void
+zm_device_trace_setup (zm_device_t *self)
+{
+    assert (self);
+    zm_trace_set (self->trace,
+        (int64_t) zm_device_cfg_number (self, "server/trace_slow", 0) * 1000,
+        zm_device_cfg_number (self, "server/trace", 0) != 0);
+}
+
+//  Publish span of traced request on malamute/stats, log it when there's
+//  no stats stream
+
+static void
+zm_device_trace_end (zm_device_t *self, int64_t received, int64_t start, int64_t end)
+{
+    assert (self);
+    char *span = zm_trace_end (self->trace, self->subject,
+        self->sender ? self->sender : "front", received, start, end);
+    if (!span)
+        return;
+    if (self->stats_client) {
+        zmsg_t *msg = zmsg_new ();
+        zmsg_addstr (msg, span);
+        mlm_client_send (self->stats_client, "TRACE", &msg);
+    }
+    else
+        zsys_info ("zm_device: %s", span);
+    zstr_free (&span);
+}
+
+//  Reply to request being handled, to its sender or to the pipe when the
+//  front actor gathers replies of its workers
+
+static int
+zm_device_reply (zm_device_t *self, const char *subject, zmsg_t **reply_p)
+{
+    assert (self);
+    assert (reply_p);
+    if (self->gather)
+        return zmsg_send (reply_p, self->pipe);
+    if (!self->client) {
+        zmsg_destroy (reply_p);
+        return -1;
+    }
+    int64_t begin = zm_trace_clock (self->trace);
+    int r = mlm_client_sendto (self->client, self->sender, subject, NULL, 1000, reply_p);
+    if (begin)
+        zm_trace_add_send (self->trace, zclock_usecs () - begin);
+    return r;
+}
+
+//  Remove a slice of expired devices and publish DELETE for them, the rest
+//  waits for the next run
+
+static int
+zm_device_handle_expire (zloop_t *loop, int timer_id, void *arg)
+{
+    zm_device_t *self = (zm_device_t *) arg;
+    if (!self->devices)
+        return 0;
+
+    int64_t now = zclock_mono ();
+    int64_t start = zclock_usecs ();
+    size_t expired = 0;
+    while (expired < self->expire_batch) {
+        zm_proto_t *device = zm_devices_expire (self->devices, now);
+        if (!device)
+            break;
+        if (self->verbose)
+            zsys_debug ("zm_device: device %s expired", zm_proto_device (device));
+        if (self->client && zm_device_cfg_producer (self))
+            zm_device_publish (self, device, "DELETE");
+        zm_proto_destroy (&device);
+        expired++;
+    }
+    if (expired)
+        zm_stats_record (self->stats, "expire", zclock_usecs () - start);
+    return 0;
+}
+
+//  Drop expired cursors, and the least recently used one if there are
+//  too many of them
+
+static void
+zm_device_cursors_gc (zm_device_t *self)
+{
+    int64_t now = zclock_mono ();
+    const char *oldest = NULL;
+    int64_t oldest_used = INT64_MAX;
+    zlistx_t *expired = zlistx_new ();
+    zm_device_cursor_t *cursor = (zm_device_cursor_t *) zhashx_first (self->cursors);
+    while (cursor) {
+        const char *token = (const char *) zhashx_cursor (self->cursors);
+        if (now - cursor->used > ZM_DEVICE_CURSOR_TTL)
+            zlistx_add_end (expired, (void *) token);
+        else
+        if (cursor->used < oldest_used) {
+            oldest = token;
+            oldest_used = cursor->used;
+        }
+        cursor = (zm_device_cursor_t *) zhashx_next (self->cursors);
+    }
+    if (oldest && zhashx_size (self->cursors) - zlistx_size (expired) >= ZM_DEVICE_CURSOR_MAX)
+        zlistx_add_end (expired, (void *) oldest);
+
+    const char *token = (const char *) zlistx_first (expired);
+    while (token) {
+        zhashx_delete (self->cursors, token);
+        token = (const char *) zlistx_next (expired);
+    }
+    zlistx_destroy (&expired);
+}
+
+//  Send one GET-PAGE or QUERY reply, see @discuss for the format
+
+static void
+zm_device_get_page (zm_device_t *self, const char *subject)
+{
+    assert (self);
+
+    size_t limit = (size_t) zm_proto_ext_int (self->msg, "_limit", ZM_DEVICE_PAGE_LIMIT);
+    uint64_t id = (uint64_t) zm_proto_ext_int (self->msg, "_cursor", 0);
+    if (limit == 0)
+        limit = ZM_DEVICE_PAGE_LIMIT;
+
+    char token [32];
+    zm_device_cursor_t *cursor = NULL;
+    if (id) {
+        snprintf (token, sizeof (token), "%" PRIu64, id);
+        cursor = (zm_device_cursor_t *) zhashx_lookup (self->cursors, token);
+    }
+    else {
+        zm_device_cursors_gc (self);
+        cursor = (zm_device_cursor_t *) zmalloc (sizeof (zm_device_cursor_t));
+        assert (cursor);
+        if (streq (subject, "QUERY")) {
+            zhash_t *ext = zm_proto_ext (self->msg);
+            cursor->names = zm_devices_query (
+                self->devices,
+                ext,
+                ext ? (const char *) zhash_lookup (ext, "_prefix") : NULL,
+                ext ? (const char *) zhash_lookup (ext, "_glob") : NULL);
+        }
+        else
+            cursor->names = zm_devices_names (self->devices);
+        cursor->count = zlistx_size (cursor->names);
+        snprintf (token, sizeof (token), "%" PRIu64, ++self->cursor_id);
+        zhashx_insert (self->cursors, token, cursor);
+    }
+
+    zmsg_t *reply = zmsg_new ();
+    zmsg_t *status = zmsg_new ();
+    if (!cursor) {
+        zm_proto_encode_error (self->msg, 410, "Cursor does not exist or has expired");
+        zm_proto_send (self->msg, status);
+        zmsg_addmsg (reply, &status);
+        goto send;
+    }
+    cursor->used = zclock_mono ();
+    zm_proto_encode_ok (self->msg);
+    zm_proto_send (self->msg, status);
+    zmsg_addmsg (reply, &status);
+
+    zmsg_t *devices = zmsg_new ();
+    size_t i = 0;
+    char *name = (char *) zlistx_first (cursor->names);
+    while (name && i < limit) {
+        zmsg_t *item = zm_devices_lookup_msg (self->devices, name);
+        if (item) {
+            zmsg_addmsg (devices, &item);
+            i++;
+        }
+        zlistx_delete (cursor->names, NULL);
+        name = (char *) zlistx_first (cursor->names);
+    }
+
+    zmsg_addstr (reply, name ? token : "0");
+    zmsg_addstrf (reply, "%zu", cursor->count);
+    zframe_t *frame = zmsg_pop (devices);
+    while (frame) {
+        zmsg_append (reply, &frame);
+        frame = zmsg_pop (devices);
+    }
+    zmsg_destroy (&devices);
+    if (!name)
+        zhashx_delete (self->cursors, token);
+
+send:
+    zm_device_reply (self, subject, &reply);
+}
+
+//  Send all devices with version of the last published change in chunks,
+//  replicas start to follow the stream from there
+
+static void
+zm_device_snapshot (zm_device_t *self)
+{
+    assert (self);
+
+    int64_t epoch = zm_devices_epoch (self->devices);
+    uint64_t version = zm_devices_version (self->devices);
+    size_t chunk = 0;
+    zmsg_t *item = zm_devices_first_msg (self->devices);
+    do {
+        zmsg_t *devices = zmsg_new ();
+        while (item && zmsg_size (devices) < ZM_DEVICE_SNAPSHOT_CHUNK) {
+            zmsg_addmsg (devices, &item);
+            item = zm_devices_next_msg (self->devices);
+        }
+        zmsg_t *reply = zmsg_new ();
+        zmsg_t *status = zmsg_new ();
+        zm_proto_encode_ok (self->msg);
+        zm_proto_send (self->msg, status);
+        zmsg_addmsg (reply, &status);
+        zmsg_addstrf (reply, "%" PRId64, epoch);
+        zmsg_addstrf (reply, "%" PRIu64, version);
+        zmsg_addstrf (reply, "%zu", ++chunk);
+        zmsg_addstr (reply, item ? "1" : "0");
+        zframe_t *frame = zmsg_pop (devices);
+        while (frame) {
+            zmsg_append (reply, &frame);
+            frame = zmsg_pop (devices);
+        }
+        zmsg_destroy (&devices);
+        if (zm_device_reply (self, "SNAPSHOT", &reply) == -1)
+            break;
+    } while (item);
+    zmsg_destroy (&item);
+}
+
+//  Send devices changed since _version of _epoch, see @discuss for format
+
+static void
+zm_device_sync_since (zm_device_t *self)
+{
+    assert (self);
+
+    int64_t epoch = (int64_t) zm_proto_ext_int (self->msg, "_epoch", 0);
+    uint64_t version = zm_proto_ext_int (self->msg, "_version", 0);
+    zlistx_t *names = epoch == zm_devices_epoch (self->devices)
+        ? zm_devices_changes (self->devices, version)
+        : NULL;
+
+    zmsg_t *reply = zmsg_new ();
+    zmsg_t *status = zmsg_new ();
+    if (names)
+        zm_proto_encode_ok (self->msg);
+    else
+        zm_proto_encode_error (self->msg, 410, "Changes are gone, ask for SNAPSHOT");
+    zm_proto_send (self->msg, status);
+    zmsg_addmsg (reply, &status);
+    zmsg_addstrf (reply, "%" PRId64, zm_devices_epoch (self->devices));
+    zmsg_addstrf (reply, "%" PRIu64, zm_devices_version (self->devices));
+
+    if (names) {
+        zmsg_t *devices = zmsg_new ();
+        zmsg_t *deleted = zmsg_new ();
+        const char *name = (const char *) zlistx_first (names);
+        while (name) {
+            zmsg_t *item = zm_devices_lookup_msg (self->devices, name);
+            if (item)
+                zmsg_addmsg (devices, &item);
+            else
+                zmsg_addstr (deleted, name);
+            name = (const char *) zlistx_next (names);
+        }
+        zlistx_destroy (&names);
+        zmsg_addstrf (reply, "%zu", zmsg_size (devices));
+        zframe_t *frame = zmsg_pop (devices);
+        while (frame) {
+            zmsg_append (reply, &frame);
+            frame = zmsg_pop (devices);
+        }
+        frame = zmsg_pop (deleted);
+        while (frame) {
+            zmsg_append (reply, &frame);
+            frame = zmsg_pop (deleted);
+        }
+        zmsg_destroy (&devices);
+        zmsg_destroy (&deleted);
+    }
+    zm_device_reply (self, "SYNC-SINCE", &reply);
+}
+
+//  Send one LOOKUP-PREFIX reply, see @discuss for the format
+
+static void
+zm_device_lookup_prefix (zm_device_t *self)
+{
+    assert (self);
+
+    const char *prefix = zm_proto_device (self->msg);
+    zhash_t *ext = zm_proto_ext (self->msg);
+    const char *after = ext ? (const char *) zhash_lookup (ext, "_after") : NULL;
+    size_t limit = (size_t) zm_proto_ext_int (self->msg, "_limit", ZM_DEVICE_PAGE_LIMIT);
+    if (limit == 0)
+        limit = ZM_DEVICE_PAGE_LIMIT;
+
+    //  One more name tells whether there's another page
+    zlistx_t *names = zm_devices_prefix (self->devices, prefix, after, limit + 1);
+    bool more = zlistx_size (names) > limit;
+
+    zmsg_t *reply = zmsg_new ();
+    zmsg_t *status = zmsg_new ();
+    zm_proto_encode_ok (self->msg);
+    zm_proto_send (self->msg, status);
+    zmsg_addmsg (reply, &status);
+
+    zmsg_t *devices = zmsg_new ();
+    const char *last = NULL;
+    size_t i = 0;
+    const char *name = (const char *) zlistx_first (names);
+    while (name && i++ < limit) {
+        zmsg_t *item = zm_devices_lookup_msg (self->devices, name);
+        if (item)
+            zmsg_addmsg (devices, &item);
+        last = name;
+        name = (const char *) zlistx_next (names);
+    }
+    zmsg_addstr (reply, more && last ? last : "");
+    zmsg_addstrf (reply, "%zu", zm_devices_prefix_size (self->devices, prefix));
+    zframe_t *frame = zmsg_pop (devices);
+    while (frame) {
+        zmsg_append (reply, &frame);
+        frame = zmsg_pop (devices);
+    }
+    zmsg_destroy (&devices);
+    zlistx_destroy (&names);
+
+    zm_device_reply (self, "LOOKUP-PREFIX", &reply);
+}
+
+static void
+zm_device_recv_mlm_mailbox (zm_device_t *self)
+{
+    assert (self);
+
+    const char *subject = self->subject;
+    zm_proto_t *msg = self->msg;    // message to send
+
+    if (streq (subject, "INSERT")) {
+        int64_t begin = zm_trace_clock (self->trace);
+        int changed = zm_devices_insert (self->devices, self->msg);
+        if (begin)
+            zm_trace_add_store (self->trace, zclock_usecs () - begin);
+        if (changed == 1)
+            zm_device_publish (self, self->msg, subject);
+        zm_proto_encode_ok (self->msg);
+    }
+    else
+    if (streq (subject, "TOUCH")) {
+        const char *device = zm_proto_device (self->msg);
+        int64_t begin = zm_trace_clock (self->trace);
+        int r = zm_devices_touch (self->devices, device, zm_proto_time (self->msg));
+        if (begin)
+            zm_trace_add_store (self->trace, zclock_usecs () - begin);
+        if (r == 0)
+            zm_proto_encode_ok (self->msg);
+        else
+            zm_proto_encode_error (self->msg, 404, "Requested device does not exists");
+    }
+    else
+    if (streq (subject, "DELETE")) {
+        const char *device = zm_proto_device (self->msg);
+        int64_t begin = zm_trace_clock (self->trace);
+        zm_devices_delete (self->devices, device);
+        if (begin)
+            zm_trace_add_store (self->trace, zclock_usecs () - begin);
+        zm_device_publish (self, self->msg, subject);
+        zm_proto_encode_ok (self->msg);
+    }
+    else
+    if (streq (subject, "LOOKUP")) {
+        const char *device = zm_proto_device (self->msg);
+        zmsg_t *found = zm_devices_lookup_msg (self->devices, device);
+        if (found) {
+            zm_device_reply (self, subject, &found);
+            return;
+        }
+        zm_proto_encode_error (self->msg, 404, "Requested device does not exists");
+    }
+    else
+    if (streq (subject, "GET-ALL")) {
+        if (zm_devices_size (self->devices) == 0 && !self->gather) {
+            zm_proto_encode_error (self->msg, 404, "No devices");
+            goto send;
+        }
+
+        //  Front actor merges [status][device]... of all workers
+        zmsg_t *all = NULL;
+        if (self->gather) {
+            all = zmsg_new ();
+            zmsg_t *status = zmsg_new ();
+            zm_proto_encode_ok (self->msg);
+            zm_proto_send (self->msg, status);
+            zmsg_addmsg (all, &status);
+        }
+        //  Devices which can't be read are skipped, so they are counted
+        //  only once all are encoded
+        zlistx_t *items = zlistx_new ();
+        assert (items);
+        zlistx_set_destructor (items, (zlistx_destructor_fn *) zmsg_destroy);
+        zmsg_t *item = zm_devices_first_msg (self->devices);
+        while (item) {
+            if (all)
+                zmsg_addmsg (all, &item);
+            else
+                zlistx_add_end (items, item);
+            item = zm_devices_next_msg (self->devices);
+        }
+        size_t cnt = zlistx_size (items);
+        size_t i = 0;
+        while ((item = (zmsg_t *) zlistx_detach (items, NULL))) {
+            zm_device_add_seq (item, i++, cnt);
+            zm_device_reply (self, subject, &item);
+        }
+        zlistx_destroy (&items);
+        if (all)
+            zm_device_reply (self, subject, &all);
+        return;
+    }
+    else
+    if (streq (subject, "LOOKUP-PREFIX")) {
+        zm_device_lookup_prefix (self);
+        return;
+    }
+    else
+    if (streq (subject, "SNAPSHOT")) {
+        zm_device_snapshot (self);
+        return;
+    }
+    else
+    if (streq (subject, "SYNC-SINCE")) {
+        zm_device_sync_since (self);
+        return;
+    }
+    else
+    if (streq (subject, "STATS")) {
+        zmsg_t *reply = zmsg_new ();
+        zmsg_t *status = zmsg_new ();
+        zm_proto_encode_ok (self->msg);
+        zm_proto_send (self->msg, status);
+        zmsg_addmsg (reply, &status);
+        char *str = zm_device_stats_str (self);
+        zmsg_addstr (reply, str);
+        zstr_free (&str);
+        zm_device_reply (self, subject, &reply);
+        return;
+    }
+    else
+    if (streq (subject, "GET-PAGE") || streq (subject, "QUERY")) {
+        zm_device_get_page (self, subject);
+        return;
+    }
+    else
+    if (streq (subject, "PUBLISH-ALL")) {
+        zm_device_publish_all (self, 0, 0);
+        return;
+    }
+    else
+    if (streq (subject, "PUBLISH-STATUS")) {
+        zmsg_t *reply = zmsg_new ();
+        zmsg_t *status = zmsg_new ();
+        if (self->publisher)
+            zm_proto_encode_ok (self->msg);
+        else
+            zm_proto_encode_error (self->msg, 404, "PUBLISH-ALL is not running");
+        zm_proto_send (self->msg, status);
+        zmsg_addmsg (reply, &status);
+        zmsg_addstrf (reply, "%zu", self->publisher ? self->publisher->seq : 0);
+        zmsg_addstrf (reply, "%zu", self->publisher ? self->publisher->cnt : 0);
+        zm_device_reply (self, subject, &reply);
+        return;
+    }
+    else
+    if (streq (subject, "PUBLISH-CANCEL")) {
+        if (zm_device_publish_all_cancel (self) == 0)
+            zm_proto_encode_ok (self->msg);
+        else
+            zm_proto_encode_error (self->msg, 404, "PUBLISH-ALL is not running");
+    }
+    else
+        zm_proto_encode_error (self->msg, 403, "Subject not found");
+
+send:
+    {
+        zmsg_t *out = zmsg_new ();
+        zm_proto_send (msg, out);
+        zm_device_reply (self, "LOOKUP", &out);
+    }
+}
+
+//  Apply INSERT-BATCH or DELETE-BATCH, see @discuss for the format
+
+#define ZM_DEVICE_BATCH_PUBLISH 1000    //  Max devices per stream message
+
+static void
+zm_device_recv_mlm_batch (zm_device_t *self, zmsg_t *request)
+{
+    assert (self);
+    assert (request);
+
+    char *subject = strdup (self->subject);
+    bool insert = streq (subject, "INSERT-BATCH");
+    zmsg_t *codes = zmsg_new ();
+    zmsg_t *publish = NULL;
+    size_t applied = 0;
+
+    zmsg_t *item = zmsg_popmsg (request);
+    while (item) {
+        int code = 400;
+        if (zm_proto_recv (self->msg, item) == 0
+        &&  zm_proto_id (self->msg) == ZM_PROTO_DEVICE
+        &&  zm_proto_device (self->msg)
+        &&  *zm_proto_device (self->msg)) {
+            code = 200;
+            int64_t begin = zm_trace_clock (self->trace);
+            if (insert) {
+                if (zm_devices_insert (self->devices, self->msg) == 0)
+                    code = 304;
+            }
+            else
+            if (zm_devices_lookup (self->devices, zm_proto_device (self->msg)))
+                zm_devices_delete (self->devices, zm_proto_device (self->msg));
+            else
+                code = 404;
+            if (begin)
+                zm_trace_add_store (self->trace, zclock_usecs () - begin);
+        }
+        zmsg_addstrf (codes, "%d", code);
+
+        if (code == 200) {
+            applied++;
+            if (self->client && zm_device_cfg_producer (self) && self->coalesce_window) {
+                zm_device_stamp (self, self->msg);
+                zm_device_coalesce (self, self->msg, subject);
+            }
+            else
+            if (self->client && zm_device_cfg_producer (self)) {
+                if (!publish)
+                    publish = zmsg_new ();
+                zm_device_stamp (self, self->msg);
+                zmsg_t *out = zmsg_new ();
+                zm_proto_send (self->msg, out);
+                zmsg_addmsg (publish, &out);
+                if (zmsg_size (publish) >= ZM_DEVICE_BATCH_PUBLISH)
+                    mlm_client_send (self->client, subject, &publish);
+            }
+        }
+        zmsg_destroy (&item);
+        item = zmsg_popmsg (request);
+    }
+    if (publish)
+        mlm_client_send (self->client, subject, &publish);
+
+    zmsg_t *reply = zmsg_new ();
+    zmsg_t *status = zmsg_new ();
+    zm_proto_encode_ok (self->msg);
+    zm_proto_send (self->msg, status);
+    zmsg_addmsg (reply, &status);
+    zmsg_addstrf (reply, "%zu", applied);
+    zframe_t *frame = zmsg_pop (codes);
+    while (frame) {
+        zmsg_append (reply, &frame);
+        frame = zmsg_pop (codes);
+    }
+    zmsg_destroy (&codes);
+    zm_device_reply (self, subject, &reply);
+    zstr_free (&subject);
+}
+
+//  Apply server/conflict, see CONSUME
+
+static void
+zm_device_cache_setup (zm_device_t *self)
+{
+    assert (self);
+    const char *conflict = zconfig_resolve (self->config, "server/conflict", "time");
+    if (zm_cache_set_conflict (self->cache, conflict) == -1)
+        zsys_warning ("zm_device: unknown server/conflict %s, using time", conflict);
+}
+
+//  Stream message of another producer, applied in cache mode, see CONSUME
+
+static void
+zm_device_recv_mlm_stream (zm_device_t *self, zmsg_t *request)
+{
+    assert (self);
+    assert (request);
+
+    const char *sender = mlm_client_sender (self->client);
+    const char *subject = mlm_client_subject (self->client);
+    if (!zm_device_cfg_cache (self)
+    ||  self->shards
+    ||  streq (sender, zm_device_cfg_address (self)))
+        return;
+
+    int64_t start = zclock_usecs ();
+    int stale = zm_cache_apply (self->cache, subject, request, self->devices);
+    if (stale == -1) {
+        if (self->verbose)
+            zsys_warning ("message from sender=%s, with subject=%s is not a change",
+                sender, subject);
         return;
     }
-    else
-    if (streq (subject, "PUBLISH-ALL")) {
+    while (stale--)
+        zm_stats_record (self->stats, "stale", 0);
+    zm_stats_record (self->stats, "STREAM", zclock_usecs () - start);
+}
 
-        msg = zm_devices_first (self->devices);
-        zm_proto_ext_set_int (msg, "_cnt", zm_devices_size (self->devices));
-        size_t i = 0;
-        while (msg) {
-            zm_proto_ext_set_int (msg, "_seq", i++);
-            zm_proto_send_mlm (
-                msg,
-                self->client,
-                subject);
-            msg = zm_devices_next (self->devices);
+//  --------------------------------------------------------------------------
+//  Replica mode, devices follow stream of server/replicate, see REPLICA
+
+//  Ask leader again when the reply does not come
+
+static int
+zm_device_handle_replica (zloop_t *loop, int timer_id, void *arg)
+{
+    zm_device_t *self = (zm_device_t *) arg;
+    self->replica_timer = -1;
+    if (zm_replica_syncing (self->replica)) {
+        zsys_warning ("zm_device: no reply of %s, asking again",
+            zm_device_cfg_replicate (self));
+        zm_device_replica_sync (self);
+    }
+    return 0;
+}
+
+//  Start timeout of the sync over, called when asked and on each reply
+
+static void
+zm_device_replica_arm (zm_device_t *self)
+{
+    assert (self);
+    if (self->replica_timer != -1)
+        zloop_timer_end (self->loop, self->replica_timer);
+    self->replica_timer = zloop_timer (self->loop,
+        ZM_DEVICE_REPLICA_TIMEOUT, 1, zm_device_handle_replica, self);
+}
+
+//  Ask leader for changes since last applied version, or for SNAPSHOT if
+//  there's none, stream is kept aside until the reply comes
+
+static void
+zm_device_replica_sync (zm_device_t *self)
+{
+    assert (self);
+    if (!self->client)
+        return;
+    const char *subject = zm_replica_sync (self->replica, self->msg);
+    if (self->verbose)
+        zsys_debug ("zm_device: asking %s for %s", zm_device_cfg_replicate (self), subject);
+    zm_proto_sendto (self->msg, self->client, zm_device_cfg_replicate (self), subject);
+    zm_device_replica_arm (self);
+}
+
+//  Stream message of the leader
+
+static void
+zm_device_replica_recv (zm_device_t *self, zmsg_t *request)
+{
+    assert (self);
+    assert (request);
+
+    if (!streq (mlm_client_sender (self->client), zm_device_cfg_replicate (self)))
+        return;
+    if (zm_replica_recv (self->replica, mlm_client_subject (self->client),
+            request, self->devices) == -1) {
+        if (self->verbose)
+            zsys_debug ("zm_device: lost changes of %s after %" PRIu64,
+                zm_device_cfg_replicate (self), zm_replica_version (self->replica));
+        zm_device_replica_sync (self);
+    }
+}
+
+//  Apply stream messages kept while syncing
+
+static void
+zm_device_replica_resume (zm_device_t *self)
+{
+    assert (self);
+    if (self->replica_timer != -1) {
+        zloop_timer_end (self->loop, self->replica_timer);
+        self->replica_timer = -1;
+    }
+    if (zm_replica_resume (self->replica, self->devices) == -1)
+        zm_device_replica_sync (self);
+}
+
+//  SNAPSHOT chunk, replace devices, delete those not in any chunk after the
+//  last one and apply what came meanwhile
+
+static void
+zm_device_replica_snapshot (zm_device_t *self, zmsg_t *reply)
+{
+    assert (self);
+    assert (reply);
+
+    int r = zm_replica_snapshot (self->replica, reply, self->devices);
+    if (r == -1)
+        return;         //  Asked again after timeout
+    zm_device_replica_arm (self);
+    if (r == 0)
+        return;
+    if (self->verbose)
+        zsys_debug ("zm_device: SNAPSHOT of %s applied, %zu devices at version %" PRIu64,
+            zm_device_cfg_replicate (self), zm_devices_size (self->devices),
+            zm_replica_version (self->replica));
+    zm_device_replica_resume (self);
+}
+
+//  SYNC-SINCE reply, apply changes, SNAPSHOT is needed if they are gone
+
+static void
+zm_device_replica_delta (zm_device_t *self, zmsg_t *reply)
+{
+    assert (self);
+    assert (reply);
+
+    if (zm_replica_delta (self->replica, reply, self->devices) == -1) {
+        zm_device_replica_sync (self);
+        return;
+    }
+    if (self->verbose)
+        zsys_debug ("zm_device: SYNC-SINCE of %s applied, version %" PRIu64,
+            zm_device_cfg_replicate (self), zm_replica_version (self->replica));
+    zm_device_replica_resume (self);
+}
+
+//  Handle mailbox request of self->sender with self->subject
+
+static void
+zm_device_recv_request (zm_device_t *self, zmsg_t *request)
+{
+    assert (self);
+    assert (request);
+
+    bool batch = streq (self->subject, "INSERT-BATCH")
+              || streq (self->subject, "DELETE-BATCH");
+
+    //  Replica changes only by stream of its leader
+    if (zm_device_cfg_replicate (self)
+    && (batch
+    ||  streq (self->subject, "INSERT")
+    ||  streq (self->subject, "TOUCH")
+    ||  streq (self->subject, "DELETE"))) {
+        zmsg_t *reply = zmsg_new ();
+        zm_proto_encode_error (self->msg, 403, "Replica is read-only");
+        if (batch) {
+            zmsg_t *status = zmsg_new ();
+            zm_proto_send (self->msg, status);
+            zmsg_addmsg (reply, &status);
+        }
+        else
+            zm_proto_send (self->msg, reply);
+        zm_device_reply (self, batch ? self->subject : "LOOKUP", &reply);
+        return;
+    }
+
+    //  Batches are not zm_proto messages themselves
+    if (batch) {
+        zm_device_recv_mlm_batch (self, request);
+        return;
+    }
+
+    if (zm_proto_recv (self->msg, request) != 0) {
+        if (self->verbose)
+            zsys_warning ("can't read message from sender=%s, with subject=%s",
+            self->sender ? self->sender : "front", self->subject);
+        //  Front actor waits for the reply
+        if (self->gather) {
+            zmsg_t *reply = zmsg_new ();
+            zm_proto_encode_error (self->msg, 400, "Malformed request");
+            zm_proto_send (self->msg, reply);
+            zm_device_reply (self, self->subject, &reply);
+        }
+        return;
+    }
+    if (zm_trace_enabled (self->trace))
+        zm_trace_begin (self->trace, self->msg);
+    zm_device_recv_mlm_mailbox (self);
+}
+
+//  --------------------------------------------------------------------------
+//  Sharded mode, the front actor keeps no devices and routes requests to
+//  worker actors, see SHARDING
+
+static size_t
+zm_device_shards_popnum (zmsg_t *msg)
+{
+    char *str = zmsg_popstr (msg);
+    size_t value = str ? (size_t) strtoull (str, NULL, 10) : 0;
+    zstr_free (&str);
+    return value;
+}
+
+//  Pass request to the worker owning the device, it replies directly.
+//  Request is decoded for the name and encoded again for the worker,
+//  returns -1 if it can't be decoded.
+
+static int
+zm_device_shards_route (zm_device_t *self, zmsg_t *request)
+{
+    assert (self);
+    assert (request);
+    if (zm_proto_recv (self->msg, request) != 0)
+        return -1;
+    size_t shard = zm_shards_owner (self->shards, zm_proto_device (self->msg));
+    zmsg_t *routed = zmsg_new ();
+    zm_proto_send (self->msg, routed);
+    zmsg_pushstr (routed, self->subject);
+    zmsg_pushstr (routed, self->sender);
+    zmsg_pushstr (routed, "MAILBOX");
+    zmsg_send (&routed, zm_shards_worker (self->shards, shard));
+    return 0;
+}
+
+//  Split batch among workers and merge their codes in request order
+
+static void
+zm_device_shards_batch (zm_device_t *self, zmsg_t *request)
+{
+    assert (self);
+    assert (request);
+
+    zmsg_t **requests = zm_shards_requests (self->shards, NULL);
+    size_t i;
+
+    //  Worker of every item, -1 for malformed ones
+    int *routes = (int *) zmalloc ((zmsg_size (request) + 1) * sizeof (int));
+    assert (routes);
+    size_t items = 0;
+    zmsg_t *item = zmsg_popmsg (request);
+    while (item) {
+        routes [items] = -1;
+        if (zm_proto_recv (self->msg, item) == 0
+        &&  zm_proto_id (self->msg) == ZM_PROTO_DEVICE
+        &&  zm_proto_device (self->msg)
+        &&  *zm_proto_device (self->msg)) {
+            size_t shard = zm_shards_owner (self->shards, zm_proto_device (self->msg));
+            zmsg_t *out = zmsg_new ();
+            zm_proto_send (self->msg, out);
+            zmsg_addmsg (requests [shard], &out);
+            routes [items] = (int) shard;
         }
+        items++;
+        zmsg_destroy (&item);
+        item = zmsg_popmsg (request);
+    }
+
+    zmsg_t **replies = zm_shards_gather (self->shards, self->subject, &requests);
+    zm_shards_status (self->shards, replies);
+    size_t applied = 0;
+    for (i = 0; i < zm_shards_size (self->shards); i++)
+        applied += zm_device_shards_popnum (replies [i]);
+
+    zmsg_t *reply = zmsg_new ();
+    zmsg_t *status = zmsg_new ();
+    zm_proto_encode_ok (self->msg);
+    zm_proto_send (self->msg, status);
+    zmsg_addmsg (reply, &status);
+    zmsg_addstrf (reply, "%zu", applied);
+    for (i = 0; i < items; i++) {
+        char *code = routes [i] == -1 ? NULL : zmsg_popstr (replies [routes [i]]);
+        zmsg_addstr (reply, code ? code : "400");
+        zstr_free (&code);
+    }
+    free (routes);
+    zm_shards_free (self->shards, &replies);
+    zm_device_reply (self, self->subject, &reply);
+}
+
+//  Send devices of all workers in name order, numbered across shards
+
+static void
+zm_device_shards_get_all (zm_device_t *self)
+{
+    assert (self);
+    zmsg_t **requests = zm_shards_requests (self->shards, self->msg);
+    zmsg_t **replies = zm_shards_gather (self->shards, self->subject, &requests);
+    zm_shards_status (self->shards, replies);
+    size_t total = 0;
+    size_t i;
+    for (i = 0; i < zm_shards_size (self->shards); i++)
+        total += zmsg_size (replies [i]);
+
+    if (total == 0) {
+        zmsg_t *reply = zmsg_new ();
+        zm_proto_encode_error (self->msg, 404, "No devices");
+        zm_proto_send (self->msg, reply);
+        zm_device_reply (self, "LOOKUP", &reply);
+        zm_shards_free (self->shards, &replies);
         return;
     }
+    zm_proto_t **heads = (zm_proto_t **) zmalloc (zm_shards_size (self->shards) * sizeof (zm_proto_t *));
+    assert (heads);
+    size_t seq = 0;
+    int next = zm_shards_merge (self->shards, replies, heads);
+    while (next != -1) {
+        zmsg_t *item = zmsg_new ();
+        zm_proto_send (heads [next], item);
+        zm_device_add_seq (item, seq++, total);
+        zm_device_reply (self, "GET-ALL", &item);
+        zm_proto_destroy (&heads [next]);
+        next = zm_shards_merge (self->shards, replies, heads);
+    }
+    free (heads);
+    zm_shards_free (self->shards, &replies);
+}
+
+//  Merge LOOKUP-PREFIX pages of all workers into one
+
+static void
+zm_device_shards_lookup_prefix (zm_device_t *self)
+{
+    assert (self);
+    size_t limit = (size_t) zm_proto_ext_int (self->msg, "_limit", ZM_DEVICE_PAGE_LIMIT);
+    if (limit == 0)
+        limit = ZM_DEVICE_PAGE_LIMIT;
+
+    zmsg_t **requests = zm_shards_requests (self->shards, self->msg);
+    zmsg_t **replies = zm_shards_gather (self->shards, self->subject, &requests);
+    zm_shards_status (self->shards, replies);
+    bool more = false;
+    size_t count = 0;
+    size_t i;
+    for (i = 0; i < zm_shards_size (self->shards); i++) {
+        char *next = zmsg_popstr (replies [i]);
+        if (next && *next)
+            more = true;
+        zstr_free (&next);
+        count += zm_device_shards_popnum (replies [i]);
+    }
+
+    //  Every worker sent up to limit devices after _after, the smallest
+    //  limit of them make the page
+    zmsg_t *devices = zmsg_new ();
+    zm_proto_t **heads = (zm_proto_t **) zmalloc (zm_shards_size (self->shards) * sizeof (zm_proto_t *));
+    assert (heads);
+    char *last = NULL;
+    int next = zm_shards_merge (self->shards, replies, heads);
+    while (next != -1 && zmsg_size (devices) < limit) {
+        zmsg_t *item = zmsg_new ();
+        zm_proto_send (heads [next], item);
+        zmsg_addmsg (devices, &item);
+        zstr_free (&last);
+        last = strdup (zm_proto_device (heads [next]));
+        zm_proto_destroy (&heads [next]);
+        next = zm_shards_merge (self->shards, replies, heads);
+    }
+    if (next != -1)
+        more = true;
+    for (i = 0; i < zm_shards_size (self->shards); i++)
+        zm_proto_destroy (&heads [i]);
+    free (heads);
+    zm_shards_free (self->shards, &replies);
+
+    zmsg_t *reply = zmsg_new ();
+    zmsg_t *status = zmsg_new ();
+    zm_proto_encode_ok (self->msg);
+    zm_proto_send (self->msg, status);
+    zmsg_addmsg (reply, &status);
+    zmsg_addstr (reply, more && last ? last : "");
+    zmsg_addstrf (reply, "%zu", count);
+    zframe_t *frame = zmsg_pop (devices);
+    while (frame) {
+        zmsg_append (reply, &frame);
+        frame = zmsg_pop (devices);
+    }
+    zmsg_destroy (&devices);
+    zstr_free (&last);
+    zm_device_reply (self, "LOOKUP-PREFIX", &reply);
+}
+
+//  Start PUBLISH-ALL on every worker, each numbers its devices from the
+//  sum of sizes of the previous ones
+
+static void
+zm_device_shards_publish_all (zm_device_t *self)
+{
+    assert (self);
+    size_t *sizes = (size_t *) zmalloc (zm_shards_size (self->shards) * sizeof (size_t));
+    assert (sizes);
+    size_t total = 0;
+    size_t i;
+    zm_shards_send (self->shards, "SIZE");
+    for (i = 0; i < zm_shards_size (self->shards); i++) {
+        //  Late GATHER replies come first
+        zm_shards_drop_late (self->shards, i);
+        char *size = zstr_recv (zm_shards_worker (self->shards, i));
+        sizes [i] = size ? (size_t) strtoull (size, NULL, 10) : 0;
+        total += sizes [i];
+        zstr_free (&size);
+    }
+
+    size_t offset = 0;
+    for (i = 0; i < zm_shards_size (self->shards); i++) {
+        zmsg_t *request = zmsg_new ();
+        zmsg_addstr (request, "PUBLISH-ALL");
+        zmsg_addstrf (request, "%zu", offset);
+        zmsg_addstrf (request, "%zu", total);
+        zmsg_send (&request, zm_shards_worker (self->shards, i));
+        offset += sizes [i];
+    }
+    free (sizes);
+}
+
+//  PUBLISH-STATUS runs if any of workers does, seq is their sum
+
+static void
+zm_device_shards_publish_status (zm_device_t *self)
+{
+    assert (self);
+    zmsg_t **requests = zm_shards_requests (self->shards, self->msg);
+    zmsg_t **replies = zm_shards_gather (self->shards, self->subject, &requests);
+    size_t running = zm_shards_status (self->shards, replies);
+    size_t seq = 0;
+    size_t cnt = 0;
+    size_t i;
+    for (i = 0; i < zm_shards_size (self->shards); i++) {
+        seq += zm_device_shards_popnum (replies [i]);
+        size_t shard_cnt = zm_device_shards_popnum (replies [i]);
+        if (shard_cnt > cnt)
+            cnt = shard_cnt;
+    }
+    zm_shards_free (self->shards, &replies);
+
+    zmsg_t *reply = zmsg_new ();
+    zmsg_t *status = zmsg_new ();
+    if (running)
+        zm_proto_encode_ok (self->msg);
     else
-        zm_proto_encode_error (self->msg, 403, "Subject not found");
+        zm_proto_encode_error (self->msg, 404, "PUBLISH-ALL is not running");
+    zm_proto_send (self->msg, status);
+    zmsg_addmsg (reply, &status);
+    zmsg_addstrf (reply, "%zu", seq);
+    zmsg_addstrf (reply, "%zu", cnt);
+    zm_device_reply (self, self->subject, &reply);
+}
+
+//  PUBLISH-CANCEL succeeds if any of workers had PUBLISH-ALL running
+
+static void
+zm_device_shards_publish_cancel (zm_device_t *self)
+{
+    assert (self);
+    zmsg_t **requests = zm_shards_requests (self->shards, self->msg);
+    zmsg_t **replies = zm_shards_gather (self->shards, self->subject, &requests);
+    bool ok = false;
+    size_t i;
+    for (i = 0; i < zm_shards_size (self->shards); i++)
+        if (zm_proto_recv (self->msg, replies [i]) == 0
+        &&  zm_proto_id (self->msg) == ZM_PROTO_OK)
+            ok = true;
+    zm_shards_free (self->shards, &replies);
+
+    zmsg_t *reply = zmsg_new ();
+    if (ok)
+        zm_proto_encode_ok (self->msg);
+    else
+        zm_proto_encode_error (self->msg, 404, "PUBLISH-ALL is not running");
+    zm_proto_send (self->msg, reply);
+    zm_device_reply (self, "LOOKUP", &reply);
+}
+
+//  Handle mailbox request in sharded mode
+
+static void
+zm_device_shards_recv (zm_device_t *self, zmsg_t *request)
+{
+    assert (self);
+    assert (request);
+    const char *subject = self->subject;
+
+    if (streq (subject, "INSERT-BATCH") || streq (subject, "DELETE-BATCH")) {
+        zm_device_shards_batch (self, request);
+        return;
+    }
+    bool route = !streq (subject, "GET-ALL")
+        && !streq (subject, "LOOKUP-PREFIX")
+        && !streq (subject, "PUBLISH-ALL")
+        && !streq (subject, "PUBLISH-STATUS")
+        && !streq (subject, "PUBLISH-CANCEL")
+        && !streq (subject, "STATS")
+        && !streq (subject, "GET-PAGE")
+        && !streq (subject, "QUERY")
+        && !streq (subject, "SNAPSHOT")
+        && !streq (subject, "SYNC-SINCE");
+    if (route ? zm_device_shards_route (self, request) != 0
+              : zm_proto_recv (self->msg, request) != 0) {
+        if (self->verbose)
+            zsys_warning ("can't read message from sender=%s, with subject=%s",
+            self->sender, subject);
+        return;
+    }
+
+    if (route)
+        ;
+    else
+    if (streq (subject, "GET-ALL"))
+        zm_device_shards_get_all (self);
+    else
+    if (streq (subject, "LOOKUP-PREFIX"))
+        zm_device_shards_lookup_prefix (self);
+    else
+    if (streq (subject, "PUBLISH-ALL"))
+        zm_device_shards_publish_all (self);
+    else
+    if (streq (subject, "PUBLISH-STATUS"))
+        zm_device_shards_publish_status (self);
+    else
+    if (streq (subject, "PUBLISH-CANCEL"))
+        zm_device_shards_publish_cancel (self);
+    else
+    if (streq (subject, "STATS"))
+        zm_device_recv_mlm_mailbox (self);
+    else
+    if (streq (subject, "GET-PAGE")
+    ||  streq (subject, "QUERY")
+    ||  streq (subject, "SNAPSHOT")
+    ||  streq (subject, "SYNC-SINCE")) {
+        zmsg_t *reply = zmsg_new ();
+        zmsg_t *status = zmsg_new ();
+        zm_proto_encode_error (self->msg, 501, "Not available with server/shards, use LOOKUP-PREFIX");
+        zm_proto_send (self->msg, status);
+        zmsg_addmsg (reply, &status);
+        zm_device_reply (self, subject, &reply);
+    }
+    //  INSERT, TOUCH, DELETE, LOOKUP, unknown subjects were routed above
+    //  and get 403 there
+}
+
+//  Handle mailbox request of sender with subject
+
+static void
+zm_device_dispatch (zm_device_t *self, const char *sender, const char *subject,
+    zmsg_t *request, int64_t received)
+{
+    assert (self);
+    self->sender = sender;
+    self->subject = subject;
+    if (zm_trace_enabled (self->trace))
+        zm_trace_reset (self->trace);
+    int64_t start = zclock_usecs ();
+    //  Replies of the leader which came late are dropped, not answered
+    bool leader = zm_device_cfg_replicate (self) && self->sender
+               && streq (self->sender, zm_device_cfg_replicate (self));
+    if (leader && streq (self->subject, "SNAPSHOT")) {
+        if (zm_replica_syncing (self->replica))
+            zm_device_replica_snapshot (self, request);
+    }
+    else
+    if (leader && streq (self->subject, "SYNC-SINCE")) {
+        if (zm_replica_syncing (self->replica))
+            zm_device_replica_delta (self, request);
+    }
+    else
+    if (self->shards)
+        zm_device_shards_recv (self, request);
+    else
+        zm_device_recv_request (self, request);
+    int64_t end = zclock_usecs ();
+    zm_stats_record (self->stats, self->subject, end - start);
+    if (zm_trace_enabled (self->trace))
+        zm_device_trace_end (self, received, start, end);
+    self->sender = NULL;
+    self->subject = NULL;
+}
+
+//  Return true for requests which change devices
+
+static bool
+zm_device_is_write (const char *subject)
+{
+    return streq (subject, "INSERT")
+        || streq (subject, "TOUCH")
+        || streq (subject, "DELETE")
+        || streq (subject, "INSERT-BATCH")
+        || streq (subject, "DELETE-BATCH");
+}
+
+//  Return true for requests replied by one multi-frame message with leading
+//  status submessage, see MAILBOX
+
+static bool
+zm_device_has_status (const char *subject)
+{
+    return streq (subject, "INSERT-BATCH")
+        || streq (subject, "DELETE-BATCH")
+        || streq (subject, "LOOKUP-PREFIX")
+        || streq (subject, "GET-PAGE")
+        || streq (subject, "QUERY")
+        || streq (subject, "SNAPSHOT")
+        || streq (subject, "SYNC-SINCE")
+        || streq (subject, "STATS")
+        || streq (subject, "PUBLISH-STATUS");
+}
+
+//  Refuse request with ZM_PROTO_ERROR code, telling sender when to retry.
+//  Reply goes the way zm_device_recv_request would answer the request.
+
+static void
+zm_device_busy (zm_device_t *self, const char *sender, const char *subject,
+    uint32_t code, int64_t retry_after)
+{
+    assert (self);
+    bool status = zm_device_has_status (subject);
+    char description [64];
+    snprintf (description, sizeof (description), "BUSY retry_after=%" PRId64,
+        retry_after > 0 ? retry_after : 1);
+    zm_proto_encode_error (self->msg, code, description);
+    zmsg_t *reply = zmsg_new ();
+    if (status) {
+        zmsg_t *submsg = zmsg_new ();
+        zm_proto_send (self->msg, submsg);
+        zmsg_addmsg (reply, &submsg);
+    }
+    else
+        zm_proto_send (self->msg, reply);
+    bool batch = streq (subject, "INSERT-BATCH")
+              || streq (subject, "DELETE-BATCH");
+    mlm_client_sendto (self->client, sender,
+        batch || !zm_device_is_write (subject) ? subject : "LOOKUP", NULL, 1000, &reply);
+    zm_stats_record (self->stats, "BUSY", 0);
+}
+
+//  Queue mailbox request just received, or refuse it, see BACKPRESSURE
+
+static void
+zm_device_admit (zm_device_t *self, const char *sender, const char *subject,
+    zmsg_t **request_p)
+{
+    assert (self);
+
+    //  Replies of the leader are not requests
+    if (zm_replica_syncing (self->replica) && streq (sender, zm_device_cfg_replicate (self))) {
+        zm_device_dispatch (self, sender, subject, *request_p, zclock_usecs ());
+        zmsg_destroy (request_p);
+        return;
+    }
+
+    int64_t retry_after;
+    int code = zm_queue_admit (self->queue, sender, subject,
+        zm_device_is_write (subject), request_p, &retry_after);
+    if (code) {
+        zm_device_busy (self, sender, subject, (uint32_t) code, retry_after);
+        zmsg_destroy (request_p);
+    }
+}
+
+//  Answer all queued reads and apply up to writes queued writes. Returns
+//  number of writes still waiting.
 
-send:
-    zm_proto_sendto (
-        msg,
-        self->client,
-        mlm_client_sender (self->client),
-        "LOOKUP");
+static size_t
+zm_device_queue_run (zm_device_t *self, size_t writes)
+{
+    assert (self);
+    bool write = !zm_queue_reads (self->queue);
+    zmsg_t *request = zm_queue_next (self->queue, writes > 0);
+    while (request) {
+        if (write)
+            writes--;
+        int64_t received = zm_queue_received (self->queue);
+        zm_stats_record (self->stats, "wait", zclock_usecs () - received);
+        zm_device_dispatch (self, zm_queue_sender (self->queue),
+            zm_queue_subject (self->queue), request, received);
+        zmsg_destroy (&request);
+        //  STOP might have destroyed the client meanwhile
+        if (!self->client)
+            break;
+        write = !zm_queue_reads (self->queue);
+        request = zm_queue_next (self->queue, writes > 0);
+    }
+    return zm_queue_writes (self->queue);
 }
 
+static int
+zm_device_handle_queue (zloop_t *loop, int timer_id, void *arg);
+
+static void
+zm_device_recv_mlm (zm_device_t *self);
+
+//  Drain waiting client messages into queues and handle a slice of them
+
 static void
-zm_device_recv_mlm_stream (zm_device_t *self)
+zm_device_queue_pump (zm_device_t *self)
 {
     assert (self);
+    size_t drained = 0;
+    while (self->client
+    &&     drained++ < ZM_DEVICE_DRAIN
+    &&     (zsock_events (mlm_client_msgpipe (self->client)) & ZMQ_POLLIN))
+        zm_device_recv_mlm (self);
 
-    if (zm_proto_id (self->msg) != ZM_PROTO_DEVICE) {
-        if (self->verbose)
-            zsys_warning ("message from sender=%s, with subject=%s os not DEVICE",
-            mlm_client_sender (self->client),
-            mlm_client_subject (self->client));
-        return;
+    size_t waiting = self->client ? zm_device_queue_run (self, ZM_DEVICE_WRITE_SLICE) : 0;
+    if (waiting && self->queue_timer == -1)
+        self->queue_timer = zloop_timer (self->loop, 1, 0, zm_device_handle_queue, self);
+    else
+    if (!waiting && self->queue_timer != -1) {
+        zloop_timer_end (self->loop, self->queue_timer);
+        self->queue_timer = -1;
     }
 }
 
+static int
+zm_device_handle_queue (zloop_t *loop, int timer_id, void *arg)
+{
+    zm_device_queue_pump ((zm_device_t *) arg);
+    return 0;
+}
+
 static void
 zm_device_recv_mlm (zm_device_t *self)
 {
     assert (self);
     zmsg_t *request = mlm_client_recv (self->client);
-    int r = zm_proto_recv (self->msg, request);
-    zmsg_destroy (&request);
-    if (r != 0) {
-        if (self->verbose)
-            zsys_warning ("can't read message from sender=%s, with subject=%s",
-            mlm_client_sender (self->client),
-            mlm_client_subject (self->client));
-        return;
-    }
+    if (!request)
+        return;        //  Interrupted
 
     if (streq (mlm_client_command (self->client), "MAILBOX DELIVER"))
-        zm_device_recv_mlm_mailbox (self);
+        zm_device_admit (self, mlm_client_sender (self->client),
+            mlm_client_subject (self->client), &request);
     else
-    if (streq (mlm_client_command (self->client), "STREAM DELIVER"))
-        zm_device_recv_mlm_stream (self);
+    if (streq (mlm_client_command (self->client), "STREAM DELIVER")) {
+        if (zm_device_cfg_replicate (self))
+            zm_device_replica_recv (self, request);
+        else
+            zm_device_recv_mlm_stream (self, request);
+    }
+    zmsg_destroy (&request);
+}
+
+//  --------------------------------------------------------------------------
+//  Reactor handlers, return -1 to terminate the loop
+
+static int
+zm_device_handle_pipe (zloop_t *loop, zsock_t *reader, void *arg)
+{
+    zm_device_t *self = (zm_device_t *) arg;
+    zm_device_recv_api (self);
+    return self->terminated ? -1 : 0;
+}
+
+static int
+zm_device_handle_mlm (zloop_t *loop, zsock_t *reader, void *arg)
+{
+    zm_device_t *self = (zm_device_t *) arg;
+    //  STOP might have destroyed the client within the same poll round
+    if (self->client)
+        zm_device_queue_pump (self);
+    return 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Pop "N/M" frame from device sent by GET-ALL or PUBLISH-ALL
+
+int
+zm_device_pop_seq (zmsg_t *msg, size_t *seq_p, size_t *cnt_p)
+{
+    assert (msg);
+    zframe_t *frame = zmsg_last (msg);
+    if (!frame || zframe_size (frame) > 64)
+        return -1;
+    char *str = zframe_strdup (frame);
+    size_t seq, cnt;
+    char tail;
+    int r = sscanf (str, "%zu/%zu%c", &seq, &cnt, &tail) == 2 ? 0 : -1;
+    zstr_free (&str);
+    if (r == -1)
+        return -1;
+    zmsg_remove (msg, frame);
+    zframe_destroy (&frame);
+    if (seq_p)
+        *seq_p = seq;
+    if (cnt_p)
+        *cnt_p = cnt;
+    return 0;
 }
 
 //  --------------------------------------------------------------------------
@@ -475,19 +3113,14 @@ zm_device_actor (zsock_t *pipe, void *args)
     if (!self)
         return;          //  Interrupted
 
+    zloop_reader (self->loop, self->pipe, zm_device_handle_pipe, self);
+
     //  Signal actor successfully initiated
     zsock_signal (self->pipe, 0);
 
-    while (!self->terminated) {
-        zsock_t *which = (zsock_t *) zpoller_wait (self->poller, 0);
+    //  Blocks until $TERM, sleeping while there's nothing to do
+    zloop_start (self->loop);
 
-        if (which == self->pipe)
-            zm_device_recv_api (self);
-        else
-        if (which == mlm_client_msgpipe (self->client))
-            zm_device_recv_mlm (self);
-       //  Add other sockets when you need them.
-    }
     zm_device_destroy (&self);
 }
 
@@ -532,7 +3165,7 @@ zm_device_test (bool verbose)
     assert (r == 0);
     mlm_client_set_producer (writer, ZM_PROTO_DEVICE_STREAM);
 
-    zmsg_t *request = zm_proto_encode_device_v1 ("device1", zclock_mono (), 1024, NULL);
+    zmsg_t *request = zm_proto_encode_device_v1 ("device1", zclock_mono (), 60000, NULL);
     zmsg_t *zreply;
     zm_proto_t *reply = zm_proto_new ();
 
@@ -541,6 +3174,22 @@ zm_device_test (bool verbose)
     zm_proto_recv (reply, zreply);
     zmsg_destroy (&zreply);
 
+    //  Neither re-sent device nor TOUCH are published again
+    request = zm_proto_encode_device_v1 ("device1", zclock_mono () + 1, 60000, NULL);
+    mlm_client_sendto (writer, "it.zmon.device", "INSERT", NULL, 1000, &request);
+    zm_proto_recv_mlm (reply, writer);
+    assert (zm_proto_id (reply) == ZM_PROTO_OK);
+
+    request = zm_proto_encode_device_v1 ("device1", 42, 0, NULL);
+    mlm_client_sendto (writer, "it.zmon.device", "TOUCH", NULL, 1000, &request);
+    zm_proto_recv_mlm (reply, writer);
+    assert (zm_proto_id (reply) == ZM_PROTO_OK);
+
+    request = zm_proto_encode_device_v1 ("nonexistent", 42, 0, NULL);
+    mlm_client_sendto (writer, "it.zmon.device", "TOUCH", NULL, 1000, &request);
+    zm_proto_recv_mlm (reply, writer);
+    assert (zm_proto_id (reply) == ZM_PROTO_ERROR);
+
     request = zm_proto_encode_device_v1 ("device1", 0, 0, NULL);
     mlm_client_sendto (writer, "it.zmon.device", "LOOKUP", NULL, 1000, &request);
     zreply = mlm_client_recv (writer);
@@ -549,13 +3198,21 @@ zm_device_test (bool verbose)
 
     assert (zm_proto_id (reply) == ZM_PROTO_DEVICE);
     assert (streq (zm_proto_device (reply), "device1"));
+    assert (zm_proto_time (reply) == 42);
     
     zm_proto_encode_ok (reply);
     zm_proto_sendto (reply, writer, "it.zmon.device", "GET-ALL");
 
-    zm_proto_recv_mlm (reply, writer);
-    assert (zm_proto_ext_int (reply, "_seq", -1) == 0);
-    assert (zm_proto_ext_int (reply, "_cnt", -1) == 1);
+    size_t seq, cnt;
+    zreply = mlm_client_recv (writer);
+    r = zm_device_pop_seq (zreply, &seq, &cnt);
+    assert (r == 0);
+    assert (seq == 0 && cnt == 1);
+    assert (zm_device_pop_seq (zreply, NULL, NULL) == -1);
+    zm_proto_recv (reply, zreply);
+    zmsg_destroy (&zreply);
+    assert (streq (zm_proto_device (reply), "device1"));
+    assert (zm_proto_ext_int (reply, "_seq", -1) == (uint64_t) -1);
 
     zreply = mlm_client_recv (reader);
     zm_proto_recv (reply, zreply);
@@ -566,9 +3223,953 @@ zm_device_test (bool verbose)
     zm_proto_encode_ok (reply);
     zm_proto_sendto (reply, writer, "it.zmon.device", "PUBLISH-ALL");
 
-    zm_proto_recv_mlm (reply, reader);
-    assert (zm_proto_ext_int (reply, "_seq", -1) == 0);
-    assert (zm_proto_ext_int (reply, "_cnt", -1) == 1);
+    zreply = mlm_client_recv (reader);
+    r = zm_device_pop_seq (zreply, &seq, &cnt);
+    assert (r == 0);
+    assert (seq == 0 && cnt == 1);
+    zmsg_destroy (&zreply);
+
+    //  Batches
+    request = zmsg_new ();
+    zmsg_t *item = zm_proto_encode_device_v1 ("batch1", zclock_mono (), 60000, NULL);
+    zmsg_addmsg (request, &item);
+    item = zmsg_new ();
+    zmsg_addstr (item, "garbage");
+    zmsg_addmsg (request, &item);
+    item = zm_proto_encode_device_v1 ("batch2", zclock_mono (), 60000, NULL);
+    zmsg_addmsg (request, &item);
+    mlm_client_sendto (writer, "it.zmon.device", "INSERT-BATCH", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    assert (streq (mlm_client_subject (writer), "INSERT-BATCH"));
+    assert (zmsg_size (zreply) == 5);
+    zmsg_t *status = zmsg_popmsg (zreply);
+    zmsg_destroy (&status);
+    char *str = zmsg_popstr (zreply);
+    assert (streq (str, "2"));
+    zstr_free (&str);
+    str = zmsg_popstr (zreply);
+    assert (streq (str, "200"));
+    zstr_free (&str);
+    str = zmsg_popstr (zreply);
+    assert (streq (str, "400"));
+    zstr_free (&str);
+    zmsg_destroy (&zreply);
+
+    zreply = mlm_client_recv (reader);
+    assert (streq (mlm_client_subject (reader), "INSERT-BATCH"));
+    assert (zmsg_size (zreply) == 2);
+    zmsg_destroy (&zreply);
+
+    request = zmsg_new ();
+    item = zm_proto_encode_device_v1 ("batch1", 0, 0, NULL);
+    zmsg_addmsg (request, &item);
+    item = zm_proto_encode_device_v1 ("batch2", 0, 0, NULL);
+    zmsg_addmsg (request, &item);
+    item = zm_proto_encode_device_v1 ("batch3", 0, 0, NULL);
+    zmsg_addmsg (request, &item);
+    mlm_client_sendto (writer, "it.zmon.device", "DELETE-BATCH", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    assert (zmsg_size (zreply) == 5);
+    status = zmsg_popmsg (zreply);
+    zmsg_destroy (&status);
+    str = zmsg_popstr (zreply);
+    assert (streq (str, "2"));
+    zstr_free (&str);
+    zmsg_destroy (&zreply);
+
+    zreply = mlm_client_recv (reader);
+    assert (streq (mlm_client_subject (reader), "DELETE-BATCH"));
+    zmsg_destroy (&zreply);
+
+    //  Nothing left to publish by now
+    zm_proto_encode_ok (reply);
+    zm_proto_sendto (reply, writer, "it.zmon.device", "PUBLISH-STATUS");
+    zreply = mlm_client_recv (writer);
+    assert (streq (mlm_client_subject (writer), "PUBLISH-STATUS"));
+    assert (zmsg_size (zreply) == 3);
+    status = zmsg_popmsg (zreply);
+    zm_proto_recv (reply, status);
+    zmsg_destroy (&status);
+    zmsg_destroy (&zreply);
+    assert (zm_proto_id (reply) == ZM_PROTO_ERROR);
+
+    zm_proto_encode_ok (reply);
+    zm_proto_sendto (reply, writer, "it.zmon.device", "PUBLISH-CANCEL");
+    zm_proto_recv_mlm (reply, writer);
+    assert (zm_proto_id (reply) == ZM_PROTO_ERROR);
+
+    //  Paged GET-ALL
+    request = zm_proto_encode_device_v1 ("device2", zclock_mono (), 60000, NULL);
+    mlm_client_sendto (writer, "it.zmon.device", "INSERT", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    zmsg_destroy (&zreply);
+
+    zhash_t *ext = zhash_new ();
+    zhash_insert (ext, "_limit", "1");
+    request = zm_proto_encode_device_v1 ("", 0, 0, ext);
+    mlm_client_sendto (writer, "it.zmon.device", "GET-PAGE", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    assert (streq (mlm_client_subject (writer), "GET-PAGE"));
+    assert (zmsg_size (zreply) == 4);
+    status = zmsg_popmsg (zreply);
+    zm_proto_recv (reply, status);
+    zmsg_destroy (&status);
+    assert (zm_proto_id (reply) == ZM_PROTO_OK);
+    char *cursor = zmsg_popstr (zreply);
+    assert (!streq (cursor, "0"));
+    char *count = zmsg_popstr (zreply);
+    assert (streq (count, "2"));
+    zstr_free (&count);
+    item = zmsg_popmsg (zreply);
+    zm_proto_recv (reply, item);
+    zmsg_destroy (&item);
+    zmsg_destroy (&zreply);
+    assert (zm_proto_id (reply) == ZM_PROTO_DEVICE);
+    char *first = strdup (zm_proto_device (reply));
+
+    zhash_update (ext, "_cursor", cursor);
+    request = zm_proto_encode_device_v1 ("", 0, 0, ext);
+    mlm_client_sendto (writer, "it.zmon.device", "GET-PAGE", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    assert (zmsg_size (zreply) == 4);
+    status = zmsg_popmsg (zreply);
+    zmsg_destroy (&status);
+    char *last = zmsg_popstr (zreply);
+    assert (streq (last, "0"));
+    zstr_free (&last);
+    zstr_free (&count);
+    count = zmsg_popstr (zreply);
+    zstr_free (&count);
+    item = zmsg_popmsg (zreply);
+    zm_proto_recv (reply, item);
+    zmsg_destroy (&item);
+    zmsg_destroy (&zreply);
+    assert (!streq (zm_proto_device (reply), first));
+    zstr_free (&first);
+
+    //  Last page drops the cursor
+    request = zm_proto_encode_device_v1 ("", 0, 0, ext);
+    mlm_client_sendto (writer, "it.zmon.device", "GET-PAGE", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    assert (zmsg_size (zreply) == 1);
+    status = zmsg_popmsg (zreply);
+    zm_proto_recv (reply, status);
+    zmsg_destroy (&status);
+    zmsg_destroy (&zreply);
+    assert (zm_proto_id (reply) == ZM_PROTO_ERROR);
+    zstr_free (&cursor);
+    zhash_destroy (&ext);
+
+    //  Query by ext and name
+    ext = zhash_new ();
+    zhash_insert (ext, "type", "ups");
+    request = zm_proto_encode_device_v1 ("ups1", zclock_mono (), 60000, ext);
+    mlm_client_sendto (writer, "it.zmon.device", "INSERT", NULL, 1000, &request);
+    zm_proto_recv_mlm (reply, writer);
+    zhash_insert (ext, "_glob", "ups*");
+    request = zm_proto_encode_device_v1 ("", 0, 0, ext);
+    mlm_client_sendto (writer, "it.zmon.device", "QUERY", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    assert (streq (mlm_client_subject (writer), "QUERY"));
+    assert (zmsg_size (zreply) == 4);
+    status = zmsg_popmsg (zreply);
+    zmsg_destroy (&status);
+    last = zmsg_popstr (zreply);
+    assert (streq (last, "0"));
+    zstr_free (&last);
+    count = zmsg_popstr (zreply);
+    assert (streq (count, "1"));
+    zstr_free (&count);
+    item = zmsg_popmsg (zreply);
+    zm_proto_recv (reply, item);
+    zmsg_destroy (&item);
+    zmsg_destroy (&zreply);
+    assert (streq (zm_proto_device (reply), "ups1"));
+    zhash_destroy (&ext);
+
+    //  Stateless paging by name prefix, device1 and device2 are there
+    ext = zhash_new ();
+    zhash_insert (ext, "_limit", "1");
+    request = zm_proto_encode_device_v1 ("device", 0, 0, ext);
+    mlm_client_sendto (writer, "it.zmon.device", "LOOKUP-PREFIX", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    assert (streq (mlm_client_subject (writer), "LOOKUP-PREFIX"));
+    assert (zmsg_size (zreply) == 4);
+    status = zmsg_popmsg (zreply);
+    zmsg_destroy (&status);
+    char *next = zmsg_popstr (zreply);
+    assert (streq (next, "device1"));
+    count = zmsg_popstr (zreply);
+    assert (streq (count, "2"));
+    zstr_free (&count);
+    zmsg_destroy (&zreply);
+
+    zhash_insert (ext, "_after", next);
+    zstr_free (&next);
+    request = zm_proto_encode_device_v1 ("device", 0, 0, ext);
+    mlm_client_sendto (writer, "it.zmon.device", "LOOKUP-PREFIX", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    assert (zmsg_size (zreply) == 4);
+    status = zmsg_popmsg (zreply);
+    zmsg_destroy (&status);
+    next = zmsg_popstr (zreply);
+    assert (streq (next, ""));
+    zstr_free (&next);
+    count = zmsg_popstr (zreply);
+    zstr_free (&count);
+    item = zmsg_popmsg (zreply);
+    zm_proto_recv (reply, item);
+    zmsg_destroy (&item);
+    zmsg_destroy (&zreply);
+    assert (streq (zm_proto_device (reply), "device2"));
+    zhash_destroy (&ext);
+
+    //  Stale device is deleted and it's published
+    request = zm_proto_encode_device_v1 ("stale", zclock_mono (), 1, NULL);
+    mlm_client_sendto (writer, "it.zmon.device", "INSERT", NULL, 1000, &request);
+    zm_proto_recv_mlm (reply, writer);
+    assert (zm_proto_id (reply) == ZM_PROTO_OK);
+    while (true) {
+        zm_proto_recv_mlm (reply, reader);
+        if (streq (mlm_client_subject (reader), "DELETE"))
+            break;
+    }
+    assert (streq (zm_proto_device (reply), "stale"));
+    request = zm_proto_encode_device_v1 ("stale", 0, 0, NULL);
+    mlm_client_sendto (writer, "it.zmon.device", "LOOKUP", NULL, 1000, &request);
+    zm_proto_recv_mlm (reply, writer);
+    assert (zm_proto_id (reply) == ZM_PROTO_ERROR);
+
+    //  Changes since version of SNAPSHOT
+    zm_proto_encode_ok (reply);
+    zm_proto_sendto (reply, writer, "it.zmon.device", "SNAPSHOT");
+    zreply = mlm_client_recv (writer);
+    assert (streq (mlm_client_subject (writer), "SNAPSHOT"));
+    status = zmsg_popmsg (zreply);
+    zmsg_destroy (&status);
+    char *epoch = zmsg_popstr (zreply);
+    char *version = zmsg_popstr (zreply);
+    str = zmsg_popstr (zreply);
+    assert (streq (str, "1"));
+    zstr_free (&str);
+    str = zmsg_popstr (zreply);
+    assert (streq (str, "0"));
+    zstr_free (&str);
+    zmsg_destroy (&zreply);
+
+    request = zm_proto_encode_device_v1 ("device2", 0, 0, NULL);
+    mlm_client_sendto (writer, "it.zmon.device", "DELETE", NULL, 1000, &request);
+    zm_proto_recv_mlm (reply, writer);
+    ext = zhash_new ();
+    zhash_insert (ext, "type", "ups");
+    request = zm_proto_encode_device_v1 ("ups2", zclock_mono (), 60000, ext);
+    mlm_client_sendto (writer, "it.zmon.device", "INSERT", NULL, 1000, &request);
+    zm_proto_recv_mlm (reply, writer);
+    zhash_destroy (&ext);
+
+    ext = zhash_new ();
+    zhash_insert (ext, "_epoch", epoch);
+    zhash_insert (ext, "_version", version);
+    request = zm_proto_encode_device_v1 ("", 0, 0, ext);
+    mlm_client_sendto (writer, "it.zmon.device", "SYNC-SINCE", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    assert (streq (mlm_client_subject (writer), "SYNC-SINCE"));
+    assert (zmsg_size (zreply) == 6);
+    status = zmsg_popmsg (zreply);
+    zm_proto_recv (reply, status);
+    zmsg_destroy (&status);
+    assert (zm_proto_id (reply) == ZM_PROTO_OK);
+    str = zmsg_popstr (zreply);
+    assert (streq (str, epoch));
+    zstr_free (&str);
+    str = zmsg_popstr (zreply);
+    assert (strtoull (str, NULL, 10) == strtoull (version, NULL, 10) + 2);
+    zstr_free (&str);
+    str = zmsg_popstr (zreply);
+    assert (streq (str, "1"));
+    zstr_free (&str);
+    item = zmsg_popmsg (zreply);
+    zm_proto_recv (reply, item);
+    zmsg_destroy (&item);
+    assert (streq (zm_proto_device (reply), "ups2"));
+    str = zmsg_popstr (zreply);
+    assert (streq (str, "device2"));
+    zstr_free (&str);
+    zmsg_destroy (&zreply);
+
+    zhash_update (ext, "_epoch", "1");
+    request = zm_proto_encode_device_v1 ("", 0, 0, ext);
+    mlm_client_sendto (writer, "it.zmon.device", "SYNC-SINCE", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    assert (zmsg_size (zreply) == 3);
+    status = zmsg_popmsg (zreply);
+    zm_proto_recv (reply, status);
+    zmsg_destroy (&status);
+    zmsg_destroy (&zreply);
+    assert (zm_proto_id (reply) == ZM_PROTO_ERROR);
+    assert (zm_proto_code (reply) == 410);
+    zhash_destroy (&ext);
+    zstr_free (&epoch);
+    zstr_free (&version);
+
+    //  Stats count requests by subject
+    zm_proto_encode_ok (reply);
+    zm_proto_sendto (reply, writer, "it.zmon.device", "STATS");
+    zreply = mlm_client_recv (writer);
+    assert (streq (mlm_client_subject (writer), "STATS"));
+    assert (zmsg_size (zreply) == 2);
+    status = zmsg_popmsg (zreply);
+    zmsg_destroy (&status);
+    str = zmsg_popstr (zreply);
+    zconfig_t *stats = zconfig_str_load (str);
+    assert (stats);
+    assert (atoi (zconfig_resolve (stats, "INSERT/count", "0")) >= 5);
+    assert (zconfig_resolve (stats, "LOOKUP/p99", NULL));
+    assert (zconfig_resolve (stats, "devices", NULL));
+    zconfig_destroy (&stats);
+    zstr_free (&str);
+    zmsg_destroy (&zreply);
+
+    zstr_send (zm_device, "STATS");
+    str = zstr_recv (zm_device);
+    stats = zconfig_str_load (str);
+    assert (zconfig_resolve (stats, "STATS/count", NULL));
+    zconfig_destroy (&stats);
+    zstr_free (&str);
+
+    //  Journal is compacted by background store
+    int i;
+    r = zsys_dir_create (".test-device", NULL);
+    assert (r == 0);
+    zactor_t *stored = zactor_new (zm_device_actor, NULL);
+    zstr_sendx (stored, "CONFIG",
+        "server\n"
+        "    file = .test-device/devices.bin\n"
+        "    sync_interval = 10\n"
+        "    compact_after = 2\n"
+        "malamute\n"
+        "    endpoint = inproc://zm-device-test\n"
+        "    address = it.zmon.stored\n",
+        NULL);
+    zstr_sendx (stored, "START", NULL);
+    for (i = 0; i < 3; i++) {
+        char name [16];
+        snprintf (name, sizeof (name), "stored%d", i);
+        request = zm_proto_encode_device_v1 (name, zclock_mono (), 60000, NULL);
+        mlm_client_sendto (writer, "it.zmon.stored", "INSERT", NULL, 1000, &request);
+        zm_proto_recv_mlm (reply, writer);
+        assert (zm_proto_id (reply) == ZM_PROTO_OK);
+    }
+    char *mode = NULL;
+    char *state = NULL;
+    int retries = 100;
+    while (retries--) {
+        zstr_free (&mode);
+        zstr_free (&state);
+        zstr_send (stored, "STORE-MODE");
+        zstr_recvx (stored, &mode, &state, NULL);
+        assert (streq (mode, "background"));
+        if (streq (state, "idle") && zsys_file_exists (".test-device/devices.bin"))
+            break;
+        zclock_sleep (10);
+    }
+    assert (streq (state, "idle"));
+    zstr_free (&mode);
+    zstr_free (&state);
+    zactor_destroy (&stored);
+    zsys_file_delete (".test-device/devices.bin");
+    zsys_file_delete (".test-device/devices.bin.journal");
+
+    //  Checkpoint stores devices in background, even without journal,
+    //  counting changes of content only
+    stored = zactor_new (zm_device_actor, NULL);
+    zstr_sendx (stored, "CONFIG",
+        "server\n"
+        "    file = .test-device/devices.bin\n"
+        "    journal = 0\n"
+        "    checkpoint_changes = 3\n"
+        "malamute\n"
+        "    endpoint = inproc://zm-device-test\n"
+        "    address = it.zmon.stored\n",
+        NULL);
+    zstr_sendx (stored, "START", NULL);
+    for (i = 0; i < 3; i++) {
+        request = zm_proto_encode_device_v1 ("stored0", zclock_mono (), 60000, NULL);
+        mlm_client_sendto (writer, "it.zmon.stored", "INSERT", NULL, 1000, &request);
+        zm_proto_recv_mlm (reply, writer);
+        assert (zm_proto_id (reply) == ZM_PROTO_OK);
+    }
+    zclock_sleep (3 * ZM_DEVICE_CHECKPOINT_TICK);
+    assert (!zsys_file_exists (".test-device/devices.bin"));
+    for (i = 1; i < 3; i++) {
+        char name [16];
+        snprintf (name, sizeof (name), "stored%d", i);
+        request = zm_proto_encode_device_v1 (name, zclock_mono (), 60000, NULL);
+        mlm_client_sendto (writer, "it.zmon.stored", "INSERT", NULL, 1000, &request);
+        zm_proto_recv_mlm (reply, writer);
+        assert (zm_proto_id (reply) == ZM_PROTO_OK);
+    }
+    retries = 100;
+    while (retries--) {
+        zstr_free (&mode);
+        zstr_free (&state);
+        zstr_send (stored, "STORE-MODE");
+        zstr_recvx (stored, &mode, &state, NULL);
+        assert (streq (mode, "background"));
+        if (streq (state, "idle") && zsys_file_exists (".test-device/devices.bin"))
+            break;
+        zclock_sleep (10);
+    }
+    assert (streq (state, "idle"));
+    zstr_free (&mode);
+    zstr_free (&state);
+    zactor_destroy (&stored);
+
+    //  Lazy load answers before devices are hydrated
+    stored = zactor_new (zm_device_actor, NULL);
+    zstr_sendx (stored, "CONFIG",
+        "server\n"
+        "    file = .test-device/devices.bin\n"
+        "    load = lazy\n"
+        "    hydrate_batch = 1\n"
+        "malamute\n"
+        "    endpoint = inproc://zm-device-test\n"
+        "    address = it.zmon.stored\n",
+        NULL);
+    zstr_sendx (stored, "START", NULL);
+    request = zm_proto_encode_device_v1 ("stored2", 0, 0, NULL);
+    mlm_client_sendto (writer, "it.zmon.stored", "LOOKUP", NULL, 1000, &request);
+    zm_proto_recv_mlm (reply, writer);
+    assert (zm_proto_id (reply) == ZM_PROTO_DEVICE);
+    char *pending = NULL;
+    char *total = NULL;
+    retries = 100;
+    while (retries--) {
+        zstr_free (&state);
+        zstr_free (&pending);
+        zstr_free (&total);
+        zstr_send (stored, "LOAD-STATUS");
+        zstr_recvx (stored, &state, &pending, &total, NULL);
+        assert (streq (total, "3"));
+        if (streq (state, "ready"))
+            break;
+        zclock_sleep (10);
+    }
+    assert (streq (state, "ready"));
+    assert (streq (pending, "0"));
+    zstr_free (&state);
+    zstr_free (&pending);
+    zstr_free (&total);
+    zactor_destroy (&stored);
+    zdir_t *dir = zdir_new (".test-device", NULL);
+    zdir_remove (dir, true);
+    zdir_destroy (&dir);
+
+    //  Changes are coalesced into CHANGE-BATCH, last state of each device
+    zactor_t *coalesced = zactor_new (zm_device_actor, NULL);
+    zstr_sendx (coalesced, "CONFIG",
+        "server\n"
+        "    coalesce_window = 500\n"
+        "    coalesce_batch = 3\n"
+        "malamute\n"
+        "    endpoint = inproc://zm-device-test\n"
+        "    address = it.zmon.coalesced\n"
+        "    producer = coalesced-test\n",
+        NULL);
+    zstr_sendx (coalesced, "START", NULL);
+    mlm_client_t *watcher = mlm_client_new ();
+    assert (watcher);
+    r = mlm_client_connect (watcher, endpoint, 1000, "watcher");
+    assert (r == 0);
+    mlm_client_set_consumer (watcher, "coalesced-test", ".*");
+
+    const char *changes [] = {"c1", "c1", "c2", "c3", "c4", NULL};
+    for (i = 0; changes [i]; i++) {
+        zhash_t *values = zhash_new ();
+        zhash_insert (values, "type", i ? "ups" : "epdu");
+        request = zm_proto_encode_device_v1 (changes [i], zclock_mono (), 0, values);
+        zhash_destroy (&values);
+        mlm_client_sendto (writer, "it.zmon.coalesced", "INSERT", NULL, 1000, &request);
+        zm_proto_recv_mlm (reply, writer);
+        assert (zm_proto_id (reply) == ZM_PROTO_OK);
+    }
+    //  Third waiting device publishes right away
+    zreply = mlm_client_recv (watcher);
+    assert (streq (mlm_client_subject (watcher), "CHANGE-BATCH"));
+    assert (zmsg_size (zreply) == 2 + 3 * 2);
+    str = zmsg_popstr (zreply);
+    assert (streq (str, "0"));
+    zstr_free (&str);
+    str = zmsg_popstr (zreply);
+    assert (streq (str, "4"));
+    zstr_free (&str);
+    while ((str = zmsg_popstr (zreply))) {
+        assert (streq (str, "INSERT"));
+        zstr_free (&str);
+        item = zmsg_popmsg (zreply);
+        zm_proto_recv (reply, item);
+        zmsg_destroy (&item);
+        assert (streq (zm_proto_ext_string (reply, "type", ""), "ups"));
+    }
+    zmsg_destroy (&zreply);
+
+    //  The rest waits for the window, DELETE replaces INSERT of c4
+    request = zm_proto_encode_device_v1 ("c4", 0, 0, NULL);
+    mlm_client_sendto (writer, "it.zmon.coalesced", "DELETE", NULL, 1000, &request);
+    zm_proto_recv_mlm (reply, writer);
+    zreply = mlm_client_recv (watcher);
+    assert (streq (mlm_client_subject (watcher), "CHANGE-BATCH"));
+    assert (zmsg_size (zreply) == 2 + 2);
+    str = zmsg_popstr (zreply);
+    assert (streq (str, "4"));
+    zstr_free (&str);
+    str = zmsg_popstr (zreply);
+    assert (streq (str, "6"));
+    zstr_free (&str);
+    str = zmsg_popstr (zreply);
+    assert (streq (str, "DELETE"));
+    zstr_free (&str);
+    zmsg_destroy (&zreply);
+    mlm_client_destroy (&watcher);
+    zactor_destroy (&coalesced);
+
+    //  Sender over server/sender_rate is told to come back later
+    zactor_t *limited = zactor_new (zm_device_actor, NULL);
+    zstr_sendx (limited, "CONFIG",
+        "server\n"
+        "    sender_rate = 1\n"
+        "malamute\n"
+        "    endpoint = inproc://zm-device-test\n"
+        "    address = it.zmon.limited\n",
+        NULL);
+    zstr_sendx (limited, "START", NULL);
+    request = zm_proto_encode_device_v1 ("l1", 0, 0, NULL);
+    mlm_client_sendto (writer, "it.zmon.limited", "LOOKUP", NULL, 1000, &request);
+    zm_proto_recv_mlm (reply, writer);
+    assert (zm_proto_id (reply) == ZM_PROTO_ERROR);
+    assert (zm_proto_code (reply) == 404);
+    request = zm_proto_encode_device_v1 ("l1", 0, 0, NULL);
+    mlm_client_sendto (writer, "it.zmon.limited", "LOOKUP", NULL, 1000, &request);
+    zm_proto_recv_mlm (reply, writer);
+    assert (zm_proto_id (reply) == ZM_PROTO_ERROR);
+    assert (zm_proto_code (reply) == 429);
+    assert (streq (mlm_client_subject (writer), "LOOKUP"));
+    assert (strncmp (zm_proto_description (reply), "BUSY retry_after=", 17) == 0);
+    zactor_destroy (&limited);
+
+    //  Queued reads go ahead of writes, read of a sender stays behind its
+    //  own writes and writes over server/queue_high are refused
+    zm_device_t *queued = zm_device_new (NULL, NULL);
+    assert (queued);
+    zmsg_t *config = zmsg_new ();
+    zmsg_addstr (config,
+        "server\n"
+        "    queue_high = 3\n"
+        "malamute\n"
+        "    endpoint = inproc://zm-device-test\n"
+        "    address = it.zmon.queued\n");
+    zm_device_config (queued, config);
+    zmsg_destroy (&config);
+    r = zm_device_start (queued);
+    assert (r == 0);
+    mlm_client_t *asker = mlm_client_new ();
+    assert (asker);
+    r = mlm_client_connect (asker, endpoint, 1000, "asker");
+    assert (r == 0);
+    request = zm_proto_encode_device_v1 ("q1", zclock_mono (), 60000, NULL);
+    zm_device_admit (queued, "writer", "INSERT", &request);
+    request = zm_proto_encode_device_v1 ("q2", zclock_mono (), 60000, NULL);
+    zm_device_admit (queued, "writer", "INSERT", &request);
+    request = zm_proto_encode_device_v1 ("q2", 0, 0, NULL);
+    zm_device_admit (queued, "writer", "LOOKUP", &request);
+    request = zm_proto_encode_device_v1 ("q3", zclock_mono (), 60000, NULL);
+    zm_device_admit (queued, "writer", "INSERT", &request);
+    request = zm_proto_encode_device_v1 ("q1", 0, 0, NULL);
+    zm_device_admit (queued, "asker", "LOOKUP", &request);
+    assert (zm_queue_writes (queued->queue) == 3);
+    assert (zm_queue_reads (queued->queue) == 1);
+    //  Refused right away
+    zm_proto_recv_mlm (reply, writer);
+    assert (zm_proto_id (reply) == ZM_PROTO_ERROR);
+    assert (zm_proto_code (reply) == 503);
+    assert (strncmp (zm_proto_description (reply), "BUSY retry_after=", 17) == 0);
+    assert (zm_device_queue_run (queued, SIZE_MAX) == 0);
+    zm_proto_recv_mlm (reply, asker);
+    assert (zm_proto_id (reply) == ZM_PROTO_ERROR);
+    assert (zm_proto_code (reply) == 404);
+    zm_proto_recv_mlm (reply, writer);
+    assert (zm_proto_id (reply) == ZM_PROTO_OK);
+    zm_proto_recv_mlm (reply, writer);
+    assert (zm_proto_id (reply) == ZM_PROTO_OK);
+    zm_proto_recv_mlm (reply, writer);
+    assert (zm_proto_id (reply) == ZM_PROTO_DEVICE);
+    assert (streq (zm_proto_device (reply), "q2"));
+    //  BUSY keeps leading status of replies which have one
+    zm_device_busy (queued, "asker", "QUERY", 429, 5);
+    zmsg_t *busy = mlm_client_recv (asker);
+    assert (streq (mlm_client_subject (asker), "QUERY"));
+    status = zmsg_popmsg (busy);
+    assert (status);
+    r = zm_proto_recv (reply, status);
+    assert (r == 0);
+    assert (zm_proto_code (reply) == 429);
+    assert (streq (zm_proto_description (reply), "BUSY retry_after=5"));
+    zmsg_destroy (&status);
+    zmsg_destroy (&busy);
+    mlm_client_destroy (&asker);
+    zm_device_destroy (&queued);
+
+    //  Cache applies devices of consumed stream, newer time wins
+    zactor_t *cache = zactor_new (zm_device_actor, NULL);
+    zstr_sendx (cache, "CONFIG",
+        "server\n"
+        "    cache = 1\n"
+        "malamute\n"
+        "    endpoint = inproc://zm-device-test\n"
+        "    address = it.zmon.cache\n"
+        "    consumer\n"
+        "        cache-test = .*\n",
+        NULL);
+    zstr_sendx (cache, "START", NULL);
+    mlm_client_t *peer = mlm_client_new ();
+    assert (peer);
+    r = mlm_client_connect (peer, endpoint, 1000, "peer");
+    assert (r == 0);
+    mlm_client_set_producer (peer, "cache-test");
+
+    const char *types [] = {"ups", "epdu", "sensor"};
+    const uint64_t times [] = {200, 100, 300};
+    for (i = 0; i < 3; i++) {
+        zhash_t *values = zhash_new ();
+        zhash_insert (values, "type", (void *) types [i]);
+        zhash_insert (values, "_epoch", "7");
+        zhash_insert (values, "_version", "42");
+        request = zm_proto_encode_device_v1 ("cached", times [i], 0, values);
+        zhash_destroy (&values);
+        mlm_client_send (peer, "INSERT", &request);
+    }
+    //  Older epdu is dropped, sensor replaces ups
+    retries = 100;
+    while (retries--) {
+        request = zm_proto_encode_device_v1 ("cached", 0, 0, NULL);
+        mlm_client_sendto (writer, "it.zmon.cache", "LOOKUP", NULL, 1000, &request);
+        zm_proto_recv_mlm (reply, writer);
+        if (zm_proto_id (reply) == ZM_PROTO_DEVICE
+        &&  zm_proto_time (reply) == 300)
+            break;
+        assert (zm_proto_id (reply) != ZM_PROTO_DEVICE
+            ||  !streq (zm_proto_ext_string (reply, "type", ""), "epdu"));
+        zclock_sleep (10);
+    }
+    assert (zm_proto_id (reply) == ZM_PROTO_DEVICE);
+    assert (streq (zm_proto_ext_string (reply, "type", ""), "sensor"));
+    //  Stamp of the peer is not kept
+    assert (!zm_proto_ext_string (reply, "_epoch", NULL));
+    assert (!zm_proto_ext_string (reply, "_version", NULL));
+
+    request = zm_proto_encode_device_v1 ("cached", 0, 0, NULL);
+    mlm_client_send (peer, "DELETE", &request);
+    retries = 100;
+    while (retries--) {
+        request = zm_proto_encode_device_v1 ("cached", 0, 0, NULL);
+        mlm_client_sendto (writer, "it.zmon.cache", "LOOKUP", NULL, 1000, &request);
+        zm_proto_recv_mlm (reply, writer);
+        if (zm_proto_id (reply) == ZM_PROTO_ERROR)
+            break;
+        zclock_sleep (10);
+    }
+    assert (zm_proto_id (reply) == ZM_PROTO_ERROR);
+    mlm_client_destroy (&peer);
+    zactor_destroy (&cache);
+
+    //  Request with _trace produces span on the stats stream
+    zactor_t *traced = zactor_new (zm_device_actor, NULL);
+    zstr_sendx (traced, "CONFIG",
+        "server\n"
+        "    trace = 1\n"
+        "malamute\n"
+        "    endpoint = inproc://zm-device-test\n"
+        "    address = it.zmon.traced\n"
+        "    stats = trace-test\n",
+        NULL);
+    zstr_sendx (traced, "START", NULL);
+    mlm_client_t *tracer = mlm_client_new ();
+    assert (tracer);
+    r = mlm_client_connect (tracer, endpoint, 1000, "tracer");
+    assert (r == 0);
+    mlm_client_set_consumer (tracer, "trace-test", "TRACE");
+
+    zhash_t *trace = zhash_new ();
+    zhash_insert (trace, "_trace", "t42");
+    request = zm_proto_encode_device_v1 ("traced", 0, 0, trace);
+    zhash_destroy (&trace);
+    mlm_client_sendto (writer, "it.zmon.traced", "LOOKUP", NULL, 1000, &request);
+    zm_proto_recv_mlm (reply, writer);
+    assert (zm_proto_id (reply) == ZM_PROTO_ERROR);
+    zreply = mlm_client_recv (tracer);
+    assert (streq (mlm_client_subject (tracer), "TRACE"));
+    str = zmsg_popstr (zreply);
+    zmsg_destroy (&zreply);
+    zconfig_t *span = zconfig_str_load (str);
+    zstr_free (&str);
+    assert (span);
+    assert (streq (zconfig_get (span, "id", ""), "t42"));
+    assert (streq (zconfig_get (span, "subject", ""), "LOOKUP"));
+    assert (streq (zconfig_get (span, "sender", ""), "writer"));
+    assert (atoll (zconfig_get (span, "total", "-1")) >= 0);
+    zconfig_destroy (&span);
+
+    //  Trace keys are not stored with the device
+    trace = zhash_new ();
+    zhash_insert (trace, "_trace", "t43");
+    zhash_insert (trace, "_sent", "1");
+    request = zm_proto_encode_device_v1 ("traced", zclock_mono (), 60000, trace);
+    zhash_destroy (&trace);
+    mlm_client_sendto (writer, "it.zmon.traced", "INSERT", NULL, 1000, &request);
+    zm_proto_recv_mlm (reply, writer);
+    assert (zm_proto_id (reply) == ZM_PROTO_OK);
+    zreply = mlm_client_recv (tracer);
+    zmsg_destroy (&zreply);
+    request = zm_proto_encode_device_v1 ("traced", 0, 0, NULL);
+    mlm_client_sendto (writer, "it.zmon.traced", "LOOKUP", NULL, 1000, &request);
+    zm_proto_recv_mlm (reply, writer);
+    assert (zm_proto_id (reply) == ZM_PROTO_DEVICE);
+    assert (!zm_proto_ext_string (reply, "_trace", NULL));
+    assert (!zm_proto_ext_string (reply, "_sent", NULL));
+    mlm_client_destroy (&tracer);
+    zactor_destroy (&traced);
+
+    //  Replica catches up by SNAPSHOT and follows the stream then
+    zactor_t *replica = zactor_new (zm_device_actor, NULL);
+    zstr_sendx (replica, "CONFIG",
+        "server\n"
+        "    replicate = it.zmon.device\n"
+        "malamute\n"
+        "    endpoint = inproc://zm-device-test\n"
+        "    address = it.zmon.replica\n",
+        NULL);
+    zstr_sendx (replica, "START", NULL);
+
+    request = zm_proto_encode_device_v1 ("replicated", zclock_mono (), 60000, NULL);
+    mlm_client_sendto (writer, "it.zmon.device", "INSERT", NULL, 1000, &request);
+    zm_proto_recv_mlm (reply, writer);
+    assert (zm_proto_id (reply) == ZM_PROTO_OK);
+
+    const char *names [] = {"device1", "replicated"};
+    size_t k;
+    for (k = 0; k < 2; k++) {
+        int retries = 100;
+        while (retries--) {
+            request = zm_proto_encode_device_v1 (names [k], 0, 0, NULL);
+            mlm_client_sendto (writer, "it.zmon.replica", "LOOKUP", NULL, 1000, &request);
+            zm_proto_recv_mlm (reply, writer);
+            if (zm_proto_id (reply) == ZM_PROTO_DEVICE)
+                break;
+            zclock_sleep (10);
+        }
+        assert (zm_proto_id (reply) == ZM_PROTO_DEVICE);
+    }
+
+    request = zm_proto_encode_device_v1 ("rejected", zclock_mono (), 60000, NULL);
+    mlm_client_sendto (writer, "it.zmon.replica", "INSERT", NULL, 1000, &request);
+    zm_proto_recv_mlm (reply, writer);
+    assert (zm_proto_id (reply) == ZM_PROTO_ERROR);
+    zactor_destroy (&replica);
+
+    //  SNAPSHOT is applied chunk by chunk, stale devices go with the last
+    zm_device_t *follower = zm_device_new (NULL, NULL);
+    assert (follower);
+    config = zmsg_new ();
+    zmsg_addstr (config,
+        "server\n"
+        "    replicate = it.zmon.leader\n");
+    zm_device_config (follower, config);
+    zmsg_destroy (&config);
+    zm_proto_encode_device (reply, "old", zclock_mono (), 60000, NULL);
+    zm_devices_insert (follower->devices, reply);
+    zm_replica_sync (follower->replica, follower->msg);
+    const char *chunks [][3] = {
+        {"1", "1", "chunk1"},       //  First chunk
+        {"3", "0", "chunk3"},       //  Out of order, dropped
+        {"2", "0", "chunk2"},       //  Last chunk
+    };
+    for (i = 0; i < 3; i++) {
+        zmsg_t *chunk = zmsg_new ();
+        status = zmsg_new ();
+        zm_proto_encode_ok (reply);
+        zm_proto_send (reply, status);
+        zmsg_addmsg (chunk, &status);
+        zmsg_addstr (chunk, "7");
+        zmsg_addstr (chunk, "42");
+        zmsg_addstr (chunk, chunks [i][0]);
+        zmsg_addstr (chunk, chunks [i][1]);
+        item = zm_proto_encode_device_v1 (chunks [i][2], zclock_mono (), 60000, NULL);
+        zmsg_addmsg (chunk, &item);
+        zm_device_replica_snapshot (follower, chunk);
+        zmsg_destroy (&chunk);
+        if (i == 0) {
+            assert (zm_devices_lookup (follower->devices, "chunk1"));
+            assert (zm_devices_lookup (follower->devices, "old"));
+            assert (zm_replica_epoch (follower->replica) == 0);
+        }
+    }
+    assert (!zm_replica_syncing (follower->replica));
+    assert (zm_replica_epoch (follower->replica) == 7);
+    assert (zm_replica_version (follower->replica) == 42);
+    assert (zm_devices_lookup (follower->devices, "chunk1"));
+    assert (zm_devices_lookup (follower->devices, "chunk2"));
+    assert (!zm_devices_lookup (follower->devices, "chunk3"));
+    assert (!zm_devices_lookup (follower->devices, "old"));
+    zm_device_destroy (&follower);
+
+    //  Reload redoes only setups whose configuration changed
+    zm_device_t *reloaded = zm_device_new (NULL, NULL);
+    assert (reloaded);
+    const char *reloads [] = {
+        "server\n    queue_high = 5\n    expire_batch = 10\n",
+        "server\n    queue_high = 5\n    expire_batch = 20\n",
+        "server\n    queue_high = 9\n    expire_batch = 20\n",
+    };
+    for (i = 0; i < 3; i++) {
+        config = zmsg_new ();
+        zmsg_addstr (config, reloads [i]);
+        r = zm_device_config (reloaded, config);
+        assert (r == 0);
+        zmsg_destroy (&config);
+        if (i == 0) {
+            assert (zm_queue_high (reloaded->queue) == 5);
+            zm_queue_set (reloaded->queue, 7, 0);
+        }
+        else
+        if (i == 1) {
+            //  Queue section is the same, only expiry is set up again
+            assert (zm_queue_high (reloaded->queue) == 7);
+            assert (reloaded->expire_batch == 20);
+        }
+    }
+    assert (zm_queue_high (reloaded->queue) == 9);
+    //  store = sync holds without journal or file
+    config = zmsg_new ();
+    zmsg_addstr (config, "server\n    journal = 0\n    store = sync\n");
+    r = zm_device_config (reloaded, config);
+    assert (r == 0);
+    zmsg_destroy (&config);
+    assert (!reloaded->store_background);
+    zm_device_destroy (&reloaded);
+
+    //  STOP which can't store devices reports it, both ways of storing
+    for (i = 0; i < 2; i++) {
+        zm_device_t *stopped = zm_device_new (NULL, NULL);
+        assert (stopped);
+        config = zmsg_new ();
+        zmsg_addstr (config, i == 0
+            ? "server\n    file = .test/missing/stop.zpl\n    journal = 0\n"
+            : "server\n    file = .test/missing/stop.zpl\n    journal = 0\n    store = sync\n");
+        r = zm_device_config (stopped, config);
+        assert (r == 0);
+        zmsg_destroy (&config);
+        assert (stopped->store_background == (i == 0));
+        request = zm_proto_encode_device_v1 ("stop1", zclock_mono (), 60000, NULL);
+        zm_proto_recv (reply, request);
+        zmsg_destroy (&request);
+        zm_devices_insert (stopped->devices, reply);
+        assert (zm_device_stop (stopped) == -1);
+        assert (!zsys_file_exists (".test/missing/stop.zpl"));
+        zm_device_destroy (&stopped);
+    }
+
+    //  Sharded actor spreads devices over two workers
+    zactor_t *sharded = zactor_new (zm_device_actor, NULL);
+    zstr_sendx (sharded, "CONFIG",
+        "server\n"
+        "    shards = 2\n"
+        "malamute\n"
+        "    endpoint = inproc://zm-device-test\n"
+        "    address = it.zmon.sharded\n",
+        NULL);
+    zstr_sendx (sharded, "START", NULL);
+
+    request = zmsg_new ();
+    for (i = 0; i < 10; i++) {
+        char name [16];
+        snprintf (name, sizeof (name), "shard%d", i);
+        item = zm_proto_encode_device_v1 (name, zclock_mono (), 60000, NULL);
+        zmsg_addmsg (request, &item);
+    }
+    item = zmsg_new ();
+    zmsg_addstr (item, "garbage");
+    zmsg_addmsg (request, &item);
+    mlm_client_sendto (writer, "it.zmon.sharded", "INSERT-BATCH", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    assert (zmsg_size (zreply) == 13);
+    status = zmsg_popmsg (zreply);
+    zmsg_destroy (&status);
+    str = zmsg_popstr (zreply);
+    assert (streq (str, "10"));
+    zstr_free (&str);
+    for (i = 0; i < 11; i++) {
+        str = zmsg_popstr (zreply);
+        assert (streq (str, i < 10 ? "200" : "400"));
+        zstr_free (&str);
+    }
+    zmsg_destroy (&zreply);
+
+    request = zm_proto_encode_device_v1 ("shard10", zclock_mono (), 60000, NULL);
+    mlm_client_sendto (writer, "it.zmon.sharded", "INSERT", NULL, 1000, &request);
+    zm_proto_recv_mlm (reply, writer);
+    assert (zm_proto_id (reply) == ZM_PROTO_OK);
+
+    request = zm_proto_encode_device_v1 ("shard3", 0, 0, NULL);
+    mlm_client_sendto (writer, "it.zmon.sharded", "LOOKUP", NULL, 1000, &request);
+    zm_proto_recv_mlm (reply, writer);
+    assert (zm_proto_id (reply) == ZM_PROTO_DEVICE);
+    assert (streq (zm_proto_device (reply), "shard3"));
+
+    //  GET-ALL is merged in name order
+    zm_proto_encode_ok (reply);
+    zm_proto_sendto (reply, writer, "it.zmon.sharded", "GET-ALL");
+    char *previous = strdup ("");
+    for (i = 0; i < 11; i++) {
+        zreply = mlm_client_recv (writer);
+        assert (streq (mlm_client_subject (writer), "GET-ALL"));
+        r = zm_device_pop_seq (zreply, &seq, &cnt);
+        assert (r == 0);
+        assert (seq == (size_t) i && cnt == 11);
+        zm_proto_recv (reply, zreply);
+        zmsg_destroy (&zreply);
+        assert (strcmp (previous, zm_proto_device (reply)) < 0);
+        zstr_free (&previous);
+        previous = strdup (zm_proto_device (reply));
+    }
+    zstr_free (&previous);
+
+    ext = zhash_new ();
+    zhash_insert (ext, "_limit", "3");
+    request = zm_proto_encode_device_v1 ("shard", 0, 0, ext);
+    mlm_client_sendto (writer, "it.zmon.sharded", "LOOKUP-PREFIX", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    assert (zmsg_size (zreply) == 6);
+    status = zmsg_popmsg (zreply);
+    zmsg_destroy (&status);
+    next = zmsg_popstr (zreply);
+    assert (streq (next, "shard10"));
+    zstr_free (&next);
+    count = zmsg_popstr (zreply);
+    assert (streq (count, "11"));
+    zstr_free (&count);
+    zmsg_destroy (&zreply);
+    zhash_destroy (&ext);
+
+    request = zm_proto_encode_device_v1 ("", 0, 0, NULL);
+    mlm_client_sendto (writer, "it.zmon.sharded", "GET-PAGE", NULL, 1000, &request);
+    zreply = mlm_client_recv (writer);
+    assert (zmsg_size (zreply) == 1);
+    status = zmsg_popmsg (zreply);
+    zm_proto_recv (reply, status);
+    zmsg_destroy (&status);
+    zmsg_destroy (&zreply);
+    assert (zm_proto_id (reply) == ZM_PROTO_ERROR);
+    zactor_destroy (&sharded);
 
     zm_proto_destroy (&reply);
     
@@ -0,0 +1,379 @@
+/*  =========================================================================
+    zm_device_bench - Mailbox throughput and latency benchmark
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+/*
+@header
+    zm_device_bench - Mailbox throughput and latency benchmark
+@discuss
+    Starts in-process mlm_server and zm_device actor, prefills it with
+    --devices devices using INSERT-BATCH and then runs one phase per
+    subject given by --subjects. In each phase --clients concurrent
+    mlm clients send --requests synchronous requests each, waiting for
+    the reply before sending the next one. Device names are spread evenly
+    over the prefilled ones, so INSERT updates existing devices and
+    LOOKUP always hits. GET-ALL takes all --devices replies as one
+    operation, so use a small --requests for it.
+
+    For every phase it prints operations, errors, ops/s and p50, p99,
+    p999 and max latency in usecs
+
+        zm_device_bench --devices 100000 --clients 8 --subjects INSERT,LOOKUP
+
+    Use tcp:// --endpoint to include the network stack, --shards to
+    benchmark sharded actor.
+@end
+*/
+
+#include "zm_device_classes.h"
+
+#define BENCH_ADDRESS   "zm-device.bench"
+#define BENCH_BATCH     1000
+#define BENCH_TIMEOUT   5000
+
+//  Arguments of one client actor, owned by main
+
+typedef struct {
+    const char *endpoint;       //  Malamute endpoint
+    const char *subject;        //  INSERT, LOOKUP or GET-ALL
+    size_t index;               //  Client number
+    size_t clients;             //  Number of clients in phase
+    size_t devices;             //  Number of prefilled devices
+    size_t requests;            //  Requests to send
+} s_client_args_t;
+
+static void
+s_device_name (char *name, size_t size, size_t index)
+{
+    snprintf (name, size, "bench.%08zu", index);
+}
+
+//  Wait for the next reply, return NULL on timeout
+
+static zmsg_t *
+s_client_recv (mlm_client_t *client, zpoller_t *poller)
+{
+    if (zpoller_wait (poller, BENCH_TIMEOUT) == NULL)
+        return NULL;
+    return mlm_client_recv (client);
+}
+
+//  Send one request and wait for whole reply, return -1 on error
+
+static int
+s_client_request (mlm_client_t *client, zpoller_t *poller, zm_proto_t *proto,
+    const char *subject, const char *name)
+{
+    int r;
+    if (streq (subject, "GET-ALL")) {
+        zm_proto_encode_ok (proto);
+        r = zm_proto_sendto (proto, client, BENCH_ADDRESS, subject);
+    }
+    else {
+        zmsg_t *request = streq (subject, "INSERT")
+            ? zm_proto_encode_device_v1 (name, zclock_mono (), 3600000, NULL)
+            : zm_proto_encode_device_v1 (name, 0, 0, NULL);
+        r = mlm_client_sendto (client, BENCH_ADDRESS, subject, NULL, 1000, &request);
+    }
+    if (r == -1)
+        return -1;
+
+    //  GET-ALL streams one reply per device, the last one has seq + 1 == cnt
+    while (true) {
+        zmsg_t *reply = s_client_recv (client, poller);
+        if (!reply)
+            return -1;
+        size_t seq = 0, cnt = 0;
+        bool last = zm_device_pop_seq (reply, &seq, &cnt) == -1 || seq + 1 >= cnt;
+        r = zm_proto_recv (proto, reply);
+        zmsg_destroy (&reply);
+        if (r == -1 || zm_proto_id (proto) == ZM_PROTO_ERROR)
+            return -1;
+        if (!streq (subject, "GET-ALL") || last)
+            return 0;
+    }
+}
+
+//  Client actor, once GO comes sends all requests and replies with number
+//  of errors and latencies of successful requests as array of int64_t
+
+static void
+s_client_actor (zsock_t *pipe, void *args)
+{
+    s_client_args_t *self = (s_client_args_t *) args;
+    char address [32];
+    snprintf (address, sizeof (address), "bench.client.%zu", self->index);
+
+    mlm_client_t *client = mlm_client_new ();
+    assert (client);
+    //  Failed client still takes part in the phase, counting all as errors
+    bool connected = mlm_client_connect (client, self->endpoint, 1000, address) == 0;
+    if (!connected)
+        zsys_error ("%s: can't connect to %s", address, self->endpoint);
+    zpoller_t *poller = zpoller_new (mlm_client_msgpipe (client), NULL);
+    assert (poller);
+    zm_proto_t *proto = zm_proto_new ();
+    int64_t *latencies = (int64_t *) zmalloc (self->requests * sizeof (int64_t));
+    assert (latencies);
+    zsock_signal (pipe, 0);
+
+    char *command = zstr_recv (pipe);
+    if (command && streq (command, "GO")) {
+        size_t done = 0;
+        uint64_t errors = 0;
+        size_t i;
+        for (i = 0; i < self->requests; i++) {
+            char name [32];
+            s_device_name (name, sizeof (name),
+                (i * self->clients + self->index) % self->devices);
+            int64_t start = zclock_usecs ();
+            if (connected
+            &&  s_client_request (client, poller, proto, self->subject, name) == 0)
+                latencies [done++] = zclock_usecs () - start;
+            else
+                errors++;
+        }
+        zmsg_t *msg = zmsg_new ();
+        zmsg_addstrf (msg, "%" PRIu64, errors);
+        zmsg_addmem (msg, latencies, done * sizeof (int64_t));
+        zmsg_send (&msg, pipe);
+    }
+    zstr_free (&command);
+
+    free (latencies);
+    zm_proto_destroy (&proto);
+    zpoller_destroy (&poller);
+    mlm_client_destroy (&client);
+}
+
+//  Insert all devices in batches, return -1 on error
+
+static int
+s_prefill (const char *endpoint, size_t devices)
+{
+    mlm_client_t *client = mlm_client_new ();
+    assert (client);
+    int rv = mlm_client_connect (client, endpoint, 1000, "bench.prefill");
+    size_t i = 0;
+    while (rv == 0 && i < devices) {
+        zmsg_t *request = zmsg_new ();
+        for (; i < devices && zmsg_size (request) < BENCH_BATCH; i++) {
+            char name [32];
+            s_device_name (name, sizeof (name), i);
+            zmsg_t *item = zm_proto_encode_device_v1 (name, zclock_mono (), 3600000, NULL);
+            zmsg_addmsg (request, &item);
+        }
+        rv = mlm_client_sendto (client, BENCH_ADDRESS, "INSERT-BATCH", NULL, 1000, &request);
+        if (rv == 0) {
+            zmsg_t *reply = mlm_client_recv (client);
+            if (!reply)
+                rv = -1;
+            zmsg_destroy (&reply);
+        }
+    }
+    mlm_client_destroy (&client);
+    return rv;
+}
+
+//  Run one phase of subject and print results, return -1 on error
+
+static int
+s_phase (const char *endpoint, const char *subject, size_t clients,
+    size_t devices, size_t requests)
+{
+    s_client_args_t *args = (s_client_args_t *) zmalloc (clients * sizeof (s_client_args_t));
+    zactor_t **actors = (zactor_t **) zmalloc (clients * sizeof (zactor_t *));
+    assert (args && actors);
+
+    int rv = 0;
+    size_t i;
+    for (i = 0; i < clients; i++) {
+        args [i].endpoint = endpoint;
+        args [i].subject = subject;
+        args [i].index = i;
+        args [i].clients = clients;
+        args [i].devices = devices;
+        args [i].requests = requests;
+        actors [i] = zactor_new (s_client_actor, &args [i]);
+        if (!actors [i]) {
+            rv = -1;
+            break;
+        }
+    }
+
+    zm_stats_t *stats = zm_stats_new ();
+    uint64_t errors = 0;
+    int64_t start = zclock_usecs ();
+    if (rv == 0) {
+        for (i = 0; i < clients; i++)
+            zstr_send (actors [i], "GO");
+        for (i = 0; i < clients; i++) {
+            zmsg_t *msg = zmsg_recv (actors [i]);
+            if (!msg) {
+                rv = -1;
+                break;
+            }
+            char *str = zmsg_popstr (msg);
+            errors += str ? strtoull (str, NULL, 10) : 0;
+            zstr_free (&str);
+            zframe_t *frame = zmsg_pop (msg);
+            if (frame) {
+                int64_t *latencies = (int64_t *) zframe_data (frame);
+                size_t k;
+                for (k = 0; k < zframe_size (frame) / sizeof (int64_t); k++)
+                    zm_stats_record (stats, subject, latencies [k]);
+            }
+            zframe_destroy (&frame);
+            zmsg_destroy (&msg);
+        }
+    }
+    double elapsed = (zclock_usecs () - start) / 1000000.0;
+
+    if (rv == 0) {
+        uint64_t ops = zm_stats_count (stats, subject);
+        printf ("%-10s %10" PRIu64 " ops %6" PRIu64 " errors %12.0f ops/s"
+                "  p50 %7" PRIu64 "  p99 %7" PRIu64 "  p999 %7" PRIu64 "  max %7" PRIu64 " usecs\n",
+            subject, ops, errors, elapsed > 0 ? ops / elapsed : 0.0,
+            zm_stats_percentile (stats, subject, 50),
+            zm_stats_percentile (stats, subject, 99),
+            zm_stats_percentile (stats, subject, 99.9),
+            zm_stats_percentile (stats, subject, 100));
+    }
+    else
+        zsys_error ("%s: phase failed", subject);
+
+    zm_stats_destroy (&stats);
+    for (i = 0; i < clients; i++)
+        zactor_destroy (&actors [i]);
+    free (actors);
+    free (args);
+    return rv;
+}
+
+int main (int argc, char *argv [])
+{
+    bool verbose = false;
+    const char *endpoint = "inproc://zm-device-bench";
+    const char *subjects = "INSERT,LOOKUP,GET-ALL";
+    size_t devices = 10000;
+    size_t clients = 4;
+    size_t requests = 10000;
+    size_t shards = 1;
+    int argn;
+    for (argn = 1; argn < argc; argn++) {
+        const char *value = argn + 1 < argc ? argv [argn + 1] : NULL;
+        if (streq (argv [argn], "--help")
+        ||  streq (argv [argn], "-h")) {
+            puts ("zm_device_bench [options] ...");
+            puts ("  --endpoint / -e       malamute endpoint, inproc:// or tcp://");
+            puts ("  --devices / -d        number of prefilled devices, default 10000");
+            puts ("  --clients / -c        number of concurrent clients, default 4");
+            puts ("  --requests / -r       requests per client, default 10000");
+            puts ("  --subjects / -s       phases to run, default INSERT,LOOKUP,GET-ALL");
+            puts ("  --shards              server/shards of zm_device actor, default 1");
+            puts ("  --verbose / -v        verbose test output");
+            puts ("  --help / -h           this information");
+            return 0;
+        }
+        else
+        if (streq (argv [argn], "--verbose")
+        ||  streq (argv [argn], "-v"))
+            verbose = true;
+        else
+        if (value && (streq (argv [argn], "--endpoint") || streq (argv [argn], "-e"))) {
+            endpoint = value;
+            argn++;
+        }
+        else
+        if (value && (streq (argv [argn], "--subjects") || streq (argv [argn], "-s"))) {
+            subjects = value;
+            argn++;
+        }
+        else
+        if (value && (streq (argv [argn], "--devices") || streq (argv [argn], "-d"))) {
+            devices = (size_t) atol (value);
+            argn++;
+        }
+        else
+        if (value && (streq (argv [argn], "--clients") || streq (argv [argn], "-c"))) {
+            clients = (size_t) atol (value);
+            argn++;
+        }
+        else
+        if (value && (streq (argv [argn], "--requests") || streq (argv [argn], "-r"))) {
+            requests = (size_t) atol (value);
+            argn++;
+        }
+        else
+        if (value && streq (argv [argn], "--shards")) {
+            shards = (size_t) atol (value);
+            argn++;
+        }
+        else {
+            printf ("Unknown option: %s\n", argv [argn]);
+            return 1;
+        }
+    }
+    if (devices == 0 || clients == 0 || shards == 0) {
+        printf ("--devices, --clients and --shards must be positive\n");
+        return 1;
+    }
+
+    zactor_t *server = zactor_new (mlm_server, "Malamute");
+    if (verbose)
+        zstr_sendx (server, "VERBOSE", NULL);
+    zstr_sendx (server, "BIND", endpoint, NULL);
+
+    zactor_t *device = zactor_new (zm_device_actor, NULL);
+    if (verbose)
+        zstr_sendx (device, "VERBOSE", NULL);
+    char *config = zsys_sprintf (
+        "server\n"
+        "    shards = %zu\n"
+        "malamute\n"
+        "    endpoint = %s\n"
+        "    address = " BENCH_ADDRESS "\n",
+        shards, endpoint);
+    zstr_sendx (device, "CONFIG", config, NULL);
+    zstr_free (&config);
+    zstr_sendx (device, "START", NULL);
+
+    int rv = 0;
+    int64_t start = zclock_usecs ();
+    if (s_prefill (endpoint, devices) == -1) {
+        zsys_error ("Fail to prefill %zu devices", devices);
+        rv = 1;
+    }
+    else
+    if (verbose)
+        zsys_info ("Prefilled %zu devices in %.3f secs",
+            devices, (zclock_usecs () - start) / 1000000.0);
+
+    char *list = strdup (subjects);
+    char *subject = strtok (list, ",");
+    while (rv == 0 && subject) {
+        if (!streq (subject, "INSERT")
+        &&  !streq (subject, "LOOKUP")
+        &&  !streq (subject, "GET-ALL")) {
+            printf ("Unknown subject: %s\n", subject);
+            rv = 1;
+        }
+        else
+        if (s_phase (endpoint, subject, clients, devices, requests) == -1)
+            rv = 1;
+        subject = strtok (NULL, ",");
+    }
+    zstr_free (&list);
+
+    zactor_destroy (&device);
+    zactor_destroy (&server);
+    return rv;
+}
@@ -30,9 +30,59 @@
 typedef struct _zm_devices_t zm_devices_t;
 #define ZM_DEVICES_T_DEFINED
 #endif
+#ifndef ZM_JOURNAL_T_DEFINED
+typedef struct _zm_journal_t zm_journal_t;
+#define ZM_JOURNAL_T_DEFINED
+#endif
+#ifndef ZM_SNAPSHOT_T_DEFINED
+typedef struct _zm_snapshot_t zm_snapshot_t;
+#define ZM_SNAPSHOT_T_DEFINED
+#endif
+#ifndef ZM_ARENA_T_DEFINED
+typedef struct _zm_arena_t zm_arena_t;
+#define ZM_ARENA_T_DEFINED
+#endif
+#ifndef ZM_STATS_T_DEFINED
+typedef struct _zm_stats_t zm_stats_t;
+#define ZM_STATS_T_DEFINED
+#endif
+#ifndef ZM_COALESCE_T_DEFINED
+typedef struct _zm_coalesce_t zm_coalesce_t;
+#define ZM_COALESCE_T_DEFINED
+#endif
+#ifndef ZM_TRACE_T_DEFINED
+typedef struct _zm_trace_t zm_trace_t;
+#define ZM_TRACE_T_DEFINED
+#endif
+#ifndef ZM_QUEUE_T_DEFINED
+typedef struct _zm_queue_t zm_queue_t;
+#define ZM_QUEUE_T_DEFINED
+#endif
+#ifndef ZM_REPLICA_T_DEFINED
+typedef struct _zm_replica_t zm_replica_t;
+#define ZM_REPLICA_T_DEFINED
+#endif
+#ifndef ZM_CACHE_T_DEFINED
+typedef struct _zm_cache_t zm_cache_t;
+#define ZM_CACHE_T_DEFINED
+#endif
+#ifndef ZM_SHARDS_T_DEFINED
+typedef struct _zm_shards_t zm_shards_t;
+#define ZM_SHARDS_T_DEFINED
+#endif
 
 //  Internal API
 #include "zm_devices.h"
+#include "zm_journal.h"
+#include "zm_snapshot.h"
+#include "zm_arena.h"
+#include "zm_stats.h"
+#include "zm_coalesce.h"
+#include "zm_trace.h"
+#include "zm_queue.h"
+#include "zm_replica.h"
+#include "zm_cache.h"
+#include "zm_shards.h"
 
 //  *** To avoid double-definitions, only define if building without draft ***
 #ifndef ZM_DEVICE_BUILD_DRAFT_API
@@ -42,6 +92,56 @@ typedef struct _zm_devices_t zm_devices_t;
 ZM_DEVICE_PRIVATE void
     zm_devices_test (bool verbose);
 
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+ZM_DEVICE_PRIVATE void
+    zm_journal_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+ZM_DEVICE_PRIVATE void
+    zm_snapshot_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+ZM_DEVICE_PRIVATE void
+    zm_arena_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+ZM_DEVICE_PRIVATE void
+    zm_stats_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+ZM_DEVICE_PRIVATE void
+    zm_coalesce_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+ZM_DEVICE_PRIVATE void
+    zm_trace_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+ZM_DEVICE_PRIVATE void
+    zm_queue_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+ZM_DEVICE_PRIVATE void
+    zm_replica_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+ZM_DEVICE_PRIVATE void
+    zm_cache_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+ZM_DEVICE_PRIVATE void
+    zm_shards_test (bool verbose);
+
 //  Self test for private classes
 ZM_DEVICE_PRIVATE void
     zm_device_private_selftest (bool verbose);
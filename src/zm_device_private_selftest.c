@@ -30,6 +30,16 @@ zm_device_private_selftest (bool verbose)
 {
 // Tests for stable private classes:
     zm_devices_test (verbose);
+    zm_journal_test (verbose);
+    zm_snapshot_test (verbose);
+    zm_arena_test (verbose);
+    zm_stats_test (verbose);
+    zm_coalesce_test (verbose);
+    zm_trace_test (verbose);
+    zm_queue_test (verbose);
+    zm_replica_test (verbose);
+    zm_cache_test (verbose);
+    zm_shards_test (verbose);
 }
 /*
 ################################################################################
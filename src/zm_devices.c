@@ -14,17 +14,1949 @@
 @header
     zm_devices - Devices API
 @discuss
+    Devices are kept in memory and stored as snapshot in file, either ZPL
+    or binary (see zm_snapshot). Format is detected on load, store uses
+    ZM_DEVICES_BINARY for files ending with .bin and ZM_DEVICES_ZPL otherwise,
+    unless changed by zm_devices_set_format.
+
+    Each device is held as compact record of its time, ttl and ext pairs.
+    Ext keys are interned in a dictionary shared by all devices, so key
+    like type or _seq is kept once, not once per device, and record refers
+    to it by a number, usually one byte. Values are interned too, as long
+    as they are short and their key has not brought in too many distinct
+    ones yet, so common values like ups or active are shared while unique
+    ones like serial numbers stay inline in the record. zm_proto_t is made
+    only at the API boundary: zm_devices_lookup and zm_devices_next decode
+    the record into a single device, the _msg functions do the same and
+    encode it by zm_proto_send into a message ready to send, and journal
+    and snapshots get the same encoded form as before. INSERT of device identical to the stored one is a no-op,
+    so repeated updates cost neither copy nor free of the device.
+
+    Along with the bytes each device has a content hash of its name, ttl
+    and ext, leaving out time and ext keys starting with '_', which carry
+    transient metadata like _seq and _cnt. zm_devices_insert tells the
+    caller whether the content changed, so device re-sent only with a new
+    time can be stored without being announced again.
+
+    Records and their compact bytes live in zm_arena, so a million devices
+    are a few thousand allocations rather than millions. Bytes of replaced
+    and deleted devices are reclaimed by compacting the arena once garbage
+    outgrows live data.
+
+    Device with non-zero ttl expires ttl msecs after it was last inserted
+    or touched, measured by local monotonic clock, so clocks of senders do
+    not matter. Expiry times are kept in a min-heap, zm_devices_expire
+    removes one expired device at a time in O(log n), without sweeping the
+    whole table. Expired devices which were not collected yet are hidden
+    from zm_devices_lookup. Expiry starts over when devices are loaded.
+
+    Ext keys can be indexed by zm_devices_index, so zm_devices_query with
+    equality on such key visits only devices having that value. Other
+    conditions, name prefix and glob, and equality on keys which are not
+    indexed, are checked on each visited device.
+
+    Records are also kept in array sorted by name. It makes hierarchical
+    names like dc1.rack12.pdu3 easy to list by prefix (zm_devices_prefix)
+    in O(log n) plus the size of the answer, and zm_devices_first/next and
+    zm_devices_names go in name order, so paging through them is stable.
+
+    Every insert which changes content of a device and every removal bumps
+    version of devices, starting from 0 once they are loaded. Names of the
+    last changes are kept in a ring, so zm_devices_changes can tell what
+    changed since version N without visiting other devices, as long as N
+    is not older than the log. Versions are meaningful only together with
+    zm_devices_epoch, creation time of devices.
+
+    Changes
+    made after last zm_devices_store can be written to write-ahead journal
+    <file>.journal (see zm_devices_journal_open), which is replayed on top
+    of the snapshot by zm_devices_new. Store folds the journal back into the
+    snapshot and truncates it.
+
+    zm_devices_store_start does the same without blocking the caller. It
+    hands background actor a frozen view: pointers to compact devices in
+    the arena, which is not compacted until zm_devices_store_finish, so
+    bytes stay where they are even when devices change, offsets of cold
+    devices with a duplicate of the cold file descriptor, and records of
+    devices not hydrated yet in the lazily loaded snapshot, which is kept
+    mapped as long. Nothing is hydrated, copied or read back from the cold
+    file by the caller. Background actor reads, encodes and writes the
+    snapshot, through a temp
+    file and rename. The journal is rotated to <file>.journal.old at the
+    same moment, so changes made meanwhile go to a fresh one. Both are
+    replayed on load until the old one is dropped by successful
+    zm_devices_store_finish.
+
+    Binary snapshot is split to segments (see zm_snapshot), zm_devices_new
+    decodes them on a pool of decoder actors, one per core up to 16, into
+    compact records. The calling thread only interns their strings and
+    merges them into the table, in file order, while decoders work on the
+    next segments.
+
+    zm_devices_store writes nothing when the file already holds all the
+    devices, as right after load with no change since, so stopping is fast
+    and lazily loaded devices are not hydrated just to be written back.
+
+    zm_devices_new_lazy makes large binary snapshot available right away.
+    It only indexes names of devices in the mapped snapshot, with no copy
+    or decoding. Device is hydrated into a record when it's first looked
+    up, touched, changed or deleted, and zm_devices_hydrate moves the rest
+    over in slices. Operations over all devices (iteration, prefix, query,
+    index, store) hydrate everything first. Hydration is not a change, it
+    bumps neither version nor dirty count and is not journaled.
+
+    zm_devices_set_budget bounds memory taken by devices. Compact bytes of
+    recently used (hot) devices stay in the arena. When hot bytes outgrow
+    the budget, least recently used devices go cold: their bytes are
+    written to cold file and dropped from memory, only the record with
+    name, expiry and file offset is kept. Lookup, touch, change or iteration of a cold
+    device reads it back transparently. Unchanged device going cold again
+    reuses its copy in the file, stale copies are reclaimed once they
+    outgrow live ones. Cold file is scratch space, unlinked right after it
+    is opened, durability still comes from snapshot and journal.
+    Device returned by zm_devices_lookup or zm_devices_next stays valid
+    until the next call, the most recently used device is never evicted.
 @end
 */
 
-#include "zm_device_classes.h"
+#include "zm_device_classes.h"
+#include <fnmatch.h>
+#include <fcntl.h>
+
+//  Stored device, compact bytes are the only copy. Record and bytes
+//  belong to the arena. Bytes, in memory and cold file only, are
+//
+//      time:8 ttl:4 count:varint { key value } * count
+//
+//  where key and value are each varint tag, id << 1 | 1 for string in
+//  dictionary, or size << 1 followed by size bytes and terminating zero.
+
+typedef struct _s_record_t s_record_t;
+struct _s_record_t {
+    byte *data;                 //  Compact device, NULL if it's cold
+    size_t size;                //  Size of compact device
+    uint64_t hash;              //  Content hash, see s_device_hash
+    char *name;                 //  Device name, also key of the record
+    size_t order;               //  Position in order
+    int64_t expires;            //  Monotonic expiry time, 0 is never
+    size_t heap;                //  Position in expiry heap + 1, 0 if not there
+    uint64_t cold;              //  Offset in cold file + 1, 0 if not there
+    s_record_t *lru_prev;       //  More recently used hot record
+    s_record_t *lru_next;       //  Less recently used hot record
+};
+
+//  Strings shared by records, ext keys and their common values. Strings
+//  live as long as the dictionary, so copy of the array made by
+//  s_dict_copy can be read by background store meanwhile.
+
+typedef struct {
+    zhashx_t *ids;              //  String to its id + 1, NULL in a copy
+    char **strings;             //  Strings by id
+    size_t *values;             //  Values interned by each key, by key id
+    size_t size;                //  Strings in dictionary
+    size_t max;                 //  Allocated slots
+} s_dict_t;
+
+//  Structure of our class
+
+struct _zm_devices_t {
+    zhashx_t *devices;
+    char *file;
+    zm_journal_t *journal;      //  Write-ahead journal, NULL if disabled
+    int format;                 //  Format used by zm_devices_store
+    zm_arena_t *arena;          //  Records and encoded devices
+    s_record_t **heap;          //  Min-heap of records by expiry time
+    size_t heap_size;           //  Records in heap
+    size_t heap_max;            //  Allocated heap slots
+    zhashx_t *indexes;          //  Ext key to s_index_t
+    s_record_t **order;         //  Records by name, see s_order_settle
+    size_t order_size;          //  Used order slots
+    size_t order_max;           //  Allocated order slots
+    size_t order_sorted;        //  Leading slots in name order
+    size_t order_holes;         //  Slots of removed records, NULL
+    size_t order_cursor;        //  Position of zm_devices_next
+    int64_t epoch;              //  Creation time, versions restart with it
+    uint64_t version;           //  Version of the last change
+    char **changes;             //  Ring of changed names by version
+    size_t changes_size;        //  Changes in ring
+    size_t changes_max;         //  Ring slots
+    size_t journal_batch;       //  Sync batch of the journal
+    zactor_t *store;            //  Background store, NULL if not running
+    size_t dirty;               //  Changes since snapshot was taken
+    size_t store_dirty;         //  Changes the running store will save
+    size_t content_dirty;       //  Dirty changes of more than time
+    size_t store_content_dirty; //  Those the running store will save
+    bool stored;                //  File holds these devices, apart from dirty
+    zm_snapshot_t *lazy;        //  Snapshot being hydrated, see zm_devices_new_lazy
+    zm_snapshot_t *store_lazy;  //  Hydrated one, kept for background store
+    zhashx_t *pending;          //  Name in snapshot to offset of its record
+    bool lazy_started;          //  Hydration walk has begun
+    bool hydrating;             //  Record comes from snapshot, not a change
+    s_record_t *lru_head;       //  Most recently used hot record
+    s_record_t *lru_tail;       //  Least recently used hot record
+    size_t hot_bytes;           //  Encoded bytes of hot records
+    size_t budget;              //  Limit of hot bytes, 0 is unlimited
+    char *cold_file;            //  Cold file, already unlinked
+    int cold_fd;                //  Its descriptor, -1 if not open
+    uint64_t cold_size;         //  Bytes written to cold file
+    uint64_t cold_garbage;      //  Bytes of stale copies in it
+    size_t cold_count;          //  Records with bytes only in cold file
+    s_dict_t *dict;             //  Interned ext keys and common values
+    byte *buffer;               //  Record being encoded
+    size_t buffer_max;          //  Its allocated size
+    zm_proto_t *device;         //  Last decoded device, see s_record_view
+    s_record_t *device_record;  //  Record it holds, NULL if none
+    size_t decoders;            //  Snapshot decoders, 0 is one per core
+};
+
+#define ZM_DEVICES_SLAB     1024        //  Records per arena slab
+#define ZM_DEVICES_CHUNK    (1 << 20)   //  Size of arena chunk
+#define ZM_DEVICES_CHANGES  100000      //  Default changes kept in the log
+#define ZM_DEVICES_DECODERS 16          //  Max snapshot decoder threads
+#define ZM_DEVICES_INTERNED 65536       //  Max strings in dictionary
+#define ZM_DEVICES_KEY_VALUES 256       //  Max values interned per ext key
+#define ZM_DEVICES_VALUE_SIZE 64        //  Longer values are never interned
+
+//  Index of one ext key
+
+typedef struct {
+    zhashx_t *values;           //  Ext value to set of names, name -> record
+    zhashx_t *names;            //  Device name to its indexed value
+} s_index_t;
+
+static void
+s_index_destroy (s_index_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        s_index_t *self = *self_p;
+        zhashx_destroy (&self->values);
+        zhashx_destroy (&self->names);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+static s_index_t *
+s_index_new (void)
+{
+    s_index_t *self = (s_index_t *) zmalloc (sizeof (s_index_t));
+    assert (self);
+    self->values = zhashx_new ();
+    assert (self->values);
+    zhashx_set_destructor (self->values, (zhashx_destructor_fn *) zhashx_destroy);
+    self->names = zhashx_new ();
+    assert (self->names);
+    zhashx_set_destructor (self->names, (zhashx_destructor_fn *) zstr_free);
+    return self;
+}
+
+//  Move device to value, NULL value removes it from the index
+
+static void
+s_index_set (s_index_t *self, const char *name, const char *value, void *record)
+{
+    const char *old = (const char *) zhashx_lookup (self->names, name);
+    if (old && value && streq (old, value))
+        return;
+    if (old) {
+        zhashx_t *set = (zhashx_t *) zhashx_lookup (self->values, old);
+        zhashx_delete (set, name);
+        if (zhashx_size (set) == 0)
+            zhashx_delete (self->values, old);
+        zhashx_delete (self->names, name);
+    }
+    if (value) {
+        zhashx_t *set = (zhashx_t *) zhashx_lookup (self->values, value);
+        if (!set) {
+            set = zhashx_new ();
+            assert (set);
+            zhashx_insert (self->values, value, set);
+        }
+        zhashx_insert (set, name, record);
+        zhashx_insert (self->names, name, strdup (value));
+    }
+}
+
+//  Encode device to single frame
+
+static zframe_t *
+s_device_encode (zm_proto_t *device)
+{
+    zmsg_t *msg = zmsg_new ();
+    zm_proto_send (device, msg);
+    zframe_t *frame = zmsg_encode (msg);
+    zmsg_destroy (&msg);
+    return frame;
+}
+
+//  Decode device from a frame, made by s_device_encode
+
+static zm_proto_t *
+s_device_decode (zframe_t *frame)
+{
+    zmsg_t *msg = zmsg_decode (frame);
+    if (!msg)
+        return NULL;
+    zm_proto_t *device = zm_proto_new ();
+    int r = zm_proto_recv (device, msg);
+    zmsg_destroy (&msg);
+    if (r != 0)
+        zm_proto_destroy (&device);
+    return device;
+}
+
+//  Return message of device, ready to send
+
+static zmsg_t *
+s_device_msg (zm_proto_t *device)
+{
+    zmsg_t *msg = zmsg_new ();
+    zm_proto_send (device, msg);
+    return msg;
+}
+
+static void
+s_dict_destroy (s_dict_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        s_dict_t *self = *self_p;
+        size_t id;
+        //  Copy only borrows the strings
+        for (id = 0; self->ids && id < self->size; id++)
+            free (self->strings [id]);
+        zhashx_destroy (&self->ids);
+        free (self->strings);
+        free (self->values);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+static s_dict_t *
+s_dict_new (void)
+{
+    s_dict_t *self = (s_dict_t *) zmalloc (sizeof (s_dict_t));
+    assert (self);
+    //  Keys are the strings themselves, owned by the array
+    self->ids = zhashx_new ();
+    assert (self->ids);
+    zhashx_set_key_duplicator (self->ids, NULL);
+    zhashx_set_key_destructor (self->ids, NULL);
+    return self;
+}
+
+//  Return copy of dictionary for reading elsewhere, strings are shared
+
+static s_dict_t *
+s_dict_copy (s_dict_t *self)
+{
+    s_dict_t *copy = (s_dict_t *) zmalloc (sizeof (s_dict_t));
+    assert (copy);
+    copy->strings = (char **) malloc ((self->size ? self->size : 1) * sizeof (char *));
+    assert (copy->strings);
+    if (self->size)
+        memcpy (copy->strings, self->strings, self->size * sizeof (char *));
+    copy->size = self->size;
+    copy->max = self->size;
+    return copy;
+}
+
+//  Return id + 1 of string, 0 if it's not in dictionary
+
+static size_t
+s_dict_find (s_dict_t *self, const char *string)
+{
+    return (size_t) (uintptr_t) zhashx_lookup (self->ids, string);
+}
+
+//  Return id + 1 of string, adding it if needed, 0 if dictionary is full
+
+static size_t
+s_dict_intern (s_dict_t *self, const char *string)
+{
+    size_t id = s_dict_find (self, string);
+    if (id || self->size == ZM_DEVICES_INTERNED)
+        return id;
+    if (self->size == self->max) {
+        self->max = self->max ? self->max * 2 : 64;
+        self->strings = (char **) realloc (self->strings, self->max * sizeof (char *));
+        self->values = (size_t *) realloc (self->values, self->max * sizeof (size_t));
+        assert (self->strings && self->values);
+    }
+    self->strings [self->size] = strdup (string);
+    self->values [self->size] = 0;
+    zhashx_insert (self->ids, self->strings [self->size], (void *) (uintptr_t) (self->size + 1));
+    return ++self->size;
+}
+
+//  LEB128 varint, 10 bytes at most
+
+static byte *
+s_varint_put (byte *p, uint64_t value)
+{
+    while (value >= 0x80) {
+        *p++ = (byte) (value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (byte) value;
+    return p;
+}
+
+static const byte *
+s_varint_get (const byte *p, const byte *end, uint64_t *value_p)
+{
+    uint64_t value = 0;
+    int shift;
+    for (shift = 0; p < end && shift < 64; shift += 7) {
+        value |= (uint64_t) (*p & 0x7f) << shift;
+        if (!(*p++ & 0x80)) {
+            *value_p = value;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+//  Put string of record, by id + 1 if it's interned, inline if id is 0
+
+static byte *
+s_record_put_string (byte *p, size_t id, const char *string)
+{
+    if (id)
+        return s_varint_put (p, (uint64_t) (id - 1) << 1 | 1);
+    size_t size = strlen (string);
+    p = s_varint_put (p, (uint64_t) size << 1);
+    memcpy (p, string, size + 1);
+    return p + size + 1;
+}
+
+//  Get string of record, pointing to dictionary or into the record.
+//  Returns NULL if record is malformed.
+
+static const byte *
+s_record_get_string (s_dict_t *dict, const byte *p, const byte *end, const char **string_p)
+{
+    uint64_t tag;
+    p = s_varint_get (p, end, &tag);
+    if (!p)
+        return NULL;
+    if (tag & 1) {
+        if ((tag >> 1) >= dict->size)
+            return NULL;
+        *string_p = dict->strings [tag >> 1];
+        return p;
+    }
+    uint64_t size = tag >> 1;
+    if ((uint64_t) (end - p) <= size || p [size])
+        return NULL;
+    *string_p = (const char *) p;
+    return p + size + 1;
+}
+
+//  Grow buffer to hold at least size bytes
+
+static void
+s_buffer_reserve (byte **buffer_p, size_t *max_p, size_t size)
+{
+    if (size > *max_p) {
+        *max_p = size * 2;
+        *buffer_p = (byte *) realloc (*buffer_p, *max_p);
+        assert (*buffer_p);
+    }
+}
+
+//  Put ext pair of record. Key is interned, value when it's short and its
+//  key interned few distinct ones so far. Without dictionary both are put
+//  inline.
+
+static byte *
+s_record_put_pair (s_dict_t *dict, byte *p, const char *key, const char *value)
+{
+    size_t key_id = dict ? s_dict_intern (dict, key) : 0;
+    size_t id = dict ? s_dict_find (dict, value) : 0;
+    if (!id && key_id
+    &&  dict->values [key_id - 1] < ZM_DEVICES_KEY_VALUES
+    &&  strlen (value) <= ZM_DEVICES_VALUE_SIZE) {
+        id = s_dict_intern (dict, value);
+        if (id)
+            dict->values [key_id - 1]++;
+    }
+    p = s_record_put_string (p, key_id, key);
+    return s_record_put_string (p, id, value);
+}
+
+//  Encode device into buffer, return size of the record. Strings are
+//  interned into dictionary, NULL one keeps them all inline, as decoder
+//  threads do.
+
+static size_t
+s_record_encode (s_dict_t *dict, zm_proto_t *device, byte **buffer_p, size_t *max_p)
+{
+    zhash_t *ext = zm_proto_ext (device);
+    size_t max = 8 + 4 + 10;
+    const char *value = ext ? (const char *) zhash_first (ext) : NULL;
+    while (value) {
+        max += 10 + strlen (zhash_cursor (ext)) + 1 + 10 + strlen (value) + 1;
+        value = (const char *) zhash_next (ext);
+    }
+    s_buffer_reserve (buffer_p, max_p, max);
+
+    byte *buffer = *buffer_p;
+    uint64_t time = zm_proto_time (device);
+    uint32_t ttl = zm_proto_ttl (device);
+    memcpy (buffer, &time, 8);
+    memcpy (buffer + 8, &ttl, 4);
+    byte *p = s_varint_put (buffer + 12, ext ? zhash_size (ext) : 0);
+    value = ext ? (const char *) zhash_first (ext) : NULL;
+    while (value) {
+        p = s_record_put_pair (dict, p, zhash_cursor (ext), value);
+        value = (const char *) zhash_next (ext);
+    }
+    return (size_t) (p - buffer);
+}
+
+//  Decode record into device, return -1 if it's malformed
+
+static int
+s_record_decode (s_dict_t *dict, const char *name, const byte *data, size_t size, zm_proto_t *device)
+{
+    if (size < 8 + 4)
+        return -1;
+    uint64_t time;
+    uint32_t ttl;
+    memcpy (&time, data, 8);
+    memcpy (&ttl, data + 8, 4);
+    const byte *end = data + size;
+    uint64_t count;
+    const byte *p = s_varint_get (data + 12, end, &count);
+
+    //  Strings are not copied here, device makes its own copy of ext
+    zhash_t *ext = zhash_new ();
+    assert (ext);
+    while (p && count--) {
+        const char *key, *value;
+        p = s_record_get_string (dict, p, end, &key);
+        if (p)
+            p = s_record_get_string (dict, p, end, &value);
+        if (p)
+            zhash_insert (ext, key, (void *) value);
+    }
+    if (p)
+        zm_proto_encode_device (device, name, time, ttl, ext);
+    zhash_destroy (&ext);
+    return p ? 0 : -1;
+}
+
+//  Return value of ext key in record, NULL if it has none
+
+static const char *
+s_record_value (s_dict_t *dict, const byte *data, size_t size, const char *key)
+{
+    if (size < 8 + 4)
+        return NULL;
+    const byte *end = data + size;
+    uint64_t count;
+    const byte *p = s_varint_get (data + 12, end, &count);
+    while (p && count--) {
+        const char *has, *value;
+        p = s_record_get_string (dict, p, end, &has);
+        if (p)
+            p = s_record_get_string (dict, p, end, &value);
+        if (p && streq (has, key))
+            return value;
+    }
+    return NULL;
+}
+
+//  Copy record with strings inline, as decoder threads make it, into
+//  self->buffer, interning the strings as s_record_encode does. Returns
+//  its size, 0 if record is malformed.
+
+static size_t
+s_record_intern (zm_devices_t *self, const byte *data, size_t size)
+{
+    if (size < 8 + 4)
+        return 0;
+    const byte *end = data + size;
+    uint64_t count;
+    const byte *p = s_varint_get (data + 12, end, &count);
+    //  Every pair takes 4 bytes at least, interned string 2 more at most
+    if (!p || count > size)
+        return 0;
+    s_buffer_reserve (&self->buffer, &self->buffer_max, size + 10 + count * 4);
+    memcpy (self->buffer, data, 12);
+    byte *out = s_varint_put (self->buffer + 12, count);
+    while (count--) {
+        const char *key, *value;
+        p = s_record_get_string (self->dict, p, end, &key);
+        if (p)
+            p = s_record_get_string (self->dict, p, end, &value);
+        if (!p)
+            return 0;
+        out = s_record_put_pair (self->dict, out, key, value);
+    }
+    return (size_t) (out - self->buffer);
+}
+
+//  Return record as frame made by s_device_encode, decoding it through
+//  given device. Returns NULL if record is malformed.
+
+static zframe_t *
+s_record_wire (s_dict_t *dict, const char *name, const byte *data, size_t size, zm_proto_t *device)
+{
+    if (s_record_decode (dict, name, data, size, device) == -1)
+        return NULL;
+    return s_device_encode (device);
+}
+
+//  FNV-1a over string including its terminating zero
+
+#define ZM_DEVICES_FNV_OFFSET   0xcbf29ce484222325ULL
+#define ZM_DEVICES_FNV_PRIME    0x100000001b3ULL
+
+static uint64_t
+s_hash_string (uint64_t hash, const char *string)
+{
+    const byte *p = (const byte *) (string ? string : "");
+    do {
+        hash ^= *p;
+        hash *= ZM_DEVICES_FNV_PRIME;
+    } while (*p++);
+    return hash;
+}
+
+//  Hash of device content, time and ext keys starting with '_' are not
+//  part of it. Ext pairs are summed, so their order does not matter.
+
+static uint64_t
+s_device_hash (zm_proto_t *device)
+{
+    uint64_t hash = s_hash_string (ZM_DEVICES_FNV_OFFSET, zm_proto_device (device));
+    hash ^= zm_proto_ttl (device);
+    hash *= ZM_DEVICES_FNV_PRIME;
+
+    uint64_t pairs = 0;
+    zhash_t *ext = zm_proto_ext (device);
+    if (ext) {
+        const char *value = (const char *) zhash_first (ext);
+        while (value) {
+            const char *key = zhash_cursor (ext);
+            if (*key != '_')
+                pairs += s_hash_string (s_hash_string (ZM_DEVICES_FNV_OFFSET, key), value);
+            value = (const char *) zhash_next (ext);
+        }
+    }
+    hash ^= pairs;
+    hash *= ZM_DEVICES_FNV_PRIME;
+    return hash;
+}
+
+//  Hot records are kept in LRU list, most recently used first
+
+static void
+s_lru_unlink (zm_devices_t *self, s_record_t *record)
+{
+    if (record->lru_prev)
+        record->lru_prev->lru_next = record->lru_next;
+    else
+        self->lru_head = record->lru_next;
+    if (record->lru_next)
+        record->lru_next->lru_prev = record->lru_prev;
+    else
+        self->lru_tail = record->lru_prev;
+    record->lru_prev = NULL;
+    record->lru_next = NULL;
+}
+
+static void
+s_lru_push (zm_devices_t *self, s_record_t *record)
+{
+    record->lru_prev = NULL;
+    record->lru_next = self->lru_head;
+    if (self->lru_head)
+        self->lru_head->lru_prev = record;
+    else
+        self->lru_tail = record;
+    self->lru_head = record;
+}
+
+//  Forget copy of record in cold file, it's stale
+
+static void
+s_record_uncold (zm_devices_t *self, s_record_t *record)
+{
+    if (record->cold) {
+        self->cold_garbage += record->size;
+        record->cold = 0;
+    }
+}
+
+//  Move bytes of record to cold file, reusing copy already there.
+//  Returns -1 if they can't be written, record stays hot then.
+
+static int
+s_record_cool (zm_devices_t *self, s_record_t *record)
+{
+    if (!record->cold) {
+        ssize_t written = pwrite (self->cold_fd, record->data, record->size,
+            (off_t) self->cold_size);
+        if (written != (ssize_t) record->size) {
+            zsys_error ("%s: fail to write device %s: %s",
+                self->cold_file, record->name, strerror (errno));
+            return -1;
+        }
+        record->cold = self->cold_size + 1;
+        self->cold_size += record->size;
+    }
+    s_lru_unlink (self, record);
+    self->hot_bytes -= record->size;
+    zm_arena_bytes_free (self->arena, record->data, record->size);
+    record->data = NULL;
+    self->cold_count++;
+    return 0;
+}
+
+static void
+s_devices_compact (zm_devices_t *self);
+
+static void
+s_cold_compact (zm_devices_t *self);
+
+//  Move least recently used records to cold file until hot ones fit the
+//  budget. The most recently used one always stays.
+
+static void
+s_devices_evict (zm_devices_t *self)
+{
+    if (!self->budget || self->cold_fd == -1)
+        return;
+    while (self->hot_bytes > self->budget
+    &&     self->lru_tail != self->lru_head)
+        if (s_record_cool (self, self->lru_tail) == -1)
+            break;
+    s_devices_compact (self);
+    s_cold_compact (self);
+}
+
+//  Return encoded record, reading it back from cold file if needed, and
+//  mark it most recently used. Returns NULL if cold file can't be read.
+
+static byte *
+s_record_data (zm_devices_t *self, s_record_t *record)
+{
+    if (record->data) {
+        if (self->lru_head != record) {
+            s_lru_unlink (self, record);
+            s_lru_push (self, record);
+        }
+        return record->data;
+    }
+    byte *data = zm_arena_bytes_new (self->arena, record->size);
+    ssize_t got = pread (self->cold_fd, data, record->size, (off_t) (record->cold - 1));
+    if (got != (ssize_t) record->size) {
+        zsys_error ("%s: fail to read device %s: %s",
+            self->cold_file, record->name, strerror (errno));
+        zm_arena_bytes_free (self->arena, data, record->size);
+        return NULL;
+    }
+    record->data = data;
+    self->cold_count--;
+    self->hot_bytes += record->size;
+    s_lru_push (self, record);
+    s_devices_evict (self);
+    return record->data;
+}
+
+//  Return copy of encoded record, read aside if it's cold, so visiting
+//  all devices doesn't churn the hot ones. Returns NULL on read error.
+
+static zframe_t *
+s_record_frame (zm_devices_t *self, s_record_t *record)
+{
+    if (record->data)
+        return zframe_new (record->data, record->size);
+    zframe_t *frame = zframe_new (NULL, record->size);
+    ssize_t got = pread (self->cold_fd, zframe_data (frame), record->size,
+        (off_t) (record->cold - 1));
+    if (got != (ssize_t) record->size) {
+        zsys_error ("%s: fail to read device %s: %s",
+            self->cold_file, record->name, strerror (errno));
+        zframe_destroy (&frame);
+    }
+    return frame;
+}
+
+//  Decode record into device, reading it aside if it's cold. Returns -1
+//  if it can't be read or is malformed.
+
+static int
+s_record_copy (zm_devices_t *self, s_record_t *record, zm_proto_t *device)
+{
+    if (record->data)
+        return s_record_decode (self->dict, record->name, record->data, record->size, device);
+    zframe_t *frame = s_record_frame (self, record);
+    int rv = frame
+        ? s_record_decode (self->dict, record->name, zframe_data (frame), zframe_size (frame), device)
+        : -1;
+    zframe_destroy (&frame);
+    return rv;
+}
+
+//  Return record decoded into self->device, which holds one device at a
+//  time. It's decoded again only when another record is asked for or the
+//  record changed.
+
+static zm_proto_t *
+s_record_view (zm_devices_t *self, s_record_t *record, const byte *data)
+{
+    if (self->device_record != record) {
+        self->device_record = NULL;
+        if (s_record_decode (self->dict, record->name, data, record->size, self->device) == -1)
+            return NULL;
+        self->device_record = record;
+    }
+    return self->device;
+}
+
+//  Return record decoded into self->device, see s_record_view
+
+static zm_proto_t *
+s_record_device (zm_devices_t *self, s_record_t *record)
+{
+    if (!record)
+        return NULL;
+    byte *data = s_record_data (self, record);
+    return data ? s_record_view (self, record, data) : NULL;
+}
+
+//  Expiry heap, records know their position so they can be moved
+//  or removed without searching
+
+static void
+s_heap_place (zm_devices_t *self, size_t index, s_record_t *record)
+{
+    self->heap [index] = record;
+    record->heap = index + 1;
+}
+
+static void
+s_heap_up (zm_devices_t *self, size_t index)
+{
+    s_record_t *record = self->heap [index];
+    while (index > 0) {
+        size_t parent = (index - 1) / 2;
+        if (self->heap [parent]->expires <= record->expires)
+            break;
+        s_heap_place (self, index, self->heap [parent]);
+        index = parent;
+    }
+    s_heap_place (self, index, record);
+}
+
+static void
+s_heap_down (zm_devices_t *self, size_t index)
+{
+    s_record_t *record = self->heap [index];
+    while (true) {
+        size_t child = 2 * index + 1;
+        if (child >= self->heap_size)
+            break;
+        if (child + 1 < self->heap_size
+        &&  self->heap [child + 1]->expires < self->heap [child]->expires)
+            child++;
+        if (record->expires <= self->heap [child]->expires)
+            break;
+        s_heap_place (self, index, self->heap [child]);
+        index = child;
+    }
+    s_heap_place (self, index, record);
+}
+
+static void
+s_heap_remove (zm_devices_t *self, s_record_t *record)
+{
+    if (!record->heap)
+        return;
+    size_t index = record->heap - 1;
+    record->heap = 0;
+    s_record_t *last = self->heap [--self->heap_size];
+    if (last == record)
+        return;
+    s_heap_place (self, index, last);
+    s_heap_up (self, index);
+    s_heap_down (self, last->heap - 1);
+}
+
+//  Set expiry of record, ttl 0 means never
+
+static void
+s_heap_expire (zm_devices_t *self, s_record_t *record, uint32_t ttl)
+{
+    if (!ttl) {
+        s_heap_remove (self, record);
+        record->expires = 0;
+        return;
+    }
+    record->expires = zclock_mono () + ttl;
+    if (record->heap) {
+        //  Expiry only moves later, except when clock is coarse
+        s_heap_up (self, record->heap - 1);
+        s_heap_down (self, record->heap - 1);
+        return;
+    }
+    if (self->heap_size == self->heap_max) {
+        self->heap_max = self->heap_max ? self->heap_max * 2 : 1024;
+        self->heap = (s_record_t **) realloc (self->heap, self->heap_max * sizeof (s_record_t *));
+        assert (self->heap);
+    }
+    self->heap [self->heap_size] = record;
+    s_heap_up (self, self->heap_size++);
+}
+
+//  Copy live bytes into fresh chunks once garbage outgrows them
+
+static void
+s_devices_compact (zm_devices_t *self)
+{
+    //  Background store reads bytes of records where they are
+    if (self->store)
+        return;
+    size_t garbage = zm_arena_garbage (self->arena);
+    size_t bytes = zm_arena_bytes (self->arena);
+    if (garbage < ZM_DEVICES_CHUNK || garbage < bytes)
+        return;
+
+    zm_arena_compact_begin (self->arena);
+    s_record_t *record = (s_record_t *) zhashx_first (self->devices);
+    while (record) {
+        if (record->data) {
+            byte *data = zm_arena_bytes_new (self->arena, record->size);
+            memcpy (data, record->data, record->size);
+            record->data = data;
+        }
+        size_t name_size = strlen (record->name) + 1;
+        char *name = (char *) zm_arena_bytes_new (self->arena, name_size);
+        memcpy (name, record->name, name_size);
+        record->name = name;
+        record = (s_record_t *) zhashx_next (self->devices);
+    }
+    zm_arena_compact_end (self->arena);
+}
+
+//  Open new cold file, unlinked so nothing is left behind, return -1
+//  if it can't be created
+
+static int
+s_cold_open (const char *file)
+{
+    int fd = open (file, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1)
+        zsys_error ("Fail to create cold file %s: %s", file, strerror (errno));
+    else
+        unlink (file);
+    return fd;
+}
+
+//  Copy cold records to a fresh cold file once stale copies outgrow them.
+//  Hot records lose their copy, they are written again when they cool.
+
+static void
+s_cold_compact (zm_devices_t *self)
+{
+    if (self->cold_fd == -1
+    ||  self->cold_garbage < ZM_DEVICES_CHUNK
+    ||  self->cold_garbage < self->cold_size - self->cold_garbage)
+        return;
+
+    int fd = s_cold_open (self->cold_file);
+    if (fd == -1)
+        return;
+    uint64_t size = 0;
+    size_t index;
+    for (index = 0; index < self->order_size; index++) {
+        s_record_t *record = self->order [index];
+        if (!record || record->data)
+            continue;
+        zframe_t *frame = s_record_frame (self, record);
+        if (!frame
+        ||  pwrite (fd, zframe_data (frame), record->size, (off_t) size)
+                != (ssize_t) record->size) {
+            //  Keep the old file, copies there are still valid
+            zsys_error ("%s: fail to compact cold file", self->cold_file);
+            zframe_destroy (&frame);
+            close (fd);
+            return;
+        }
+        zframe_destroy (&frame);
+        size += record->size;
+    }
+    //  Same walk again, now that all copies are written
+    size = 0;
+    for (index = 0; index < self->order_size; index++) {
+        s_record_t *record = self->order [index];
+        if (!record)
+            continue;
+        if (record->data)
+            record->cold = 0;
+        else {
+            record->cold = size + 1;
+            size += record->size;
+        }
+    }
+    close (self->cold_fd);
+    self->cold_fd = fd;
+    self->cold_size = size;
+    self->cold_garbage = 0;
+}
+
+//  Return first position in order with name not less than given one,
+//  comparing only first size bytes if size is not 0
+
+static size_t
+s_order_lower (zm_devices_t *self, const char *name, size_t size)
+{
+    size_t low = 0;
+    size_t high = self->order_size;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        const char *other = self->order [mid]->name;
+        int cmp = size ? strncmp (other, name, size) : strcmp (other, name);
+        if (cmp < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+//  Return first position in order after names starting with prefix
+
+static size_t
+s_order_upper (zm_devices_t *self, const char *prefix, size_t size)
+{
+    size_t low = 0;
+    size_t high = self->order_size;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (strncmp (self->order [mid]->name, prefix, size) <= 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+static int
+s_order_compare (const void *a, const void *b)
+{
+    return strcmp ((*(s_record_t **) a)->name, (*(s_record_t **) b)->name);
+}
+
+//  Order is kept sorted lazily. New records are appended, removed ones
+//  leave a hole, and binary search or walk in name order first settles
+//  it: records appended since are sorted and merged in, holes dropped.
+//  So batch of inserts or removals costs O(n + k log k) once, not O(n)
+//  each. zm_devices_next stays on the device it was about to return.
+
+static void
+s_order_settle (zm_devices_t *self)
+{
+    if (self->order_sorted == self->order_size && !self->order_holes)
+        return;
+    s_record_t *cursor = NULL;
+    size_t index;
+    for (index = self->order_cursor; !cursor && index < self->order_sorted; index++)
+        cursor = self->order [index];
+
+    size_t tail = self->order_sorted;
+    size_t added = 0;
+    for (index = tail; index < self->order_size; index++)
+        if (self->order [index])
+            self->order [tail + added++] = self->order [index];
+    qsort (self->order + tail, added, sizeof (s_record_t *), s_order_compare);
+
+    s_record_t **order = (s_record_t **) malloc (self->order_max * sizeof (s_record_t *));
+    assert (order);
+    size_t size = 0;
+    size_t left = 0;
+    size_t right = tail;
+    self->order_cursor = SIZE_MAX;
+    while (left < tail || right < tail + added) {
+        if (left < tail && !self->order [left]) {
+            left++;
+            continue;
+        }
+        s_record_t *record;
+        if (right == tail + added
+        ||  (left < tail && strcmp (self->order [left]->name, self->order [right]->name) < 0))
+            record = self->order [left++];
+        else
+            record = self->order [right++];
+        if (record == cursor)
+            self->order_cursor = size;
+        record->order = size;
+        order [size++] = record;
+    }
+    if (self->order_cursor == SIZE_MAX)
+        self->order_cursor = size;
+    free (self->order);
+    self->order = order;
+    self->order_size = size;
+    self->order_sorted = size;
+    self->order_holes = 0;
+}
+
+static void
+s_order_insert (zm_devices_t *self, s_record_t *record)
+{
+    if (self->order_size == self->order_max) {
+        self->order_max = self->order_max ? self->order_max * 2 : 1024;
+        self->order = (s_record_t **) realloc (self->order, self->order_max * sizeof (s_record_t *));
+        assert (self->order);
+    }
+    //  Names coming in order, as from snapshot, keep it sorted
+    bool sorted = self->order_sorted == self->order_size
+        && (self->order_size == 0
+        ||  (self->order [self->order_size - 1]
+        &&   strcmp (self->order [self->order_size - 1]->name, record->name) < 0));
+    record->order = self->order_size;
+    self->order [self->order_size++] = record;
+    if (sorted)
+        self->order_sorted++;
+}
+
+static void
+s_order_remove (zm_devices_t *self, s_record_t *record)
+{
+    assert (self->order [record->order] == record);
+    self->order [record->order] = NULL;
+    self->order_holes++;
+    //  Don't let holes pile up when nothing walks the order
+    if (self->order_holes > 1024 && self->order_holes > self->order_size / 2)
+        s_order_settle (self);
+}
+
+//  New list of names, owning its items
+
+static zlistx_t *
+s_names_new (void)
+{
+    zlistx_t *names = zlistx_new ();
+    assert (names);
+    zlistx_set_duplicator (names, (zlistx_duplicator_fn *) strdup);
+    zlistx_set_destructor (names, (zlistx_destructor_fn *) zstr_free);
+    return names;
+}
+
+//  Update all indexes with ext of device, NULL device removes it
+
+static void
+s_devices_index (zm_devices_t *self, const char *name, zm_proto_t *device, s_record_t *record)
+{
+    zhash_t *ext = device ? zm_proto_ext (device) : NULL;
+    s_index_t *index = (s_index_t *) zhashx_first (self->indexes);
+    while (index) {
+        const char *key = (const char *) zhashx_cursor (self->indexes);
+        const char *value = ext ? (const char *) zhash_lookup (ext, key) : NULL;
+        s_index_set (index, name, value, record);
+        index = (s_index_t *) zhashx_next (self->indexes);
+    }
+}
+
+//  Update indexes of hot record from its own values
+
+static void
+s_devices_index_record (zm_devices_t *self, s_record_t *record)
+{
+    s_index_t *index = (s_index_t *) zhashx_first (self->indexes);
+    while (index) {
+        const char *key = (const char *) zhashx_cursor (self->indexes);
+        s_index_set (index, record->name,
+            s_record_value (self->dict, record->data, record->size, key), record);
+        index = (s_index_t *) zhashx_next (self->indexes);
+    }
+}
+
+//  Drop all changes from the log
+
+static void
+s_changes_reset (zm_devices_t *self)
+{
+    size_t i;
+    for (i = 0; self->changes && i < self->changes_max; i++)
+        zstr_free (&self->changes [i]);
+    free (self->changes);
+    self->changes = NULL;
+    self->changes_size = 0;
+}
+
+//  Bump version and log the changed name
+
+static void
+s_changes_add (zm_devices_t *self, const char *name)
+{
+    self->version++;
+    if (!self->changes_max)
+        return;
+    if (!self->changes) {
+        self->changes = (char **) zmalloc (self->changes_max * sizeof (char *));
+        assert (self->changes);
+    }
+    size_t slot = (size_t) ((self->version - 1) % self->changes_max);
+    zstr_free (&self->changes [slot]);
+    self->changes [slot] = strdup (name);
+    if (self->changes_size < self->changes_max)
+        self->changes_size++;
+}
+
+static void
+s_devices_put_frame (zm_devices_t *self, zframe_t **frame_p);
+
+//  Drop lazily loaded snapshot, all of it was hydrated
+
+static void
+s_devices_release (zm_devices_t *self)
+{
+    zhashx_destroy (&self->pending);
+    if (self->store) {
+        //  Background store may still read devices it had pending
+        assert (!self->store_lazy);
+        self->store_lazy = self->lazy;
+        self->lazy = NULL;
+    }
+    else
+        zm_snapshot_destroy (&self->lazy);
+}
+
+//  Move device from lazily loaded snapshot to records, return its record
+
+static s_record_t *
+s_devices_hydrate (zm_devices_t *self, const char *name)
+{
+    size_t offset = (size_t) (uintptr_t) zhashx_lookup (self->pending, name);
+    if (!offset)
+        return NULL;
+    zhashx_delete (self->pending, name);
+
+    size_t size;
+    const byte *data = zm_snapshot_read (self->lazy, offset, &size);
+    if (data) {
+        zframe_t *frame = zframe_new (data, size);
+        bool hydrating = self->hydrating;
+        self->hydrating = true;
+        s_devices_put_frame (self, &frame);
+        self->hydrating = hydrating;
+    }
+    //  Name might point to the snapshot, look it up before releasing it
+    s_record_t *record = (s_record_t *) zhashx_lookup (self->devices, name);
+    if (zhashx_size (self->pending) == 0)
+        s_devices_release (self);
+    return record;
+}
+
+//  Return record of device, hydrating it if needed
+
+static s_record_t *
+s_devices_fetch (zm_devices_t *self, const char *name)
+{
+    s_record_t *record = (s_record_t *) zhashx_lookup (self->devices, name);
+    if (!record && self->pending)
+        record = s_devices_hydrate (self, name);
+    return record;
+}
+
+//  Hydrate all devices left in lazily loaded snapshot
+
+static void
+s_devices_hydrate_all (zm_devices_t *self)
+{
+    while (self->lazy)
+        zm_devices_hydrate (self, SIZE_MAX);
+}
+
+//  Remove device with all its memory
+
+static void
+s_devices_remove (zm_devices_t *self, const char *name)
+{
+    s_record_t *record = s_devices_fetch (self, name);
+    if (!record)
+        return;
+    s_changes_add (self, name);
+    self->dirty++;
+    self->content_dirty++;
+    s_devices_index (self, name, NULL, NULL);
+    s_order_remove (self, record);
+    zhashx_delete (self->devices, name);
+    s_heap_remove (self, record);
+    s_record_uncold (self, record);
+    if (record->data) {
+        s_lru_unlink (self, record);
+        self->hot_bytes -= record->size;
+        zm_arena_bytes_free (self->arena, record->data, record->size);
+    }
+    else
+        self->cold_count--;
+    if (self->device_record == record)
+        self->device_record = NULL;
+    zm_arena_bytes_free (self->arena, (byte *) record->name, strlen (record->name) + 1);
+    zm_arena_record_free (self->arena, record);
+    s_devices_compact (self);
+    s_cold_compact (self);
+}
+
+//  Store device, frame_p may hold it encoded by s_device_encode, which is
+//  then used for journal, and is destroyed. Changed devices are journaled.
+//  Returns 1 if content of device changed, 0 if it is the same, apart
+//  from time.
+
+static int
+s_devices_put_record (zm_devices_t *self, const char *name, uint64_t hash,
+    zm_proto_t *device, s_record_t *record, byte *data, size_t size, zframe_t *frame);
+
+static int
+s_devices_put (zm_devices_t *self, zm_proto_t *device, zframe_t **frame_p)
+{
+    assert (device);
+    zframe_t *frame = frame_p ? *frame_p : NULL;
+    if (frame_p)
+        *frame_p = NULL;
+    const char *name = zm_proto_device (device);
+    s_record_t *record = s_devices_fetch (self, name);
+    byte *data = record ? s_record_data (self, record) : NULL;
+    //  Fetch may hydrate, which encodes too, so encode only now
+    size_t size = s_record_encode (self->dict, device, &self->buffer, &self->buffer_max);
+    return s_devices_put_record (self, name, s_device_hash (device), device, record, data, size, frame);
+}
+
+//  Store compact record with strings inline, made by decoder thread
+
+static void
+s_devices_put_compact (zm_devices_t *self, const char *name, uint64_t hash,
+    const byte *compact, size_t compact_size)
+{
+    s_record_t *record = s_devices_fetch (self, name);
+    byte *data = record ? s_record_data (self, record) : NULL;
+    size_t size = s_record_intern (self, compact, compact_size);
+    if (size)
+        s_devices_put_record (self, name, hash, NULL, record, data, size, NULL);
+}
+
+//  Store record encoded in self->buffer over the current one, data of
+//  which is given if it could be read. Device is NULL for record put
+//  by s_devices_put_compact, frame made by s_device_encode may come with
+//  it, for journal.
+
+static int
+s_devices_put_record (zm_devices_t *self, const char *name, uint64_t hash,
+    zm_proto_t *device, s_record_t *record, byte *data, size_t size, zframe_t *frame)
+{
+    int changed = 1;
+    uint32_t ttl;
+    memcpy (&ttl, self->buffer + 8, 4);
+    if (data) {
+        if (record->size == size
+        &&  memcmp (data, self->buffer, size) == 0) {
+            zframe_destroy (&frame);
+            s_heap_expire (self, record, ttl);
+            return 0;
+        }
+        changed = record->hash != hash;
+        s_record_uncold (self, record);
+        self->hot_bytes -= record->size;
+        zm_arena_bytes_free (self->arena, data, record->size);
+    }
+    else
+    if (record) {
+        //  Cold copy can't be read, new content replaces it anyway
+        s_record_uncold (self, record);
+        self->cold_count--;
+        s_lru_push (self, record);
+    }
+    else {
+        record = (s_record_t *) zm_arena_record_new (self->arena);
+        size_t name_size = strlen (name) + 1;
+        record->name = (char *) zm_arena_bytes_new (self->arena, name_size);
+        memcpy (record->name, name, name_size);
+        zhashx_insert (self->devices, name, record);
+        s_order_insert (self, record);
+        s_lru_push (self, record);
+    }
+    if (self->device_record == record)
+        self->device_record = NULL;
+    record->data = zm_arena_bytes_new (self->arena, size);
+    record->size = size;
+    record->hash = hash;
+    self->hot_bytes += size;
+    memcpy (record->data, self->buffer, size);
+    s_heap_expire (self, record, ttl);
+    if (changed && device)
+        s_devices_index (self, name, device, record);
+    else
+    if (changed)
+        s_devices_index_record (self, record);
+    if (!self->hydrating) {
+        self->dirty++;
+        if (changed) {
+            self->content_dirty++;
+            s_changes_add (self, name);
+        }
+        if (self->journal) {
+            if (!frame && device)
+                frame = s_device_encode (device);
+            else
+            if (!frame)
+                frame = s_record_wire (self->dict, name, record->data, size, self->device);
+            if (frame)
+                zm_journal_insert (self->journal, zframe_data (frame), zframe_size (frame));
+        }
+    }
+    zframe_destroy (&frame);
+    s_devices_compact (self);
+    s_devices_evict (self);
+    return changed;
+}
+
+//  Store encoded device, decoding it to learn the name
+
+static void
+s_devices_put_frame (zm_devices_t *self, zframe_t **frame_p)
+{
+    zm_proto_t *dev = s_device_decode (*frame_p);
+    if (dev)
+        s_devices_put (self, dev, frame_p);
+    else
+        zframe_destroy (frame_p);
+    zm_proto_destroy (&dev);
+}
+
+//  Default format based on file extension
+
+static int
+s_file_format (const char *file)
+{
+    size_t len = strlen (file);
+    if (len >= 4 && streq (file + len - 4, ".bin"))
+        return ZM_DEVICES_BINARY;
+    return ZM_DEVICES_ZPL;
+}
+
+static int
+s_load_zpl (zm_devices_t *self, const char *file)
+{
+    zconfig_t *root = zconfig_load (file);
+    if (!root) {
+        zsys_error ("Fail to load file %s: %s", file, strerror (errno));
+        return -1;
+    }
+
+    zconfig_t *item = zconfig_child (root);
+    while (item) {
+        zm_proto_t *dev = zm_proto_new_zpl (item);
+        if (dev) {
+            s_devices_put (self, dev, NULL);
+            zm_proto_destroy (&dev);
+        }
+        item = zconfig_next (item);
+    }
+    zconfig_destroy (&root);
+    return 0;
+}
+
+//  Devices of one snapshot segment, decoded by s_decoder_actor into
+//  compact records with strings inline, as [hash:8][name][size][record]
+//  with zero terminated name and varint size. Malformed ones are left out.
+
+typedef struct {
+    size_t count;               //  Devices in data
+    byte *data;                 //  Their records
+    size_t size;                //  Used bytes of data
+    size_t max;                 //  Allocated bytes of data
+} s_segment_t;
+
+static void
+s_segment_destroy (s_segment_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        s_segment_t *self = *self_p;
+        free (self->data);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+static s_segment_t *
+s_segment_decode (zm_snapshot_t *snapshot, size_t index)
+{
+    size_t count;
+    size_t offset = zm_snapshot_segment (snapshot, index, &count);
+    s_segment_t *self = (s_segment_t *) zmalloc (sizeof (s_segment_t));
+    assert (self);
+    byte *buffer = NULL;
+    size_t buffer_max = 0;
+    size_t read;
+    for (read = 0; read < count; read++) {
+        size_t size;
+        const byte *data = zm_snapshot_walk (snapshot, &offset, &size, NULL);
+        if (!data)
+            break;
+        zframe_t *frame = zframe_new (data, size);
+        zm_proto_t *device = s_device_decode (frame);
+        zframe_destroy (&frame);
+        if (!device)
+            continue;
+        const char *name = zm_proto_device (device);
+        size_t name_size = strlen (name) + 1;
+        size_t record_size = s_record_encode (NULL, device, &buffer, &buffer_max);
+        s_buffer_reserve (&self->data, &self->max, self->size + 8 + name_size + 10 + record_size);
+        uint64_t hash = s_device_hash (device);
+        byte *p = self->data + self->size;
+        memcpy (p, &hash, 8);
+        memcpy (p + 8, name, name_size);
+        p = s_varint_put (p + 8 + name_size, record_size);
+        memcpy (p, buffer, record_size);
+        self->size = (size_t) (p + record_size - self->data);
+        self->count++;
+        zm_proto_destroy (&device);
+    }
+    free (buffer);
+    return self;
+}
+
+//  Decode segments of snapshot given in args, one per DECODE command, and
+//  send them back as pointers to s_segment_t. Snapshot is only read, by
+//  all decoders at once.
+
+static void
+s_decoder_actor (zsock_t *pipe, void *args)
+{
+    zm_snapshot_t *snapshot = (zm_snapshot_t *) args;
+    zsock_signal (pipe, 0);
+    while (true) {
+        zmsg_t *request = zmsg_recv (pipe);
+        if (!request)
+            break;              //  Interrupted
+        char *command = zmsg_popstr (request);
+        char *index = zmsg_popstr (request);
+        zmsg_destroy (&request);
+        bool terminated = !command || streq (command, "$TERM");
+        if (!terminated && streq (command, "DECODE") && index) {
+            s_segment_t *segment = s_segment_decode (snapshot, (size_t) atol (index));
+            if (zsock_send (pipe, "p", segment) == -1)
+                s_segment_destroy (&segment);
+        }
+        zstr_free (&command);
+        zstr_free (&index);
+        if (terminated)
+            break;
+    }
+}
+
+//  Store devices of decoded segment, in file order
+
+static void
+s_devices_put_segment (zm_devices_t *self, s_segment_t *segment)
+{
+    const byte *p = segment->data;
+    const byte *end = segment->data + segment->size;
+    size_t index;
+    for (index = 0; index < segment->count; index++) {
+        uint64_t hash;
+        memcpy (&hash, p, 8);
+        const char *name = (const char *) p + 8;
+        uint64_t size;
+        p = s_varint_get (p + 8 + strlen (name) + 1, end, &size);
+        assert (p);
+        s_devices_put_compact (self, name, hash, p, (size_t) size);
+        p += size;
+    }
+}
+
+//  Decode segments of snapshot in parallel. Segment N goes to decoder
+//  N % decoders, which gets N + decoders once it's collected, so results
+//  come in file order and at most one segment per decoder waits.
+
+static int
+s_load_segments (zm_devices_t *self, zm_snapshot_t *snapshot, size_t decoders)
+{
+    size_t segments = zm_snapshot_segments (snapshot);
+    zactor_t *decoder [ZM_DEVICES_DECODERS];
+    size_t index;
+    for (index = 0; index < decoders; index++) {
+        decoder [index] = zactor_new (s_decoder_actor, snapshot);
+        assert (decoder [index]);
+        zstr_sendm (decoder [index], "DECODE");
+        zstr_sendf (decoder [index], "%zu", index);
+    }
+    int rv = 0;
+    for (index = 0; index < segments; index++) {
+        zactor_t *next = decoder [index % decoders];
+        s_segment_t *segment = NULL;
+        if (zsock_recv (next, "p", &segment) == -1 || !segment) {
+            rv = -1;            //  Interrupted
+            break;
+        }
+        if (index + decoders < segments) {
+            zstr_sendm (next, "DECODE");
+            zstr_sendf (next, "%zu", index + decoders);
+        }
+        s_devices_put_segment (self, segment);
+        s_segment_destroy (&segment);
+    }
+    //  Collect what is left after interrupt, so it's not leaked
+    size_t pending;
+    for (pending = index + 1; rv == -1 && pending < index + decoders && pending < segments; pending++) {
+        s_segment_t *segment = NULL;
+        if (zsock_recv (decoder [pending % decoders], "p", &segment) == 0)
+            s_segment_destroy (&segment);
+    }
+    for (index = 0; index < decoders; index++)
+        zactor_destroy (&decoder [index]);
+    return rv;
+}
+
+static int
+s_load_binary (zm_devices_t *self, const char *file)
+{
+    zm_snapshot_t *snapshot = zm_snapshot_load (file);
+    if (!snapshot)
+        return -1;
+
+    long cores = sysconf (_SC_NPROCESSORS_ONLN);
+    size_t decoders = self->decoders ? self->decoders : cores > 1 ? (size_t) cores : 1;
+    if (decoders > ZM_DEVICES_DECODERS)
+        decoders = ZM_DEVICES_DECODERS;
+    if (decoders > zm_snapshot_segments (snapshot))
+        decoders = zm_snapshot_segments (snapshot);
+    if (decoders > 1) {
+        int rv = s_load_segments (self, snapshot, decoders);
+        zm_snapshot_destroy (&snapshot);
+        return rv;
+    }
+
+    size_t size;
+    const byte *data = zm_snapshot_first (snapshot, &size);
+    while (data) {
+        zframe_t *frame = zframe_new (data, size);
+        s_devices_put_frame (self, &frame);
+        data = zm_snapshot_next (snapshot, &size);
+    }
+    zm_snapshot_destroy (&snapshot);
+    return 0;
+}
+
+//  Save and destroy ZPL snapshot. It's written aside and renamed, so crash
+//  never leaves half written snapshot.
+
+static int
+s_save_zpl (zconfig_t **root_p, const char *file)
+{
+    char *tmp = zsys_sprintf ("%s.tmp", file);
+    int r = zconfig_save (*root_p, tmp);
+    zconfig_destroy (root_p);
+    if (r == 0 && rename (tmp, file) == -1)
+        r = -1;
+    if (r == -1)
+        zsys_error ("Fail to store file %s: %s", file, strerror (errno));
+    zstr_free (&tmp);
+    return r;
+}
+
+//  Snapshot must hold all devices, so any device which can't be read
+//  fails the store
+
+static int
+s_store_zpl (zm_devices_t *self, const char *file)
+{
+    zconfig_t *root = zconfig_new ("root", NULL);
+    s_order_settle (self);
+    size_t index;
+    for (index = 0; index < self->order_size; index++) {
+        s_record_t *record = self->order [index];
+        if (!record)
+            continue;
+        zm_proto_t *device = s_record_device (self, record);
+        if (!device) {
+            zsys_error ("Fail to store file %s: can't read device %s", file, record->name);
+            zconfig_destroy (&root);
+            return -1;
+        }
+        zm_proto_zpl (device, root);
+    }
+    return s_save_zpl (&root, file);
+}
+
+static int
+s_store_binary (zm_devices_t *self, const char *file)
+{
+    zm_snapshot_t *snapshot = zm_snapshot_new (file);
+    if (!snapshot)
+        return -1;
+
+    int r = 0;
+    zm_proto_t *device = zm_proto_new ();
+    s_order_settle (self);
+    size_t index;
+    for (index = 0; index < self->order_size && r == 0; index++) {
+        s_record_t *record = self->order [index];
+        if (!record)
+            continue;
+        zframe_t *cold = record->data ? NULL : s_record_frame (self, record);
+        zframe_t *frame = record->data || cold
+            ? s_record_wire (self->dict, record->name,
+                cold ? zframe_data (cold) : record->data, record->size, device)
+            : NULL;
+        r = frame
+            ? zm_snapshot_append (snapshot, record->name, zframe_data (frame), zframe_size (frame))
+            : -1;
+        zframe_destroy (&frame);
+        zframe_destroy (&cold);
+    }
+    zm_proto_destroy (&device);
+    if (r == 0)
+        r = zm_snapshot_commit (snapshot);
+    zm_snapshot_destroy (&snapshot);
+    return r;
+}
+
+//  Device in frozen view of background store
+
+typedef struct {
+    const char *name;           //  In arena or lazily loaded snapshot
+    const byte *data;           //  Record in arena or snapshot, NULL if cold
+    uint64_t cold;              //  Offset + 1 of cold record in cold file
+    size_t size;                //  Bytes of record
+    bool wire;                  //  Data is made by s_device_encode
+} s_store_item_t;
+
+//  Frozen view of devices written by background store, owned by its actor
+
+typedef struct {
+    char *file;                 //  Snapshot file
+    int format;                 //  Snapshot format
+    s_store_item_t *items;      //  Records in name order, then pending ones
+    size_t records;             //  Records in items
+    size_t size;                //  All items
+    int cold_fd;                //  Duplicate of cold file, -1 if none
+    s_dict_t *dict;             //  Copy of dictionary they refer to
+} s_store_t;
+
+static void
+s_store_destroy (s_store_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        s_store_t *self = *self_p;
+        zstr_free (&self->file);
+        free (self->items);
+        if (self->cold_fd != -1)
+            close (self->cold_fd);
+        s_dict_destroy (&self->dict);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+static int
+s_store_item_compare (const void *a, const void *b)
+{
+    return strcmp (((const s_store_item_t *) a)->name, ((const s_store_item_t *) b)->name);
+}
+
+//  Return next item in name order, merging records with pending devices,
+//  NULL at the end
+
+static s_store_item_t *
+s_store_next (s_store_t *self, size_t *record_p, size_t *pending_p)
+{
+    bool record = *record_p < self->records;
+    bool pending = *pending_p < self->size;
+    if (record && pending)
+        record = strcmp (self->items [*record_p].name, self->items [*pending_p].name) < 0;
+    if (record)
+        return &self->items [(*record_p)++];
+    if (pending)
+        return &self->items [(*pending_p)++];
+    return NULL;
+}
+
+//  Return device of item decoded into device, NULL if it can't be read
+
+static zm_proto_t *
+s_store_device (s_store_t *self, s_store_item_t *item, zm_proto_t *device)
+{
+    if (item->wire) {
+        zframe_t *frame = zframe_new (item->data, item->size);
+        zm_proto_t *decoded = s_device_decode (frame);
+        zframe_destroy (&frame);
+        if (decoded)
+            zm_proto_destroy (&device);
+        return decoded;
+    }
+    zframe_t *cold = NULL;
+    const byte *data = item->data;
+    if (!data) {
+        cold = zframe_new (NULL, item->size);
+        if (pread (self->cold_fd, zframe_data (cold), item->size, (off_t) (item->cold - 1))
+            != (ssize_t) item->size) {
+            zsys_error ("%s: fail to read device %s: %s", self->file, item->name, strerror (errno));
+            zframe_destroy (&cold);
+            return NULL;
+        }
+        data = zframe_data (cold);
+    }
+    int rv = s_record_decode (self->dict, item->name, data, item->size, device);
+    zframe_destroy (&cold);
+    return rv == 0 ? device : NULL;
+}
+
+//  Return item as frame made by s_device_encode, NULL if it can't be read
+
+static zframe_t *
+s_store_wire (s_store_t *self, s_store_item_t *item, zm_proto_t *device)
+{
+    if (item->wire)
+        return zframe_new (item->data, item->size);
+    if (item->data)
+        return s_record_wire (self->dict, item->name, item->data, item->size, device);
+    zframe_t *cold = zframe_new (NULL, item->size);
+    zframe_t *wire = NULL;
+    if (pread (self->cold_fd, zframe_data (cold), item->size, (off_t) (item->cold - 1))
+        == (ssize_t) item->size)
+        wire = s_record_wire (self->dict, item->name, zframe_data (cold), item->size, device);
+    else
+        zsys_error ("%s: fail to read device %s: %s", self->file, item->name, strerror (errno));
+    zframe_destroy (&cold);
+    return wire;
+}
+
+static int
+s_store_write (s_store_t *self)
+{
+    //  Pending devices come in snapshot order, records are sorted already
+    qsort (self->items + self->records, self->size - self->records,
+        sizeof (s_store_item_t), s_store_item_compare);
+    size_t record = 0;
+    size_t pending = self->records;
+    s_store_item_t *item;
+
+    int r = 0;
+    zm_proto_t *device = zm_proto_new ();
+    if (self->format == ZM_DEVICES_BINARY) {
+        zm_snapshot_t *snapshot = zm_snapshot_new (self->file);
+        if (!snapshot) {
+            zm_proto_destroy (&device);
+            return -1;
+        }
+        while (r == 0 && (item = s_store_next (self, &record, &pending))) {
+            zframe_t *wire = s_store_wire (self, item, device);
+            r = wire
+                ? zm_snapshot_append (snapshot, item->name, zframe_data (wire), zframe_size (wire))
+                : -1;
+            zframe_destroy (&wire);
+        }
+        zm_proto_destroy (&device);
+        if (r == 0)
+            r = zm_snapshot_commit (snapshot);
+        zm_snapshot_destroy (&snapshot);
+        return r;
+    }
+    zconfig_t *root = zconfig_new ("root", NULL);
+    while ((item = s_store_next (self, &record, &pending))) {
+        zm_proto_t *stored = s_store_device (self, item, device);
+        if (!stored) {
+            //  Journal is kept, it still has the device
+            zm_proto_destroy (&device);
+            zconfig_destroy (&root);
+            return -1;
+        }
+        zm_proto_zpl (stored, root);
+        device = stored;
+    }
+    zm_proto_destroy (&device);
+    return s_save_zpl (&root, self->file);
+}
+
+//  Background store actor, sends result of the write and waits for
+//  zactor_destroy
 
-//  Structure of our class
+static void
+s_store_actor (zsock_t *pipe, void *args)
+{
+    s_store_t *self = (s_store_t *) args;
+    zsock_signal (pipe, 0);
+    zstr_sendf (pipe, "%d", s_store_write (self));
+    s_store_destroy (&self);
 
-struct _zm_devices_t {
-    zhashx_t *devices;
-    char *file;
-};
+    while (true) {
+        char *command = zstr_recv (pipe);
+        bool terminated = !command || streq (command, "$TERM");
+        zstr_free (&command);
+        if (terminated)
+            break;
+    }
+}
+
+static char *
+s_journal_file (zm_devices_t *self)
+{
+    return zsys_sprintf ("%s.journal", self->file);
+}
+
+//  Journal rotated away by zm_devices_store_start
+
+static char *
+s_journal_old_file (zm_devices_t *self)
+{
+    return zsys_sprintf ("%s.journal.old", self->file);
+}
+
+//  Replay journal on top of loaded snapshot. Records store
+//  the state of device, so replaying already stored ones is harmless.
+
+static int
+s_devices_replay_file (zm_devices_t *self, char **file_p)
+{
+    char *file = *file_p;
+    if (!zsys_file_exists (file)) {
+        zstr_free (file_p);
+        return 0;
+    }
+    zm_journal_t *journal = zm_journal_new (file, 0);
+    zstr_free (file_p);
+    if (!journal)
+        return -1;
+
+    char op;
+    zframe_t *payload;
+    while (zm_journal_read (journal, &op, &payload) == 0) {
+        if (op == ZM_JOURNAL_INSERT)
+            s_devices_put_frame (self, &payload);
+        else {
+            char *name = zframe_strdup (payload);
+            s_devices_remove (self, name);
+            zstr_free (&name);
+            zframe_destroy (&payload);
+        }
+    }
+    zm_journal_destroy (&journal);
+    return 0;
+}
+
+//  Replay journal left by unfinished background store, then the current one
+
+static int
+s_devices_replay (zm_devices_t *self)
+{
+    char *file = s_journal_old_file (self);
+    if (s_devices_replay_file (self, &file) == -1)
+        return -1;
+    file = s_journal_file (self);
+    return s_devices_replay_file (self, &file);
+}
 
 
 //  --------------------------------------------------------------------------
@@ -37,148 +1969,896 @@ zm_devices_new (const char *file)
     //  Initialize class properties here
     self->devices = zhashx_new ();
     assert (self->devices);
-    zhashx_set_destructor (self->devices, (void(*)(void**)) zm_proto_destroy);
+    self->arena = zm_arena_new (sizeof (s_record_t), ZM_DEVICES_SLAB, ZM_DEVICES_CHUNK);
+    assert (self->arena);
+    self->indexes = zhashx_new ();
+    assert (self->indexes);
+    zhashx_set_destructor (self->indexes, (zhashx_destructor_fn *) s_index_destroy);
+    self->dict = s_dict_new ();
+    self->device = zm_proto_new ();
+    assert (self->device);
+    self->epoch = zclock_time ();
+    self->changes_max = ZM_DEVICES_CHANGES;
+    self->cold_fd = -1;
 
     if (!file)
         return self;
 
     self->file = strdup (file);
-    zconfig_t *root = zconfig_load (file);
-    if (!root) {
-        zsys_error ("Fail to load file %s: %s", file, strerror (errno));
-        goto fail;
-    }
-
-    zconfig_t *item = zconfig_child (root);
-    while (item) {
-        zm_proto_t *dev = zm_proto_new_zpl (item);
-        zhashx_insert (self->devices, zm_proto_device (dev), (void*) dev);
-        item = zconfig_next (item);
+    self->format = s_file_format (file);
+    //  Missing snapshot is fine, journal might still exist
+    if (zsys_file_exists (file)) {
+        if (zm_devices_import (self, file) == -1)
+            goto fail;
+        self->stored = true;
     }
+    //  Only what journal adds is missing in the snapshot
+    self->dirty = 0;
+    self->content_dirty = 0;
 
-    zconfig_destroy (&root);
+    if (s_devices_replay (self) == -1)
+        goto fail;
+    //  Loading is not a change anyone has to catch up with
+    s_changes_reset (self);
+    self->version = 0;
     return self;
 fail:
-    zconfig_destroy (&root);
     zm_devices_destroy (&self);
     return NULL;
 }
 
+//  --------------------------------------------------------------------------
+//  Create a new zm_devices, indexing binary snapshot for lazy loading
+
+zm_devices_t *
+zm_devices_new_lazy (const char *file)
+{
+    assert (file);
+    if (!zsys_file_exists (file) || !zm_snapshot_probe (file))
+        return zm_devices_new (file);
+
+    zm_snapshot_t *snapshot = zm_snapshot_load (file);
+    if (!snapshot)
+        return NULL;
+    size_t size;
+    if (!zm_snapshot_first (snapshot, &size)) {
+        //  Nothing to index
+        zm_snapshot_destroy (&snapshot);
+        return zm_devices_new (file);
+    }
+
+    zm_devices_t *self = zm_devices_new (NULL);
+    assert (self);
+    self->file = strdup (file);
+    self->format = s_file_format (file);
+    self->lazy = snapshot;
+    //  Keys are names in the mapped snapshot, neither copied nor freed
+    self->pending = zhashx_new ();
+    assert (self->pending);
+    zhashx_set_key_duplicator (self->pending, NULL);
+    zhashx_set_key_destructor (self->pending, NULL);
+    const byte *data = zm_snapshot_first (snapshot, &size);
+    while (data) {
+        zhashx_update (self->pending, zm_snapshot_name (snapshot),
+            (void *) (uintptr_t) zm_snapshot_offset (snapshot));
+        data = zm_snapshot_next (snapshot, &size);
+    }
+    self->stored = true;
+
+    if (s_devices_replay (self) == -1) {
+        zm_devices_destroy (&self);
+        return NULL;
+    }
+    s_changes_reset (self);
+    self->version = 0;
+    return self;
+}
+
 //  --------------------------------------------------------------------------
 //  Destroy the zm_devices
 int
 zm_devices_store (zm_devices_t *self);
 
-void
-zm_devices_destroy (zm_devices_t **self_p)
+void
+zm_devices_destroy (zm_devices_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zm_devices_t *self = *self_p;
+        //  Free class properties here
+        zm_devices_store_finish (self);
+        zm_journal_destroy (&self->journal);
+        s_devices_release (self);
+        zhashx_destroy (&self->indexes);
+        //  Records go away with the arena
+        zhashx_destroy (&self->devices);
+        zm_arena_destroy (&self->arena);
+        s_dict_destroy (&self->dict);
+        free (self->buffer);
+        zm_proto_destroy (&self->device);
+        if (self->cold_fd != -1)
+            close (self->cold_fd);
+        zstr_free (&self->cold_file);
+        free (self->heap);
+        free (self->order);
+        s_changes_reset (self);
+        zstr_free (&self->file);
+        //  Free object itself
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+const char*
+zm_devices_file (zm_devices_t *self)
+{
+    assert (self);
+    return (const char*) self->file;
+}
+
+void
+zm_devices_set_file (zm_devices_t *self, const char *file)
+{
+    assert (self);
+    //  Journal and running store belong to the old file
+    zm_devices_store_finish (self);
+    zm_journal_destroy (&self->journal);
+    if (!self->file || !streq (self->file, file))
+        self->stored = false;
+    zstr_free (&self->file);
+    self->file = strdup (file);
+    self->format = s_file_format (file);
+}
+
+void
+zm_devices_set_format (zm_devices_t *self, int format)
+{
+    assert (self);
+    assert (format == ZM_DEVICES_ZPL || format == ZM_DEVICES_BINARY);
+    if (self->format != format)
+        self->stored = false;
+    self->format = format;
+}
+
+int
+zm_devices_format (zm_devices_t *self)
+{
+    assert (self);
+    return self->format;
+}
+
+int
+zm_devices_import (zm_devices_t *self, const char *file)
+{
+    assert (self);
+    assert (file);
+    if (zm_snapshot_probe (file))
+        return s_load_binary (self, file);
+    return s_load_zpl (self, file);
+}
+
+int
+zm_devices_export (zm_devices_t *self, const char *file, int format)
+{
+    assert (self);
+    assert (file);
+    s_devices_hydrate_all (self);
+    if (format == ZM_DEVICES_BINARY)
+        return s_store_binary (self, file);
+    return s_store_zpl (self, file);
+}
+
+int
+zm_devices_journal_open (zm_devices_t *self, size_t batch)
+{
+    assert (self);
+    if (!self->file)
+        return -1;
+
+    zm_journal_destroy (&self->journal);
+    char *file = s_journal_file (self);
+    self->journal = zm_journal_new (file, batch);
+    self->journal_batch = batch;
+    zstr_free (&file);
+    return self->journal ? 0 : -1;
+}
+
+int
+zm_devices_sync (zm_devices_t *self)
+{
+    assert (self);
+    if (!self->journal)
+        return 0;
+    return zm_journal_sync (self->journal);
+}
+
+size_t
+zm_devices_dirty (zm_devices_t *self)
+{
+    assert (self);
+    return self->dirty;
+}
+
+size_t
+zm_devices_dirty_content (zm_devices_t *self)
+{
+    assert (self);
+    return self->content_dirty;
+}
+
+size_t
+zm_devices_journal_size (zm_devices_t *self)
+{
+    assert (self);
+    return self->journal ? zm_journal_size (self->journal) : 0;
+}
+
+zm_proto_t *zm_devices_first (zm_devices_t *self)
+{
+    assert (self);
+    s_devices_hydrate_all (self);
+    s_order_settle (self);
+    self->order_cursor = 0;
+    return zm_devices_next (self);
+}
+
+//  Move cursor past holes, return its record or NULL at the end. Records
+//  added during the walk are not visited.
+
+static s_record_t *
+s_order_next (zm_devices_t *self)
+{
+    while (self->order_cursor < self->order_sorted && !self->order [self->order_cursor])
+        self->order_cursor++;
+    if (self->order_cursor >= self->order_sorted)
+        return NULL;
+    return self->order [self->order_cursor++];
+}
+
+zm_proto_t *zm_devices_next (zm_devices_t *self)
+{
+    assert (self);
+    //  Device which can't be read is skipped, so NULL is only the end
+    s_record_t *record = s_order_next (self);
+    zm_proto_t *device = s_record_device (self, record);
+    while (record && !device) {
+        zsys_error ("zm_devices: skipping unreadable device %s", record->name);
+        record = s_order_next (self);
+        device = s_record_device (self, record);
+    }
+    return device;
+}
+
+size_t zm_devices_size (zm_devices_t *self)
+{
+    assert (self);
+    return zhashx_size (self->devices) + zm_devices_pending (self);
+}
+
+size_t
+zm_devices_pending (zm_devices_t *self)
+{
+    assert (self);
+    return self->pending ? zhashx_size (self->pending) : 0;
+}
+
+size_t
+zm_devices_hydrate (zm_devices_t *self, size_t batch)
+{
+    assert (self);
+    //  Walk the snapshot, skipping devices hydrated on demand or
+    //  replaced by later record of the same name
+    while (self->lazy && batch--) {
+        size_t size;
+        const byte *data = self->lazy_started
+            ? zm_snapshot_next (self->lazy, &size)
+            : zm_snapshot_first (self->lazy, &size);
+        self->lazy_started = true;
+        if (!data) {
+            s_devices_release (self);
+            break;
+        }
+        const char *name = zm_snapshot_name (self->lazy);
+        size_t offset = (size_t) (uintptr_t) zhashx_lookup (self->pending, name);
+        if (offset == zm_snapshot_offset (self->lazy))
+            s_devices_hydrate (self, name);
+    }
+    return zm_devices_pending (self);
+}
+
+zlistx_t *zm_devices_names (zm_devices_t *self)
+{
+    assert (self);
+    s_devices_hydrate_all (self);
+    s_order_settle (self);
+    zlistx_t *names = s_names_new ();
+    size_t index;
+    for (index = 0; index < self->order_size; index++)
+        zlistx_add_end (names, self->order [index]->name);
+    return names;
+}
+
+zlistx_t *
+zm_devices_prefix (zm_devices_t *self, const char *prefix, const char *after, size_t limit)
+{
+    assert (self);
+    s_devices_hydrate_all (self);
+    s_order_settle (self);
+    if (!prefix)
+        prefix = "";
+    size_t size = strlen (prefix);
+    size_t index = s_order_lower (self, prefix, size);
+    if (after && *after) {
+        size_t next = s_order_lower (self, after, 0);
+        if (next < self->order_size && streq (self->order [next]->name, after))
+            next++;
+        if (next > index)
+            index = next;
+    }
+    size_t end = s_order_upper (self, prefix, size);
+
+    zlistx_t *names = s_names_new ();
+    int64_t now = zclock_mono ();
+    for (; index < end && (!limit || zlistx_size (names) < limit); index++) {
+        s_record_t *record = self->order [index];
+        if (!(record->expires && record->expires <= now))
+            zlistx_add_end (names, record->name);
+    }
+    return names;
+}
+
+size_t
+zm_devices_prefix_size (zm_devices_t *self, const char *prefix)
+{
+    assert (self);
+    s_devices_hydrate_all (self);
+    s_order_settle (self);
+    if (!prefix)
+        prefix = "";
+    size_t size = strlen (prefix);
+    //  Expired devices not collected yet are hidden from pages, so they
+    //  don't count either
+    size_t end = s_order_upper (self, prefix, size);
+    size_t count = 0;
+    int64_t now = zclock_mono ();
+    size_t index;
+    for (index = s_order_lower (self, prefix, size); index < end; index++) {
+        s_record_t *record = self->order [index];
+        if (!(record->expires && record->expires <= now))
+            count++;
+    }
+    return count;
+}
+
+size_t zm_devices_allocated (zm_devices_t *self)
+{
+    assert (self);
+    return zm_arena_allocated (self->arena);
+}
+
+int
+zm_devices_set_budget (zm_devices_t *self, size_t budget, const char *cold_file)
+{
+    assert (self);
+    if (!budget) {
+        //  Everything goes back to memory, nothing is evicted meanwhile
+        self->budget = 0;
+        s_order_settle (self);
+        size_t index;
+        for (index = 0; index < self->order_size; index++) {
+            s_record_t *record = self->order [index];
+            if (!record->data && !s_record_data (self, record))
+                return -1;
+        }
+        for (index = 0; index < self->order_size; index++)
+            self->order [index]->cold = 0;
+        if (self->cold_fd != -1)
+            close (self->cold_fd);
+        self->cold_fd = -1;
+        self->cold_size = 0;
+        self->cold_garbage = 0;
+        return 0;
+    }
+    if (self->cold_fd == -1) {
+        if (!cold_file && !self->file)
+            return -1;
+        zstr_free (&self->cold_file);
+        self->cold_file = cold_file
+            ? strdup (cold_file)
+            : zsys_sprintf ("%s.cold", self->file);
+        self->cold_fd = s_cold_open (self->cold_file);
+        if (self->cold_fd == -1)
+            return -1;
+    }
+    self->budget = budget;
+    s_devices_evict (self);
+    return 0;
+}
+
+size_t
+zm_devices_hot_bytes (zm_devices_t *self)
+{
+    assert (self);
+    return self->hot_bytes;
+}
+
+size_t
+zm_devices_cold (zm_devices_t *self)
+{
+    assert (self);
+    return self->cold_count;
+}
+
+int
+zm_devices_store (zm_devices_t *self)
+{
+    assert (self);
+    if (!self->file)
+        return 0;
+
+    //  Snapshot written in background would be older than this one
+    zm_devices_store_finish (self);
+    //  Nothing to add, lazily loaded devices need not even be hydrated
+    if (self->stored && !self->dirty)
+        return 0;
+    if (zm_devices_export (self, self->file, self->format) == -1)
+        return -1;
+    self->dirty = 0;
+    self->content_dirty = 0;
+    self->stored = true;
+
+    //  Everything is in snapshot now
+    char *file = s_journal_old_file (self);
+    if (zsys_file_exists (file))
+        zsys_file_delete (file);
+    zstr_free (&file);
+    if (self->journal)
+        return zm_journal_truncate (self->journal);
+
+    file = s_journal_file (self);
+    if (zsys_file_exists (file))
+        zsys_file_delete (file);
+    zstr_free (&file);
+    return 0;
+}
+
+int
+zm_devices_store_start (zm_devices_t *self)
+{
+    assert (self);
+    if (!self->file || self->store)
+        return -1;
+
+    char *old = s_journal_old_file (self);
+    if (zsys_file_exists (old)) {
+        //  Last background store failed, its journal can be dropped only
+        //  once complete snapshot is written
+        zsys_warning ("%s: previous store did not finish, storing now", self->file);
+        zstr_free (&old);
+        return zm_devices_store (self);
+    }
+
+    s_store_t *store = (s_store_t *) zmalloc (sizeof (s_store_t));
+    assert (store);
+    store->file = strdup (self->file);
+    store->format = self->format;
+    store->dict = s_dict_copy (self->dict);
+    store->cold_fd = self->cold_fd == -1 ? -1 : dup (self->cold_fd);
+    s_order_settle (self);
+    store->items = (s_store_item_t *) zmalloc (
+        (self->order_size + zm_devices_pending (self) + 1) * sizeof (s_store_item_t));
+    assert (store->items);
+    size_t i;
+    for (i = 0; i < self->order_size; i++) {
+        s_record_t *record = self->order [i];
+        if (!record)
+            continue;
+        s_store_item_t *item = &store->items [store->size++];
+        item->name = record->name;
+        item->data = record->data;
+        item->cold = record->data ? 0 : record->cold;
+        item->size = record->size;
+    }
+    store->records = store->size;
+    void *offset = self->pending ? zhashx_first (self->pending) : NULL;
+    while (offset) {
+        s_store_item_t *item = &store->items [store->size];
+        item->name = (const char *) zhashx_cursor (self->pending);
+        item->data = zm_snapshot_read (self->lazy, (size_t) (uintptr_t) offset, &item->size);
+        item->wire = true;
+        if (item->data)
+            store->size++;
+        offset = zhashx_next (self->pending);
+    }
+
+    //  Changes from now on go to a new journal, the old one is needed
+    //  until the snapshot is written
+    int rv = 0;
+    bool journal = self->journal != NULL;
+    if (journal) {
+        zm_journal_sync (self->journal);
+        zm_journal_destroy (&self->journal);
+    }
+    char *file = s_journal_file (self);
+    if (zsys_file_exists (file) && rename (file, old) == -1) {
+        zsys_error ("Fail to rotate journal %s: %s", file, strerror (errno));
+        rv = -1;
+    }
+    if (journal)
+        self->journal = zm_journal_new (file, self->journal_batch);
+    zstr_free (&file);
+    zstr_free (&old);
+
+    if (rv == 0) {
+        self->store = zactor_new (s_store_actor, store);
+        assert (self->store);
+        self->store_dirty = self->dirty;
+        self->store_content_dirty = self->content_dirty;
+        self->dirty = 0;
+        self->content_dirty = 0;
+    }
+    else
+        s_store_destroy (&store);
+    return rv;
+}
+
+zactor_t *
+zm_devices_store_actor (zm_devices_t *self)
+{
+    assert (self);
+    return self->store;
+}
+
+int
+zm_devices_store_finish (zm_devices_t *self)
+{
+    assert (self);
+    if (!self->store)
+        return 0;
+
+    char *result = zstr_recv (self->store);
+    int rv = result && streq (result, "0") ? 0 : -1;
+    zstr_free (&result);
+    zactor_destroy (&self->store);
+    //  View of the store is gone, what it held can go too
+    zm_snapshot_destroy (&self->store_lazy);
+    s_devices_compact (self);
+
+    if (rv == 0) {
+        char *file = s_journal_old_file (self);
+        zsys_file_delete (file);
+        zstr_free (&file);
+        self->stored = true;
+    }
+    else {
+        self->dirty += self->store_dirty;
+        self->content_dirty += self->store_content_dirty;
+    }
+    self->store_dirty = 0;
+    self->store_content_dirty = 0;
+    return rv;
+}
+
+//  --------------------------------------------------------------------------
+//  Destroy the zm_devices
+
+int
+zm_devices_insert (zm_devices_t *self, zm_proto_t *msg)
+{
+    assert (self);
+
+    // zm_proto_t will be overwritten on another mlm_client_recv, so keep
+    // compact copy, which is also a cheap way to find out nothing changed
+
+    // TODO
+    // see: zm-proto issue#1, zhash inside message DOES NOT own memory
+    //      we need to find a solution
+    //zm_proto_aux_insert (msg, "x-zm-devices-time", "%zu", (uint64_t) zclock_mono ());
+    return s_devices_put (self, msg, NULL);
+}
+
+int
+zm_devices_touch (zm_devices_t *self, const char *name, uint64_t time)
 {
-    assert (self_p);
-    if (*self_p) {
-        zm_devices_t *self = *self_p;
-        //  Free class properties here
+    assert (self);
+    if (!name)
+        return -1;
 
-        zhashx_destroy (&self->devices);
-        zstr_free (&self->file);
-        zhashx_destroy (&self->devices);
-        //  Free object itself
-        free (self);
-        *self_p = NULL;
+    s_record_t *record = s_devices_fetch (self, name);
+    if (!record)
+        return -1;
+
+    //  Device returned by lookup might be changed by the caller, so start
+    //  from stored bytes
+    zm_proto_t *device = zm_proto_new ();
+    if (s_record_copy (self, record, device) == -1) {
+        zm_proto_destroy (&device);
+        return -1;
     }
+    zm_proto_set_time (device, time);
+    s_devices_put (self, device, NULL);
+    zm_proto_destroy (&device);
+    return 0;
 }
 
-const char*
-zm_devices_file (zm_devices_t *self)
+zm_proto_t*
+zm_devices_lookup (zm_devices_t *self, const char* name)
 {
     assert (self);
-    return (const char*) self->file;
+    if (!name)
+        return NULL;
+
+    s_record_t *record = s_devices_fetch (self, name);
+    if (record && record->expires && record->expires <= zclock_mono ())
+        return NULL;
+    return s_record_device (self, record);
 }
 
-void
-zm_devices_set_file (zm_devices_t *self, const char *file)
+zmsg_t *
+zm_devices_lookup_msg (zm_devices_t *self, const char *name)
 {
     assert (self);
-    zstr_free (&self->file);
-    self->file = strdup (file);
+    if (!name)
+        return NULL;
+
+    s_record_t *record = s_devices_fetch (self, name);
+    if (!record || (record->expires && record->expires <= zclock_mono ()))
+        return NULL;
+    byte *data = s_record_data (self, record);
+    if (!data)
+        return NULL;
+    zm_proto_t *device = s_record_view (self, record, data);
+    return device ? s_device_msg (device) : NULL;
 }
 
-zm_proto_t *zm_devices_first (zm_devices_t *self)
+zmsg_t *
+zm_devices_first_msg (zm_devices_t *self)
 {
     assert (self);
-    return (zm_proto_t *) zhashx_first (self->devices);
+    s_devices_hydrate_all (self);
+    s_order_settle (self);
+    self->order_cursor = 0;
+    return zm_devices_next_msg (self);
 }
 
-zm_proto_t *zm_devices_next (zm_devices_t *self)
+zmsg_t *
+zm_devices_next_msg (zm_devices_t *self)
 {
     assert (self);
-    return (zm_proto_t *) zhashx_next (self->devices);
+    //  Cold devices are read aside, walking all of them is not a use.
+    //  Device which can't be read is skipped, so NULL is only the end.
+    s_record_t *record = s_order_next (self);
+    while (record) {
+        zframe_t *cold = record->data ? NULL : s_record_frame (self, record);
+        const byte *data = cold ? zframe_data (cold) : record->data;
+        zmsg_t *msg = NULL;
+        if (data) {
+            self->device_record = NULL;
+            if (s_record_decode (self->dict, record->name, data, record->size, self->device) == 0)
+                msg = s_device_msg (self->device);
+        }
+        zframe_destroy (&cold);
+        if (msg)
+            return msg;
+        zsys_error ("zm_devices: skipping unreadable device %s", record->name);
+        record = s_order_next (self);
+    }
+    return NULL;
 }
 
-size_t zm_devices_size (zm_devices_t *self)
+void
+zm_devices_delete (zm_devices_t *self, const char* name)
 {
     assert (self);
-    return zhashx_size (self->devices);
+    if (!name)
+        return;
+
+    if (self->journal && s_devices_fetch (self, name))
+        zm_journal_delete (self->journal, name);
+    s_devices_remove (self, name);
 }
 
 int
-zm_devices_store (zm_devices_t *self)
+zm_devices_index (zm_devices_t *self, const char *key)
 {
     assert (self);
-    if (self->file) {
-        zconfig_t *root = zconfig_new ("root", NULL);
-        zm_proto_t *device = (zm_proto_t*) zhashx_first (self->devices);
-        while (device) {
-            zm_proto_zpl (device, root);
-            device = (zm_proto_t*) zhashx_next (self->devices);
-        }
-        zconfig_save (root, self->file);
-        zconfig_destroy (&root);
+    assert (key);
+    if (zhashx_lookup (self->indexes, key))
+        return 0;
+
+    //  Devices still in lazily loaded snapshot join the index as they
+    //  hydrate, zm_devices_query hydrates all before using it
+
+    s_index_t *index = s_index_new ();
+    zhashx_insert (self->indexes, key, index);
+    s_record_t *record = (s_record_t *) zhashx_first (self->devices);
+    while (record) {
+        //  Read cold devices aside, not to churn the hot ones
+        zframe_t *frame = s_record_frame (self, record);
+        const char *value = frame
+            ? s_record_value (self->dict, zframe_data (frame), zframe_size (frame), key)
+            : NULL;
+        if (value)
+            s_index_set (index, record->name, value, record);
+        zframe_destroy (&frame);
+        record = (s_record_t *) zhashx_next (self->devices);
     }
     return 0;
+}
+
+zlistx_t *
+zm_devices_query (zm_devices_t *self, zhash_t *filter, const char *prefix, const char *glob)
+{
+    assert (self);
+    zlistx_t *names = s_names_new ();
+    zlistx_set_comparator (names, (zlistx_comparator_fn *) strcmp);
+
+    //  Visit the smallest set of devices some index gives for a value.
+    //  Indexes know no pending devices, those are walked below.
+    zhashx_t *candidates = self->devices;
+    const char *value = filter ? (const char *) zhash_first (filter) : NULL;
+    while (value) {
+        const char *key = zhash_cursor (filter);
+        s_index_t *index = *key == '_' ? NULL : (s_index_t *) zhashx_lookup (self->indexes, key);
+        if (index) {
+            zhashx_t *set = (zhashx_t *) zhashx_lookup (index->values, value);
+            if (!set) {
+                candidates = NULL;
+                break;
+            }
+            if (zhashx_size (set) < zhashx_size (candidates))
+                candidates = set;
+        }
+        value = (const char *) zhash_next (filter);
+    }
+
+    int64_t now = zclock_mono ();
+    size_t prefix_size = prefix ? strlen (prefix) : 0;
+    //  Cold devices are read aside, warming them up would evict and compact
+    //  records under the walk
+    s_record_t *record = candidates ? (s_record_t *) zhashx_first (candidates) : NULL;
+    while (record) {
+        const char *name = record->name;
+        bool match = !(record->expires && record->expires <= now)
+                  && (!prefix || strncmp (name, prefix, prefix_size) == 0)
+                  && (!glob || fnmatch (glob, name, 0) == 0);
+
+        value = match && filter ? (const char *) zhash_first (filter) : NULL;
+        while (value) {
+            const char *key = zhash_cursor (filter);
+            if (*key != '_') {
+                s_index_t *index = (s_index_t *) zhashx_lookup (self->indexes, key);
+                zframe_t *frame = index || record->data ? NULL : s_record_frame (self, record);
+                const char *has;
+                if (index)
+                    has = (const char *) zhashx_lookup (index->names, name);
+                else
+                if (record->data)
+                    has = s_record_value (self->dict, record->data, record->size, key);
+                else
+                    has = frame
+                        ? s_record_value (self->dict, zframe_data (frame), zframe_size (frame), key)
+                        : NULL;
+                match = has && streq (has, value);
+                zframe_destroy (&frame);
+                if (!match)
+                    break;
+            }
+            value = (const char *) zhash_next (filter);
+        }
+        if (match)
+            zlistx_add_end (names, (void *) record->name);
+        record = (s_record_t *) zhashx_next (candidates);
+    }
+
+    //  Pending devices are read aside too, hydrating them all would defeat
+    //  lazy load. They did not get expiry yet.
+    void *offset = self->pending ? zhashx_first (self->pending) : NULL;
+    while (offset) {
+        const char *name = (const char *) zhashx_cursor (self->pending);
+        bool match = (!prefix || strncmp (name, prefix, prefix_size) == 0)
+                  && (!glob || fnmatch (glob, name, 0) == 0);
+        value = match && filter ? (const char *) zhash_first (filter) : NULL;
+        zm_proto_t *device = NULL;
+        while (value) {
+            const char *key = zhash_cursor (filter);
+            if (*key != '_') {
+                if (!device) {
+                    size_t size;
+                    const byte *data = zm_snapshot_read (self->lazy, (size_t) (uintptr_t) offset, &size);
+                    zframe_t *frame = data ? zframe_new (data, size) : NULL;
+                    device = frame ? s_device_decode (frame) : NULL;
+                    zframe_destroy (&frame);
+                }
+                const char *has = device
+                    ? (const char *) zhash_lookup (zm_proto_ext (device), key)
+                    : NULL;
+                match = has && streq (has, value);
+                if (!match)
+                    break;
+            }
+            value = (const char *) zhash_next (filter);
+        }
+        zm_proto_destroy (&device);
+        if (match)
+            zlistx_add_end (names, (void *) name);
+        offset = zhashx_next (self->pending);
+    }
+    //  Same order as zm_devices_prefix and GET-ALL
+    zlistx_sort (names);
+    return names;
+}
 
+int64_t
+zm_devices_epoch (zm_devices_t *self)
+{
+    assert (self);
+    return self->epoch;
 }
 
-//  --------------------------------------------------------------------------
-//  Destroy the zm_devices
+uint64_t
+zm_devices_version (zm_devices_t *self)
+{
+    assert (self);
+    return self->version;
+}
 
 void
-zm_devices_insert (zm_devices_t *self, zm_proto_t *msg)
+zm_devices_set_changes_max (zm_devices_t *self, size_t max)
 {
     assert (self);
+    if (max == self->changes_max)
+        return;
+    s_changes_reset (self);
+    self->changes_max = max;
+}
 
-    const char *device = zm_proto_device (msg);
-    // zm_proto_t will be overwritten on another mlm_client_recv
-    // so duplicate it
-    zm_proto_t *dev = zm_proto_dup (msg);
-
-    // TODO
-    // see: zm-proto issue#1, zhash inside message DOES NOT own memory
-    //      we need to find a solution
-    //zm_proto_aux_insert (msg, "x-zm-devices-time", "%zu", (uint64_t) zclock_mono ());
-    zhashx_update (self->devices, device, (void*)dev);
+void
+zm_devices_set_decoders (zm_devices_t *self, size_t decoders)
+{
+    assert (self);
+    self->decoders = decoders;
 }
 
-zm_proto_t*
-zm_devices_lookup (zm_devices_t *self, const char* name)
+zlistx_t *
+zm_devices_changes (zm_devices_t *self, uint64_t version)
 {
     assert (self);
-    if (!name)
+    if (version > self->version
+    ||  self->version - version > self->changes_size)
         return NULL;
 
-    //TODO:
-    //zm_devices_gc (self);
-    return (zm_proto_t*) zhashx_lookup (self->devices, name);
+    //  Walk back from the newest, so each name is listed at its last change
+    zlistx_t *names = s_names_new ();
+    zhashx_t *seen = zhashx_new ();
+    assert (seen);
+    uint64_t current;
+    for (current = self->version; current > version; current--) {
+        const char *name = self->changes [(current - 1) % self->changes_max];
+        if (!zhashx_lookup (seen, name)) {
+            zhashx_insert (seen, name, (void *) names);
+            zlistx_add_start (names, (void *) name);
+        }
+    }
+    zhashx_destroy (&seen);
+    return names;
 }
 
-void
-zm_devices_delete (zm_devices_t *self, const char* name)
+zm_proto_t *
+zm_devices_expire (zm_devices_t *self, int64_t now)
 {
     assert (self);
-    if (!name)
-        return;
+    if (!self->heap_size || self->heap [0]->expires > now)
+        return NULL;
 
-    //TODO:
-    //zm_devices_gc (self);
-    zhashx_delete (self->devices, name);
+    s_record_t *record = self->heap [0];
+    zm_proto_t *device = zm_proto_new ();
+    if (s_record_copy (self, record, device) == -1)
+        zm_proto_destroy (&device);
+    if (self->journal)
+        zm_journal_delete (self->journal, record->name);
+    s_devices_remove (self, record->name);
+    return device;
 }
 
 //  --------------------------------------------------------------------------
@@ -230,6 +2910,40 @@ zm_devices_test (bool verbose)
     assert (zm_devices_lookup (self, "device2"));
     assert (zm_devices_lookup (self, "device3"));
 
+    //  Same content keeps stored device in place
+    zm_proto_t *device2 = zm_devices_lookup (self, "device2");
+    dev = zm_proto_dup (device2);
+    r = zm_devices_insert (self, dev);
+    assert (r == 0);
+    assert (zm_devices_lookup (self, "device2") == device2);
+    zm_proto_encode_device (dev, "device2", zclock_mono () + 1, 20000, NULL);
+    r = zm_devices_insert (self, dev);
+    assert (r == 1);
+    assert (zm_proto_ttl (zm_devices_lookup (self, "device2")) == 20000);
+
+    //  New time alone is stored, but it's not a change
+    zm_proto_encode_device (dev, "device2", 42, 20000, NULL);
+    r = zm_devices_insert (self, dev);
+    assert (r == 0);
+    assert (zm_proto_time (zm_devices_lookup (self, "device2")) == 42);
+    zhash_t *ext = zhash_new ();
+    zhash_insert (ext, "ip.1", "10.0.0.1");
+    zm_proto_encode_device (dev, "device2", 42, 20000, ext);
+    r = zm_devices_insert (self, dev);
+    assert (r == 1);
+    zhash_insert (ext, "_seq", "1");
+    zm_proto_encode_device (dev, "device2", 42, 20000, ext);
+    r = zm_devices_insert (self, dev);
+    assert (r == 0);
+    zhash_destroy (&ext);
+    zm_proto_destroy (&dev);
+
+    r = zm_devices_touch (self, "device2", 43);
+    assert (r == 0);
+    assert (zm_proto_time (zm_devices_lookup (self, "device2")) == 43);
+    r = zm_devices_touch (self, "nonexistent", 43);
+    assert (r == -1);
+
     zm_devices_set_file (self, ".test/devices.zpl");
     r = zm_devices_store (self);
     assert (r == 0);
@@ -242,12 +2956,698 @@ zm_devices_test (bool verbose)
     assert (zm_devices_lookup (devices2, "device2"));
     assert (zm_devices_lookup (devices2, "device3"));
 
+    zlistx_t *names = zm_devices_names (devices2);
+    assert (zlistx_size (names) == 3);
+    zlistx_destroy (&names);
+
     zm_proto_t *device3_old = zm_devices_lookup (self, "device3");
     zm_proto_t *device3_new = zm_devices_lookup (self, "device3");
     assert (streq (zm_proto_device (device3_old), zm_proto_device (device3_new)));
 
+    //  Changes after store survive through the journal
+    r = zm_devices_journal_open (devices2, 0);
+    assert (r == 0);
+    zm_devices_delete (devices2, "device1");
+    dev = zm_proto_new ();
+    zm_proto_encode_device (dev, "device4", zclock_mono (), 10000, NULL);
+    zm_devices_insert (devices2, dev);
+    zm_proto_destroy (&dev);
+    assert (zm_devices_journal_size (devices2) == 2);
+    assert (zm_devices_dirty (devices2) == 2);
+    r = zm_devices_sync (devices2);
+    assert (r == 0);
+    zm_devices_destroy (&devices2);
+
+    devices2 = zm_devices_new (".test/devices.zpl");
+    assert (devices2);
+    assert (!zm_devices_lookup (devices2, "device1"));
+    assert (zm_devices_lookup (devices2, "device4"));
+    assert (zm_devices_size (devices2) == 3);
+
+    //  Store folds journal into snapshot
+    r = zm_devices_journal_open (devices2, 0);
+    assert (r == 0);
+    assert (zm_devices_dirty (devices2) == 2);
+    r = zm_devices_store (devices2);
+    assert (r == 0);
+    assert (zm_devices_journal_size (devices2) == 0);
+    assert (zm_devices_dirty (devices2) == 0);
+    zm_devices_destroy (&devices2);
+    devices2 = zm_devices_new (".test/devices.zpl");
+    assert (devices2);
+    assert (zm_devices_size (devices2) == 3);
+
+    //  Background store keeps changes made meanwhile in the new journal
+    r = zm_devices_journal_open (devices2, 0);
+    assert (r == 0);
+    r = zm_devices_store_start (devices2);
+    assert (r == 0);
+    assert (zm_devices_store_actor (devices2));
+    assert (zm_devices_store_start (devices2) == -1);
+    dev = zm_proto_new ();
+    zm_proto_encode_device (dev, "device5", zclock_mono (), 10000, NULL);
+    zm_devices_insert (devices2, dev);
+    zm_proto_destroy (&dev);
+    assert (zm_devices_journal_size (devices2) == 1);
+    assert (zm_devices_dirty (devices2) == 1);
+    assert (zm_devices_dirty_content (devices2) == 1);
+    //  Refreshed time is dirty, but not a change of content
+    r = zm_devices_touch (devices2, "device5", zclock_mono ());
+    assert (r == 0);
+    assert (zm_devices_dirty (devices2) == 2);
+    assert (zm_devices_dirty_content (devices2) == 1);
+    r = zm_devices_sync (devices2);
+    assert (r == 0);
+    r = zm_devices_store_finish (devices2);
+    assert (r == 0);
+    assert (!zm_devices_store_actor (devices2));
+    assert (!zsys_file_exists (".test/devices.zpl.journal.old"));
+    zm_devices_destroy (&devices2);
+    devices2 = zm_devices_new (".test/devices.zpl");
+    assert (devices2);
+    assert (zm_devices_size (devices2) == 4);
+    zm_devices_delete (devices2, "device5");
+
+    //  Binary snapshot, ZPL stays as import/export path
+    zm_devices_set_file (devices2, ".test/devices.bin");
+    assert (zm_devices_format (devices2) == ZM_DEVICES_BINARY);
+    r = zm_devices_store (devices2);
+    assert (r == 0);
+    assert (zm_snapshot_probe (".test/devices.bin"));
+    r = zm_devices_export (devices2, ".test/export.zpl", ZM_DEVICES_ZPL);
+    assert (r == 0);
+    zm_devices_destroy (&devices2);
+
+    devices2 = zm_devices_new (".test/devices.bin");
+    assert (devices2);
+    assert (zm_devices_size (devices2) == 3);
+    assert (zm_devices_lookup (devices2, "device4"));
+    zm_devices_destroy (&devices2);
+
+    //  Lazy load hydrates looked up device first, the rest on demand
+    devices2 = zm_devices_new_lazy (".test/devices.bin");
+    assert (devices2);
+    assert (zm_devices_size (devices2) == 3);
+    assert (zm_devices_pending (devices2) == 3);
+    assert (zm_devices_lookup (devices2, "device4"));
+    assert (zm_devices_pending (devices2) == 2);
+    assert (!zm_devices_lookup (devices2, "device1"));
+    assert (zm_devices_hydrate (devices2, 1) == 1);
+    assert (zm_devices_version (devices2) == 0);
+    assert (zm_devices_dirty (devices2) == 0);
+    zm_devices_delete (devices2, "device3");
+    assert (zm_devices_version (devices2) == 1);
+    assert (zm_devices_size (devices2) == 2);
+    names = zm_devices_names (devices2);
+    assert (zlistx_size (names) == 2);
+    zlistx_destroy (&names);
+    assert (zm_devices_pending (devices2) == 0);
+    zm_devices_destroy (&devices2);
+
+    //  Index and query leave lazily loaded devices pending
+    devices2 = zm_devices_new_lazy (".test/devices.bin");
+    assert (devices2);
+    r = zm_devices_index (devices2, "type");
+    assert (r == 0);
+    assert (zm_devices_pending (devices2) == 3);
+    dev = zm_proto_new ();
+    ext = zhash_new ();
+    zhash_update (ext, "type", "ups");
+    zm_proto_encode_device (dev, "device6", zclock_mono (), 10000, ext);
+    zm_devices_insert (devices2, dev);
+    zm_proto_destroy (&dev);
+    zhash_destroy (&ext);
+    assert (zm_devices_pending (devices2) == 3);
+    ext = zhash_new ();
+    zhash_insert (ext, "type", "ups");
+    names = zm_devices_query (devices2, ext, NULL, NULL);
+    assert (zlistx_size (names) == 1);
+    assert (streq ((const char *) zlistx_first (names), "device6"));
+    zlistx_destroy (&names);
+    zhash_destroy (&ext);
+    assert (zm_devices_pending (devices2) == 3);
+    //  Pending devices match too, all in name order
+    names = zm_devices_query (devices2, NULL, "device", NULL);
+    assert (zlistx_size (names) == 4);
+    const char *last = (const char *) zlistx_first (names);
+    const char *next = (const char *) zlistx_next (names);
+    while (next) {
+        assert (strcmp (last, next) < 0);
+        last = next;
+        next = (const char *) zlistx_next (names);
+    }
+    assert (streq (last, "device6"));
+    zlistx_destroy (&names);
+    assert (zm_devices_pending (devices2) == 3);
+    zm_devices_destroy (&devices2);
+
+    //  Background store writes lazily loaded devices as they are, even
+    //  when they hydrate or change meanwhile
+    devices2 = zm_devices_new_lazy (".test/devices.bin");
+    assert (devices2);
+    assert (zm_devices_lookup (devices2, "device4"));
+    assert (zm_devices_pending (devices2) == 2);
+    r = zm_devices_store_start (devices2);
+    assert (r == 0);
+    assert (zm_devices_pending (devices2) == 2);
+    zm_devices_delete (devices2, "device4");
+    assert (zm_devices_hydrate (devices2, SIZE_MAX) == 0);
+    r = zm_devices_store_finish (devices2);
+    assert (r == 0);
+    zm_devices_destroy (&devices2);
+    devices2 = zm_devices_new (".test/devices.bin");
+    assert (devices2);
+    assert (zm_devices_size (devices2) == 3);
+    assert (zm_devices_lookup (devices2, "device4"));
+    zm_devices_destroy (&devices2);
+
+    devices2 = zm_devices_new (NULL);
+    r = zm_devices_import (devices2, ".test/export.zpl");
+    assert (r == 0);
+    assert (zm_devices_size (devices2) == 3);
+
+    //  Snapshot of many segments loads the same, whatever the decoders
+    zm_devices_t *many = zm_devices_new (NULL);
+    zm_devices_set_file (many, ".test/many.bin");
+    dev = zm_proto_new ();
+    int i;
+    for (i = 0; i < 40000; i++) {
+        char name [32];
+        snprintf (name, sizeof (name), "many.%05d", i);
+        zm_proto_encode_device (dev, name, i, i % 2 ? 60000 : 0, NULL);
+        zm_devices_insert (many, dev);
+    }
+    zm_proto_destroy (&dev);
+    r = zm_devices_store (many);
+    assert (r == 0);
+    zm_devices_destroy (&many);
+    many = zm_devices_new (".test/many.bin");
+    assert (many);
+    assert (zm_devices_size (many) == 40000);
+    assert (zm_devices_dirty (many) == 0);
+    assert (zm_proto_time (zm_devices_lookup (many, "many.39999")) == 39999);
+    names = zm_devices_names (many);
+    assert (streq ((char *) zlistx_first (names), "many.00000"));
+    zlistx_destroy (&names);
+    //  File already holds them, store has nothing to write until a change
+    zsys_file_delete (".test/many.bin");
+    r = zm_devices_store (many);
+    assert (r == 0);
+    assert (!zsys_file_exists (".test/many.bin"));
+    zm_devices_delete (many, "many.00000");
+    r = zm_devices_store (many);
+    assert (r == 0);
+    assert (zsys_file_exists (".test/many.bin"));
+    zm_devices_destroy (&many);
+    //  Both serial and parallel decoding, whatever cores this machine has
+    size_t decoders;
+    for (decoders = 1; decoders <= 4; decoders += 3) {
+        many = zm_devices_new (NULL);
+        zm_devices_set_decoders (many, decoders);
+        r = zm_devices_index (many, "type");
+        assert (r == 0);
+        r = zm_devices_import (many, ".test/many.bin");
+        assert (r == 0);
+        assert (zm_devices_size (many) == 39999);
+        assert (!zm_devices_lookup (many, "many.00000"));
+        dev = zm_devices_lookup (many, "many.39999");
+        assert (dev);
+        assert (zm_proto_time (dev) == 39999);
+        assert (zm_proto_ttl (dev) == 60000);
+        assert (zm_proto_ttl (zm_devices_lookup (many, "many.39998")) == 0);
+        names = zm_devices_names (many);
+        assert (zlistx_size (names) == 39999);
+        assert (streq ((char *) zlistx_first (names), "many.00001"));
+        assert (streq ((char *) zlistx_last (names), "many.39999"));
+        zlistx_destroy (&names);
+        zm_devices_destroy (&many);
+    }
+
+    zm_devices_destroy (&self);
+    zm_devices_destroy (&devices2);
+
+    //  Queries, with and without index
+    self = zm_devices_new (NULL);
+    ext = zhash_new ();
+    dev = zm_proto_new ();
+    zhash_update (ext, "type", "ups");
+    zhash_update (ext, "location", "rack1");
+    zm_proto_encode_device (dev, "ups-1", 0, 0, ext);
+    zm_devices_insert (self, dev);
+    zhash_update (ext, "location", "rack2");
+    zm_proto_encode_device (dev, "ups-2", 0, 0, ext);
+    zm_devices_insert (self, dev);
+    zhash_update (ext, "type", "epdu");
+    zm_proto_encode_device (dev, "epdu-1", 0, 0, ext);
+    zm_devices_insert (self, dev);
+
+    zhash_t *filter = zhash_new ();
+    zhash_insert (filter, "type", "ups");
+    names = zm_devices_query (self, filter, NULL, NULL);
+    assert (zlistx_size (names) == 2);
+    zlistx_destroy (&names);
+
+    r = zm_devices_index (self, "type");
+    assert (r == 0);
+    names = zm_devices_query (self, filter, NULL, NULL);
+    assert (zlistx_size (names) == 2);
+    zlistx_destroy (&names);
+    zhash_insert (filter, "location", "rack2");
+    names = zm_devices_query (self, filter, NULL, NULL);
+    assert (zlistx_size (names) == 1);
+    assert (streq ((char *) zlistx_first (names), "ups-2"));
+    zlistx_destroy (&names);
+
+    //  Index follows changes
+    zhash_update (ext, "type", "ups");
+    zm_proto_encode_device (dev, "epdu-1", 0, 0, ext);
+    zm_devices_insert (self, dev);
+    names = zm_devices_query (self, filter, NULL, NULL);
+    assert (zlistx_size (names) == 2);
+    zlistx_destroy (&names);
+    zm_devices_delete (self, "ups-2");
+    names = zm_devices_query (self, filter, "epdu", NULL);
+    assert (zlistx_size (names) == 1);
+    zlistx_destroy (&names);
+    zhash_update (filter, "type", "none");
+    names = zm_devices_query (self, filter, NULL, NULL);
+    assert (zlistx_size (names) == 0);
+    zlistx_destroy (&names);
+
+    names = zm_devices_query (self, NULL, NULL, "*-1");
+    assert (zlistx_size (names) == 2);
+    zlistx_destroy (&names);
+    zhash_destroy (&filter);
+    zhash_destroy (&ext);
+    zm_proto_destroy (&dev);
+    zm_devices_destroy (&self);
+
+    //  Keys and common values are interned, unique ones stay in the record
+    self = zm_devices_new (NULL);
+    zm_devices_set_file (self, ".test/compact.bin");
+    ext = zhash_new ();
+    dev = zm_proto_new ();
+    zhash_update (ext, "type", "ups");
+    for (i = 0; i < 1000; i++) {
+        char name [32];
+        snprintf (name, sizeof (name), "compact%d", i);
+        zm_proto_encode_device (dev, name, i, 0, ext);
+        zm_devices_insert (self, dev);
+    }
+    //  Time, ttl and a byte for each of count, key and value
+    assert (zm_devices_hot_bytes (self) == 1000 * (8 + 4 + 3));
+    char description [101];
+    memset (description, 'x', 100);
+    description [100] = 0;
+    zhash_update (ext, "description", description);
+    for (i = 0; i < 1000; i++) {
+        char name [32];
+        char serial [32];
+        snprintf (name, sizeof (name), "compact%d", i);
+        snprintf (serial, sizeof (serial), "sn-%d", i);
+        zhash_update (ext, "serial", serial);
+        zm_proto_encode_device (dev, name, i, 0, ext);
+        r = zm_devices_insert (self, dev);
+        assert (r == 1);
+    }
+    zm_proto_t *compact = zm_devices_lookup (self, "compact999");
+    assert (compact);
+    assert (streq (zhash_lookup (zm_proto_ext (compact), "type"), "ups"));
+    assert (streq (zhash_lookup (zm_proto_ext (compact), "serial"), "sn-999"));
+    assert (streq (zhash_lookup (zm_proto_ext (compact), "description"), description));
+    zmsg_t *compact_msg = zm_devices_lookup_msg (self, "compact0");
+    assert (compact_msg);
+    r = zm_proto_recv (dev, compact_msg);
+    assert (r == 0);
+    zmsg_destroy (&compact_msg);
+    assert (streq (zm_proto_device (dev), "compact0"));
+    assert (streq (zhash_lookup (zm_proto_ext (dev), "serial"), "sn-0"));
+    filter = zhash_new ();
+    zhash_insert (filter, "serial", "sn-500");
+    names = zm_devices_query (self, filter, NULL, NULL);
+    assert (zlistx_size (names) == 1);
+    assert (streq ((char *) zlistx_first (names), "compact500"));
+    zlistx_destroy (&names);
+    zhash_destroy (&filter);
+    r = zm_devices_store (self);
+    assert (r == 0);
+    zm_devices_destroy (&self);
+    self = zm_devices_new (".test/compact.bin");
+    assert (self);
+    assert (zm_devices_size (self) == 1000);
+    compact = zm_devices_lookup (self, "compact0");
+    assert (streq (zhash_lookup (zm_proto_ext (compact), "serial"), "sn-0"));
+    assert (zm_proto_time (zm_devices_lookup (self, "compact999")) == 999);
+    zhash_destroy (&ext);
+    zm_proto_destroy (&dev);
+    zm_devices_destroy (&self);
+
+    //  Names in order and by prefix
+    self = zm_devices_new (NULL);
+    dev = zm_proto_new ();
+    const char *hierarchy [] = {
+        "dc1.rack12.pdu3", "dc2.rack1.ups1", "dc1.rack12.pdu1", "dc1.rack1.pdu1",
+        "dc1.rack12.ups1", "dc1", NULL
+    };
+    for (i = 0; hierarchy [i]; i++) {
+        zm_proto_encode_device (dev, hierarchy [i], 0, 0, NULL);
+        zm_devices_insert (self, dev);
+    }
+    zm_proto_destroy (&dev);
+    names = zm_devices_names (self);
+    assert (streq ((char *) zlistx_first (names), "dc1"));
+    assert (streq ((char *) zlistx_next (names), "dc1.rack1.pdu1"));
+    assert (streq ((char *) zlistx_next (names), "dc1.rack12.pdu1"));
+    zlistx_destroy (&names);
+    assert (streq (zm_proto_device (zm_devices_first (self)), "dc1"));
+    assert (streq (zm_proto_device (zm_devices_next (self)), "dc1.rack1.pdu1"));
+
+    assert (zm_devices_prefix_size (self, "dc1.rack12.") == 3);
+    assert (zm_devices_prefix_size (self, "dc3") == 0);
+    assert (zm_devices_prefix_size (self, NULL) == 6);
+    names = zm_devices_prefix (self, "dc1.rack12.", NULL, 2);
+    assert (zlistx_size (names) == 2);
+    assert (streq ((char *) zlistx_first (names), "dc1.rack12.pdu1"));
+    assert (streq ((char *) zlistx_next (names), "dc1.rack12.pdu3"));
+    zlistx_destroy (&names);
+    names = zm_devices_prefix (self, "dc1.rack12.", "dc1.rack12.pdu3", 0);
+    assert (zlistx_size (names) == 1);
+    assert (streq ((char *) zlistx_first (names), "dc1.rack12.ups1"));
+    zlistx_destroy (&names);
+
+    zm_devices_delete (self, "dc1.rack12.pdu1");
+    assert (zm_devices_prefix_size (self, "dc1.rack12.") == 2);
+    names = zm_devices_prefix (self, "dc2", NULL, 0);
+    assert (zlistx_size (names) == 1);
+    zlistx_destroy (&names);
+
+    //  Expired device is neither listed nor counted
+    dev = zm_proto_new ();
+    zm_proto_encode_device (dev, "dc2.rack1.old", 0, 1, NULL);
+    zm_devices_insert (self, dev);
+    zm_proto_destroy (&dev);
+    zclock_sleep (5);
+    assert (zm_devices_prefix_size (self, "dc2") == 1);
+    names = zm_devices_prefix (self, "dc2", NULL, 0);
+    assert (zlistx_size (names) == 1);
+    zlistx_destroy (&names);
+
+    //  Walk keeps its place while devices come and go around it
+    assert (streq (zm_proto_device (zm_devices_first (self)), "dc1"));
+    zm_devices_delete (self, "dc1.rack1.pdu1");
+    dev = zm_proto_new ();
+    zm_proto_encode_device (dev, "dc0", 0, 0, NULL);
+    zm_devices_insert (self, dev);
+    zm_proto_destroy (&dev);
+    assert (zm_devices_prefix_size (self, "dc0") == 1);
+    assert (streq (zm_proto_device (zm_devices_next (self)), "dc1.rack12.pdu3"));
+    zm_devices_destroy (&self);
+
+    //  Scattered inserts and removals settle into one sorted order
+    self = zm_devices_new (NULL);
+    dev = zm_proto_new ();
+    for (i = 0; i < 20000; i++) {
+        char name [32];
+        snprintf (name, sizeof (name), "scatter.%05d", (i * 7919) % 20000);
+        zm_proto_encode_device (dev, name, 0, 0, NULL);
+        zm_devices_insert (self, dev);
+    }
+    for (i = 0; i < 20000; i += 2) {
+        char name [32];
+        snprintf (name, sizeof (name), "scatter.%05d", i);
+        zm_devices_delete (self, name);
+    }
+    zm_proto_destroy (&dev);
+    assert (zm_devices_prefix_size (self, "scatter.") == 10000);
+    names = zm_devices_names (self);
+    assert (zlistx_size (names) == 10000);
+    const char *previous = (const char *) zlistx_first (names);
+    assert (streq (previous, "scatter.00001"));
+    const char *current = (const char *) zlistx_next (names);
+    while (current) {
+        assert (strcmp (previous, current) < 0);
+        previous = current;
+        current = (const char *) zlistx_next (names);
+    }
+    zlistx_destroy (&names);
+    zm_devices_destroy (&self);
+
+    //  Devices expire one by one, soonest first
+    self = zm_devices_new (NULL);
+    dev = zm_proto_new ();
+    zm_proto_encode_device (dev, "expire3", 0, 30000, NULL);
+    zm_devices_insert (self, dev);
+    zm_proto_encode_device (dev, "expire1", 0, 10000, NULL);
+    zm_devices_insert (self, dev);
+    zm_proto_encode_device (dev, "expire2", 0, 20000, NULL);
+    zm_devices_insert (self, dev);
+    zm_proto_encode_device (dev, "forever", 0, 0, NULL);
+    zm_devices_insert (self, dev);
+    zm_proto_destroy (&dev);
+    int64_t now = zclock_mono ();
+    assert (!zm_devices_expire (self, now));
+    dev = zm_devices_expire (self, now + 25000);
+    assert (dev);
+    assert (streq (zm_proto_device (dev), "expire1"));
+    zm_proto_destroy (&dev);
+    dev = zm_devices_expire (self, now + 25000);
+    assert (dev);
+    assert (streq (zm_proto_device (dev), "expire2"));
+    zm_proto_destroy (&dev);
+    assert (!zm_devices_expire (self, now + 25000));
+    r = zm_devices_touch (self, "expire3", 0);
+    assert (r == 0);
+    dev = zm_devices_expire (self, zclock_mono () + 30000);
+    assert (dev);
+    zm_proto_destroy (&dev);
+    assert (!zm_devices_expire (self, INT64_MAX));
+    assert (zm_devices_size (self) == 1);
+    assert (zm_devices_lookup (self, "forever"));
+    zm_devices_destroy (&self);
+
+    //  Change log lists each name once, at its last change
+    self = zm_devices_new (NULL);
+    zm_devices_set_changes_max (self, 3);
+    dev = zm_proto_new ();
+    zm_proto_encode_device (dev, "change1", 0, 0, NULL);
+    zm_devices_insert (self, dev);
+    zm_proto_encode_device (dev, "change2", 0, 0, NULL);
+    zm_devices_insert (self, dev);
+    zm_proto_encode_device (dev, "change1", 1, 0, NULL);
+    zm_devices_insert (self, dev);
+    zm_proto_destroy (&dev);
+    assert (zm_devices_version (self) == 2);
+    zm_devices_delete (self, "change1");
+    zm_devices_delete (self, "unknown");
+    assert (zm_devices_version (self) == 3);
+    names = zm_devices_changes (self, 0);
+    assert (names);
+    assert (zlistx_size (names) == 2);
+    assert (streq ((char *) zlistx_first (names), "change2"));
+    assert (streq ((char *) zlistx_next (names), "change1"));
+    zlistx_destroy (&names);
+    names = zm_devices_changes (self, 3);
+    assert (names && zlistx_size (names) == 0);
+    zlistx_destroy (&names);
+    assert (!zm_devices_changes (self, 4));
+    zm_devices_touch (self, "change2", 5);
+    zm_devices_delete (self, "change2");
+    assert (!zm_devices_changes (self, 0));
+    names = zm_devices_changes (self, 1);
+    assert (names && zlistx_size (names) == 2);
+    zlistx_destroy (&names);
+    zm_devices_destroy (&self);
+
+    //  Replaced devices are compacted away, memory stays bounded
+    self = zm_devices_new (NULL);
+    dev = zm_proto_new ();
+    for (i = 0; i < 50000; i++) {
+        char name [32];
+        snprintf (name, sizeof (name), "device%d", i % 100);
+        zm_proto_encode_device (dev, name, i, 10000, NULL);
+        zm_devices_insert (self, dev);
+    }
+    zm_proto_destroy (&dev);
+    assert (zm_devices_size (self) == 100);
+    assert (zm_devices_allocated (self) <= 4 * ZM_DEVICES_CHUNK);
+    assert (zm_proto_time (zm_devices_lookup (self, "device99")) == 49999);
+    for (i = 0; i < 100; i++) {
+        char name [32];
+        snprintf (name, sizeof (name), "device%d", i);
+        zm_devices_delete (self, name);
+    }
+    assert (zm_devices_size (self) == 0);
     zm_devices_destroy (&self);
+
+    //  Over budget devices go cold and come back on access
+    self = zm_devices_new (NULL);
+    zm_devices_set_file (self, ".test/tiered.bin");
+    r = zm_devices_set_budget (self, 1, NULL);
+    assert (r == 0);
+    dev = zm_proto_new ();
+    ext = zhash_new ();
+    zhash_update (ext, "type", "ups");
+    for (i = 0; i < 100; i++) {
+        char name [32];
+        snprintf (name, sizeof (name), "tier%d", i);
+        zm_proto_encode_device (dev, name, 0, 0, ext);
+        zm_devices_insert (self, dev);
+    }
+    assert (zm_devices_cold (self) == 99);
+    assert (zm_devices_hot_bytes (self) > 0);
+    zm_proto_t *found = zm_devices_lookup (self, "tier0");
+    assert (found);
+    assert (streq (zm_proto_device (found), "tier0"));
+    assert (streq (zhash_lookup (zm_proto_ext (found), "type"), "ups"));
+    assert (zm_devices_cold (self) == 99);
+    zm_proto_encode_device (dev, "tier1", 5, 0, ext);
+    zm_devices_insert (self, dev);
+    assert (zm_proto_time (zm_devices_lookup (self, "tier1")) == 5);
+    r = zm_devices_touch (self, "tier2", 7);
+    assert (r == 0);
+    assert (zm_proto_time (zm_devices_lookup (self, "tier2")) == 7);
+    zm_devices_delete (self, "tier3");
+    assert (zm_devices_size (self) == 99);
+    assert (zm_devices_cold (self) == 98);
+    size_t count = 0;
+    found = zm_devices_first (self);
+    while (found) {
+        count++;
+        found = zm_devices_next (self);
+    }
+    assert (count == 99);
+    zmsg_t *encoded = zm_devices_lookup_msg (self, "tier1");
+    assert (encoded);
+    r = zm_proto_recv (dev, encoded);
+    assert (r == 0);
+    assert (zm_proto_time (dev) == 5);
+    zmsg_destroy (&encoded);
+    assert (!zm_devices_lookup_msg (self, "tier3"));
+    count = 0;
+    encoded = zm_devices_first_msg (self);
+    while (encoded) {
+        count++;
+        zmsg_destroy (&encoded);
+        encoded = zm_devices_next_msg (self);
+    }
+    assert (count == 99);
+    zhash_destroy (&ext);
+    filter = zhash_new ();
+    zhash_insert (filter, "type", "ups");
+    names = zm_devices_query (self, filter, NULL, NULL);
+    assert (zlistx_size (names) == 99);
+    assert (zm_devices_cold (self) == 98);
+    zlistx_destroy (&names);
+    zhash_destroy (&filter);
+    //  Unindexed filter reads cold devices aside, names stay valid
+    filter = zhash_new ();
+    zhash_insert (filter, "type", "ups");
+    names = zm_devices_query (self, filter, "tier4", NULL);
+    assert (zlistx_size (names) == 11);
+    const char *name = (const char *) zlistx_first (names);
+    while (name) {
+        assert (strncmp (name, "tier4", 5) == 0);
+        name = (const char *) zlistx_next (names);
+    }
+    assert (zm_devices_cold (self) == 98);
+    zlistx_destroy (&names);
+    zhash_destroy (&filter);
+    r = zm_devices_store (self);
+    assert (r == 0);
+    devices2 = zm_devices_new (".test/tiered.bin");
+    assert (devices2);
+    assert (zm_devices_size (devices2) == 99);
+    assert (zm_proto_time (zm_devices_lookup (devices2, "tier1")) == 5);
     zm_devices_destroy (&devices2);
+    r = zm_devices_set_budget (self, 0, NULL);
+    assert (r == 0);
+    assert (zm_devices_cold (self) == 0);
+    assert (zm_devices_lookup (self, "tier50"));
+    zm_proto_destroy (&dev);
+    zm_devices_destroy (&self);
+
+    //  Messages made from records decode to the same device
+    self = zm_devices_new (NULL);
+    dev = zm_proto_new ();
+    ext = zhash_new ();
+    zhash_update (ext, "type", "ups");
+    zhash_update (ext, "description", "value much longer than ZM_DEVICES_VALUE_SIZE, so it "
+        "is kept inline in the record and never interned by the dictionary");
+    zhash_update (ext, "empty", "");
+    zm_proto_encode_device (dev, "wire1", 42, 600, ext);
+    zm_devices_insert (self, dev);
+    encoded = zm_devices_lookup_msg (self, "wire1");
+    assert (encoded);
+    r = zm_proto_recv (dev, encoded);
+    assert (r == 0);
+    zmsg_destroy (&encoded);
+    assert (zm_proto_id (dev) == ZM_PROTO_DEVICE);
+    assert (streq (zm_proto_device (dev), "wire1"));
+    assert (zm_proto_time (dev) == 42);
+    assert (zm_proto_ttl (dev) == 600);
+    assert (zhash_size (zm_proto_ext (dev)) == 3);
+    assert (streq (zhash_lookup (zm_proto_ext (dev), "type"), "ups"));
+    assert (streq (zhash_lookup (zm_proto_ext (dev), "description"),
+        zhash_lookup (ext, "description")));
+    assert (streq (zhash_lookup (zm_proto_ext (dev), "empty"), ""));
+    encoded = zm_devices_first_msg (self);
+    assert (encoded);
+    r = zm_proto_recv (dev, encoded);
+    assert (r == 0);
+    zmsg_destroy (&encoded);
+    assert (streq (zm_proto_device (dev), "wire1"));
+    assert (zhash_size (zm_proto_ext (dev)) == 3);
+    assert (!zm_devices_next_msg (self));
+    zhash_destroy (&ext);
+    zm_proto_destroy (&dev);
+    zm_devices_destroy (&self);
+
+    //  Unreadable cold devices are skipped, not taken for the end
+    self = zm_devices_new (NULL);
+    r = zm_devices_set_budget (self, 1, ".test/unreadable.cold");
+    assert (r == 0);
+    dev = zm_proto_new ();
+    for (i = 0; i < 10; i++) {
+        char name [32];
+        snprintf (name, sizeof (name), "cold%d", i);
+        zm_proto_encode_device (dev, name, 0, 0, NULL);
+        zm_devices_insert (self, dev);
+    }
+    zm_proto_destroy (&dev);
+    assert (zm_devices_cold (self) == 9);
+    r = ftruncate (self->cold_fd, 0);
+    assert (r == 0);
+    count = 0;
+    encoded = zm_devices_first_msg (self);
+    while (encoded) {
+        count++;
+        zmsg_destroy (&encoded);
+        encoded = zm_devices_next_msg (self);
+    }
+    assert (count == 1);
+    count = 0;
+    found = zm_devices_first (self);
+    while (found) {
+        count++;
+        found = zm_devices_next (self);
+    }
+    assert (count == 1);
+    //  Snapshot without them is not stored, journal keeps what it has
+    zm_devices_set_file (self, ".test/unreadable.zpl");
+    r = zm_devices_store (self);
+    assert (r == -1);
+    assert (!zsys_file_exists (".test/unreadable.zpl"));
+    r = zm_devices_journal_open (self, 0);
+    assert (r == 0);
+    zm_devices_delete (self, "cold0");
+    r = zm_devices_store_start (self);
+    assert (r == 0);
+    r = zm_devices_store_finish (self);
+    assert (r == -1);
+    assert (!zsys_file_exists (".test/unreadable.zpl"));
+    assert (zsys_file_exists (".test/unreadable.zpl.journal.old"));
+    assert (zm_devices_dirty (self) > 0);
+    zm_devices_destroy (&self);
 
     zdir_remove (dir, true);
     zdir_destroy (&dir);
@@ -18,10 +18,20 @@ extern "C" {
 #endif
 
 //  @interface
+#define ZM_DEVICES_ZPL      0   //  Text ZPL snapshot
+#define ZM_DEVICES_BINARY   1   //  Binary snapshot, see zm_snapshot
+
 //  Create a new zm_devices - if file is not NULL, it loads devices from it
 ZM_DEVICE_PRIVATE zm_devices_t *
     zm_devices_new (const char *file);
 
+//  Create a new zm_devices from binary snapshot without loading devices.
+//  Names are indexed, devices are hydrated on first access or by
+//  zm_devices_hydrate. ZPL and version 1 snapshots are loaded right away,
+//  as by zm_devices_new.
+ZM_DEVICE_PRIVATE zm_devices_t *
+    zm_devices_new_lazy (const char *file);
+
 //  Destroy the zm_devices
 ZM_DEVICE_PRIVATE void
     zm_devices_destroy (zm_devices_t **self_p);
@@ -34,6 +44,22 @@ zm_devices_file (zm_devices_t *self);
 ZM_DEVICE_PRIVATE void
 zm_devices_set_file (zm_devices_t *self, const char *file);
 
+//  Set format used by zm_devices_store, default depends on file extension
+ZM_DEVICE_PRIVATE void
+zm_devices_set_format (zm_devices_t *self, int format);
+
+//  Return format used by zm_devices_store
+ZM_DEVICE_PRIVATE int
+zm_devices_format (zm_devices_t *self);
+
+//  Load devices from snapshot file in either format
+ZM_DEVICE_PRIVATE int
+zm_devices_import (zm_devices_t *self, const char *file);
+
+//  Write all devices to file in given format
+ZM_DEVICE_PRIVATE int
+zm_devices_export (zm_devices_t *self, const char *file, int format);
+
 ZM_DEVICE_PRIVATE zm_proto_t*
     zm_devices_first (zm_devices_t *self);
 
@@ -43,19 +69,174 @@ ZM_DEVICE_PRIVATE zm_proto_t*
 ZM_DEVICE_PRIVATE size_t
     zm_devices_size (zm_devices_t *self);
 
-//  Store devices
+//  Return number of devices not hydrated yet, see zm_devices_new_lazy
+ZM_DEVICE_PRIVATE size_t
+    zm_devices_pending (zm_devices_t *self);
+
+//  Hydrate up to batch devices from lazily loaded snapshot, return number
+//  of devices still pending
+ZM_DEVICE_PRIVATE size_t
+    zm_devices_hydrate (zm_devices_t *self, size_t batch);
+
+//  Return list of all device names in order, caller owns the list
+ZM_DEVICE_PRIVATE zlistx_t *
+    zm_devices_names (zm_devices_t *self);
+
+//  Return memory held by device records
+ZM_DEVICE_PRIVATE size_t
+    zm_devices_allocated (zm_devices_t *self);
+
+//  Keep at most budget bytes of compact devices in memory, least recently
+//  used ones beyond it are moved to cold file and read back on access.
+//  Cold file defaults to <file>.cold and is opened by the first non-zero
+//  budget, later calls only change the budget. Budget 0 (default) reads
+//  all devices back. Returns -1 if there's no file to use or it can't be
+//  created.
+ZM_DEVICE_PRIVATE int
+    zm_devices_set_budget (zm_devices_t *self, size_t budget, const char *cold_file);
+
+//  Return compact bytes of devices held in memory
+ZM_DEVICE_PRIVATE size_t
+    zm_devices_hot_bytes (zm_devices_t *self);
+
+//  Return number of devices held only in cold file
+ZM_DEVICE_PRIVATE size_t
+    zm_devices_cold (zm_devices_t *self);
+
+//  Store devices to snapshot, truncates the journal
 ZM_DEVICE_PRIVATE int
 zm_devices_store (zm_devices_t *self);
 
-ZM_DEVICE_PRIVATE void
+//  Start storing devices to snapshot in background. Store reads a frozen
+//  view, so devices can change meanwhile, and the journal is rotated.
+//  Lazily loaded devices are not hydrated. Returns -1 if
+//  there's no file set, store is already running or journal can't be
+//  rotated. If previous background store did not finish, stores devices
+//  right away instead.
+ZM_DEVICE_PRIVATE int
+zm_devices_store_start (zm_devices_t *self);
+
+//  Return actor of running background store, NULL if there's none. It
+//  sends one message once the snapshot is written.
+ZM_DEVICE_PRIVATE zactor_t *
+zm_devices_store_actor (zm_devices_t *self);
+
+//  Wait for background store to finish and return its result, 0 if it
+//  was not running.
+ZM_DEVICE_PRIVATE int
+zm_devices_store_finish (zm_devices_t *self);
+
+//  Start writing changes to <file>.journal, fsync after batch of records
+//  (0 means on zm_devices_sync only). Returns -1 if there's no file set.
+ZM_DEVICE_PRIVATE int
+zm_devices_journal_open (zm_devices_t *self, size_t batch);
+
+//  Flush journal records to disk
+ZM_DEVICE_PRIVATE int
+zm_devices_sync (zm_devices_t *self);
+
+//  Return number of changes made since devices were last stored, or since
+//  background store copied them. Failed background store adds its changes
+//  back. Loaded snapshot is clean, journal replayed on top of it is not.
+ZM_DEVICE_PRIVATE size_t
+zm_devices_dirty (zm_devices_t *self);
+
+//  Return number of those dirty changes which changed more than time, so
+//  TOUCH and INSERT of the same content don't count
+ZM_DEVICE_PRIVATE size_t
+zm_devices_dirty_content (zm_devices_t *self);
+
+//  Return number of journal records written since last store
+ZM_DEVICE_PRIVATE size_t
+zm_devices_journal_size (zm_devices_t *self);
+
+//  Insert or update device. Returns 1 if content changed, 0 if device
+//  is the same apart from time and ext keys starting with '_'.
+ZM_DEVICE_PRIVATE int
 zm_devices_insert (zm_devices_t *self, zm_proto_t *msg);
 
+//  Set time of stored device. Returns -1 if there's no such device.
+ZM_DEVICE_PRIVATE int
+zm_devices_touch (zm_devices_t *self, const char *name, uint64_t time);
+
+//  Return device, NULL if unknown or expired. Device is owned by self and
+//  is valid only until next call on self, copy what you keep.
 ZM_DEVICE_PRIVATE zm_proto_t*
 zm_devices_lookup (zm_devices_t *self, const char* name);
 
+//  Return device as message ready to send, encoded from the stored record,
+//  caller owns it. Returns NULL as zm_devices_lookup does.
+ZM_DEVICE_PRIVATE zmsg_t *
+zm_devices_lookup_msg (zm_devices_t *self, const char *name);
+
+//  Iterate devices in name order as messages ready to send, like
+//  zm_devices_first and zm_devices_next, sharing their cursor. Caller owns
+//  the messages. Devices which can't be read back from cold file are
+//  logged and skipped, NULL is returned only at the end.
+ZM_DEVICE_PRIVATE zmsg_t *
+zm_devices_first_msg (zm_devices_t *self);
+
+ZM_DEVICE_PRIVATE zmsg_t *
+zm_devices_next_msg (zm_devices_t *self);
+
 ZM_DEVICE_PRIVATE void
 zm_devices_delete (zm_devices_t *self, const char* name);
 
+//  Return names starting with prefix in order, caller owns the list. List
+//  starts after given name, if not NULL, and has at most limit names or
+//  all of them if limit is 0.
+ZM_DEVICE_PRIVATE zlistx_t *
+zm_devices_prefix (zm_devices_t *self, const char *prefix, const char *after, size_t limit);
+
+//  Return number of devices starting with prefix
+ZM_DEVICE_PRIVATE size_t
+zm_devices_prefix_size (zm_devices_t *self, const char *prefix);
+
+//  Index devices by value of ext key, to speed up zm_devices_query. Does
+//  not hydrate lazily loaded devices, they are indexed when they are.
+ZM_DEVICE_PRIVATE int
+zm_devices_index (zm_devices_t *self, const char *key);
+
+//  Return names of devices matching all the conditions, caller owns the
+//  list. Filter (may be NULL) lists ext values devices must have, keys
+//  starting with '_' are ignored. Name must start with prefix and match
+//  glob (fnmatch), when they are not NULL. Names are in name order, lazily
+//  loaded devices are read without hydrating them.
+ZM_DEVICE_PRIVATE zlistx_t *
+zm_devices_query (zm_devices_t *self, zhash_t *filter, const char *prefix, const char *glob);
+
+//  Remove one device whose ttl passed by now (see zclock_mono) and return
+//  it, caller owns the device. Returns NULL if nothing has expired.
+ZM_DEVICE_PRIVATE zm_proto_t *
+zm_devices_expire (zm_devices_t *self, int64_t now);
+
+//  Return creation time of devices, versions are valid only with it
+ZM_DEVICE_PRIVATE int64_t
+zm_devices_epoch (zm_devices_t *self);
+
+//  Return version of the last change. It grows by one with each insert
+//  which changes content of a device and each removal, from 0 once devices
+//  are loaded.
+ZM_DEVICE_PRIVATE uint64_t
+zm_devices_version (zm_devices_t *self);
+
+//  Set number of changes kept for zm_devices_changes, default is 100000 and
+//  0 disables the log. Changes logged so far are dropped.
+ZM_DEVICE_PRIVATE void
+zm_devices_set_changes_max (zm_devices_t *self, size_t max);
+
+//  Set number of decoder threads zm_devices_import uses for binary
+//  snapshot, 0 (default) is one per core up to 16, 1 decodes in the
+//  calling thread.
+ZM_DEVICE_PRIVATE void
+zm_devices_set_decoders (zm_devices_t *self, size_t decoders);
+
+//  Return names of devices changed after version, in order of their last
+//  change, caller owns the list. Returns NULL if the log does not reach
+//  that far back, so the caller has to get all devices.
+ZM_DEVICE_PRIVATE zlistx_t *
+zm_devices_changes (zm_devices_t *self, uint64_t version);
+
 //  Self test of this class
 ZM_DEVICE_PRIVATE void
     zm_devices_test (bool verbose);
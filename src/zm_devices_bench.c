@@ -0,0 +1,350 @@
+/*  =========================================================================
+    zm_devices_bench - Storage layer micro-benchmarks
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+/*
+@header
+    zm_devices_bench - Storage layer micro-benchmarks
+@discuss
+    Measures zm_devices alone, without actor and malamute. For each count
+    in --devices it inserts that many devices with --ext ext keys of
+    realistic sizes, updates, looks up and deletes all of them, and stores
+    and loads snapshot in each of --formats. Devices are touched in
+    scattered order, so lookups don't just follow the insertion order.
+
+    Results are printed as ZPL, one section per device count
+
+        zm_devices_bench
+            ext = 8
+            10000
+                insert
+                    ops = 10000
+                    usecs = 21034
+                    ops_per_sec = 475420
+                ...
+                store_binary
+                    usecs = 5012
+                    bytes = 1843200
+                load_binary
+                    usecs = 8120
+                load_lazy
+                    usecs = 1210
+                memory
+                    allocated = 1523712
+                    per_device = 152
+                    rss = 4096000
+
+    where allocated is zm_devices_allocated and rss is growth of resident
+    set (Linux only, 0 elsewhere) while devices were inserted. --journal
+    adds cost of journal writes to insert, update and delete.
+@end
+*/
+
+#include "zm_device_classes.h"
+
+#define BENCH_DIR   ".bench-devices"
+
+static const char *s_ext_keys [] = {
+    "type", "ip.1", "hostname", "location", "model",
+    "manufacturer", "serial_no", "firmware", "status", "description"
+};
+#define S_EXT_KEYS  (sizeof (s_ext_keys) / sizeof (s_ext_keys [0]))
+
+//  Return resident set size in bytes, 0 if unknown
+
+static size_t
+s_rss (void)
+{
+    size_t rss = 0;
+    FILE *file = fopen ("/proc/self/statm", "r");
+    if (file) {
+        unsigned long size, resident;
+        if (fscanf (file, "%lu %lu", &size, &resident) == 2)
+            rss = (size_t) resident * (size_t) sysconf (_SC_PAGESIZE);
+        fclose (file);
+    }
+    return rss;
+}
+
+//  Return step coprime with count, so s_scatter visits all indexes
+
+static size_t
+s_scatter_step (size_t count)
+{
+    size_t step = 7919;
+    while (true) {
+        size_t a = step, b = count;
+        while (b) {
+            size_t t = a % b;
+            a = b;
+            b = t;
+        }
+        if (a == 1)
+            break;
+        step++;
+    }
+    return step;
+}
+
+//  Scatter indexes over 0..count-1
+
+static size_t
+s_scatter (size_t i, size_t count, size_t step)
+{
+    return (i * step) % count;
+}
+
+//  Encode device number index into msg, generation changes ext values
+
+static void
+s_device (zm_proto_t *msg, size_t index, size_t ext_size, int generation)
+{
+    char name [32];
+    snprintf (name, sizeof (name), "dev.%08zu", index);
+
+    char values [S_EXT_KEYS][64];
+    zhash_t *ext = zhash_new ();
+    size_t k;
+    for (k = 0; k < ext_size && k < S_EXT_KEYS; k++) {
+        if (streq (s_ext_keys [k], "ip.1"))
+            snprintf (values [k], sizeof (values [k]), "10.%zu.%zu.%zu",
+                (index >> 16) & 0xff, (index >> 8) & 0xff, index & 0xff);
+        else
+        if (streq (s_ext_keys [k], "status"))
+            snprintf (values [k], sizeof (values [k]), "%s",
+                generation ? "nonactive" : "active");
+        else
+            snprintf (values [k], sizeof (values [k]), "%s-%zu-%d",
+                s_ext_keys [k], index % 1000, generation);
+        zhash_insert (ext, s_ext_keys [k], values [k]);
+    }
+    zm_proto_encode_device (msg, name, zclock_mono (), 3600000, ext);
+    zhash_destroy (&ext);
+}
+
+//  Add ops, usecs and ops_per_sec under path
+
+static void
+s_report (zconfig_t *root, const char *path, size_t ops, int64_t usecs)
+{
+    zconfig_t *section = zconfig_new (path, root);
+    zconfig_putf (section, "ops", "%zu", ops);
+    zconfig_putf (section, "usecs", "%" PRId64, usecs);
+    zconfig_putf (section, "ops_per_sec", "%.0f",
+        usecs > 0 ? ops * 1000000.0 / usecs : 0.0);
+}
+
+//  Run all benchmarks for count devices, return -1 on error
+
+static int
+s_bench (zconfig_t *root, size_t count, size_t ext_size, const char *formats,
+    bool journal, bool verbose)
+{
+    char name [32];
+    snprintf (name, sizeof (name), "%zu", count);
+    zconfig_t *section = zconfig_new (name, root);
+    zconfig_putf (section, "devices", "%zu", count);
+
+    zm_proto_t *msg = zm_proto_new ();
+    size_t rss = s_rss ();
+    zm_devices_t *devices = zm_devices_new (NULL);
+    assert (devices);
+    zm_devices_set_file (devices, BENCH_DIR "/devices.bin");
+    if (journal && zm_devices_journal_open (devices, 0) == -1) {
+        zm_devices_destroy (&devices);
+        zm_proto_destroy (&msg);
+        return -1;
+    }
+
+    size_t step = s_scatter_step (count);
+    size_t i;
+    int64_t start = zclock_usecs ();
+    for (i = 0; i < count; i++) {
+        s_device (msg, s_scatter (i, count, step), ext_size, 0);
+        zm_devices_insert (devices, msg);
+    }
+    s_report (section, "insert", count, zclock_usecs () - start);
+
+    zconfig_t *memory = zconfig_new ("memory", section);
+    size_t allocated = zm_devices_allocated (devices);
+    zconfig_putf (memory, "allocated", "%zu", allocated);
+    zconfig_putf (memory, "per_device", "%zu", allocated / count);
+    size_t grown = s_rss ();
+    zconfig_putf (memory, "rss", "%zu", grown > rss ? grown - rss : 0);
+
+    start = zclock_usecs ();
+    for (i = 0; i < count; i++) {
+        s_device (msg, s_scatter (i, count, step), ext_size, 1);
+        zm_devices_insert (devices, msg);
+    }
+    s_report (section, "update", count, zclock_usecs () - start);
+
+    size_t missing = 0;
+    start = zclock_usecs ();
+    for (i = 0; i < count; i++) {
+        snprintf (name, sizeof (name), "dev.%08zu", s_scatter (count - 1 - i, count, step));
+        if (!zm_devices_lookup (devices, name))
+            missing++;
+    }
+    s_report (section, "lookup", count, zclock_usecs () - start);
+    if (missing)
+        zsys_warning ("%zu devices not found by lookup", missing);
+
+    int rv = 0;
+    char *list = strdup (formats);
+    char *format = strtok (list, ",");
+    while (rv == 0 && format) {
+        char path [32];
+        const char *file = streq (format, "zpl")
+            ? BENCH_DIR "/devices.zpl" : BENCH_DIR "/devices.bin";
+        zm_devices_set_file (devices, file);
+        zm_devices_set_format (devices,
+            streq (format, "zpl") ? ZM_DEVICES_ZPL : ZM_DEVICES_BINARY);
+
+        start = zclock_usecs ();
+        rv = zm_devices_store (devices);
+        snprintf (path, sizeof (path), "store_%s", format);
+        zconfig_t *store = zconfig_new (path, section);
+        zconfig_putf (store, "usecs", "%" PRId64, zclock_usecs () - start);
+        zconfig_putf (store, "bytes", "%zd", zsys_file_size (file));
+
+        if (rv == 0) {
+            start = zclock_usecs ();
+            zm_devices_t *loaded = zm_devices_new (file);
+            snprintf (path, sizeof (path), "load_%s", format);
+            zconfig_t *load = zconfig_new (path, section);
+            zconfig_putf (load, "usecs", "%" PRId64, zclock_usecs () - start);
+            if (!loaded || zm_devices_size (loaded) != count) {
+                zsys_error ("%s: loaded %zu devices of %zu",
+                    file, loaded ? zm_devices_size (loaded) : 0, count);
+                rv = -1;
+            }
+            zm_devices_destroy (&loaded);
+        }
+        if (rv == 0 && !streq (format, "zpl")) {
+            //  Time until lazily loaded devices can be looked up
+            start = zclock_usecs ();
+            zm_devices_t *loaded = zm_devices_new_lazy (file);
+            zconfig_t *load = zconfig_new ("load_lazy", section);
+            zconfig_putf (load, "usecs", "%" PRId64, zclock_usecs () - start);
+            if (!loaded || zm_devices_size (loaded) != count)
+                rv = -1;
+            zm_devices_destroy (&loaded);
+        }
+        if (verbose)
+            zsys_info ("%zu devices: %s snapshot done", count, format);
+        format = strtok (NULL, ",");
+    }
+    zstr_free (&list);
+
+    start = zclock_usecs ();
+    for (i = 0; i < count; i++) {
+        snprintf (name, sizeof (name), "dev.%08zu", s_scatter (i, count, step));
+        zm_devices_delete (devices, name);
+    }
+    s_report (section, "delete", count, zclock_usecs () - start);
+    if (zm_devices_size (devices) != 0) {
+        zsys_error ("%zu devices left after delete", zm_devices_size (devices));
+        rv = -1;
+    }
+
+    zm_devices_destroy (&devices);
+    zm_proto_destroy (&msg);
+    return rv;
+}
+
+int main (int argc, char *argv [])
+{
+    bool verbose = false;
+    bool journal = false;
+    const char *counts = "10000,100000,1000000";
+    const char *formats = "binary,zpl";
+    size_t ext_size = 8;
+    int argn;
+    for (argn = 1; argn < argc; argn++) {
+        const char *value = argn + 1 < argc ? argv [argn + 1] : NULL;
+        if (streq (argv [argn], "--help")
+        ||  streq (argv [argn], "-h")) {
+            puts ("zm_devices_bench [options] ...");
+            puts ("  --devices / -d        device counts, default 10000,100000,1000000");
+            puts ("  --ext / -x            ext keys per device, default 8, max 10");
+            puts ("  --formats / -f        snapshot formats, default binary,zpl");
+            puts ("  --journal / -j        write journal while changing devices");
+            puts ("  --verbose / -v        verbose test output");
+            puts ("  --help / -h           this information");
+            return 0;
+        }
+        else
+        if (streq (argv [argn], "--verbose")
+        ||  streq (argv [argn], "-v"))
+            verbose = true;
+        else
+        if (streq (argv [argn], "--journal")
+        ||  streq (argv [argn], "-j"))
+            journal = true;
+        else
+        if (value && (streq (argv [argn], "--devices") || streq (argv [argn], "-d"))) {
+            counts = value;
+            argn++;
+        }
+        else
+        if (value && (streq (argv [argn], "--ext") || streq (argv [argn], "-x"))) {
+            ext_size = (size_t) atol (value);
+            argn++;
+        }
+        else
+        if (value && (streq (argv [argn], "--formats") || streq (argv [argn], "-f"))) {
+            formats = value;
+            argn++;
+        }
+        else {
+            printf ("Unknown option: %s\n", argv [argn]);
+            return 1;
+        }
+    }
+    zsys_init ();
+    if (zsys_dir_create (BENCH_DIR, NULL) == -1) {
+        zsys_error ("Can't create %s", BENCH_DIR);
+        return 1;
+    }
+
+    zconfig_t *root = zconfig_new ("zm_devices_bench", NULL);
+    zconfig_putf (root, "ext", "%zu", ext_size < S_EXT_KEYS ? ext_size : S_EXT_KEYS);
+
+    int rv = 0;
+    char *list = strdup (counts);
+    char *saveptr;
+    char *count = strtok_r (list, ",", &saveptr);
+    while (rv == 0 && count) {
+        size_t size = (size_t) atol (count);
+        if (size == 0) {
+            printf ("Invalid device count: %s\n", count);
+            rv = 1;
+        }
+        else
+        if (s_bench (root, size, ext_size, formats, journal, verbose) == -1)
+            rv = 1;
+        count = strtok_r (NULL, ",", &saveptr);
+    }
+    zstr_free (&list);
+
+    char *output = zconfig_str_save (root);
+    printf ("%s", output);
+    zstr_free (&output);
+    zconfig_destroy (&root);
+
+    zdir_t *dir = zdir_new (BENCH_DIR, NULL);
+    if (dir) {
+        zdir_remove (dir, true);
+        zdir_destroy (&dir);
+    }
+    return rv;
+}
@@ -0,0 +1,380 @@
+/*  =========================================================================
+    zm_journal - Write-ahead journal of device changes
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+/*
+@header
+    zm_journal - Write-ahead journal of device changes
+@discuss
+    Journal is an append-only file of records
+
+        'ZMJ2'                          file magic
+        op:1 size:4 crc:4 payload:size  repeated
+
+    where op is ZM_JOURNAL_INSERT with encoded zm_proto device as a payload
+    or ZM_JOURNAL_DELETE with device name. Crc is CRC-32 of op, size and
+    payload. Numbers are in network byte order.
+
+    Records are written through stdio buffer and fsync'ed in batches, so
+    at most batch records, or whatever came since last zm_journal_sync, can
+    be lost on crash. Partially written record at the end is ignored and
+    cut off on replay, so is record with size beyond end of file or wrong
+    crc, along with everything after it.
+@end
+*/
+
+#include "zm_device_classes.h"
+
+#define ZM_JOURNAL_MAGIC "ZMJ2"
+#define ZM_JOURNAL_MAGIC_SIZE 4
+#define ZM_JOURNAL_HEADER_SIZE 9
+
+//  Structure of our class
+
+struct _zm_journal_t {
+    char *file;             //  Journal file name
+    FILE *handle;           //  Journal opened for read and append
+    off_t offset;           //  Read offset for zm_journal_read
+    bool reading;           //  Last stream operation was a read
+    size_t size;            //  Number of records in journal
+    size_t pending;         //  Records not yet synced to disk
+    size_t batch;           //  Sync after this many pending records
+};
+
+
+//  --------------------------------------------------------------------------
+//  Create a new zm_journal
+
+zm_journal_t *
+zm_journal_new (const char *file, size_t batch)
+{
+    assert (file);
+    zm_journal_t *self = (zm_journal_t *) zmalloc (sizeof (zm_journal_t));
+    assert (self);
+    //  Initialize class properties here
+    self->file = strdup (file);
+    self->batch = batch;
+    self->offset = ZM_JOURNAL_MAGIC_SIZE;
+
+    self->handle = fopen (file, "a+b");
+    if (!self->handle) {
+        zsys_error ("Fail to open journal %s: %s", file, strerror (errno));
+        goto fail;
+    }
+
+    char magic [ZM_JOURNAL_MAGIC_SIZE];
+    fseeko (self->handle, 0, SEEK_SET);
+    self->reading = true;
+    if (fread (magic, 1, ZM_JOURNAL_MAGIC_SIZE, self->handle) != ZM_JOURNAL_MAGIC_SIZE) {
+        //  Empty or truncated at the very beginning, start from scratch
+        fseeko (self->handle, 0, SEEK_END);
+        self->reading = false;
+        if (ftruncate (fileno (self->handle), 0) == -1
+        ||  fwrite (ZM_JOURNAL_MAGIC, 1, ZM_JOURNAL_MAGIC_SIZE, self->handle) != ZM_JOURNAL_MAGIC_SIZE
+        ||  zm_journal_sync (self) == -1) {
+            zsys_error ("Fail to initialize journal %s: %s", file, strerror (errno));
+            goto fail;
+        }
+    }
+    else
+    if (memcmp (magic, ZM_JOURNAL_MAGIC, ZM_JOURNAL_MAGIC_SIZE) != 0) {
+        zsys_error ("%s is not a zm-device journal", file);
+        goto fail;
+    }
+    return self;
+fail:
+    zm_journal_destroy (&self);
+    return NULL;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the zm_journal
+
+void
+zm_journal_destroy (zm_journal_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zm_journal_t *self = *self_p;
+        //  Free class properties here
+        if (self->handle) {
+            zm_journal_sync (self);
+            fclose (self->handle);
+        }
+        zstr_free (&self->file);
+        //  Free object itself
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Read next record from the journal
+
+int
+zm_journal_read (zm_journal_t *self, char *op_p, zframe_t **payload_p)
+{
+    assert (self);
+    assert (op_p);
+    assert (payload_p);
+
+    //  Appends move the stream position, so seek every time
+    self->reading = true;
+    if (fseeko (self->handle, self->offset, SEEK_SET) == -1)
+        return -1;
+
+    size_t header_size = ZM_JOURNAL_HEADER_SIZE;
+    byte header [ZM_JOURNAL_HEADER_SIZE];
+    size_t r = fread (header, 1, header_size, self->handle);
+    if (r == 0)
+        return -1;     //  Clean end of journal
+
+    //  Seek above flushed any appends, so file size is up to date
+    struct stat st;
+    off_t left = fstat (fileno (self->handle), &st) == 0
+        ? st.st_size - self->offset - (off_t) header_size : 0;
+    if (r == header_size
+    && (header [0] == ZM_JOURNAL_INSERT || header [0] == ZM_JOURNAL_DELETE)) {
+        size_t size = ((size_t) header [1] << 24) | ((size_t) header [2] << 16)
+                    | ((size_t) header [3] << 8)  |  (size_t) header [4];
+        //  Corrupted size must not make us allocate what isn't there
+        zframe_t *payload = (off_t) size <= left ? zframe_new (NULL, size) : NULL;
+        if (payload
+        &&  fread (zframe_data (payload), 1, size, self->handle) == size) {
+            uint32_t crc = ((uint32_t) header [5] << 24) | ((uint32_t) header [6] << 16)
+                         | ((uint32_t) header [7] << 8)  |  (uint32_t) header [8];
+            if (zm_snapshot_crc32 (zm_snapshot_crc32 (0, header, 5),
+                    zframe_data (payload), size) == crc) {
+                self->offset += header_size + size;
+                self->size++;
+                *op_p = (char) header [0];
+                *payload_p = payload;
+                return 0;
+            }
+        }
+        zframe_destroy (&payload);
+    }
+
+    zsys_warning ("Journal %s: dropping torn or corrupted record at offset %jd",
+        self->file, (intmax_t) self->offset);
+    if (ftruncate (fileno (self->handle), self->offset) == -1)
+        zsys_error ("Journal %s: can't truncate: %s", self->file, strerror (errno));
+    return -1;
+}
+
+//  Append a record, sync if batch is full
+
+static int
+s_journal_append (zm_journal_t *self, char op, const void *data, size_t size)
+{
+    assert (self);
+    assert (size <= UINT32_MAX);
+
+    //  Switching from input to output needs repositioning
+    if (self->reading) {
+        fseeko (self->handle, 0, SEEK_END);
+        self->reading = false;
+    }
+
+    byte header [ZM_JOURNAL_HEADER_SIZE] = {
+        (byte) op,
+        (byte) (size >> 24), (byte) (size >> 16), (byte) (size >> 8), (byte) size
+    };
+    uint32_t crc = zm_snapshot_crc32 (zm_snapshot_crc32 (0, header, 5),
+        (const byte *) data, size);
+    header [5] = (byte) (crc >> 24);
+    header [6] = (byte) (crc >> 16);
+    header [7] = (byte) (crc >> 8);
+    header [8] = (byte) crc;
+    if (fwrite (header, 1, ZM_JOURNAL_HEADER_SIZE, self->handle) != ZM_JOURNAL_HEADER_SIZE
+    ||  fwrite (data, 1, size, self->handle) != size) {
+        zsys_error ("Journal %s: write failed: %s", self->file, strerror (errno));
+        return -1;
+    }
+    self->size++;
+    self->pending++;
+    if (self->batch && self->pending >= self->batch)
+        return zm_journal_sync (self);
+    return 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Append INSERT record
+
+int
+zm_journal_insert (zm_journal_t *self, const byte *data, size_t size)
+{
+    assert (data);
+    return s_journal_append (self, ZM_JOURNAL_INSERT, data, size);
+}
+
+//  --------------------------------------------------------------------------
+//  Append DELETE record
+
+int
+zm_journal_delete (zm_journal_t *self, const char *name)
+{
+    assert (name);
+    return s_journal_append (self, ZM_JOURNAL_DELETE, name, strlen (name));
+}
+
+//  --------------------------------------------------------------------------
+//  Flush and fsync pending records
+
+int
+zm_journal_sync (zm_journal_t *self)
+{
+    assert (self);
+    if (fflush (self->handle) == EOF
+    ||  fsync (fileno (self->handle)) == -1) {
+        zsys_error ("Journal %s: sync failed: %s", self->file, strerror (errno));
+        return -1;
+    }
+    self->pending = 0;
+    return 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Drop all records
+
+int
+zm_journal_truncate (zm_journal_t *self)
+{
+    assert (self);
+    fflush (self->handle);
+    if (ftruncate (fileno (self->handle), ZM_JOURNAL_MAGIC_SIZE) == -1) {
+        zsys_error ("Journal %s: can't truncate: %s", self->file, strerror (errno));
+        return -1;
+    }
+    self->offset = ZM_JOURNAL_MAGIC_SIZE;
+    self->size = 0;
+    return zm_journal_sync (self);
+}
+
+//  --------------------------------------------------------------------------
+//  Return number of records in journal
+
+size_t
+zm_journal_size (zm_journal_t *self)
+{
+    assert (self);
+    return self->size;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+zm_journal_test (bool verbose)
+{
+    printf (" * zm_journal: ");
+
+    //  @selftest
+    int r = zsys_dir_create (".test-journal", NULL);
+    assert (r == 0);
+    zdir_t *dir = zdir_new (".test-journal", NULL);
+    assert (dir);
+
+    zm_journal_t *self = zm_journal_new (".test-journal/devices.journal", 2);
+    assert (self);
+    assert (zm_journal_size (self) == 0);
+
+    zframe_t *device = zframe_new ("device1", 7);
+    r = zm_journal_insert (self, zframe_data (device), zframe_size (device));
+    assert (r == 0);
+    r = zm_journal_delete (self, "device1");
+    assert (r == 0);
+    assert (zm_journal_size (self) == 2);
+    zm_journal_destroy (&self);
+
+    //  Simulate crash in the middle of record
+    FILE *f = fopen (".test-journal/devices.journal", "ab");
+    assert (f);
+    fwrite ("I\0\0\0\x10\0\0\0\0" "dev", 1, 12, f);
+    fclose (f);
+
+    self = zm_journal_new (".test-journal/devices.journal", 0);
+    assert (self);
+    char op;
+    zframe_t *payload;
+    r = zm_journal_read (self, &op, &payload);
+    assert (r == 0);
+    assert (op == ZM_JOURNAL_INSERT);
+    assert (zframe_eq (payload, device));
+    zframe_destroy (&payload);
+    r = zm_journal_read (self, &op, &payload);
+    assert (r == 0);
+    assert (op == ZM_JOURNAL_DELETE);
+    assert (zframe_streq (payload, "device1"));
+    zframe_destroy (&payload);
+    r = zm_journal_read (self, &op, &payload);
+    assert (r == -1);
+    assert (zm_journal_size (self) == 2);
+
+    //  New records go after the last good one
+    r = zm_journal_insert (self, zframe_data (device), zframe_size (device));
+    assert (r == 0);
+    r = zm_journal_read (self, &op, &payload);
+    assert (r == 0);
+    assert (op == ZM_JOURNAL_INSERT);
+    zframe_destroy (&payload);
+
+    r = zm_journal_truncate (self);
+    assert (r == 0);
+    assert (zm_journal_size (self) == 0);
+    r = zm_journal_read (self, &op, &payload);
+    assert (r == -1);
+    zm_journal_destroy (&self);
+
+    //  Huge size in header is torn record, not an allocation
+    f = fopen (".test-journal/devices.journal", "ab");
+    assert (f);
+    fwrite ("I\xff\xff\xff\xf0\0\0\0\0" "dev", 1, 12, f);
+    fclose (f);
+    self = zm_journal_new (".test-journal/devices.journal", 0);
+    assert (self);
+    r = zm_journal_read (self, &op, &payload);
+    assert (r == -1);
+
+    //  Flipped payload byte fails the crc, record and the rest are dropped
+    r = zm_journal_insert (self, zframe_data (device), zframe_size (device));
+    assert (r == 0);
+    r = zm_journal_delete (self, "device1");
+    assert (r == 0);
+    zm_journal_destroy (&self);
+    f = fopen (".test-journal/devices.journal", "r+b");
+    assert (f);
+    fseek (f, ZM_JOURNAL_MAGIC_SIZE + ZM_JOURNAL_HEADER_SIZE, SEEK_SET);
+    fputc ('X', f);
+    fclose (f);
+    self = zm_journal_new (".test-journal/devices.journal", 0);
+    assert (self);
+    r = zm_journal_read (self, &op, &payload);
+    assert (r == -1);
+    assert (zsys_file_size (".test-journal/devices.journal") == ZM_JOURNAL_MAGIC_SIZE);
+    zm_journal_destroy (&self);
+
+    //  File of other magic is not a journal
+    f = fopen (".test-journal/other.journal", "wb");
+    assert (f);
+    fwrite ("ZMJ1" "D\0\0\0\x07" "device1", 1, 16, f);
+    fclose (f);
+    self = zm_journal_new (".test-journal/other.journal", 0);
+    assert (!self);
+    assert (zsys_file_size (".test-journal/other.journal") == 16);
+    zframe_destroy (&device);
+
+    zdir_remove (dir, true);
+    zdir_destroy (&dir);
+    //  @end
+    printf ("OK\n");
+}
@@ -0,0 +1,69 @@
+/*  =========================================================================
+    zm_journal - Write-ahead journal of device changes
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+#ifndef ZM_JOURNAL_H_INCLUDED
+#define ZM_JOURNAL_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ZM_JOURNAL_INSERT 'I'
+#define ZM_JOURNAL_DELETE 'D'
+
+//  @interface
+//  Open (or create) journal file. Records are fsync'ed once batch of them
+//  is pending, 0 means only on explicit zm_journal_sync.
+ZM_DEVICE_PRIVATE zm_journal_t *
+    zm_journal_new (const char *file, size_t batch);
+
+//  Sync pending records and destroy the zm_journal
+ZM_DEVICE_PRIVATE void
+    zm_journal_destroy (zm_journal_t **self_p);
+
+//  Read next record from the beginning of journal. Returns 0 and sets op
+//  and payload (owned by the caller), or -1 when there are no more records.
+//  Torn record at the end of the journal is cut off.
+ZM_DEVICE_PRIVATE int
+    zm_journal_read (zm_journal_t *self, char *op_p, zframe_t **payload_p);
+
+//  Append INSERT record with encoded device
+ZM_DEVICE_PRIVATE int
+    zm_journal_insert (zm_journal_t *self, const byte *data, size_t size);
+
+//  Append DELETE record with device name
+ZM_DEVICE_PRIVATE int
+    zm_journal_delete (zm_journal_t *self, const char *name);
+
+//  Flush and fsync pending records
+ZM_DEVICE_PRIVATE int
+    zm_journal_sync (zm_journal_t *self);
+
+//  Drop all records, called once they are folded into a snapshot
+ZM_DEVICE_PRIVATE int
+    zm_journal_truncate (zm_journal_t *self);
+
+//  Return number of records in journal
+ZM_DEVICE_PRIVATE size_t
+    zm_journal_size (zm_journal_t *self);
+
+//  Self test of this class
+ZM_DEVICE_PRIVATE void
+    zm_journal_test (bool verbose);
+
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,406 @@
+/*  =========================================================================
+    zm_queue - Admission queues of mailbox requests
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+/*
+@header
+    zm_queue - Admission queues of mailbox requests
+@discuss
+    Keeps reads and writes in two queues, as BACKPRESSURE of zm_device
+    describes. Reads are taken first. Read of a sender which has writes
+    waiting is queued as a write, so requests of one sender keep their
+    order. Each sender has a token bucket refilled at the rate, with one
+    second burst.
+
+    Senders are kept while they have writes waiting, or while rate is set
+    so their buckets hold. Once there are too many, idle ones are
+    forgotten, their tokens are spent by then.
+@end
+*/
+
+#include "zm_device_classes.h"
+
+#define ZM_QUEUE_SENDERS_MAX    10000   //  Forget idle senders beyond
+
+typedef struct {
+    zmsg_t *request;            //  Request as received
+    char *sender;               //  Its sender
+    char *subject;              //  Its subject
+    int64_t received;           //  When it was admitted, usecs
+    bool write;                 //  Waits in the write queue
+} s_entry_t;
+
+typedef struct {
+    double tokens;              //  Requests allowed now
+    int64_t refilled;           //  Last time tokens were refilled
+    size_t writes;              //  Requests waiting in the write queue
+} s_sender_t;
+
+//  Structure of our class
+
+struct _zm_queue_t {
+    zlistx_t *reads;            //  Requests answered first
+    zlistx_t *writes;           //  Requests applied in slices
+    zhashx_t *senders;          //  Sender to s_sender_t
+    size_t slice;               //  Writes applied per msec
+    size_t high;                //  Writes waiting before 503, 0 is no limit
+    size_t rate;                //  Requests/sec of one sender, 0 is no limit
+    s_entry_t *last;            //  Returned by zm_queue_next
+};
+
+static void
+s_entry_destroy (s_entry_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        s_entry_t *self = *self_p;
+        zmsg_destroy (&self->request);
+        zstr_free (&self->sender);
+        zstr_free (&self->subject);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+static void
+s_sender_destroy (s_sender_t **self_p)
+{
+    assert (self_p);
+    free (*self_p);
+    *self_p = NULL;
+}
+
+//  Return state of sender, created if it's not known
+
+static s_sender_t *
+s_sender_require (zm_queue_t *self, const char *sender)
+{
+    s_sender_t *state = (s_sender_t *) zhashx_lookup (self->senders, sender);
+    if (state)
+        return state;
+
+    if (zhashx_size (self->senders) >= ZM_QUEUE_SENDERS_MAX) {
+        zlistx_t *idle = zlistx_new ();
+        assert (idle);
+        state = (s_sender_t *) zhashx_first (self->senders);
+        while (state) {
+            if (!state->writes)
+                zlistx_add_end (idle, (void *) zhashx_cursor (self->senders));
+            state = (s_sender_t *) zhashx_next (self->senders);
+        }
+        const char *name = (const char *) zlistx_first (idle);
+        while (name) {
+            zhashx_delete (self->senders, name);
+            name = (const char *) zlistx_next (idle);
+        }
+        zlistx_destroy (&idle);
+    }
+    state = (s_sender_t *) zmalloc (sizeof (s_sender_t));
+    assert (state);
+    state->tokens = self->rate;
+    state->refilled = zclock_mono ();
+    zhashx_insert (self->senders, sender, state);
+    return state;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create a new zm_queue
+
+zm_queue_t *
+zm_queue_new (size_t slice)
+{
+    zm_queue_t *self = (zm_queue_t *) zmalloc (sizeof (zm_queue_t));
+    assert (self);
+    //  Initialize class properties here
+    self->reads = zlistx_new ();
+    assert (self->reads);
+    zlistx_set_destructor (self->reads, (zlistx_destructor_fn *) s_entry_destroy);
+    self->writes = zlistx_new ();
+    assert (self->writes);
+    zlistx_set_destructor (self->writes, (zlistx_destructor_fn *) s_entry_destroy);
+    self->senders = zhashx_new ();
+    assert (self->senders);
+    zhashx_set_destructor (self->senders, (zhashx_destructor_fn *) s_sender_destroy);
+    self->slice = slice ? slice : 1;
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the zm_queue
+
+void
+zm_queue_destroy (zm_queue_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zm_queue_t *self = *self_p;
+        //  Free class properties here
+        zlistx_destroy (&self->reads);
+        zlistx_destroy (&self->writes);
+        zhashx_destroy (&self->senders);
+        s_entry_destroy (&self->last);
+        //  Free object itself
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Set limits of writes waiting and of one sender
+
+void
+zm_queue_set (zm_queue_t *self, size_t high, size_t rate)
+{
+    assert (self);
+    self->high = high;
+    self->rate = rate;
+    //  Token buckets of the old rate mean nothing now
+    s_sender_t *state = (s_sender_t *) zhashx_first (self->senders);
+    while (state) {
+        state->tokens = self->rate;
+        state->refilled = zclock_mono ();
+        state = (s_sender_t *) zhashx_next (self->senders);
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Queue request of sender, or refuse it
+
+int
+zm_queue_admit (zm_queue_t *self, const char *sender, const char *subject,
+    bool write, zmsg_t **request_p, int64_t *retry_after_p)
+{
+    assert (self);
+    assert (sender);
+    assert (subject);
+    assert (request_p);
+    assert (retry_after_p);
+
+    s_sender_t *state = (s_sender_t *) zhashx_lookup (self->senders, sender);
+    if (self->rate) {
+        int64_t now = zclock_mono ();
+        if (!state)
+            state = s_sender_require (self, sender);
+        state->tokens += self->rate * (now - state->refilled) / 1000.0;
+        if (state->tokens > self->rate)
+            state->tokens = self->rate;
+        state->refilled = now;
+        if (state->tokens < 1) {
+            *retry_after_p = (int64_t) ((1 - state->tokens) * 1000 / self->rate) + 1;
+            return 429;
+        }
+        state->tokens -= 1;
+    }
+
+    //  Read of sender with writes waiting must not overtake them
+    write = write || (state && state->writes);
+    size_t waiting = zlistx_size (self->writes);
+    if (write && self->high && waiting >= self->high) {
+        *retry_after_p = (int64_t) (waiting / self->slice);
+        return 503;
+    }
+
+    s_entry_t *entry = (s_entry_t *) zmalloc (sizeof (s_entry_t));
+    assert (entry);
+    entry->request = *request_p;
+    *request_p = NULL;
+    entry->sender = strdup (sender);
+    entry->subject = strdup (subject);
+    entry->received = zclock_usecs ();
+    entry->write = write;
+    if (write) {
+        if (!state)
+            state = s_sender_require (self, sender);
+        state->writes++;
+        zlistx_add_end (self->writes, entry);
+    }
+    else
+        zlistx_add_end (self->reads, entry);
+    return 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return next request to handle
+
+zmsg_t *
+zm_queue_next (zm_queue_t *self, bool write)
+{
+    assert (self);
+    s_entry_destroy (&self->last);
+    zlistx_t *queue = zlistx_size (self->reads) ? self->reads
+                    : write && zlistx_size (self->writes) ? self->writes
+                    : NULL;
+    if (!queue)
+        return NULL;
+
+    s_entry_t *entry = (s_entry_t *) zlistx_detach (queue, NULL);
+    if (entry->write) {
+        s_sender_t *state = (s_sender_t *) zhashx_lookup (self->senders, entry->sender);
+        assert (state);
+        //  Without rate limit, idle sender has nothing worth keeping
+        if (--state->writes == 0 && !self->rate)
+            zhashx_delete (self->senders, entry->sender);
+    }
+    zmsg_t *request = entry->request;
+    entry->request = NULL;
+    self->last = entry;
+    return request;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return sender of request last returned by zm_queue_next
+
+const char *
+zm_queue_sender (zm_queue_t *self)
+{
+    assert (self);
+    return self->last ? self->last->sender : NULL;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return subject of request last returned by zm_queue_next
+
+const char *
+zm_queue_subject (zm_queue_t *self)
+{
+    assert (self);
+    return self->last ? self->last->subject : NULL;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return when request last returned by zm_queue_next was admitted
+
+int64_t
+zm_queue_received (zm_queue_t *self)
+{
+    assert (self);
+    return self->last ? self->last->received : 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return number of writes waiting before 503
+
+size_t
+zm_queue_high (zm_queue_t *self)
+{
+    assert (self);
+    return self->high;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return number of reads waiting
+
+size_t
+zm_queue_reads (zm_queue_t *self)
+{
+    assert (self);
+    return zlistx_size (self->reads);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return number of writes waiting
+
+size_t
+zm_queue_writes (zm_queue_t *self)
+{
+    assert (self);
+    return zlistx_size (self->writes);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+zm_queue_test (bool verbose)
+{
+    printf (" * zm_queue: ");
+
+    //  @selftest
+    zm_queue_t *self = zm_queue_new (10);
+    assert (self);
+    zm_queue_set (self, 3, 0);
+    assert (zm_queue_high (self) == 3);
+    assert (!zm_queue_next (self, true));
+    assert (!zm_queue_sender (self));
+
+    //  Reads go ahead of writes, read of a sender stays behind its own
+    //  writes and writes over high are refused
+    int64_t retry_after = -1;
+    const char *requests [][3] = {
+        {"writer", "INSERT", "w"},
+        {"writer", "INSERT", "w"},
+        {"writer", "LOOKUP", "r"},
+        {"writer", "INSERT", "w"},
+        {"asker", "LOOKUP", "r"},
+    };
+    size_t i;
+    for (i = 0; i < 5; i++) {
+        zmsg_t *request = zmsg_new ();
+        zmsg_addstrf (request, "%zu", i);
+        int r = zm_queue_admit (self, requests [i][0], requests [i][1],
+            *requests [i][2] == 'w', &request, &retry_after);
+        assert (r == (i == 3 ? 503 : 0));
+        assert (i == 3 ? request != NULL : request == NULL);
+        zmsg_destroy (&request);
+    }
+    assert (retry_after == 0);
+    assert (zm_queue_writes (self) == 3);
+    assert (zm_queue_reads (self) == 1);
+
+    zmsg_t *request = zm_queue_next (self, false);
+    assert (request);
+    char *str = zmsg_popstr (request);
+    assert (streq (str, "4"));
+    zstr_free (&str);
+    zmsg_destroy (&request);
+    assert (streq (zm_queue_sender (self), "asker"));
+    assert (streq (zm_queue_subject (self), "LOOKUP"));
+    assert (zm_queue_received (self) > 0);
+    assert (!zm_queue_next (self, false));
+    const char *order [] = {"0", "1", "2"};
+    for (i = 0; i < 3; i++) {
+        request = zm_queue_next (self, true);
+        assert (request);
+        str = zmsg_popstr (request);
+        assert (streq (str, order [i]));
+        zstr_free (&str);
+        zmsg_destroy (&request);
+        assert (streq (zm_queue_sender (self), "writer"));
+    }
+    assert (!zm_queue_next (self, true));
+    assert (zm_queue_writes (self) == 0);
+
+    //  Sender over its rate is refused until tokens refill
+    zm_queue_set (self, 0, 1);
+    request = zmsg_new ();
+    assert (zm_queue_admit (self, "fast", "LOOKUP", false, &request, &retry_after) == 0);
+    request = zmsg_new ();
+    assert (zm_queue_admit (self, "fast", "LOOKUP", false, &request, &retry_after) == 429);
+    assert (retry_after > 0 && retry_after <= 1001);
+    zmsg_destroy (&request);
+    request = zmsg_new ();
+    assert (zm_queue_admit (self, "slow", "LOOKUP", false, &request, &retry_after) == 0);
+    zm_queue_destroy (&self);
+    //  @end
+    printf ("OK\n");
+}
@@ -0,0 +1,85 @@
+/*  =========================================================================
+    zm_queue - Admission queues of mailbox requests
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+#ifndef ZM_QUEUE_H_INCLUDED
+#define ZM_QUEUE_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @interface
+//  Create a new zm_queue, whose owner applies slice writes per msec. It
+//  has no limits.
+ZM_DEVICE_PRIVATE zm_queue_t *
+    zm_queue_new (size_t slice);
+
+//  Destroy the zm_queue, requests still waiting are dropped
+ZM_DEVICE_PRIVATE void
+    zm_queue_destroy (zm_queue_t **self_p);
+
+//  Refuse writes once high of them wait, 0 is no limit, and requests of
+//  sender over rate per second, 0 is no limit. Senders start over with
+//  a full burst.
+ZM_DEVICE_PRIVATE void
+    zm_queue_set (zm_queue_t *self, size_t high, size_t rate);
+
+//  Queue request of sender, taking it over, and return 0. Write is true
+//  for requests which change devices. Returns 429 if sender is over its
+//  rate or 503 if too many writes wait, request is left to the caller
+//  then and *retry_after_p says in how many msecs to try again.
+ZM_DEVICE_PRIVATE int
+    zm_queue_admit (zm_queue_t *self, const char *sender, const char *subject,
+        bool write, zmsg_t **request_p, int64_t *retry_after_p);
+
+//  Return next request to handle and remove it from its queue, NULL if
+//  none waits. Reads come first, writes only if write is true. Caller
+//  destroys the request.
+ZM_DEVICE_PRIVATE zmsg_t *
+    zm_queue_next (zm_queue_t *self, bool write);
+
+//  Return sender of request last returned by zm_queue_next
+ZM_DEVICE_PRIVATE const char *
+    zm_queue_sender (zm_queue_t *self);
+
+//  Return subject of request last returned by zm_queue_next
+ZM_DEVICE_PRIVATE const char *
+    zm_queue_subject (zm_queue_t *self);
+
+//  Return zclock_usecs when request last returned by zm_queue_next was
+//  admitted
+ZM_DEVICE_PRIVATE int64_t
+    zm_queue_received (zm_queue_t *self);
+
+//  Return number of writes waiting before 503, 0 is no limit
+ZM_DEVICE_PRIVATE size_t
+    zm_queue_high (zm_queue_t *self);
+
+//  Return number of reads waiting
+ZM_DEVICE_PRIVATE size_t
+    zm_queue_reads (zm_queue_t *self);
+
+//  Return number of writes waiting
+ZM_DEVICE_PRIVATE size_t
+    zm_queue_writes (zm_queue_t *self);
+
+//  Self test of this class
+ZM_DEVICE_PRIVATE void
+    zm_queue_test (bool verbose);
+
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,551 @@
+/*  =========================================================================
+    zm_replica - State of replica following its leader
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+/*
+@header
+    zm_replica - State of replica following its leader
+@discuss
+    Applies what the leader sends to devices, as REPLICA of zm_device
+    describes: stream of changes, SNAPSHOT chunk by chunk and SYNC-SINCE
+    replies. Keeps epoch and version of the leader applied so far and
+    stream messages which came while syncing. Actor owns the client and
+    the timeout, it sends what zm_replica_sync encodes and syncs again
+    whenever a call here returns -1.
+@end
+*/
+
+#include "zm_device_classes.h"
+
+#define ZM_REPLICA_PENDING  100000  //  Max stream messages kept while syncing
+
+//  Structure of our class
+
+struct _zm_replica_t {
+    int64_t epoch;              //  Epoch of the followed leader
+    uint64_t version;           //  Last applied version of the leader
+    bool syncing;               //  Waiting for SYNC-SINCE or SNAPSHOT
+    size_t snapshot_chunk;      //  Last SNAPSHOT chunk applied
+    int64_t snapshot_epoch;     //  Epoch of SNAPSHOT being applied
+    uint64_t snapshot_version;  //  Version of SNAPSHOT being applied
+    zhashx_t *snapshot_stale;   //  Names not in chunks received so far
+    zlistx_t *pending;          //  Stream messages received while syncing
+    bool pending_lost;          //  Some of them did not fit
+    zm_proto_t *msg;            //  Device being applied
+};
+
+
+//  --------------------------------------------------------------------------
+//  Create a new zm_replica
+
+zm_replica_t *
+zm_replica_new (void)
+{
+    zm_replica_t *self = (zm_replica_t *) zmalloc (sizeof (zm_replica_t));
+    assert (self);
+    //  Initialize class properties here
+    self->pending = zlistx_new ();
+    assert (self->pending);
+    zlistx_set_destructor (self->pending, (zlistx_destructor_fn *) zmsg_destroy);
+    self->msg = zm_proto_new ();
+    assert (self->msg);
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the zm_replica
+
+void
+zm_replica_destroy (zm_replica_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zm_replica_t *self = *self_p;
+        //  Free class properties here
+        zhashx_destroy (&self->snapshot_stale);
+        zlistx_destroy (&self->pending);
+        zm_proto_destroy (&self->msg);
+        //  Free object itself
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return epoch of the leader
+
+int64_t
+zm_replica_epoch (zm_replica_t *self)
+{
+    assert (self);
+    return self->epoch;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return last version of the leader applied
+
+uint64_t
+zm_replica_version (zm_replica_t *self)
+{
+    assert (self);
+    return self->version;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return true while waiting for SNAPSHOT or SYNC-SINCE reply
+
+bool
+zm_replica_syncing (zm_replica_t *self)
+{
+    assert (self);
+    return self->syncing;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return number of stream messages kept aside
+
+size_t
+zm_replica_pending (zm_replica_t *self)
+{
+    assert (self);
+    return zlistx_size (self->pending);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Start syncing over, encode request for the leader
+
+const char *
+zm_replica_sync (zm_replica_t *self, zm_proto_t *msg)
+{
+    assert (self);
+    assert (msg);
+    //  Chunks of SNAPSHOT asked before are not applied any more
+    self->snapshot_chunk = 0;
+    zhashx_destroy (&self->snapshot_stale);
+    self->syncing = true;
+    if (!self->epoch) {
+        zm_proto_encode_ok (msg);
+        return "SNAPSHOT";
+    }
+    char epoch [32];
+    char version [32];
+    snprintf (epoch, sizeof (epoch), "%" PRId64, self->epoch);
+    snprintf (version, sizeof (version), "%" PRIu64, self->version);
+    zhash_t *ext = zhash_new ();
+    zhash_insert (ext, "_epoch", epoch);
+    zhash_insert (ext, "_version", version);
+    zm_proto_encode_device (msg, "", 0, 0, ext);
+    zhash_destroy (&ext);
+    return "SYNC-SINCE";
+}
+
+
+//  --------------------------------------------------------------------------
+//  Remove _epoch and _version of the leader
+
+void
+zm_replica_unstamp (zm_proto_t *device)
+{
+    assert (device);
+    zhash_t *ext = zm_proto_ext (device);
+    if (ext) {
+        zhash_delete (ext, "_epoch");
+        zhash_delete (ext, "_version");
+    }
+}
+
+//  Apply CHANGE-BATCH published by leader, returns -1 if changes before
+//  it were lost
+
+static int
+s_apply_changes (zm_replica_t *self, zmsg_t *msg, zm_devices_t *devices)
+{
+    char *from = zmsg_popstr (msg);
+    char *to = zmsg_popstr (msg);
+    uint64_t from_version = from ? (uint64_t) strtoull (from, NULL, 10) : 0;
+    uint64_t to_version = to ? (uint64_t) strtoull (to, NULL, 10) : 0;
+    zstr_free (&from);
+    zstr_free (&to);
+    if (from_version > self->version)
+        return -1;
+
+    char *op = zmsg_popstr (msg);
+    zmsg_t *item = zmsg_popmsg (msg);
+    while (op && item) {
+        if (zm_proto_recv (self->msg, item) == 0
+        &&  zm_proto_id (self->msg) == ZM_PROTO_DEVICE) {
+            int64_t epoch = (int64_t) zm_proto_ext_int (self->msg, "_epoch", 0);
+            if (epoch != self->epoch) {
+                zstr_free (&op);
+                zmsg_destroy (&item);
+                return -1;
+            }
+            //  Devices not changed since the replica's version are there
+            if (zm_proto_ext_int (self->msg, "_version", 0) > self->version) {
+                if (streq (op, "INSERT")) {
+                    zm_replica_unstamp (self->msg);
+                    zm_devices_insert (devices, self->msg);
+                }
+                else
+                    zm_devices_delete (devices, zm_proto_device (self->msg));
+            }
+        }
+        zstr_free (&op);
+        zmsg_destroy (&item);
+        op = zmsg_popstr (msg);
+        item = zmsg_popmsg (msg);
+    }
+    zstr_free (&op);
+    zmsg_destroy (&item);
+    if (to_version > self->version)
+        self->version = to_version;
+    return 0;
+}
+
+//  Apply change published by leader, returns -1 if some were lost
+
+static int
+s_apply (zm_replica_t *self, const char *subject, zmsg_t *msg, zm_devices_t *devices)
+{
+    if (streq (subject, "CHANGE-BATCH"))
+        return s_apply_changes (self, msg, devices);
+    bool batch = streq (subject, "INSERT-BATCH") || streq (subject, "DELETE-BATCH");
+    bool insert = streq (subject, "INSERT") || streq (subject, "INSERT-BATCH");
+    if (!insert && !streq (subject, "DELETE") && !streq (subject, "DELETE-BATCH"))
+        return 0;       //  PUBLISH-ALL is not a change
+
+    zmsg_t *item = batch ? zmsg_popmsg (msg) : zmsg_dup (msg);
+    while (item) {
+        if (zm_proto_recv (self->msg, item) == 0
+        &&  zm_proto_id (self->msg) == ZM_PROTO_DEVICE) {
+            int64_t epoch = (int64_t) zm_proto_ext_int (self->msg, "_epoch", 0);
+            uint64_t version = zm_proto_ext_int (self->msg, "_version", 0);
+            if (epoch != self->epoch || version > self->version + 1) {
+                zmsg_destroy (&item);
+                return -1;
+            }
+            //  Older versions are already in the snapshot
+            if (version == self->version + 1) {
+                self->version = version;
+                if (insert) {
+                    zm_replica_unstamp (self->msg);
+                    zm_devices_insert (devices, self->msg);
+                }
+                else
+                    zm_devices_delete (devices, zm_proto_device (self->msg));
+            }
+        }
+        zmsg_destroy (&item);
+        item = batch ? zmsg_popmsg (msg) : NULL;
+    }
+    return 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Apply stream message of the leader, or keep it aside while syncing
+
+int
+zm_replica_recv (zm_replica_t *self, const char *subject, zmsg_t *msg,
+    zm_devices_t *devices)
+{
+    assert (self);
+    assert (subject);
+    assert (msg);
+    assert (devices);
+
+    if (self->syncing) {
+        if (zlistx_size (self->pending) < ZM_REPLICA_PENDING) {
+            zmsg_t *copy = zmsg_dup (msg);
+            zmsg_pushstr (copy, subject);
+            zlistx_add_end (self->pending, copy);
+        }
+        else
+            self->pending_lost = true;
+        return 0;
+    }
+    return s_apply (self, subject, msg, devices);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Apply SNAPSHOT chunk of the leader
+
+int
+zm_replica_snapshot (zm_replica_t *self, zmsg_t *reply, zm_devices_t *devices)
+{
+    assert (self);
+    assert (reply);
+    assert (devices);
+
+    zmsg_t *status = zmsg_popmsg (reply);
+    int r = status ? zm_proto_recv (self->msg, status) : -1;
+    zmsg_destroy (&status);
+    if (r != 0 || zm_proto_id (self->msg) != ZM_PROTO_OK) {
+        zsys_warning ("zm_replica: leader refused SNAPSHOT");
+        return -1;
+    }
+
+    char *str_epoch = zmsg_popstr (reply);
+    char *str_version = zmsg_popstr (reply);
+    char *str_chunk = zmsg_popstr (reply);
+    char *more = zmsg_popstr (reply);
+    int64_t epoch = str_epoch ? (int64_t) strtoll (str_epoch, NULL, 10) : 0;
+    uint64_t version = str_version ? (uint64_t) strtoull (str_version, NULL, 10) : 0;
+    size_t chunk = str_chunk ? (size_t) strtoull (str_chunk, NULL, 10) : 0;
+    bool last = !more || streq (more, "0");
+    zstr_free (&str_epoch);
+    zstr_free (&str_version);
+    zstr_free (&str_chunk);
+    zstr_free (&more);
+
+    if (chunk == 1) {
+        //  Names we have now, each one is crossed out as its device arrives
+        zhashx_destroy (&self->snapshot_stale);
+        self->snapshot_stale = zhashx_new ();
+        assert (self->snapshot_stale);
+        zlistx_t *names = zm_devices_names (devices);
+        const char *name = (const char *) zlistx_first (names);
+        while (name) {
+            zhashx_insert (self->snapshot_stale, name, (void *) 1);
+            name = (const char *) zlistx_next (names);
+        }
+        zlistx_destroy (&names);
+        self->snapshot_epoch = epoch;
+        self->snapshot_version = version;
+    }
+    else
+    if (!self->snapshot_stale
+    ||  chunk != self->snapshot_chunk + 1
+    ||  epoch != self->snapshot_epoch
+    ||  version != self->snapshot_version)
+        return -1;      //  Left from SNAPSHOT asked before
+    self->snapshot_chunk = chunk;
+
+    zmsg_t *item = zmsg_popmsg (reply);
+    while (item) {
+        if (zm_proto_recv (self->msg, item) == 0
+        &&  zm_proto_id (self->msg) == ZM_PROTO_DEVICE) {
+            zm_devices_insert (devices, self->msg);
+            zhashx_delete (self->snapshot_stale, zm_proto_device (self->msg));
+        }
+        zmsg_destroy (&item);
+        item = zmsg_popmsg (reply);
+    }
+    if (!last)
+        return 0;
+
+    zlistx_t *stale = zhashx_keys (self->snapshot_stale);
+    const char *name = (const char *) zlistx_first (stale);
+    while (name) {
+        zm_devices_delete (devices, name);
+        name = (const char *) zlistx_next (stale);
+    }
+    zlistx_destroy (&stale);
+    zhashx_destroy (&self->snapshot_stale);
+    self->snapshot_chunk = 0;
+    self->epoch = self->snapshot_epoch;
+    self->version = self->snapshot_version;
+    return 1;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Apply SYNC-SINCE reply of the leader
+
+int
+zm_replica_delta (zm_replica_t *self, zmsg_t *reply, zm_devices_t *devices)
+{
+    assert (self);
+    assert (reply);
+    assert (devices);
+
+    zmsg_t *status = zmsg_popmsg (reply);
+    int r = status ? zm_proto_recv (self->msg, status) : -1;
+    zmsg_destroy (&status);
+    if (r != 0 || zm_proto_id (self->msg) != ZM_PROTO_OK) {
+        self->epoch = 0;
+        return -1;
+    }
+
+    char *epoch = zmsg_popstr (reply);
+    char *version = zmsg_popstr (reply);
+    char *inserted = zmsg_popstr (reply);
+    self->epoch = epoch ? (int64_t) strtoll (epoch, NULL, 10) : 0;
+    self->version = version ? (uint64_t) strtoull (version, NULL, 10) : 0;
+    size_t count = inserted ? (size_t) strtoull (inserted, NULL, 10) : 0;
+    zstr_free (&epoch);
+    zstr_free (&version);
+    zstr_free (&inserted);
+
+    size_t i;
+    for (i = 0; i < count; i++) {
+        zmsg_t *item = zmsg_popmsg (reply);
+        if (item
+        &&  zm_proto_recv (self->msg, item) == 0
+        &&  zm_proto_id (self->msg) == ZM_PROTO_DEVICE)
+            zm_devices_insert (devices, self->msg);
+        zmsg_destroy (&item);
+    }
+    char *name = zmsg_popstr (reply);
+    while (name) {
+        zm_devices_delete (devices, name);
+        zstr_free (&name);
+        name = zmsg_popstr (reply);
+    }
+    return 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  End syncing, apply stream messages kept aside
+
+int
+zm_replica_resume (zm_replica_t *self, zm_devices_t *devices)
+{
+    assert (self);
+    assert (devices);
+    self->syncing = false;
+    bool lost = self->pending_lost;
+    self->pending_lost = false;
+    zmsg_t *msg = (zmsg_t *) zlistx_first (self->pending);
+    while (msg && !lost) {
+        char *subject = zmsg_popstr (msg);
+        lost = s_apply (self, subject, msg, devices) == -1;
+        zstr_free (&subject);
+        msg = (zmsg_t *) zlistx_next (self->pending);
+    }
+    zlistx_purge (self->pending);
+    return lost ? -1 : 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+static zmsg_t *
+s_test_chunk (const char *chunk, const char *more, const char *name)
+{
+    zm_proto_t *proto = zm_proto_new ();
+    zmsg_t *reply = zmsg_new ();
+    zmsg_t *submsg = zmsg_new ();
+    zm_proto_encode_ok (proto);
+    zm_proto_send (proto, submsg);
+    zmsg_addmsg (reply, &submsg);
+    zmsg_addstr (reply, "7");
+    zmsg_addstr (reply, "42");
+    zmsg_addstr (reply, chunk);
+    zmsg_addstr (reply, more);
+    zm_proto_encode_device (proto, name, zclock_mono (), 60000, NULL);
+    submsg = zmsg_new ();
+    zm_proto_send (proto, submsg);
+    zmsg_addmsg (reply, &submsg);
+    zm_proto_destroy (&proto);
+    return reply;
+}
+
+void
+zm_replica_test (bool verbose)
+{
+    printf (" * zm_replica: ");
+
+    //  @selftest
+    zm_replica_t *self = zm_replica_new ();
+    assert (self);
+    zm_devices_t *devices = zm_devices_new (NULL);
+    assert (devices);
+    zm_proto_t *msg = zm_proto_new ();
+    assert (!zm_replica_syncing (self));
+
+    //  Without epoch whole SNAPSHOT is asked for
+    const char *subject = zm_replica_sync (self, msg);
+    assert (streq (subject, "SNAPSHOT"));
+    assert (zm_proto_id (msg) == ZM_PROTO_OK);
+    assert (zm_replica_syncing (self));
+
+    //  Stream is kept aside while syncing
+    zhash_t *ext = zhash_new ();
+    zhash_insert (ext, "_epoch", "7");
+    zhash_insert (ext, "_version", "43");
+    zm_proto_encode_device (msg, "streamed", zclock_mono (), 60000, ext);
+    zhash_destroy (&ext);
+    zmsg_t *change = zmsg_new ();
+    zm_proto_send (msg, change);
+    assert (zm_replica_recv (self, "INSERT", change, devices) == 0);
+    assert (zm_replica_pending (self) == 1);
+    assert (!zm_devices_lookup (devices, "streamed"));
+
+    //  Chunks apply in order, devices not in any go with the last one
+    zm_proto_encode_device (msg, "old", zclock_mono (), 60000, NULL);
+    zm_devices_insert (devices, msg);
+    zmsg_t *reply = s_test_chunk ("1", "1", "chunk1");
+    assert (zm_replica_snapshot (self, reply, devices) == 0);
+    zmsg_destroy (&reply);
+    assert (zm_devices_lookup (devices, "old"));
+    assert (zm_replica_epoch (self) == 0);
+    reply = s_test_chunk ("3", "0", "chunk3");
+    assert (zm_replica_snapshot (self, reply, devices) == -1);
+    zmsg_destroy (&reply);
+    reply = s_test_chunk ("2", "0", "chunk2");
+    assert (zm_replica_snapshot (self, reply, devices) == 1);
+    zmsg_destroy (&reply);
+    assert (zm_replica_epoch (self) == 7);
+    assert (zm_replica_version (self) == 42);
+    assert (zm_devices_lookup (devices, "chunk1"));
+    assert (zm_devices_lookup (devices, "chunk2"));
+    assert (!zm_devices_lookup (devices, "chunk3"));
+    assert (!zm_devices_lookup (devices, "old"));
+
+    //  Change kept aside follows the snapshot, unstamped
+    assert (zm_replica_resume (self, devices) == 0);
+    assert (!zm_replica_syncing (self));
+    assert (zm_replica_pending (self) == 0);
+    assert (zm_replica_version (self) == 43);
+    zm_proto_t *stored = zm_devices_lookup (devices, "streamed");
+    assert (stored);
+    assert (!zm_proto_ext_string (stored, "_version", NULL));
+
+    //  Gap in versions means changes were lost
+    assert (zm_replica_recv (self, "INSERT", change, devices) == 0);
+    zm_proto_ext_set_int (msg, "_epoch", 7);
+    zm_proto_ext_set_int (msg, "_version", 45);
+    zmsg_destroy (&change);
+    change = zmsg_new ();
+    zm_proto_send (msg, change);
+    assert (zm_replica_recv (self, "DELETE", change, devices) == -1);
+    zmsg_destroy (&change);
+
+    //  Once epoch is known, changes since version are asked for
+    subject = zm_replica_sync (self, msg);
+    assert (streq (subject, "SYNC-SINCE"));
+    assert (zm_proto_ext_int (msg, "_version", 0) == 43);
+    reply = zmsg_new ();
+    zmsg_t *submsg = zmsg_new ();
+    zm_proto_encode_error (msg, 410, "Gone");
+    zm_proto_send (msg, submsg);
+    zmsg_addmsg (reply, &submsg);
+    assert (zm_replica_delta (self, reply, devices) == -1);
+    zmsg_destroy (&reply);
+    assert (zm_replica_epoch (self) == 0);
+    assert (streq (zm_replica_sync (self, msg), "SNAPSHOT"));
+
+    zm_proto_destroy (&msg);
+    zm_devices_destroy (&devices);
+    zm_replica_destroy (&self);
+    //  @end
+    printf ("OK\n");
+}
@@ -0,0 +1,90 @@
+/*  =========================================================================
+    zm_replica - State of replica following its leader
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+#ifndef ZM_REPLICA_H_INCLUDED
+#define ZM_REPLICA_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @interface
+//  Create a new zm_replica, which has applied nothing of the leader yet
+ZM_DEVICE_PRIVATE zm_replica_t *
+    zm_replica_new (void);
+
+//  Destroy the zm_replica
+ZM_DEVICE_PRIVATE void
+    zm_replica_destroy (zm_replica_t **self_p);
+
+//  Return epoch of the leader, 0 until SNAPSHOT or SYNC-SINCE is applied
+ZM_DEVICE_PRIVATE int64_t
+    zm_replica_epoch (zm_replica_t *self);
+
+//  Return last version of the leader applied
+ZM_DEVICE_PRIVATE uint64_t
+    zm_replica_version (zm_replica_t *self);
+
+//  Return true while waiting for SNAPSHOT or SYNC-SINCE reply
+ZM_DEVICE_PRIVATE bool
+    zm_replica_syncing (zm_replica_t *self);
+
+//  Return number of stream messages kept aside while syncing
+ZM_DEVICE_PRIVATE size_t
+    zm_replica_pending (zm_replica_t *self);
+
+//  Start syncing over. Encodes request for the leader into msg and returns
+//  its subject, SYNC-SINCE once an epoch is known, SNAPSHOT otherwise.
+//  Chunks of SNAPSHOT asked before are not applied any more.
+ZM_DEVICE_PRIVATE const char *
+    zm_replica_sync (zm_replica_t *self, zm_proto_t *msg);
+
+//  Apply stream message of the leader with subject to devices, or keep it
+//  aside while syncing. Returns -1 if changes before it were lost and
+//  replica must sync again, otherwise 0.
+ZM_DEVICE_PRIVATE int
+    zm_replica_recv (zm_replica_t *self, const char *subject, zmsg_t *msg,
+        zm_devices_t *devices);
+
+//  Apply SNAPSHOT chunk of the leader to devices. Returns 1 when it was the
+//  last one and devices not in any chunk are deleted, 0 when more chunks
+//  are to come, -1 if leader refused or chunk is not the expected one.
+ZM_DEVICE_PRIVATE int
+    zm_replica_snapshot (zm_replica_t *self, zmsg_t *reply, zm_devices_t *devices);
+
+//  Apply SYNC-SINCE reply of the leader to devices. Returns 0 if applied,
+//  -1 if leader refused it, epoch is forgotten then so next sync asks for
+//  SNAPSHOT.
+ZM_DEVICE_PRIVATE int
+    zm_replica_delta (zm_replica_t *self, zmsg_t *reply, zm_devices_t *devices);
+
+//  End syncing, apply stream messages kept aside meanwhile. Returns -1 if
+//  some were lost and replica must sync again, otherwise 0.
+ZM_DEVICE_PRIVATE int
+    zm_replica_resume (zm_replica_t *self, zm_devices_t *devices);
+
+//  Remove _epoch and _version the leader stamps changes with, they are
+//  not stored with the device
+ZM_DEVICE_PRIVATE void
+    zm_replica_unstamp (zm_proto_t *device);
+
+//  Self test of this class
+ZM_DEVICE_PRIVATE void
+    zm_replica_test (bool verbose);
+
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,402 @@
+/*  =========================================================================
+    zm_shards - Worker actors of sharded zm_device
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+/*
+@header
+    zm_shards - Worker actors of sharded zm_device
+@discuss
+    Runs the workers of SHARDING in zm_device, maps device names to them
+    and gathers replies of all of them to one request, keeping track of
+    replies which came too late. The front actor configures and starts
+    the workers and makes replies of what is gathered.
+@end
+*/
+
+#include "zm_device_classes.h"
+
+#define ZM_SHARDS_TIMEOUT   5000    //  Max msecs waiting for GATHER replies
+
+//  Structure of our class
+
+struct _zm_shards_t {
+    zactor_t **workers;         //  Worker actors
+    size_t count;               //  Number of them
+    size_t *late;               //  GATHER replies given up on, per worker
+    zm_proto_t *msg;            //  Status being decoded
+};
+
+
+//  --------------------------------------------------------------------------
+//  Create a new zm_shards
+
+zm_shards_t *
+zm_shards_new (size_t count)
+{
+    assert (count);
+    zm_shards_t *self = (zm_shards_t *) zmalloc (sizeof (zm_shards_t));
+    assert (self);
+    //  Initialize class properties here
+    self->workers = (zactor_t **) zmalloc (count * sizeof (zactor_t *));
+    assert (self->workers);
+    self->late = (size_t *) zmalloc (count * sizeof (size_t));
+    assert (self->late);
+    self->count = count;
+    size_t i;
+    for (i = 0; i < count; i++) {
+        self->workers [i] = zactor_new (zm_device_actor, NULL);
+        assert (self->workers [i]);
+    }
+    self->msg = zm_proto_new ();
+    assert (self->msg);
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the zm_shards
+
+void
+zm_shards_destroy (zm_shards_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zm_shards_t *self = *self_p;
+        //  Free class properties here
+        size_t i;
+        for (i = 0; i < self->count; i++)
+            zactor_destroy (&self->workers [i]);
+        free (self->workers);
+        free (self->late);
+        zm_proto_destroy (&self->msg);
+        //  Free object itself
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return number of workers
+
+size_t
+zm_shards_size (zm_shards_t *self)
+{
+    assert (self);
+    return self->count;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return index-th worker
+
+zactor_t *
+zm_shards_worker (zm_shards_t *self, size_t index)
+{
+    assert (self);
+    assert (index < self->count);
+    return self->workers [index];
+}
+
+
+//  --------------------------------------------------------------------------
+//  Send command to every worker
+
+void
+zm_shards_send (zm_shards_t *self, const char *command)
+{
+    assert (self);
+    assert (command);
+    size_t i;
+    for (i = 0; i < self->count; i++)
+        zstr_send (self->workers [i], command);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return index of worker owning device name, jump consistent hash
+//  (Lamping, Veach) of its FNV-1a hash
+
+size_t
+zm_shards_owner (zm_shards_t *self, const char *name)
+{
+    assert (self);
+    uint64_t key = 14695981039346656037ULL;
+    const char *p;
+    for (p = name ? name : ""; *p; p++) {
+        key ^= (byte) *p;
+        key *= 1099511628211ULL;
+    }
+    int64_t shard = -1;
+    int64_t next = 0;
+    while (next < (int64_t) self->count) {
+        shard = next;
+        key = key * 2862933555777941757ULL + 1;
+        next = (int64_t) ((shard + 1) * ((double) (1LL << 31) / (double) ((key >> 33) + 1)));
+    }
+    return (size_t) shard;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return array of one request per worker
+
+zmsg_t **
+zm_shards_requests (zm_shards_t *self, zm_proto_t *msg)
+{
+    assert (self);
+    zmsg_t **requests = (zmsg_t **) zmalloc (self->count * sizeof (zmsg_t *));
+    assert (requests);
+    size_t i;
+    for (i = 0; i < self->count; i++) {
+        requests [i] = zmsg_new ();
+        if (msg)
+            zm_proto_send (msg, requests [i]);
+    }
+    return requests;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy array of messages, one per worker
+
+void
+zm_shards_free (zm_shards_t *self, zmsg_t ***msgs_p)
+{
+    assert (self);
+    assert (msgs_p);
+    if (*msgs_p) {
+        size_t i;
+        for (i = 0; i < self->count; i++)
+            zmsg_destroy (&(*msgs_p) [i]);
+        free (*msgs_p);
+        *msgs_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Send requests to workers and wait for all replies
+
+zmsg_t **
+zm_shards_gather (zm_shards_t *self, const char *subject, zmsg_t ***requests_p)
+{
+    assert (self);
+    assert (subject);
+    assert (requests_p);
+    zmsg_t **requests = *requests_p;
+    size_t i;
+    for (i = 0; i < self->count; i++) {
+        zmsg_pushstr (requests [i], subject);
+        zmsg_pushstr (requests [i], "GATHER");
+        zmsg_send (&requests [i], self->workers [i]);
+    }
+    zm_shards_free (self, requests_p);
+
+    //  Workers run meanwhile, so this takes as long as the slowest one
+    zmsg_t **replies = (zmsg_t **) zmalloc (self->count * sizeof (zmsg_t *));
+    assert (replies);
+    zpoller_t *poller = zpoller_new (NULL);
+    assert (poller);
+    for (i = 0; i < self->count; i++)
+        zpoller_add (poller, self->workers [i]);
+    size_t waiting = self->count;
+    int64_t deadline = zclock_mono () + ZM_SHARDS_TIMEOUT;
+    while (waiting) {
+        int64_t timeout = deadline - zclock_mono ();
+        void *which = timeout > 0 ? zpoller_wait (poller, (int) timeout) : NULL;
+        if (!which)
+            break;                          //  Timed out or interrupted
+        for (i = 0; i < self->count; i++)
+            if (which == self->workers [i])
+                break;
+        assert (i < self->count);
+        zmsg_t *reply = zmsg_recv (self->workers [i]);
+        if (!reply)
+            break;
+        if (self->late [i]) {
+            self->late [i]--;               //  Left over from timed out gather
+            zmsg_destroy (&reply);
+            continue;
+        }
+        assert (!replies [i]);
+        replies [i] = reply;
+        zpoller_remove (poller, self->workers [i]);
+        waiting--;
+    }
+    zpoller_destroy (&poller);
+    for (i = 0; i < self->count; i++)
+        if (!replies [i]) {
+            zsys_warning ("zm_shards: shard %zu did not reply %s in time", i, subject);
+            self->late [i]++;
+            replies [i] = zmsg_new ();
+        }
+    return replies;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Drop leading status submessage of gathered replies
+
+size_t
+zm_shards_status (zm_shards_t *self, zmsg_t **replies)
+{
+    assert (self);
+    assert (replies);
+    size_t ok = 0;
+    size_t i;
+    for (i = 0; i < self->count; i++) {
+        zmsg_t *status = zmsg_popmsg (replies [i]);
+        if (status
+        &&  zm_proto_recv (self->msg, status) == 0
+        &&  zm_proto_id (self->msg) == ZM_PROTO_OK)
+            ok++;
+        zmsg_destroy (&status);
+    }
+    return ok;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return index of the smallest name of sorted lists
+
+int
+zm_shards_merge (zm_shards_t *self, zmsg_t **lists, zm_proto_t **heads)
+{
+    assert (self);
+    assert (lists);
+    assert (heads);
+    int best = -1;
+    size_t i;
+    for (i = 0; i < self->count; i++) {
+        while (!heads [i] && zmsg_size (lists [i])) {
+            zmsg_t *item = zmsg_popmsg (lists [i]);
+            if (!item)
+                continue;
+            heads [i] = zm_proto_new ();
+            if (zm_proto_recv (heads [i], item) != 0)
+                zm_proto_destroy (&heads [i]);
+            zmsg_destroy (&item);
+        }
+        if (heads [i]
+        && (best == -1
+        ||  strcmp (zm_proto_device (heads [i]), zm_proto_device (heads [best])) < 0))
+            best = (int) i;
+    }
+    return best;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Receive and drop late GATHER replies of index-th worker
+
+void
+zm_shards_drop_late (zm_shards_t *self, size_t index)
+{
+    assert (self);
+    assert (index < self->count);
+    for (; self->late [index]; self->late [index]--) {
+        zmsg_t *late = zmsg_recv (self->workers [index]);
+        zmsg_destroy (&late);
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+zm_shards_test (bool verbose)
+{
+    printf (" * zm_shards: ");
+
+    //  @selftest
+    zm_shards_t *self = zm_shards_new (3);
+    assert (self);
+    assert (zm_shards_size (self) == 3);
+    assert (zm_shards_worker (self, 2));
+
+    //  Adding a worker moves devices only to the new one
+    zm_shards_t *more = zm_shards_new (4);
+    size_t owned [3] = {0, 0, 0};
+    size_t moved = 0;
+    char name [32];
+    size_t i;
+    for (i = 0; i < 300; i++) {
+        snprintf (name, sizeof (name), "device%zu", i);
+        size_t owner = zm_shards_owner (self, name);
+        assert (owner < 3);
+        assert (zm_shards_owner (self, name) == owner);
+        owned [owner]++;
+        size_t other = zm_shards_owner (more, name);
+        if (other != owner) {
+            assert (other == 3);
+            moved++;
+        }
+    }
+    assert (owned [0] && owned [1] && owned [2]);
+    assert (moved > 0 && moved < 150);
+    zm_shards_destroy (&more);
+
+    //  Batch is split among workers and merged back in name order
+    zm_proto_t *msg = zm_proto_new ();
+    zmsg_t **requests = zm_shards_requests (self, NULL);
+    for (i = 0; i < 10; i++) {
+        snprintf (name, sizeof (name), "device%zu", 9 - i);
+        zm_proto_encode_device (msg, name, zclock_mono (), 60000, NULL);
+        zmsg_t *item = zmsg_new ();
+        zm_proto_send (msg, item);
+        zmsg_addmsg (requests [zm_shards_owner (self, name)], &item);
+    }
+    zmsg_t **replies = zm_shards_gather (self, "INSERT-BATCH", &requests);
+    assert (!requests);
+    assert (zm_shards_status (self, replies) == 3);
+    size_t applied = 0;
+    for (i = 0; i < 3; i++) {
+        char *str = zmsg_popstr (replies [i]);
+        applied += str ? (size_t) strtoull (str, NULL, 10) : 0;
+        zstr_free (&str);
+    }
+    assert (applied == 10);
+    zm_shards_free (self, &replies);
+    assert (!replies);
+
+    zm_proto_encode_device (msg, "", 0, 0, NULL);
+    requests = zm_shards_requests (self, msg);
+    replies = zm_shards_gather (self, "GET-ALL", &requests);
+    assert (zm_shards_status (self, replies) == 3);
+    zm_proto_t *heads [3] = {NULL, NULL, NULL};
+    size_t merged = 0;
+    int next = zm_shards_merge (self, replies, heads);
+    while (next != -1) {
+        snprintf (name, sizeof (name), "device%zu", merged++);
+        assert (streq (zm_proto_device (heads [next]), name));
+        zm_proto_destroy (&heads [next]);
+        next = zm_shards_merge (self, replies, heads);
+    }
+    assert (merged == 10);
+    zm_shards_free (self, &replies);
+
+    //  Nothing is late, so SIZE is answered right away
+    zm_shards_send (self, "SIZE");
+    size_t total = 0;
+    for (i = 0; i < 3; i++) {
+        zm_shards_drop_late (self, i);
+        char *size = zstr_recv (zm_shards_worker (self, i));
+        total += size ? (size_t) strtoull (size, NULL, 10) : 0;
+        zstr_free (&size);
+    }
+    assert (total == 10);
+    zm_proto_destroy (&msg);
+    zm_shards_destroy (&self);
+    //  @end
+    printf ("OK\n");
+}
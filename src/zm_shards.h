@@ -0,0 +1,90 @@
+/*  =========================================================================
+    zm_shards - Worker actors of sharded zm_device
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+#ifndef ZM_SHARDS_H_INCLUDED
+#define ZM_SHARDS_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @interface
+//  Create a new zm_shards running count zm_device_actor workers, not
+//  configured nor started yet
+ZM_DEVICE_PRIVATE zm_shards_t *
+    zm_shards_new (size_t count);
+
+//  Destroy the zm_shards, workers store their devices
+ZM_DEVICE_PRIVATE void
+    zm_shards_destroy (zm_shards_t **self_p);
+
+//  Return number of workers
+ZM_DEVICE_PRIVATE size_t
+    zm_shards_size (zm_shards_t *self);
+
+//  Return index-th worker
+ZM_DEVICE_PRIVATE zactor_t *
+    zm_shards_worker (zm_shards_t *self, size_t index);
+
+//  Send command to every worker
+ZM_DEVICE_PRIVATE void
+    zm_shards_send (zm_shards_t *self, const char *command);
+
+//  Return index of worker owning device name. FNV-1a hash of the name is
+//  mapped by jump consistent hash, so adding a worker moves only 1/N of
+//  devices, all of them to the new one.
+ZM_DEVICE_PRIVATE size_t
+    zm_shards_owner (zm_shards_t *self, const char *name);
+
+//  Return array of one request per worker, each encoded from msg, or
+//  empty if msg is NULL. Free it with zm_shards_free.
+ZM_DEVICE_PRIVATE zmsg_t **
+    zm_shards_requests (zm_shards_t *self, zm_proto_t *msg);
+
+//  Destroy array of messages, one per worker
+ZM_DEVICE_PRIVATE void
+    zm_shards_free (zm_shards_t *self, zmsg_t ***msgs_p);
+
+//  Send requests [i] with GATHER subject to i-th worker and wait for all
+//  replies, at most 5 seconds. Worker which did not reply in time gets
+//  empty reply, so its status is not OK, and its late reply is dropped
+//  when it comes. Requests are destroyed, caller frees the replies.
+ZM_DEVICE_PRIVATE zmsg_t **
+    zm_shards_gather (zm_shards_t *self, const char *subject, zmsg_t ***requests_p);
+
+//  Drop leading status submessage of gathered replies, returns number of
+//  workers which replied ZM_PROTO_OK
+ZM_DEVICE_PRIVATE size_t
+    zm_shards_status (zm_shards_t *self, zmsg_t **replies);
+
+//  Decode next device of each sorted list into heads and return index of
+//  the one with smallest name, or -1 when all lists are exhausted. Caller
+//  takes the returned head, heads has one slot per worker.
+ZM_DEVICE_PRIVATE int
+    zm_shards_merge (zm_shards_t *self, zmsg_t **lists, zm_proto_t **heads);
+
+//  Receive and drop late GATHER replies of index-th worker, so its next
+//  reply is the one to the pipe command sent now
+ZM_DEVICE_PRIVATE void
+    zm_shards_drop_late (zm_shards_t *self, size_t index);
+
+//  Self test of this class
+ZM_DEVICE_PRIVATE void
+    zm_shards_test (bool verbose);
+
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
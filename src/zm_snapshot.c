@@ -0,0 +1,642 @@
+/*  =========================================================================
+    zm_snapshot - Binary snapshot of devices
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+/*
+@header
+    zm_snapshot - Binary snapshot of devices
+@discuss
+    Snapshot is a compact alternative to ZPL file, which can be mapped to
+    memory and walked without any parsing. It starts with 32 bytes header
+
+        'ZMDS'          magic
+        version:4       format version, 1
+        count:8         number of records
+        body:8          size of body in bytes
+        crc:4           CRC-32 of body
+        segments:4      number of segments
+
+    followed by body of count records
+
+        name_size:2 name:name_size size:4 data:size
+
+    where data is zm_proto device encoded by zmsg_encode and name is its
+    device name including terminating zero, so it can be used right from
+    the mapped file. Names let devices be indexed without decoding them.
+
+    Records are split to segments of up to 16384 records, listed by table
+    at the end of body
+
+        offset:8 count:8
+
+    with file offset of the first record of each segment and its number of
+    records. Segments are independent, so threads can walk them at once
+    with zm_snapshot_walk. Snapshot of other magic or version is not
+    loaded. All numbers are in network byte order.
+@end
+*/
+
+#include "zm_device_classes.h"
+#include <sys/mman.h>
+
+#define ZM_SNAPSHOT_MAGIC "ZMDS"
+#define ZM_SNAPSHOT_VERSION 1
+#define ZM_SNAPSHOT_HEADER_SIZE 32
+#define ZM_SNAPSHOT_SEGMENT 16384   //  Records per segment
+#define ZM_SNAPSHOT_ENTRY_SIZE 16   //  Segment table entry
+
+//  Structure of our class
+
+struct _zm_snapshot_t {
+    char *file;             //  Snapshot file name
+    char *tmp;              //  Temporary file being written
+    FILE *handle;           //  Writer handle
+    byte *data;             //  Mapped file
+    size_t data_size;       //  Size of mapped file
+    size_t cursor;          //  Offset of next record in data
+    size_t offset;          //  Offset of the last returned record
+    const char *name;       //  Name of the last returned record
+    uint64_t count;         //  Number of records
+    uint64_t body;          //  Size of body
+    uint32_t crc;           //  CRC-32 of body so far
+    size_t end;             //  Offset past the last record in data
+    uint32_t segments;      //  Number of segments
+    const byte *table;      //  Segment table in data
+    uint64_t *starts;       //  Writer, offsets of segments so far
+};
+
+//  CRC-32 (IEEE 802.3), reflected polynomial 0xEDB88320. Table is built
+//  once, journals of several actors may need it at the same time.
+
+static uint32_t s_crc_table [256];
+static pthread_once_t s_crc_once = PTHREAD_ONCE_INIT;
+
+static void
+s_crc_init (void)
+{
+    uint32_t i;
+    for (i = 0; i < 256; i++) {
+        uint32_t c = i;
+        int bit;
+        for (bit = 0; bit < 8; bit++)
+            c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        s_crc_table [i] = c;
+    }
+}
+
+uint32_t
+zm_snapshot_crc32 (uint32_t crc, const byte *data, size_t size)
+{
+    pthread_once (&s_crc_once, s_crc_init);
+    crc = ~crc;
+    while (size--)
+        crc = s_crc_table [(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void
+s_put_uint32 (byte *p, uint32_t v)
+{
+    p [0] = (byte) (v >> 24);
+    p [1] = (byte) (v >> 16);
+    p [2] = (byte) (v >> 8);
+    p [3] = (byte) v;
+}
+
+static uint32_t
+s_get_uint32 (const byte *p)
+{
+    return ((uint32_t) p [0] << 24) | ((uint32_t) p [1] << 16)
+         | ((uint32_t) p [2] << 8)  |  (uint32_t) p [3];
+}
+
+static void
+s_put_uint64 (byte *p, uint64_t v)
+{
+    s_put_uint32 (p, (uint32_t) (v >> 32));
+    s_put_uint32 (p + 4, (uint32_t) v);
+}
+
+static uint64_t
+s_get_uint64 (const byte *p)
+{
+    return ((uint64_t) s_get_uint32 (p) << 32) | s_get_uint32 (p + 4);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create a new snapshot for writing
+
+zm_snapshot_t *
+zm_snapshot_new (const char *file)
+{
+    assert (file);
+    zm_snapshot_t *self = (zm_snapshot_t *) zmalloc (sizeof (zm_snapshot_t));
+    assert (self);
+    //  Initialize class properties here
+    self->file = strdup (file);
+    self->tmp = zsys_sprintf ("%s.tmp", file);
+    self->handle = fopen (self->tmp, "wb");
+    if (!self->handle) {
+        zsys_error ("Fail to create snapshot %s: %s", self->tmp, strerror (errno));
+        zm_snapshot_destroy (&self);
+        return NULL;
+    }
+    //  Header is written on commit
+    byte header [ZM_SNAPSHOT_HEADER_SIZE] = {0};
+    fwrite (header, 1, ZM_SNAPSHOT_HEADER_SIZE, self->handle);
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Map existing snapshot to memory
+
+zm_snapshot_t *
+zm_snapshot_load (const char *file)
+{
+    assert (file);
+    zm_snapshot_t *self = (zm_snapshot_t *) zmalloc (sizeof (zm_snapshot_t));
+    assert (self);
+    self->file = strdup (file);
+
+    int fd = open (file, O_RDONLY);
+    if (fd == -1) {
+        zsys_error ("Fail to open snapshot %s: %s", file, strerror (errno));
+        goto fail;
+    }
+    struct stat st;
+    if (fstat (fd, &st) == -1 || st.st_size < ZM_SNAPSHOT_HEADER_SIZE) {
+        zsys_error ("Snapshot %s is too short", file);
+        close (fd);
+        goto fail;
+    }
+    void *data = mmap (NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (data == MAP_FAILED) {
+        zsys_error ("Fail to map snapshot %s: %s", file, strerror (errno));
+        goto fail;
+    }
+    self->data = (byte *) data;
+    self->data_size = (size_t) st.st_size;
+    //  Records are walked sequentially
+    madvise (self->data, self->data_size, MADV_SEQUENTIAL);
+
+    if (memcmp (self->data, ZM_SNAPSHOT_MAGIC, 4) != 0
+    ||  s_get_uint32 (self->data + 4) != ZM_SNAPSHOT_VERSION) {
+        zsys_error ("%s is not a zm-device snapshot of version %d", file, ZM_SNAPSHOT_VERSION);
+        goto fail;
+    }
+    self->count = s_get_uint64 (self->data + 8);
+    self->body = s_get_uint64 (self->data + 16);
+    if (self->body != self->data_size - ZM_SNAPSHOT_HEADER_SIZE
+    ||  zm_snapshot_crc32 (0, self->data + ZM_SNAPSHOT_HEADER_SIZE, self->body) != s_get_uint32 (self->data + 24)) {
+        zsys_error ("Snapshot %s is corrupted", file);
+        goto fail;
+    }
+    self->segments = s_get_uint32 (self->data + 28);
+    if ((uint64_t) self->segments * ZM_SNAPSHOT_ENTRY_SIZE > self->body) {
+        zsys_error ("Snapshot %s is corrupted", file);
+        goto fail;
+    }
+    self->end = self->data_size - (size_t) self->segments * ZM_SNAPSHOT_ENTRY_SIZE;
+    self->table = self->data + self->end;
+    uint64_t count = 0;
+    uint32_t index;
+    for (index = 0; index < self->segments; index++) {
+        uint64_t offset = s_get_uint64 (self->table + index * ZM_SNAPSHOT_ENTRY_SIZE);
+        if (offset < ZM_SNAPSHOT_HEADER_SIZE || offset >= self->end)
+            break;
+        count += s_get_uint64 (self->table + index * ZM_SNAPSHOT_ENTRY_SIZE + 8);
+    }
+    if (index < self->segments || count != self->count) {
+        zsys_error ("Snapshot %s has invalid segment table", file);
+        goto fail;
+    }
+    return self;
+fail:
+    zm_snapshot_destroy (&self);
+    return NULL;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the zm_snapshot
+
+void
+zm_snapshot_destroy (zm_snapshot_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zm_snapshot_t *self = *self_p;
+        //  Free class properties here
+        if (self->handle) {
+            fclose (self->handle);
+            zsys_file_delete (self->tmp);
+        }
+        if (self->data)
+            munmap (self->data, self->data_size);
+        free (self->starts);
+        zstr_free (&self->tmp);
+        zstr_free (&self->file);
+        //  Free object itself
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Return true if file starts with snapshot magic
+
+bool
+zm_snapshot_probe (const char *file)
+{
+    assert (file);
+    FILE *handle = fopen (file, "rb");
+    if (!handle)
+        return false;
+    char magic [4];
+    bool rv = fread (magic, 1, 4, handle) == 4
+           && memcmp (magic, ZM_SNAPSHOT_MAGIC, 4) == 0;
+    fclose (handle);
+    return rv;
+}
+
+//  --------------------------------------------------------------------------
+//  Append record to snapshot being written
+
+int
+zm_snapshot_append (zm_snapshot_t *self, const char *name, const byte *data, size_t size)
+{
+    assert (self);
+    assert (self->handle);
+    assert (name);
+    assert (size <= UINT32_MAX);
+    size_t name_size = strlen (name) + 1;
+    assert (name_size <= UINT16_MAX);
+
+    if (self->count % ZM_SNAPSHOT_SEGMENT == 0) {
+        size_t segments = (size_t) (self->count / ZM_SNAPSHOT_SEGMENT);
+        self->starts = (uint64_t *) realloc (self->starts, (segments + 1) * sizeof (uint64_t));
+        assert (self->starts);
+        self->starts [segments] = ZM_SNAPSHOT_HEADER_SIZE + self->body;
+        self->segments = (uint32_t) segments + 1;
+    }
+    byte name_prefix [2] = { (byte) (name_size >> 8), (byte) name_size };
+    byte prefix [4];
+    s_put_uint32 (prefix, (uint32_t) size);
+    if (fwrite (name_prefix, 1, 2, self->handle) != 2
+    ||  fwrite (name, 1, name_size, self->handle) != name_size
+    ||  fwrite (prefix, 1, 4, self->handle) != 4
+    ||  fwrite (data, 1, size, self->handle) != size)
+        return -1;
+    self->crc = zm_snapshot_crc32 (self->crc, name_prefix, 2);
+    self->crc = zm_snapshot_crc32 (self->crc, (const byte *) name, name_size);
+    self->crc = zm_snapshot_crc32 (self->crc, prefix, 4);
+    self->crc = zm_snapshot_crc32 (self->crc, data, size);
+    self->body += 2 + name_size + 4 + size;
+    self->count++;
+    return 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Write header, fsync and atomically replace the file
+
+int
+zm_snapshot_commit (zm_snapshot_t *self)
+{
+    assert (self);
+    assert (self->handle);
+
+    int r = 0;
+    uint32_t index;
+    for (index = 0; index < self->segments && r == 0; index++) {
+        uint64_t count = index + 1 < self->segments
+            ? ZM_SNAPSHOT_SEGMENT
+            : self->count - (uint64_t) index * ZM_SNAPSHOT_SEGMENT;
+        byte entry [ZM_SNAPSHOT_ENTRY_SIZE];
+        s_put_uint64 (entry, self->starts [index]);
+        s_put_uint64 (entry + 8, count);
+        if (fwrite (entry, 1, ZM_SNAPSHOT_ENTRY_SIZE, self->handle) != ZM_SNAPSHOT_ENTRY_SIZE)
+            r = -1;
+        self->crc = zm_snapshot_crc32 (self->crc, entry, ZM_SNAPSHOT_ENTRY_SIZE);
+        self->body += ZM_SNAPSHOT_ENTRY_SIZE;
+    }
+
+    byte header [ZM_SNAPSHOT_HEADER_SIZE] = {0};
+    memcpy (header, ZM_SNAPSHOT_MAGIC, 4);
+    s_put_uint32 (header + 4, ZM_SNAPSHOT_VERSION);
+    s_put_uint64 (header + 8, self->count);
+    s_put_uint64 (header + 16, self->body);
+    s_put_uint32 (header + 24, self->crc);
+    s_put_uint32 (header + 28, self->segments);
+
+    if (r == -1
+    ||  fseeko (self->handle, 0, SEEK_SET) == -1
+    ||  fwrite (header, 1, ZM_SNAPSHOT_HEADER_SIZE, self->handle) != ZM_SNAPSHOT_HEADER_SIZE
+    ||  fflush (self->handle) == EOF
+    ||  fsync (fileno (self->handle)) == -1)
+        r = -1;
+    fclose (self->handle);
+    self->handle = NULL;
+
+    if (r == 0 && rename (self->tmp, self->file) == -1)
+        r = -1;
+    if (r == -1) {
+        zsys_error ("Fail to write snapshot %s: %s", self->file, strerror (errno));
+        zsys_file_delete (self->tmp);
+    }
+    return r;
+}
+
+//  --------------------------------------------------------------------------
+//  Return number of records
+
+size_t
+zm_snapshot_size (zm_snapshot_t *self)
+{
+    assert (self);
+    return (size_t) self->count;
+}
+
+//  --------------------------------------------------------------------------
+//  Return first record of loaded snapshot
+
+const byte *
+zm_snapshot_first (zm_snapshot_t *self, size_t *size_p)
+{
+    assert (self);
+    self->cursor = ZM_SNAPSHOT_HEADER_SIZE;
+    return zm_snapshot_next (self, size_p);
+}
+
+//  --------------------------------------------------------------------------
+//  Return next record of loaded snapshot
+
+//  Parse record at *offset_p, return its data or NULL past the end. Moves
+//  *offset_p after the record, changes nothing in self.
+
+static const byte *
+s_snapshot_parse (zm_snapshot_t *self, size_t *offset_p, size_t *size_p, const char **name_p)
+{
+    size_t cursor = *offset_p;
+    if (!self->data || cursor < ZM_SNAPSHOT_HEADER_SIZE)
+        return NULL;
+
+    if (cursor + 2 > self->end)
+        return NULL;
+    size_t name_size = ((size_t) self->data [cursor] << 8) | self->data [cursor + 1];
+    if (name_size == 0
+    ||  cursor + 2 + name_size > self->end
+    ||  self->data [cursor + 2 + name_size - 1] != 0)
+        return NULL;
+    const char *name = (const char *) self->data + cursor + 2;
+    cursor += 2 + name_size;
+    if (cursor + 4 > self->end)
+        return NULL;
+    size_t size = s_get_uint32 (self->data + cursor);
+    if (cursor + 4 + size > self->end)
+        return NULL;
+
+    *offset_p = cursor + 4 + size;
+    *size_p = size;
+    *name_p = name;
+    return self->data + cursor + 4;
+}
+
+//  Parse record at offset, as s_snapshot_parse does. Sets name and offset
+//  of the record and moves cursor after it.
+
+static const byte *
+s_snapshot_record (zm_snapshot_t *self, size_t offset, size_t *size_p)
+{
+    size_t cursor = offset;
+    const char *name;
+    const byte *data = s_snapshot_parse (self, &cursor, size_p, &name);
+    if (!data)
+        return NULL;
+    self->offset = offset;
+    self->name = name;
+    self->cursor = cursor;
+    return data;
+}
+
+const byte *
+zm_snapshot_next (zm_snapshot_t *self, size_t *size_p)
+{
+    assert (self);
+    assert (size_p);
+    return s_snapshot_record (self, self->cursor, size_p);
+}
+
+//  --------------------------------------------------------------------------
+//  Return name of the last returned record
+
+const char *
+zm_snapshot_name (zm_snapshot_t *self)
+{
+    assert (self);
+    return self->name;
+}
+
+//  --------------------------------------------------------------------------
+//  Return offset of the last returned record
+
+size_t
+zm_snapshot_offset (zm_snapshot_t *self)
+{
+    assert (self);
+    return self->offset;
+}
+
+//  --------------------------------------------------------------------------
+//  Return record at offset
+
+const byte *
+zm_snapshot_read (zm_snapshot_t *self, size_t offset, size_t *size_p)
+{
+    assert (self);
+    assert (size_p);
+    size_t cursor = self->cursor;
+    const byte *record = s_snapshot_record (self, offset, size_p);
+    self->cursor = cursor;
+    return record;
+}
+
+//  --------------------------------------------------------------------------
+//  Return number of segments
+
+size_t
+zm_snapshot_segments (zm_snapshot_t *self)
+{
+    assert (self);
+    return self->segments;
+}
+
+//  --------------------------------------------------------------------------
+//  Return offset of first record of segment and number of its records
+
+size_t
+zm_snapshot_segment (zm_snapshot_t *self, size_t index, size_t *count_p)
+{
+    assert (self);
+    assert (index < self->segments);
+    if (count_p)
+        *count_p = (size_t) s_get_uint64 (self->table + index * ZM_SNAPSHOT_ENTRY_SIZE + 8);
+    return (size_t) s_get_uint64 (self->table + index * ZM_SNAPSHOT_ENTRY_SIZE);
+}
+
+//  --------------------------------------------------------------------------
+//  Return record at *offset_p and move *offset_p to the next one
+
+const byte *
+zm_snapshot_walk (zm_snapshot_t *self, size_t *offset_p, size_t *size_p, const char **name_p)
+{
+    assert (self);
+    assert (offset_p);
+    assert (size_p);
+    const char *name;
+    const byte *data = s_snapshot_parse (self, offset_p, size_p, &name);
+    if (data && name_p)
+        *name_p = name;
+    return data;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+zm_snapshot_test (bool verbose)
+{
+    printf (" * zm_snapshot: ");
+
+    //  @selftest
+    int r = zsys_dir_create (".test-snapshot", NULL);
+    assert (r == 0);
+    zdir_t *dir = zdir_new (".test-snapshot", NULL);
+    assert (dir);
+
+    assert (!zm_snapshot_probe (".test-snapshot/devices.bin"));
+    zm_snapshot_t *self = zm_snapshot_new (".test-snapshot/devices.bin");
+    assert (self);
+    r = zm_snapshot_append (self, "device1", (byte *) "data1", 5);
+    assert (r == 0);
+    r = zm_snapshot_append (self, "dev2", (byte *) "data2!", 6);
+    assert (r == 0);
+    r = zm_snapshot_commit (self);
+    assert (r == 0);
+    zm_snapshot_destroy (&self);
+    assert (zm_snapshot_probe (".test-snapshot/devices.bin"));
+
+    self = zm_snapshot_load (".test-snapshot/devices.bin");
+    assert (self);
+    assert (zm_snapshot_size (self) == 2);
+    size_t size;
+    const byte *record = zm_snapshot_first (self, &size);
+    assert (record && size == 5 && memcmp (record, "data1", 5) == 0);
+    assert (streq (zm_snapshot_name (self), "device1"));
+    record = zm_snapshot_next (self, &size);
+    assert (record && size == 6 && memcmp (record, "data2!", 6) == 0);
+    assert (streq (zm_snapshot_name (self), "dev2"));
+    size_t offset = zm_snapshot_offset (self);
+    assert (!zm_snapshot_next (self, &size));
+
+    //  Random access by offset
+    record = zm_snapshot_read (self, offset, &size);
+    assert (record && size == 6 && memcmp (record, "data2!", 6) == 0);
+    assert (!zm_snapshot_read (self, ZM_SNAPSHOT_HEADER_SIZE + 1, &size));
+    assert (zm_snapshot_segments (self) == 1);
+    zm_snapshot_destroy (&self);
+
+    //  Segments are walked on their own, and cover all records
+    self = zm_snapshot_new (".test-snapshot/segments.bin");
+    assert (self);
+    size_t index;
+    for (index = 0; index < ZM_SNAPSHOT_SEGMENT * 2 + 10; index++) {
+        char name [16];
+        snprintf (name, sizeof (name), "d%zu", index);
+        r = zm_snapshot_append (self, name, (byte *) &index, sizeof (index));
+        assert (r == 0);
+    }
+    r = zm_snapshot_commit (self);
+    assert (r == 0);
+    zm_snapshot_destroy (&self);
+    self = zm_snapshot_load (".test-snapshot/segments.bin");
+    assert (self);
+    assert (zm_snapshot_segments (self) == 3);
+    size_t count;
+    offset = zm_snapshot_segment (self, 2, &count);
+    assert (count == 10);
+    const char *name;
+    record = zm_snapshot_walk (self, &offset, &size, &name);
+    assert (record && size == sizeof (size_t));
+    assert (streq (name, "d32768"));
+    size_t walked = 1;
+    while (zm_snapshot_walk (self, &offset, &size, &name))
+        walked++;
+    assert (walked == 10);
+    assert (streq (name, "d32777"));
+    //  Table is not a record
+    assert (zm_snapshot_first (self, &size));
+    walked = 1;
+    while (zm_snapshot_next (self, &size))
+        walked++;
+    assert (walked == ZM_SNAPSHOT_SEGMENT * 2 + 10);
+    zm_snapshot_destroy (&self);
+
+    //  Flipped bit is detected
+    FILE *f = fopen (".test-snapshot/devices.bin", "r+b");
+    assert (f);
+    fseek (f, ZM_SNAPSHOT_HEADER_SIZE + 5, SEEK_SET);
+    fputc ('X', f);
+    fclose (f);
+    self = zm_snapshot_load (".test-snapshot/devices.bin");
+    assert (!self);
+
+    //  Snapshot of other version or magic is not loaded, even if its
+    //  checksum holds
+    self = zm_snapshot_new (".test-snapshot/version.bin");
+    assert (self);
+    r = zm_snapshot_append (self, "device1", (byte *) "data1", 5);
+    assert (r == 0);
+    r = zm_snapshot_commit (self);
+    assert (r == 0);
+    zm_snapshot_destroy (&self);
+    f = fopen (".test-snapshot/version.bin", "r+b");
+    assert (f);
+    byte header [ZM_SNAPSHOT_HEADER_SIZE];
+    assert (fread (header, 1, sizeof (header), f) == sizeof (header));
+    s_put_uint32 (header + 4, ZM_SNAPSHOT_VERSION + 1);
+    fseek (f, 0, SEEK_SET);
+    fwrite (header, 1, sizeof (header), f);
+    fclose (f);
+    assert (!zm_snapshot_load (".test-snapshot/version.bin"));
+    f = fopen (".test-snapshot/version.bin", "r+b");
+    assert (f);
+    s_put_uint32 (header + 4, ZM_SNAPSHOT_VERSION);
+    memcpy (header, "ZMDX", 4);
+    fwrite (header, 1, sizeof (header), f);
+    fclose (f);
+    assert (!zm_snapshot_probe (".test-snapshot/version.bin"));
+    assert (!zm_snapshot_load (".test-snapshot/version.bin"));
+
+    //  Uncommitted snapshot leaves no trace
+    self = zm_snapshot_new (".test-snapshot/other.bin");
+    assert (self);
+    zm_snapshot_destroy (&self);
+    assert (!zsys_file_exists (".test-snapshot/other.bin"));
+    assert (!zsys_file_exists (".test-snapshot/other.bin.tmp"));
+
+    zdir_remove (dir, true);
+    zdir_destroy (&dir);
+    //  @end
+    printf ("OK\n");
+}
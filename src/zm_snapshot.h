@@ -0,0 +1,102 @@
+/*  =========================================================================
+    zm_snapshot - Binary snapshot of devices
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+#ifndef ZM_SNAPSHOT_H_INCLUDED
+#define ZM_SNAPSHOT_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @interface
+//  Create new snapshot for writing. Records go to <file>.tmp, which
+//  replaces file on zm_snapshot_commit.
+ZM_DEVICE_PRIVATE zm_snapshot_t *
+    zm_snapshot_new (const char *file);
+
+//  Map existing snapshot to memory and verify its checksum. Returns NULL
+//  if file can't be read or is corrupted.
+ZM_DEVICE_PRIVATE zm_snapshot_t *
+    zm_snapshot_load (const char *file);
+
+//  Destroy the zm_snapshot, uncommitted snapshot is discarded
+ZM_DEVICE_PRIVATE void
+    zm_snapshot_destroy (zm_snapshot_t **self_p);
+
+//  Return true if file starts with snapshot magic
+ZM_DEVICE_PRIVATE bool
+    zm_snapshot_probe (const char *file);
+
+//  Append record (encoded device and its name) to snapshot being written
+ZM_DEVICE_PRIVATE int
+    zm_snapshot_append (zm_snapshot_t *self, const char *name, const byte *data, size_t size);
+
+//  Write header, fsync and atomically replace the file
+ZM_DEVICE_PRIVATE int
+    zm_snapshot_commit (zm_snapshot_t *self);
+
+//  Return number of records
+ZM_DEVICE_PRIVATE size_t
+    zm_snapshot_size (zm_snapshot_t *self);
+
+//  Return first record of loaded snapshot and its size, NULL if empty.
+//  Data point to the mapped file and are valid until snapshot is destroyed.
+ZM_DEVICE_PRIVATE const byte *
+    zm_snapshot_first (zm_snapshot_t *self, size_t *size_p);
+
+//  Return next record of loaded snapshot, NULL when there are no more
+ZM_DEVICE_PRIVATE const byte *
+    zm_snapshot_next (zm_snapshot_t *self, size_t *size_p);
+
+//  Return device name of record last returned by zm_snapshot_first, next
+//  or read. Points to the mapped file.
+ZM_DEVICE_PRIVATE const char *
+    zm_snapshot_name (zm_snapshot_t *self);
+
+//  Return offset of record last returned by zm_snapshot_first, next or read
+ZM_DEVICE_PRIVATE size_t
+    zm_snapshot_offset (zm_snapshot_t *self);
+
+//  Return record at offset given by zm_snapshot_offset and its size, NULL
+//  if there's no record. Does not move zm_snapshot_next.
+ZM_DEVICE_PRIVATE const byte *
+    zm_snapshot_read (zm_snapshot_t *self, size_t offset, size_t *size_p);
+
+//  Return number of segments of loaded snapshot, see zm_snapshot_walk
+ZM_DEVICE_PRIVATE size_t
+    zm_snapshot_segments (zm_snapshot_t *self);
+
+//  Return offset of the first record of segment and number of its records
+ZM_DEVICE_PRIVATE size_t
+    zm_snapshot_segment (zm_snapshot_t *self, size_t index, size_t *count_p);
+
+//  Return record at *offset_p, its size and name, and move *offset_p to
+//  the next record. Returns NULL if there's no record. Keeps no state, so
+//  threads can walk segments of one snapshot at the same time.
+ZM_DEVICE_PRIVATE const byte *
+    zm_snapshot_walk (zm_snapshot_t *self, size_t *offset_p, size_t *size_p, const char **name_p);
+
+//  Return CRC-32 of data, continuing from crc (0 to start)
+ZM_DEVICE_PRIVATE uint32_t
+    zm_snapshot_crc32 (uint32_t crc, const byte *data, size_t size);
+
+//  Self test of this class
+ZM_DEVICE_PRIVATE void
+    zm_snapshot_test (bool verbose);
+
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,331 @@
+/*  =========================================================================
+    zm_stats - Counters and latency histograms
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+/*
+@header
+    zm_stats - Counters and latency histograms
+@discuss
+    Each recorded name has a count, total and max latency and a histogram
+    in the style of HdrHistogram. Values below 16 usecs have a bucket of
+    their own, above that each power of two is split into 16 buckets, so
+    any percentile is known within 1/16 of its value while histogram has
+    fixed size. Recording is a hash lookup and a few integer operations.
+
+    Number of names is limited, operations of names over the limit are
+    counted as "other", so names coming from the network can't grow it.
+    Names the caller reserves are always recorded and do not count against
+    the limit.
+@end
+*/
+
+#include "zm_device_classes.h"
+
+#define ZM_STATS_SUB_BITS   4
+#define ZM_STATS_SUB        (1 << ZM_STATS_SUB_BITS)
+#define ZM_STATS_MAX_BIT    40          //  Values up to 2^41 usecs
+#define ZM_STATS_BUCKETS    ((ZM_STATS_MAX_BIT - ZM_STATS_SUB_BITS + 2) * ZM_STATS_SUB)
+#define ZM_STATS_NAMES      64          //  Max recorded names
+
+typedef struct {
+    uint64_t count;
+    uint64_t total;
+    uint64_t max;
+    uint64_t buckets [ZM_STATS_BUCKETS];
+} s_histogram_t;
+
+//  Structure of our class
+
+struct _zm_stats_t {
+    zhashx_t *histograms;       //  Name to s_histogram_t
+    zhashx_t *gauges;           //  Name to uint64_t
+    zhashx_t *reserved;         //  Names not counted against the limit
+    size_t names;               //  Recorded names which are not reserved
+};
+
+static void
+s_free (void **item_p)
+{
+    free (*item_p);
+    *item_p = NULL;
+}
+
+//  Bucket of value, see @discuss
+
+static size_t
+s_bucket (uint64_t value)
+{
+    if (value < ZM_STATS_SUB)
+        return (size_t) value;
+    int bit = ZM_STATS_SUB_BITS;
+    while (bit < 63 && (value >> (bit + 1)))
+        bit++;
+    size_t bucket = (size_t) (bit - ZM_STATS_SUB_BITS + 1) * ZM_STATS_SUB
+                  + (size_t) ((value >> (bit - ZM_STATS_SUB_BITS)) & (ZM_STATS_SUB - 1));
+    return bucket < ZM_STATS_BUCKETS ? bucket : ZM_STATS_BUCKETS - 1;
+}
+
+//  Highest value falling into bucket
+
+static uint64_t
+s_bucket_value (size_t bucket)
+{
+    if (bucket < ZM_STATS_SUB)
+        return bucket;
+    int shift = (int) (bucket / ZM_STATS_SUB) - 1;
+    uint64_t low = (uint64_t) (ZM_STATS_SUB + bucket % ZM_STATS_SUB) << shift;
+    return low + ((uint64_t) 1 << shift) - 1;
+}
+
+static uint64_t
+s_histogram_percentile (s_histogram_t *self, double percent)
+{
+    if (!self || !self->count)
+        return 0;
+    uint64_t rank = (uint64_t) (self->count * percent / 100.0 + 0.5);
+    if (rank == 0)
+        rank = 1;
+    uint64_t seen = 0;
+    size_t bucket;
+    for (bucket = 0; bucket < ZM_STATS_BUCKETS; bucket++) {
+        seen += self->buckets [bucket];
+        if (seen >= rank) {
+            uint64_t value = s_bucket_value (bucket);
+            return value < self->max ? value : self->max;
+        }
+    }
+    return self->max;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create a new zm_stats
+
+zm_stats_t *
+zm_stats_new (void)
+{
+    zm_stats_t *self = (zm_stats_t *) zmalloc (sizeof (zm_stats_t));
+    assert (self);
+    //  Initialize class properties here
+    self->histograms = zhashx_new ();
+    assert (self->histograms);
+    zhashx_set_destructor (self->histograms, s_free);
+    self->gauges = zhashx_new ();
+    assert (self->gauges);
+    zhashx_set_destructor (self->gauges, s_free);
+    self->reserved = zhashx_new ();
+    assert (self->reserved);
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the zm_stats
+
+void
+zm_stats_destroy (zm_stats_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zm_stats_t *self = *self_p;
+        //  Free class properties here
+        zhashx_destroy (&self->histograms);
+        zhashx_destroy (&self->gauges);
+        zhashx_destroy (&self->reserved);
+        //  Free object itself
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Count one operation of name
+
+void
+zm_stats_record (zm_stats_t *self, const char *name, int64_t usecs)
+{
+    assert (self);
+    assert (name);
+    s_histogram_t *histogram = (s_histogram_t *) zhashx_lookup (self->histograms, name);
+    if (!histogram && !zhashx_lookup (self->reserved, name)) {
+        if (self->names >= ZM_STATS_NAMES)
+            name = "other";
+        histogram = (s_histogram_t *) zhashx_lookup (self->histograms, name);
+        if (!histogram)
+            self->names++;
+    }
+    if (!histogram) {
+        histogram = (s_histogram_t *) zmalloc (sizeof (s_histogram_t));
+        assert (histogram);
+        zhashx_insert (self->histograms, name, histogram);
+    }
+    uint64_t value = usecs > 0 ? (uint64_t) usecs : 0;
+    histogram->count++;
+    histogram->total += value;
+    if (value > histogram->max)
+        histogram->max = value;
+    histogram->buckets [s_bucket (value)]++;
+}
+
+//  --------------------------------------------------------------------------
+//  Reserve name, so its operations are recorded however many names are
+
+void
+zm_stats_reserve (zm_stats_t *self, const char *name)
+{
+    assert (self);
+    assert (name);
+    zhashx_insert (self->reserved, name, (void *) 1);
+}
+
+//  --------------------------------------------------------------------------
+//  Set gauge of name
+
+void
+zm_stats_set (zm_stats_t *self, const char *name, uint64_t value)
+{
+    assert (self);
+    assert (name);
+    uint64_t *gauge = (uint64_t *) zhashx_lookup (self->gauges, name);
+    if (!gauge) {
+        gauge = (uint64_t *) zmalloc (sizeof (uint64_t));
+        assert (gauge);
+        zhashx_insert (self->gauges, name, gauge);
+    }
+    *gauge = value;
+}
+
+//  --------------------------------------------------------------------------
+//  Return number of operations recorded for name
+
+uint64_t
+zm_stats_count (zm_stats_t *self, const char *name)
+{
+    assert (self);
+    s_histogram_t *histogram = (s_histogram_t *) zhashx_lookup (self->histograms, name);
+    return histogram ? histogram->count : 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Return latency percentile of name
+
+uint64_t
+zm_stats_percentile (zm_stats_t *self, const char *name, double percent)
+{
+    assert (self);
+    return s_histogram_percentile (
+        (s_histogram_t *) zhashx_lookup (self->histograms, name), percent);
+}
+
+//  --------------------------------------------------------------------------
+//  Return everything as ZPL
+
+zconfig_t *
+zm_stats_zpl (zm_stats_t *self)
+{
+    assert (self);
+    zconfig_t *root = zconfig_new ("root", NULL);
+    assert (root);
+
+    uint64_t *gauge = (uint64_t *) zhashx_first (self->gauges);
+    while (gauge) {
+        zconfig_t *item = zconfig_new ((const char *) zhashx_cursor (self->gauges), root);
+        zconfig_set_value (item, "%" PRIu64, *gauge);
+        gauge = (uint64_t *) zhashx_next (self->gauges);
+    }
+
+    s_histogram_t *histogram = (s_histogram_t *) zhashx_first (self->histograms);
+    while (histogram) {
+        zconfig_t *item = zconfig_new ((const char *) zhashx_cursor (self->histograms), root);
+        zconfig_putf (item, "count", "%" PRIu64, histogram->count);
+        zconfig_putf (item, "total", "%" PRIu64, histogram->total);
+        zconfig_putf (item, "p50", "%" PRIu64, s_histogram_percentile (histogram, 50));
+        zconfig_putf (item, "p90", "%" PRIu64, s_histogram_percentile (histogram, 90));
+        zconfig_putf (item, "p99", "%" PRIu64, s_histogram_percentile (histogram, 99));
+        zconfig_putf (item, "p999", "%" PRIu64, s_histogram_percentile (histogram, 99.9));
+        zconfig_putf (item, "max", "%" PRIu64, histogram->max);
+        histogram = (s_histogram_t *) zhashx_next (self->histograms);
+    }
+    return root;
+}
+
+//  --------------------------------------------------------------------------
+//  Drop all recorded operations
+
+void
+zm_stats_reset (zm_stats_t *self)
+{
+    assert (self);
+    zhashx_purge (self->histograms);
+    self->names = 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+zm_stats_test (bool verbose)
+{
+    printf (" * zm_stats: ");
+
+    //  @selftest
+    size_t bucket;
+    for (bucket = 0; bucket + 1 < ZM_STATS_BUCKETS; bucket++) {
+        assert (s_bucket (s_bucket_value (bucket)) == bucket);
+        assert (s_bucket (s_bucket_value (bucket) + 1) == bucket + 1);
+    }
+
+    zm_stats_t *self = zm_stats_new ();
+    assert (self);
+    assert (zm_stats_count (self, "INSERT") == 0);
+    assert (zm_stats_percentile (self, "INSERT", 50) == 0);
+
+    int i;
+    for (i = 1; i <= 1000; i++)
+        zm_stats_record (self, "INSERT", i);
+    zm_stats_record (self, "LOOKUP", 5);
+    assert (zm_stats_count (self, "INSERT") == 1000);
+    assert (zm_stats_count (self, "LOOKUP") == 1);
+    uint64_t p50 = zm_stats_percentile (self, "INSERT", 50);
+    assert (p50 >= 500 && p50 <= 500 + 500 / 16);
+    uint64_t p99 = zm_stats_percentile (self, "INSERT", 99);
+    assert (p99 >= 990 && p99 <= 990 + 990 / 16);
+    assert (zm_stats_percentile (self, "INSERT", 100) == 1000);
+    assert (zm_stats_percentile (self, "LOOKUP", 99) == 5);
+
+    //  Names over the limit are counted together, reserved ones are not
+    zm_stats_reserve (self, "wait");
+    for (i = 0; i < 100; i++) {
+        char name [16];
+        snprintf (name, sizeof (name), "name%d", i);
+        zm_stats_record (self, name, 1);
+    }
+    assert (zm_stats_count (self, "other") > 0);
+    assert (zm_stats_count (self, "name99") == 0);
+    zm_stats_record (self, "wait", 3);
+    assert (zm_stats_count (self, "wait") == 1);
+
+    zm_stats_set (self, "devices", 42);
+    zconfig_t *zpl = zm_stats_zpl (self);
+    assert (streq (zconfig_resolve (zpl, "devices", ""), "42"));
+    assert (streq (zconfig_resolve (zpl, "INSERT/count", ""), "1000"));
+    assert (streq (zconfig_resolve (zpl, "INSERT/max", ""), "1000"));
+    zconfig_destroy (&zpl);
+
+    zm_stats_reset (self);
+    assert (zm_stats_count (self, "INSERT") == 0);
+    zpl = zm_stats_zpl (self);
+    assert (streq (zconfig_resolve (zpl, "devices", ""), "42"));
+    zconfig_destroy (&zpl);
+    zm_stats_destroy (&self);
+    //  @end
+    printf ("OK\n");
+}
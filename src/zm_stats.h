@@ -0,0 +1,69 @@
+/*  =========================================================================
+    zm_stats - Counters and latency histograms
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+#ifndef ZM_STATS_H_INCLUDED
+#define ZM_STATS_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @interface
+//  Create a new zm_stats
+ZM_DEVICE_PRIVATE zm_stats_t *
+    zm_stats_new (void);
+
+//  Destroy the zm_stats
+ZM_DEVICE_PRIVATE void
+    zm_stats_destroy (zm_stats_t **self_p);
+
+//  Count one operation of name which took usecs
+ZM_DEVICE_PRIVATE void
+    zm_stats_record (zm_stats_t *self, const char *name, int64_t usecs);
+
+//  Reserve name, its operations are recorded even over the limit of names
+ZM_DEVICE_PRIVATE void
+    zm_stats_reserve (zm_stats_t *self, const char *name);
+
+//  Set gauge of name to value
+ZM_DEVICE_PRIVATE void
+    zm_stats_set (zm_stats_t *self, const char *name, uint64_t value);
+
+//  Return number of operations recorded for name
+ZM_DEVICE_PRIVATE uint64_t
+    zm_stats_count (zm_stats_t *self, const char *name);
+
+//  Return latency of name in usecs, which percent of operations did not
+//  exceed, to precision of 1/16
+ZM_DEVICE_PRIVATE uint64_t
+    zm_stats_percentile (zm_stats_t *self, const char *name, double percent);
+
+//  Return all counters, histograms summaries and gauges as ZPL, caller
+//  destroys the config
+ZM_DEVICE_PRIVATE zconfig_t *
+    zm_stats_zpl (zm_stats_t *self);
+
+//  Drop all recorded operations, gauges are kept
+ZM_DEVICE_PRIVATE void
+    zm_stats_reset (zm_stats_t *self);
+
+//  Self test of this class
+ZM_DEVICE_PRIVATE void
+    zm_stats_test (bool verbose);
+
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,272 @@
+/*  =========================================================================
+    zm_trace - Timing of mailbox requests
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+/*
+@header
+    zm_trace - Timing of mailbox requests
+@discuss
+    Splits the time of one request at a time into broker, queue, handle,
+    store and send, as described in TRACING of zm_device. Caller adds
+    what was spent in store and send, zm_trace_end works out the rest from
+    when request was sent, drained and handled. Slow requests are logged
+    here, spans are returned to the caller, which knows where to publish
+    them.
+@end
+*/
+
+#include "zm_device_classes.h"
+
+//  Structure of our class
+
+struct _zm_trace_t {
+    bool enabled;               //  Requests are timed
+    int64_t slow;               //  Log requests slower than this, usecs
+    bool spans;                 //  Make span of requests with _trace
+    char *id;                   //  _trace of request being timed
+    int64_t sent;               //  Its _sent, 0 if not given
+    int64_t store;              //  Usecs it spent in devices and journal
+    int64_t send;               //  Usecs it spent sending replies
+};
+
+
+//  --------------------------------------------------------------------------
+//  Create a new zm_trace
+
+zm_trace_t *
+zm_trace_new (void)
+{
+    zm_trace_t *self = (zm_trace_t *) zmalloc (sizeof (zm_trace_t));
+    assert (self);
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the zm_trace
+
+void
+zm_trace_destroy (zm_trace_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zm_trace_t *self = *self_p;
+        //  Free class properties here
+        zstr_free (&self->id);
+        //  Free object itself
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Set what is traced
+
+void
+zm_trace_set (zm_trace_t *self, int64_t slow, bool spans)
+{
+    assert (self);
+    self->slow = slow;
+    self->spans = spans;
+    self->enabled = slow || spans;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return true if requests are traced at all
+
+bool
+zm_trace_enabled (zm_trace_t *self)
+{
+    assert (self);
+    return self->enabled;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return current time in usecs when tracing, 0 otherwise
+
+int64_t
+zm_trace_clock (zm_trace_t *self)
+{
+    assert (self);
+    return self->enabled ? zclock_usecs () : 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Start timing of next request
+
+void
+zm_trace_reset (zm_trace_t *self)
+{
+    assert (self);
+    zstr_free (&self->id);
+    self->sent = 0;
+    self->store = 0;
+    self->send = 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Take _trace and _sent out of request
+
+void
+zm_trace_begin (zm_trace_t *self, zm_proto_t *request)
+{
+    assert (self);
+    assert (request);
+    zstr_free (&self->id);
+    const char *id = zm_proto_ext_string (request, "_trace", NULL);
+    if (id)
+        self->id = strdup (id);
+    self->sent = (int64_t) zm_proto_ext_int (request, "_sent", 0);
+    zhash_t *ext = zm_proto_ext (request);
+    if (ext) {
+        zhash_delete (ext, "_trace");
+        zhash_delete (ext, "_sent");
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Add usecs the request spent in devices and journal
+
+void
+zm_trace_add_store (zm_trace_t *self, int64_t usecs)
+{
+    assert (self);
+    self->store += usecs;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Add usecs the request spent sending replies
+
+void
+zm_trace_add_send (zm_trace_t *self, int64_t usecs)
+{
+    assert (self);
+    self->send += usecs;
+}
+
+
+//  --------------------------------------------------------------------------
+//  End timing of request, return its span if it's made
+
+char *
+zm_trace_end (zm_trace_t *self, const char *subject, const char *sender,
+    int64_t received, int64_t start, int64_t end)
+{
+    assert (self);
+    assert (subject);
+    assert (sender);
+    //  Clocks of sender and broker host may differ, skewed _sent is ignored
+    int64_t sent = self->sent > 0 && self->sent <= received ? self->sent : received;
+    int64_t total = end - sent;
+    int64_t handle = end - start - self->store - self->send;
+
+    if (self->slow && total >= self->slow)
+        zsys_warning ("zm_device: slow %s from %s trace=%s total=%" PRId64
+            " broker=%" PRId64 " queue=%" PRId64 " handle=%" PRId64
+            " store=%" PRId64 " send=%" PRId64 " usecs",
+            subject, sender, self->id ? self->id : "-", total,
+            received - sent, start - received, handle, self->store, self->send);
+
+    char *str = NULL;
+    if (self->spans && self->id) {
+        zconfig_t *span = zconfig_new ("trace", NULL);
+        zconfig_put (span, "id", self->id);
+        zconfig_put (span, "subject", subject);
+        zconfig_put (span, "sender", sender);
+        zconfig_putf (span, "received", "%" PRId64, received);
+        zconfig_putf (span, "total", "%" PRId64, total);
+        zconfig_putf (span, "broker", "%" PRId64, received - sent);
+        zconfig_putf (span, "queue", "%" PRId64, start - received);
+        zconfig_putf (span, "handle", "%" PRId64, handle);
+        zconfig_putf (span, "store", "%" PRId64, self->store);
+        zconfig_putf (span, "send", "%" PRId64, self->send);
+        str = zconfig_str_save (span);
+        zconfig_destroy (&span);
+    }
+    zstr_free (&self->id);
+    return str;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+zm_trace_test (bool verbose)
+{
+    printf (" * zm_trace: ");
+
+    //  @selftest
+    zm_trace_t *self = zm_trace_new ();
+    assert (self);
+    assert (!zm_trace_enabled (self));
+    assert (zm_trace_clock (self) == 0);
+    zm_trace_set (self, 0, true);
+    assert (zm_trace_enabled (self));
+    assert (zm_trace_clock (self) > 0);
+
+    //  Trace keys are taken out of the request
+    zm_proto_t *request = zm_proto_new ();
+    zhash_t *ext = zhash_new ();
+    zhash_insert (ext, "_trace", "t42");
+    zhash_insert (ext, "_sent", "100");
+    zhash_insert (ext, "type", "ups");
+    zm_proto_encode_device (request, "device1", 0, 0, ext);
+    zhash_destroy (&ext);
+    zm_trace_reset (self);
+    zm_trace_begin (self, request);
+    assert (!zm_proto_ext_string (request, "_trace", NULL));
+    assert (!zm_proto_ext_string (request, "_sent", NULL));
+    assert (streq (zm_proto_ext_string (request, "type", ""), "ups"));
+    zm_trace_add_store (self, 10);
+    zm_trace_add_send (self, 5);
+    zm_trace_add_store (self, 10);
+
+    //  Time is split from _sent through drain and start to end
+    char *str = zm_trace_end (self, "INSERT", "client", 150, 170, 200);
+    assert (str);
+    zconfig_t *span = zconfig_str_load (str);
+    zstr_free (&str);
+    assert (span);
+    assert (streq (zconfig_resolve (span, "id", ""), "t42"));
+    assert (streq (zconfig_resolve (span, "subject", ""), "INSERT"));
+    assert (streq (zconfig_resolve (span, "sender", ""), "client"));
+    assert (streq (zconfig_resolve (span, "total", ""), "100"));
+    assert (streq (zconfig_resolve (span, "broker", ""), "50"));
+    assert (streq (zconfig_resolve (span, "queue", ""), "20"));
+    assert (streq (zconfig_resolve (span, "handle", ""), "5"));
+    assert (streq (zconfig_resolve (span, "store", ""), "20"));
+    assert (streq (zconfig_resolve (span, "send", ""), "5"));
+    zconfig_destroy (&span);
+
+    //  Request without _trace makes no span, _sent after drain is skewed
+    zm_trace_reset (self);
+    zm_proto_encode_device (request, "device1", 0, 0, NULL);
+    zm_proto_ext_set_int (request, "_sent", 1000);
+    zm_trace_begin (self, request);
+    assert (!zm_trace_end (self, "LOOKUP", "client", 150, 170, 200));
+
+    //  Slow requests are only logged
+    zm_trace_set (self, 10, false);
+    zm_trace_reset (self);
+    assert (!zm_trace_end (self, "LOOKUP", "client", 150, 170, 200));
+    zm_proto_destroy (&request);
+    zm_trace_destroy (&self);
+    //  @end
+    printf ("OK\n");
+}
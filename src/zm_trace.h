@@ -0,0 +1,76 @@
+/*  =========================================================================
+    zm_trace - Timing of mailbox requests
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.  This file is part
+    of zmon.it, the fast and scalable monitoring system.                           
+                                                                                   
+    This Source Code Form is subject to the terms of the Mozilla Public License, v.
+    2.0. If a copy of the MPL was not distributed with this file, You can obtain   
+    one at http://mozilla.org/MPL/2.0/.                                            
+    =========================================================================
+*/
+
+#ifndef ZM_TRACE_H_INCLUDED
+#define ZM_TRACE_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @interface
+//  Create a new zm_trace, tracing nothing
+ZM_DEVICE_PRIVATE zm_trace_t *
+    zm_trace_new (void);
+
+//  Destroy the zm_trace
+ZM_DEVICE_PRIVATE void
+    zm_trace_destroy (zm_trace_t **self_p);
+
+//  Log requests taking at least slow usecs, 0 never, and make spans of
+//  requests with _trace if spans is true
+ZM_DEVICE_PRIVATE void
+    zm_trace_set (zm_trace_t *self, int64_t slow, bool spans);
+
+//  Return true if requests are traced at all
+ZM_DEVICE_PRIVATE bool
+    zm_trace_enabled (zm_trace_t *self);
+
+//  Return current time in usecs when tracing, 0 otherwise
+ZM_DEVICE_PRIVATE int64_t
+    zm_trace_clock (zm_trace_t *self);
+
+//  Start timing of next request, nothing is spent yet
+ZM_DEVICE_PRIVATE void
+    zm_trace_reset (zm_trace_t *self);
+
+//  Take _trace and _sent out of request just decoded, so they are not
+//  stored with the device
+ZM_DEVICE_PRIVATE void
+    zm_trace_begin (zm_trace_t *self, zm_proto_t *request);
+
+//  Add usecs the request spent in devices and journal
+ZM_DEVICE_PRIVATE void
+    zm_trace_add_store (zm_trace_t *self, int64_t usecs);
+
+//  Add usecs the request spent sending replies
+ZM_DEVICE_PRIVATE void
+    zm_trace_add_send (zm_trace_t *self, int64_t usecs);
+
+//  End timing of request drained at received, handled from start to end.
+//  Logs it if it was slow. Returns its span as ZPL when request had _trace
+//  and spans are made, otherwise NULL. Caller frees the string.
+ZM_DEVICE_PRIVATE char *
+    zm_trace_end (zm_trace_t *self, const char *subject, const char *sender,
+        int64_t received, int64_t start, int64_t end);
+
+//  Self test of this class
+ZM_DEVICE_PRIVATE void
+    zm_trace_test (bool verbose);
+
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
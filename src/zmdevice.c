@@ -14,19 +14,57 @@
 @header
     zmdevice - Main daemon
 @discuss
+    Runs zm_device actor configured by ZPL file, zmdevice.cfg unless given
+    as the argument, see zmdevice.cfg.in. With server/background set, it
+    detaches and changes to server/workdir first.
+
+    SIGHUP reloads the file and passes it to the actor as CONFIG. Devices
+    in memory are kept as long as server/file stays the same, so reload
+    costs no load of the snapshot. Only settings which changed are set up
+    again, journal, memory budget and indexes are left alone when their
+    settings did not change. When malamute section changed, actor
+    is stopped and started again to connect with the new settings. File
+    which can't be loaded is reported and the old configuration stays.
+
+    SIGTERM and SIGINT stop the actor. Actor's loop is not ended by the
+    signals itself, daemon sends STOP and then $TERM. It answers requests it admitted
+    already, waits for background store in progress and stores devices
+    only if anything changed since, with the journal truncated, so the
+    next start has just the snapshot to load. Changed devices are written
+    by the background store, from the frozen view without hydrating lazily
+    loaded ones, and the daemon waits for it unless server/store is sync.
 @end
 */
 
 #include "zm_device_classes.h"
 
+static volatile sig_atomic_t s_reload = 0;
+
+static void
+s_handle_sighup (int signum)
+{
+    s_reload = 1;
+}
+
+//  Return malamute section of config as string, caller frees it
+
+static char *
+s_malamute_str (zconfig_t *config)
+{
+    zconfig_t *malamute = zconfig_locate (config, "malamute");
+    return malamute ? zconfig_str_save (malamute) : strdup ("");
+}
+
 int main (int argc, char *argv [])
 {
     bool verbose = false;
+    const char *file = "zmdevice.cfg";
     int argn;
     for (argn = 1; argn < argc; argn++) {
         if (streq (argv [argn], "--help")
         ||  streq (argv [argn], "-h")) {
-            puts ("zmdevice [options] ...");
+            puts ("zmdevice [options] [config]");
+            puts ("  config                 configuration file, default zmdevice.cfg");
             puts ("  --verbose / -v         verbose test output");
             puts ("  --help / -h            this information");
             return 0;
@@ -35,13 +73,83 @@ int main (int argc, char *argv [])
         if (streq (argv [argn], "--verbose")
         ||  streq (argv [argn], "-v"))
             verbose = true;
+        else
+        if (*argv [argn] != '-')
+            file = argv [argn];
         else {
             printf ("Unknown option: %s\n", argv [argn]);
             return 1;
         }
     }
-    //  Insert main code here
+
+    zconfig_t *config = zconfig_load (file);
+    if (!config) {
+        zsys_error ("zmdevice: can't load config file %s", file);
+        return 1;
+    }
+    if (atoi (zconfig_resolve (config, "server/verbose", "0")))
+        verbose = true;
+    //  Must happen before any thread is started
+    if (atoi (zconfig_resolve (config, "server/background", "0"))
+    &&  zsys_daemonize (zconfig_resolve (config, "server/workdir", ".")) == -1) {
+        zsys_error ("zmdevice: can't run in background");
+        zconfig_destroy (&config);
+        return 1;
+    }
+    if (verbose)
+        zsys_info ("zmdevice - Main daemon, config %s", file);
+
+    struct sigaction action;
+    memset (&action, 0, sizeof (action));
+    action.sa_handler = s_handle_sighup;
+    sigemptyset (&action.sa_mask);
+    sigaction (SIGHUP, &action, NULL);
+
+    zactor_t *device = zactor_new (zm_device_actor, NULL);
+    assert (device);
+    if (verbose)
+        zstr_send (device, "VERBOSE");
+    char *str_config = zconfig_str_save (config);
+    zstr_sendx (device, "CONFIG", str_config, NULL);
+    zstr_free (&str_config);
+    zstr_sendx (device, "START", NULL);
+
+    //  Signals cut the wait short, the actor itself sends nothing
+    zpoller_t *poller = zpoller_new (device, NULL);
+    assert (poller);
+    while (!zsys_interrupted) {
+        zpoller_wait (poller, 1000);
+        if (!s_reload || zsys_interrupted)
+            continue;
+        s_reload = 0;
+        zconfig_t *reloaded = zconfig_load (file);
+        if (!reloaded) {
+            zsys_warning ("zmdevice: can't load config file %s, keeping the old one", file);
+            continue;
+        }
+        char *malamute = s_malamute_str (config);
+        char *changed = s_malamute_str (reloaded);
+        bool reconnect = !streq (malamute, changed);
+        zstr_free (&malamute);
+        zstr_free (&changed);
+        zsys_info ("zmdevice: reloading %s%s", file, reconnect ? ", reconnecting" : "");
+
+        if (reconnect)
+            zstr_sendx (device, "STOP", NULL);
+        str_config = zconfig_str_save (reloaded);
+        zstr_sendx (device, "CONFIG", str_config, NULL);
+        zstr_free (&str_config);
+        if (reconnect)
+            zstr_sendx (device, "START", NULL);
+        zconfig_destroy (&config);
+        config = reloaded;
+    }
+    zpoller_destroy (&poller);
+
     if (verbose)
-        zsys_info ("zmdevice - Main daemon");
+        zsys_info ("zmdevice: stopping");
+    zstr_sendx (device, "STOP", NULL);
+    zactor_destroy (&device);
+    zconfig_destroy (&config);
     return 0;
 }